@@ -0,0 +1,273 @@
+// AMF command codec benchmark: decodes the connect and play commands a
+// reconnecting player sends, in AMF0 and in AMF3, and encodes the replies
+// the server answers them with, reporting commands per second.
+#include "../src/amf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_ROUNDS 2000000
+#define BENCH_MAX_COMMAND 1024
+
+static double
+now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile size_t sink;
+
+static void
+put_u29(struct amf_writer *w, uint32_t v)
+{
+	uint8_t b[4];
+	size_t n;
+
+	if (v < 0x80) {
+		b[0] = v;
+		n = 1;
+	} else if (v < 0x4000) {
+		b[0] = 0x80 | v >> 7;
+		b[1] = v & 0x7F;
+		n = 2;
+	} else {
+		b[0] = 0x80 | v >> 14;
+		b[1] = 0x80 | (v >> 7 & 0x7F);
+		b[2] = v & 0x7F;
+		n = 3;
+	}
+	memcpy(w->p, b, n);
+	w->p += n;
+}
+
+static void
+put_byte(struct amf_writer *w, uint8_t b)
+{
+	*w->p++ = b;
+}
+
+static void
+put_utf8(struct amf_writer *w, const char *s)
+{
+	size_t len = strlen(s);
+
+	put_u29(w, len << 1 | 1);
+	memcpy(w->p, s, len);
+	w->p += len;
+}
+
+static void
+put_amf3_string(struct amf_writer *w, const char *key, const char *s)
+{
+	put_utf8(w, key);
+	put_byte(w, AMF3_STRING);
+	put_utf8(w, s);
+}
+
+// The connect ffmpeg and OBS send
+static size_t
+connect_amf0(uint8_t *buf)
+{
+	struct amf_writer w;
+
+	amf_writer_init(&w, buf, BENCH_MAX_COMMAND);
+	amf_write_string(&w, "connect");
+	amf_write_number(&w, 1);
+	amf_write_object_start(&w);
+	amf_write_prop_string(&w, "app", "live");
+	amf_write_prop_string(&w, "type", "nonprivate");
+	amf_write_prop_string(&w, "flashVer", "FMLE/3.0 (compatible; FMSc/1.0)");
+	amf_write_prop_string(&w, "swfUrl", "rtmp://origin.example.com/live");
+	amf_write_prop_string(&w, "tcUrl", "rtmp://origin.example.com/live");
+	amf_write_prop_number(&w, "fpad", 0);
+	amf_write_prop_number(&w, "capabilities", 239);
+	amf_write_prop_number(&w, "audioCodecs", 3575);
+	amf_write_prop_number(&w, "videoCodecs", 252);
+	amf_write_prop_number(&w, "videoFunction", 1);
+	amf_write_prop_string(&w, "pageUrl", "http://www.example.com/player.html");
+	amf_write_prop_number(&w, "objectEncoding", 3);
+	amf_write_object_end(&w);
+	return amf_writer_len(&w);
+}
+
+// The same connect from a Flash player using object encoding 3: an AMF3
+// command message (format byte first) whose command object is AMF3, with
+// app and tcUrl sealed members and swfUrl a reference back to tcUrl
+static size_t
+connect_amf3(uint8_t *buf)
+{
+	struct amf_writer w;
+
+	amf_writer_init(&w, buf, BENCH_MAX_COMMAND);
+	put_byte(&w, 0);
+	amf_write_string(&w, "connect");
+	amf_write_number(&w, 1);
+	put_byte(&w, AMF0_AVMPLUS);
+	put_byte(&w, AMF3_OBJECT);
+	put_u29(&w, 2 << 4 | 8 | 2 | 1);
+	put_utf8(&w, "");
+	put_utf8(&w, "app");
+	put_utf8(&w, "tcUrl");
+	put_byte(&w, AMF3_STRING);
+	put_utf8(&w, "live");
+	put_byte(&w, AMF3_STRING);
+	put_utf8(&w, "rtmp://origin.example.com/live");
+	put_amf3_string(&w, "flashVer", "WIN 32,0,0,465");
+	put_utf8(&w, "swfUrl");
+	put_byte(&w, AMF3_STRING);
+	put_u29(&w, 3 << 1);
+	put_utf8(&w, "capabilities");
+	put_byte(&w, AMF3_INTEGER);
+	put_u29(&w, 239);
+	put_utf8(&w, "fpad");
+	put_byte(&w, AMF3_FALSE);
+	put_amf3_string(&w, "pageUrl", "http://www.example.com/player.html");
+	put_utf8(&w, "");
+	return amf_writer_len(&w);
+}
+
+static size_t
+play_amf0(uint8_t *buf)
+{
+	struct amf_writer w;
+
+	amf_writer_init(&w, buf, BENCH_MAX_COMMAND);
+	amf_write_string(&w, "play");
+	amf_write_number(&w, 4);
+	amf_write_null(&w);
+	amf_write_string(&w, "channel-042?timeshift=30");
+	amf_write_number(&w, -2000);
+	return amf_writer_len(&w);
+}
+
+static size_t
+status(uint8_t *buf, const char *code, const char *description)
+{
+	struct amf_writer w;
+
+	amf_writer_init(&w, buf, BENCH_MAX_COMMAND);
+	amf_write_string(&w, "onStatus");
+	amf_write_number(&w, 0);
+	amf_write_null(&w);
+	amf_write_object_start(&w);
+	amf_write_prop_string(&w, "level", "status");
+	amf_write_prop_string(&w, "code", code);
+	amf_write_prop_string(&w, "description", description);
+	amf_write_object_end(&w);
+	return w.overflow ? 0 : amf_writer_len(&w);
+}
+
+// Decode a connect as rtmp_handle_command does and write its _result.
+// Returns the reply's length, or 0 if the command didn't parse.
+static size_t
+handle_connect(const uint8_t *cmd, size_t len, int amf3, uint8_t *out)
+{
+	struct amf_reader r;
+	struct amf_writer w;
+	const char *name, *app;
+	size_t n, app_len;
+	double txn;
+
+	amf_reader_init(&r, cmd, len);
+	if (amf3) {
+		r.p++;
+	}
+	if (amf_read_string(&r, &name, &n) != 0 || amf_read_number(&r, &txn) != 0 ||
+		n != 7 || memcmp(name, "connect", 7) != 0 ||
+		amf_read_object_string(&r, "app", &app, &app_len) != 0 ||
+		app == NULL || app_len != 4 || memcmp(app, "live", 4) != 0) {
+		return 0;
+	}
+
+	amf_writer_init(&w, out, BENCH_MAX_COMMAND);
+	amf_write_string(&w, "_result");
+	amf_write_number(&w, txn);
+	amf_write_object_start(&w);
+	amf_write_prop_string(&w, "fmsVer", "FMS/3,0,1,123");
+	amf_write_prop_number(&w, "capabilities", 31);
+	amf_write_object_end(&w);
+	amf_write_object_start(&w);
+	amf_write_prop_string(&w, "level", "status");
+	amf_write_prop_string(&w, "code", "NetConnection.Connect.Success");
+	amf_write_prop_string(&w, "description", "Connection succeeded.");
+	amf_write_prop_number(&w, "objectEncoding", 0);
+	amf_write_object_end(&w);
+	return w.overflow ? 0 : amf_writer_len(&w);
+}
+
+// Decode a play and write the two statuses that start playback
+static size_t
+handle_play(const uint8_t *cmd, size_t len, uint8_t *out)
+{
+	struct amf_reader r;
+	const char *name, *stream;
+	size_t n, stream_len;
+	double txn, start;
+
+	amf_reader_init(&r, cmd, len);
+	if (amf_read_string(&r, &name, &n) != 0 || amf_read_number(&r, &txn) != 0 ||
+		n != 4 || memcmp(name, "play", 4) != 0 || amf_skip(&r) != 0 ||
+		amf_read_string(&r, &stream, &stream_len) != 0 ||
+		amf_read_number(&r, &start) != 0) {
+		return 0;
+	}
+	return status(out, "NetStream.Play.Reset", "/live/channel-042") +
+		status(out, "NetStream.Play.Start", "/live/channel-042");
+}
+
+static void
+report(const char *label, size_t cmd_len, double elapsed)
+{
+	printf("%-14s %5zu bytes %8.2f M commands/s %7.1f ns/command\n", label,
+		cmd_len, BENCH_ROUNDS / elapsed / 1e6, elapsed / BENCH_ROUNDS * 1e9);
+}
+
+int
+main()
+{
+	uint8_t connect0[BENCH_MAX_COMMAND], connect3[BENCH_MAX_COMMAND];
+	uint8_t play[BENCH_MAX_COMMAND], out[BENCH_MAX_COMMAND];
+	size_t connect0_len = connect_amf0(connect0);
+	size_t connect3_len = connect_amf3(connect3);
+	size_t play_len = play_amf0(play);
+	double start;
+
+	if (handle_connect(connect0, connect0_len, 0, out) == 0 ||
+		handle_connect(connect3, connect3_len, 1, out) == 0 ||
+		handle_play(play, play_len, out) == 0) {
+		fprintf(stderr, "command failed to parse\n");
+		return 1;
+	}
+	// Every truncation of a command must fail cleanly, not read past it
+	for (size_t n = 0; n < connect3_len; n++) {
+		if (handle_connect(connect3, n, 1, out) != 0 ||
+			handle_connect(connect0, n < connect0_len ? n : 0, 0, out) != 0) {
+			fprintf(stderr, "truncated command parsed\n");
+			return 1;
+		}
+	}
+
+	start = now();
+	for (int i = 0; i < BENCH_ROUNDS; i++) {
+		sink += handle_connect(connect0, connect0_len, 0, out);
+	}
+	report("connect AMF0", connect0_len, now() - start);
+
+	start = now();
+	for (int i = 0; i < BENCH_ROUNDS; i++) {
+		sink += handle_connect(connect3, connect3_len, 1, out);
+	}
+	report("connect AMF3", connect3_len, now() - start);
+
+	start = now();
+	for (int i = 0; i < BENCH_ROUNDS; i++) {
+		sink += handle_play(play, play_len, out);
+	}
+	report("play", play_len, now() - start);
+
+	return 0;
+}
@@ -0,0 +1,212 @@
+// RTMP egress chunking benchmark: queues a synthetic 4 Mbit/s, 30 fps
+// stream for a player at several outbound chunk sizes, writing each
+// message to a socket as it is queued, and reports what a second of video
+// costs in syscalls, iovecs and bytes on the wire.
+#include "../src/amf.h"
+#include "../src/config.h"
+#include "../src/conn.h"
+#include "../src/reactor.h"
+#include "../src/rtmp.h"
+
+#include <errno.h>
+#include <event2/event.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_SIG_SIZE 1536
+#define BENCH_FPS 30
+#define BENCH_AUDIO_RATE 43             // AAC frames per second at 44.1 kHz
+#define BENCH_AUDIO_SIZE 372            // ~128 kbit/s
+#define BENCH_KEYFRAME_RATIO 8
+// Per inter frame, leaving room for audio and a keyframe eight times as big
+#define BENCH_FRAME_SIZE ((4000000 / 8 - BENCH_AUDIO_RATE * BENCH_AUDIO_SIZE) / \
+	(BENCH_FPS - 1 + BENCH_KEYFRAME_RATIO))
+
+struct result {
+	size_t writes;
+	size_t iovecs;
+	size_t wire;
+	size_t payload;
+	double queue_ns;
+};
+
+static double
+now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+drain(void *arg)
+{
+	int fd = *(int *)arg;
+	static char buf[1 << 20];
+
+	while (read(fd, buf, sizeof(buf)) > 0);
+	return NULL;
+}
+
+// Take a player through the handshake and connect, so it has told the
+// player its chunk size
+static struct conn_client *
+player_new(struct reactor *reactor, struct bufferevent *bev)
+{
+	struct conn_client *client = conn_alloc_client(reactor, bev);
+	struct evbuffer *input = evbuffer_new();
+	char sig[1 + BENCH_SIG_SIZE] = { RTMP_VERSION };
+	uint8_t hdr[12] = { 3, 0, 0, 0, 0, 0, 0, RTMP_TYPE_AMF0_COMMAND };
+	uint8_t body[128];
+	struct amf_writer w;
+	size_t len;
+
+	client->proto = protocol_rtmp;
+	amf_writer_init(&w, body, sizeof(body));
+	amf_write_string(&w, "connect");
+	amf_write_number(&w, 1);
+	amf_write_object_start(&w);
+	amf_write_prop_string(&w, "app", "bench");
+	amf_write_object_end(&w);
+	len = amf_writer_len(&w);
+	hdr[4] = len >> 16;
+	hdr[5] = len >> 8;
+	hdr[6] = len;
+
+	evbuffer_add(input, sig, sizeof(sig));
+	evbuffer_add(input, sig + 1, BENCH_SIG_SIZE);
+	evbuffer_add(input, hdr, sizeof(hdr));
+	evbuffer_add(input, body, len);
+	if (w.overflow || rtmp_read(client, input) < 0) {
+		fprintf(stderr, "connect failed\n");
+		exit(1);
+	}
+	evbuffer_drain(bufferevent_get_output(bev), -1);
+	client->egress = egress_rtmp;
+
+	evbuffer_free(input);
+	return client;
+}
+
+// Write out the way a bufferevent would: the chains as iovecs, at most
+// max_write bytes a call
+static void
+flush(struct evbuffer *out, int fd, size_t max_write, struct result *res)
+{
+	while (evbuffer_get_length(out) > 0) {
+		size_t len = evbuffer_get_length(out);
+		res->iovecs += evbuffer_peek(out,
+			len < max_write ? len : max_write, NULL, NULL, 0);
+		if (evbuffer_write_atmost(out, fd, max_write) < 0 && errno != EAGAIN) {
+			perror("write");
+			exit(1);
+		}
+		res->writes++;
+	}
+}
+
+static struct msg *
+media_new(uint8_t type, uint32_t ts, size_t len, uint8_t first)
+{
+	struct msg *msg = msg_alloc(len);
+
+	msg->type = type;
+	msg->timestamp = ts;
+	memset(msg->data, 0x5a, len);
+	msg->data[0] = first;
+	rtmp_classify(msg);
+	return msg;
+}
+
+static void
+bench(uint32_t chunk_size, size_t max_write, int seconds, struct result *res)
+{
+	struct event_base *base = event_base_new();
+	struct reactor reactor = { .base = base };
+	struct bufferevent *pair[2];
+	struct conn_client *client;
+	struct evbuffer *out = evbuffer_new();
+	struct msg *msgs[BENCH_FPS + BENCH_AUDIO_RATE];
+	int fds[2], nmsgs, nqueued = 0, sndbuf = 4 << 20;
+	pthread_t reader;
+	double t0;
+
+	config.rtmp_chunk_size = chunk_size;
+	bufferevent_pair_new(base, 0, pair);
+	client = player_new(&reactor, pair[0]);
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	pthread_create(&reader, NULL, drain, &fds[1]);
+
+	memset(res, 0, sizeof(*res));
+	for (int s = 0; s < seconds; s++) {
+		uint32_t base_ms = s * 1000;
+
+		// Audio and video interleaved as an encoder would send them
+		nmsgs = 0;
+		for (int i = 0, a = 0; i < BENCH_FPS; i++) {
+			uint32_t ts = base_ms + i * 1000 / BENCH_FPS;
+			msgs[nmsgs++] = i == 0
+				? media_new(RTMP_TYPE_VIDEO_PACKET, ts,
+					BENCH_FRAME_SIZE * BENCH_KEYFRAME_RATIO, 0x17)
+				: media_new(RTMP_TYPE_VIDEO_PACKET, ts, BENCH_FRAME_SIZE, 0x27);
+			for (; a * 1000 / BENCH_AUDIO_RATE < (i + 1) * 1000 / BENCH_FPS &&
+				a < BENCH_AUDIO_RATE; a++) {
+				msgs[nmsgs++] = media_new(RTMP_TYPE_AUDIO_PACKET,
+					base_ms + a * 1000 / BENCH_AUDIO_RATE, BENCH_AUDIO_SIZE, 0xaf);
+			}
+		}
+
+		// A player that keeps up has each message written as it arrives
+		for (int i = 0; i < nmsgs; i++) {
+			t0 = now();
+			rtmp_queue_msg(client, out, msgs[i]);
+			res->queue_ns += (now() - t0) * 1e9;
+			res->payload += msgs[i]->len;
+			msg_unref(msgs[i]);
+			res->wire += evbuffer_get_length(out);
+			flush(out, fds[0], max_write, res);
+		}
+		nqueued += nmsgs;
+	}
+	res->queue_ns /= nqueued;
+
+	shutdown(fds[0], SHUT_WR);
+	pthread_join(reader, NULL);
+	close(fds[0]);
+	close(fds[1]);
+	conn_free_client(client);
+	bufferevent_free(pair[1]);
+	evbuffer_free(out);
+	event_base_free(base);
+}
+
+int
+main(int argc, char *argv[])
+{
+	uint32_t sizes[] = { 128, 4096, 65536, 1 << 20 };
+	size_t writes[] = { 16384, CONN_MAX_WRITE };
+	int seconds = 100;
+	struct result res;
+
+	printf("per second of 4 Mbit/s video (%d fps, %d audio msgs)\n",
+		BENCH_FPS, BENCH_AUDIO_RATE);
+	printf("%8s %8s %9s %9s %11s %9s %9s\n", "chunk", "write max",
+		"syscalls", "iovecs", "wire bytes", "overhead", "ns/msg");
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 2; j++) {
+			bench(sizes[i], writes[j], seconds, &res);
+			printf("%8u %8zuK %9.1f %9.1f %11.0f %8.2f%% %9.0f\n",
+				sizes[i], writes[j] / 1024, (double)res.writes / seconds,
+				(double)res.iovecs / seconds, (double)res.wire / seconds,
+				100.0 * (res.wire - res.payload) / res.payload, res.queue_ns);
+		}
+	}
+	return 0;
+}
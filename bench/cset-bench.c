@@ -0,0 +1,134 @@
+// Consumer set benchmark: join, fan-out iteration and leave at different
+// audience sizes, against the singly-linked list it replaced.
+#include "../src/conn.h"
+#include "../src/cset.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct list_node {
+	struct conn_client *client;
+	struct list_node *next;
+};
+
+static double
+now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+shuffle(struct conn_client **clients, size_t n)
+{
+	for (size_t i = n - 1; i > 0; i--) {
+		size_t j = rand() % (i + 1);
+		struct conn_client *tmp = clients[i];
+		clients[i] = clients[j];
+		clients[j] = tmp;
+	}
+}
+
+static volatile size_t sink;
+
+static void
+bench_cset(struct conn_client **clients, size_t n, int passes)
+{
+	struct cset set;
+	struct conn_client *client;
+	double t0, t1, t2, t3;
+	size_t i, sum = 0;
+
+	cset_init(&set);
+
+	t0 = now();
+	for (i = 0; i < n; i++) {
+		cset_add(&set, clients[i]);
+	}
+	t1 = now();
+	for (int p = 0; p < passes; p++) {
+		cset_foreach(&set, i, client) {
+			sum += client->path_len;
+		}
+	}
+	t2 = now();
+	shuffle(clients, n);
+	for (i = 0; i < n; i++) {
+		cset_del(&set, clients[i]);
+	}
+	t3 = now();
+	sink = sum;
+
+	printf("cset  %7zu  join %8.1f ns  iterate %6.2f ns  leave %8.1f ns\n", n,
+		(t1 - t0) * 1e9 / n, (t2 - t1) * 1e9 / ((double)n * passes),
+		(t3 - t2) * 1e9 / n);
+	cset_free(&set);
+}
+
+static void
+bench_list(struct conn_client **clients, size_t n, int passes)
+{
+	struct list_node *head = NULL, *c, **prev;
+	double t0, t1, t2, t3;
+	size_t i, sum = 0;
+
+	t0 = now();
+	for (i = 0; i < n; i++) {
+		struct list_node *node = malloc(sizeof(struct list_node));
+		node->client = clients[i];
+		node->next = NULL;
+		for (prev = &head; *prev != NULL; prev = &(*prev)->next);
+		*prev = node;
+	}
+	t1 = now();
+	for (int p = 0; p < passes; p++) {
+		for (c = head; c != NULL; c = c->next) {
+			sum += c->client->path_len;
+		}
+	}
+	t2 = now();
+	shuffle(clients, n);
+	for (i = 0; i < n; i++) {
+		for (prev = &head; (*prev)->client != clients[i]; prev = &(*prev)->next);
+		c = *prev;
+		*prev = c->next;
+		free(c);
+	}
+	t3 = now();
+	sink = sum;
+
+	printf("list  %7zu  join %8.1f ns  iterate %6.2f ns  leave %8.1f ns\n", n,
+		(t1 - t0) * 1e9 / n, (t2 - t1) * 1e9 / ((double)n * passes),
+		(t3 - t2) * 1e9 / n);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t sizes[] = { 1000, 10000, 100000 };
+
+	srand(1);
+	for (int s = 0; s < 3; s++) {
+		size_t n = sizes[s];
+		int passes = 10000000 / n;
+		struct conn_client **clients = malloc(n * sizeof(struct conn_client *));
+
+		// Scatter the clients the way a long-running heap would
+		for (size_t i = 0; i < n; i++) {
+			clients[i] = calloc(1, sizeof(struct conn_client) + rand() % 512);
+		}
+		shuffle(clients, n);
+
+		bench_cset(clients, n, passes);
+		bench_list(clients, n, passes);
+
+		for (size_t i = 0; i < n; i++) {
+			free(clients[i]);
+		}
+		free(clients);
+	}
+
+	return 0;
+}
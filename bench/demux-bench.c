@@ -0,0 +1,132 @@
+// RTMP ingest parsing benchmark: feeds a synthetic 4 Mbit/s, 30 fps
+// stream through the chunk demuxer and reports parse throughput.
+#include "../src/conn.h"
+#include "../src/reactor.h"
+#include "../src/rtmp.h"
+
+#include <event2/event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_SIG_SIZE 1536
+
+static double
+now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+put24(struct evbuffer *buf, uint32_t v)
+{
+	uint8_t b[3] = { v >> 16, v >> 8, v };
+	evbuffer_add(buf, b, 3);
+}
+
+static void
+put32(struct evbuffer *buf, uint32_t v)
+{
+	uint8_t b[4] = { v >> 24, v >> 16, v >> 8, v };
+	evbuffer_add(buf, b, 4);
+}
+
+// One message on csid 6 as the producer would chunk it
+static void
+chunk_msg(struct evbuffer *buf, uint8_t type, uint32_t ts, const char *data,
+	uint32_t len, uint32_t chunk_size)
+{
+	uint8_t b = 6, le[4] = { 1, 0, 0, 0 };
+	uint32_t off = 0, n;
+
+	evbuffer_add(buf, &b, 1);
+	put24(buf, ts);
+	put24(buf, len);
+	evbuffer_add(buf, &type, 1);
+	evbuffer_add(buf, le, 4);
+	while (off < len) {
+		if (off > 0) {
+			b = 0xC0 | 6;
+			evbuffer_add(buf, &b, 1);
+		}
+		n = len - off < chunk_size ? len - off : chunk_size;
+		evbuffer_add(buf, data + off, n);
+		off += n;
+	}
+}
+
+static void
+bench(uint32_t chunk_size, int seconds)
+{
+	struct event_base *base = event_base_new();
+	struct reactor reactor = { .base = base };
+	struct bufferevent *pair[2];
+	struct conn_client *client;
+	struct evbuffer *stream = evbuffer_new(), *input = evbuffer_new();
+	char frame[4000000 / 8 / 30], sig[1 + BENCH_SIG_SIZE] = { 3 };
+	size_t stream_len, total = 0;
+	double t0, elapsed;
+	int frames = 30 * 10;
+
+	bufferevent_pair_new(base, 0, pair);
+	client = conn_alloc_client(&reactor, pair[0]);
+	client->proto = protocol_rtmp;
+
+	memset(frame, 0x5a, sizeof(frame));
+	frame[0] = 0x27;
+
+	if (chunk_size != 128) {
+		uint8_t set[] = { 2, 0, 0, 0, 0, 0, 4, RTMP_TYPE_CHUNK_SIZE, 0, 0, 0, 0 };
+		evbuffer_add(stream, set, sizeof(set));
+		put32(stream, chunk_size);
+	}
+	for (int i = 0; i < frames; i++) {
+		frame[0] = i % 30 == 0 ? 0x17 : 0x27;
+		chunk_msg(stream, RTMP_TYPE_VIDEO_PACKET, i * 33, frame,
+			sizeof(frame), chunk_size);
+	}
+	stream_len = evbuffer_get_length(stream);
+	const char *flat = (const char *)evbuffer_pullup(stream, -1);
+
+	evbuffer_add(input, sig, sizeof(sig));
+	evbuffer_add(input, sig, BENCH_SIG_SIZE);
+	rtmp_read(client, input);
+
+	t0 = now();
+	do {
+		// Hand the stream over in TCP-sized pieces
+		for (size_t off = 0; off < stream_len; off += 65536) {
+			size_t n = stream_len - off < 65536 ? stream_len - off : 65536;
+			evbuffer_add_reference(input, flat + off, n, NULL, NULL);
+			if (rtmp_read(client, input) < 0) {
+				fprintf(stderr, "parse error\n");
+				exit(1);
+			}
+		}
+		total += stream_len;
+		elapsed = now() - t0;
+	} while (elapsed < seconds);
+
+	printf("chunk size %6u: %7.2f Gbit/s  (%.0f streams of 4 Mbit/s per core)\n",
+		chunk_size, total * 8 / elapsed / 1e9, total * 8 / elapsed / 4e6);
+
+	conn_free_client(client);
+	bufferevent_free(pair[1]);
+	evbuffer_free(stream);
+	evbuffer_free(input);
+	event_base_free(base);
+}
+
+int
+main(int argc, char *argv[])
+{
+	uint32_t sizes[] = { 128, 4096, 65536 };
+
+	for (int i = 0; i < 3; i++) {
+		bench(sizes[i], 2);
+	}
+	return 0;
+}
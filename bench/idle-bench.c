@@ -0,0 +1,129 @@
+// Idle connection harness: attaches N idle GET consumers to one stream and
+// reports how much resident memory the server spends per connection.
+//
+// usage: idle-bench -P server-pid [-h host] [-p port] [-n conns] [-s sources]
+//
+// Connections are spread over 127.0.0.1..127.0.0.<sources> so a single
+// client box can hold more than 64k of them; for 1M consumers raise
+// RLIMIT_NOFILE and fs.nr_open on both ends and use -s 40.
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static long
+rss_kb(int pid)
+{
+	char path[64], line[256];
+	long kb = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	if ((f = fopen(path, "r")) == NULL) {
+		err(1, "open %s", path);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) {
+			break;
+		}
+	}
+	fclose(f);
+	return kb;
+}
+
+static int
+open_conn(const char *host, int port, int source, const char *req)
+{
+	struct sockaddr_in sin, src;
+	int fd;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+		return -1;
+	}
+
+	memset(&src, 0, sizeof(src));
+	src.sin_family = AF_INET;
+	src.sin_addr.s_addr = htonl(0x7F000001 + source);
+	if (bind(fd, (struct sockaddr *)&src, sizeof(src)) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	inet_pton(AF_INET, host, &sin.sin_addr);
+	if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
+		close(fd);
+		return -1;
+	}
+	if (write(fd, req, strlen(req)) != strlen(req)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *host = "127.0.0.1";
+	int port = 1234, n = 10000, sources = 1, pid = 0, opt, i, producer;
+	long before, after;
+	struct rlimit rl;
+
+	while ((opt = getopt(argc, argv, "h:p:n:s:P:")) != -1) {
+		switch (opt) {
+			case 'h': host = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'n': n = atoi(optarg); break;
+			case 's': sources = atoi(optarg); break;
+			case 'P': pid = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s -P server-pid [-h host] [-p port] "
+					"[-n conns] [-s sources]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (pid == 0) {
+		errx(1, "need the server pid (-P) to read its RSS");
+	}
+
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	if (rl.rlim_cur < n + 16) {
+		errx(1, "RLIMIT_NOFILE %ld is too low for %d connections",
+			(long)rl.rlim_cur, n);
+	}
+
+	producer = open_conn(host, port, 0, "POST /idle HTTP/1.1\r\n\r\n");
+	if (producer == -1) {
+		err(1, "producer connect");
+	}
+	usleep(200 * 1000);
+
+	before = rss_kb(pid);
+	for (i = 0; i < n; i++) {
+		if (open_conn(host, port, i % sources, "GET /idle HTTP/1.1\r\n\r\n") == -1) {
+			warn("connection %d", i);
+			break;
+		}
+		// Let the server keep up with the accept backlog
+		if (i % 1000 == 999) {
+			usleep(10 * 1000);
+		}
+	}
+	sleep(2);
+	after = rss_kb(pid);
+
+	printf("%d idle consumers: server RSS %ld kB -> %ld kB, %.0f bytes per connection\n",
+		i, before, after, (after - before) * 1024.0 / (i ? i : 1));
+	return 0;
+}
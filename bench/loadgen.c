@@ -0,0 +1,1149 @@
+// Load generator and fan-out benchmark.
+//
+// Publishes -P streams over HTTP POST or RTMP and attaches -C consumers to
+// each, shaping every stream like real video: -b kbit/s at -f fps with a
+// keyframe every -g seconds (keyframes -k times the size of an inter
+// frame) plus a 128 kbit/s audio track for RTMP. Every frame carries the
+// wall-clock time it was sent, so consumers can measure end-to-end latency.
+//
+// Reports ingest and egress throughput once a second and, at the end,
+// latency percentiles and (given the server's pid with -S) server CPU
+// seconds spent per Gbit delivered and the read/write syscalls it made.
+
+// memmem
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/thread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LG_MAGIC 0x7465656c6567656eULL
+#define LG_FRAME_HEADER 24
+#define LG_MAX_THREADS 64
+#define LG_MAX_SAMPLES (4 * 1024 * 1024)
+#define LG_SIG_SIZE 1536
+#define LG_CHUNK_SIZE 4096
+
+enum lg_proto {
+	lg_http,
+	lg_rtmp,
+	lg_flv,
+	lg_hls
+};
+
+struct lg_options {
+	const char *host;
+	int port;
+	int consumer_port;      // 0 for port
+	int producers;
+	int consumers;
+	enum lg_proto producer_proto;
+	enum lg_proto consumer_proto;
+	int kbps;
+	int fps;
+	double gop;
+	int key_ratio;
+	int duration;
+	int threads;
+	int ramp;
+	int server_pid;
+	const char *prefix;
+	int timeshift;
+};
+
+static struct lg_options opts = {
+	.host = "127.0.0.1",
+	.port = 1234,
+	.producers = 1,
+	.consumers = 10,
+	.producer_proto = lg_http,
+	.consumer_proto = lg_http,
+	.kbps = 4000,
+	.fps = 30,
+	.gop = 2,
+	.key_ratio = 8,
+	.duration = 10,
+	.threads = 1,
+	.ramp = 1000,
+	.prefix = "bench",
+};
+
+// Counters are owned by one thread each and only summed by the reporter
+struct lg_stats {
+	uint64_t ingest_bytes;
+	uint64_t egress_bytes;
+	uint64_t frames;
+	uint64_t gaps;
+	uint64_t connected;
+	uint64_t closed;
+	uint32_t *samples;
+	size_t nsamples;
+	uint64_t seen;
+} __attribute__((aligned(64)));
+
+struct lg_thread {
+	int id;
+	pthread_t thread;
+	struct event_base *base;
+	struct lg_stats stats;
+	int next_consumer;
+	int nconsumers;
+	struct event *ramp_ev;
+};
+
+struct lg_producer {
+	struct lg_thread *thread;
+	struct bufferevent *bev;
+	struct event *frame_ev;
+	int id;
+	uint32_t seq;
+	uint64_t start;
+	int handshake;
+};
+
+// Client side of the RTMP chunk stream, just enough to follow a server
+struct lg_chunk_stream {
+	uint32_t len;
+	uint8_t type;
+	uint32_t received;
+	char *buf;
+};
+
+struct lg_consumer {
+	struct lg_thread *thread;
+	struct bufferevent *bev;
+	int stream;
+	int header_done;
+	int handshake;
+	uint32_t last_seq;
+	int have_seq;
+	// Frames sent before this came from the GOP cache; their age says
+	// nothing about latency
+	uint64_t joined;
+	// Input left unparsed by the previous read
+	size_t unparsed;
+	// HTTP byte stream framing
+	int synced;
+	uint64_t frame_ts;
+	uint32_t frame_left;
+	// RTMP
+	uint32_t chunk_size;
+	struct lg_chunk_stream cs[64];
+	// LL-HLS: the last part fetched and whether the playlist is next
+	int hls_msn;
+	int hls_part;
+	int hls_playlist;
+	int hls_status;
+};
+
+static struct lg_thread threads[LG_MAX_THREADS];
+// Frame payloads are copied out of this, so it holds the largest frame
+static char *filler;
+static size_t filler_len = 1024 * 1024;
+
+static uint64_t
+lg_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+lg_sample(struct lg_consumer *c, uint64_t sent_ns)
+{
+	struct lg_stats *stats = &c->thread->stats;
+	uint64_t now = lg_now_ns();
+	uint32_t us = now > sent_ns ? (now - sent_ns) / 1000 : 0;
+
+	stats->frames++;
+	if (sent_ns < c->joined) {
+		return;
+	}
+	stats->seen++;
+	if (stats->nsamples < LG_MAX_SAMPLES) {
+		stats->samples[stats->nsamples++] = us;
+	} else {
+		// Reservoir sampling keeps the distribution fair on long runs
+		uint64_t j = ((uint64_t)rand() << 31 | rand()) % stats->seen;
+		if (j < LG_MAX_SAMPLES) {
+			stats->samples[j] = us;
+		}
+	}
+}
+
+static void
+lg_put_frame_header(char *p, uint32_t seq, uint32_t size, uint64_t ts)
+{
+	uint64_t magic = LG_MAGIC;
+	memcpy(p, &magic, 8);
+	memcpy(p + 8, &seq, 4);
+	memcpy(p + 12, &size, 4);
+	memcpy(p + 16, &ts, 8);
+}
+
+static void
+lg_track_seq(struct lg_consumer *c, uint32_t seq)
+{
+	if (c->have_seq && seq != c->last_seq + 1) {
+		c->thread->stats.gaps++;
+	}
+	c->last_seq = seq;
+	c->have_seq = 1;
+}
+
+// Size of video frame n of a GOP, so that a GOP averages out to kbps
+static uint32_t
+lg_frame_size(uint32_t seq)
+{
+	int per_gop = opts.gop * opts.fps;
+	double gop_bytes = opts.kbps * 1000.0 / 8 * opts.gop;
+	double inter = gop_bytes / (per_gop - 1 + opts.key_ratio);
+	uint32_t size = seq % per_gop == 0 ? inter * opts.key_ratio : inter;
+	return size < LG_FRAME_HEADER ? LG_FRAME_HEADER : size;
+}
+
+static int
+lg_is_key(uint32_t seq)
+{
+	return seq % (int)(opts.gop * opts.fps) == 0;
+}
+
+static struct bufferevent *
+lg_connect(struct event_base *base, int port, void *ctx, bufferevent_data_cb read_cb,
+	bufferevent_event_cb event_cb)
+{
+	struct bufferevent *bev;
+	struct sockaddr_in sin;
+	int one = 1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	inet_pton(AF_INET, opts.host, &sin.sin_addr);
+
+	bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+	bufferevent_setcb(bev, read_cb, NULL, event_cb, ctx);
+	if (bufferevent_socket_connect(bev, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+		bufferevent_free(bev);
+		return NULL;
+	}
+	setsockopt(bufferevent_getfd(bev), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+	return bev;
+}
+
+/* RTMP wire helpers */
+
+static void
+lg_put_be(char *p, uint32_t v, int n)
+{
+	for (int i = n - 1; i >= 0; i--) {
+		p[i] = v & 0xFF;
+		v >>= 8;
+	}
+}
+
+// Writes one message as fmt 0 chunks of LG_CHUNK_SIZE
+static void
+lg_rtmp_msg(struct evbuffer *out, int csid, uint8_t type, uint32_t msid,
+	uint32_t ts, const char *data, uint32_t len)
+{
+	char hdr[16];
+	uint32_t off = 0, n;
+
+	hdr[0] = csid;
+	lg_put_be(hdr + 1, ts & 0xFFFFFF, 3);
+	lg_put_be(hdr + 4, len, 3);
+	hdr[7] = type;
+	memcpy(hdr + 8, &msid, 4);
+	evbuffer_add(out, hdr, 12);
+	do {
+		if (off > 0) {
+			hdr[0] = 0xC0 | csid;
+			evbuffer_add(out, hdr, 1);
+		}
+		n = len - off < LG_CHUNK_SIZE ? len - off : LG_CHUNK_SIZE;
+		evbuffer_add(out, data + off, n);
+		off += n;
+	} while (off < len);
+}
+
+static size_t
+lg_amf_str(char *p, const char *s)
+{
+	size_t len = strlen(s);
+	p[0] = 0x02;
+	lg_put_be(p + 1, len, 2);
+	memcpy(p + 3, s, len);
+	return 3 + len;
+}
+
+static size_t
+lg_amf_num(char *p, double d)
+{
+	uint64_t v;
+	memcpy(&v, &d, 8);
+	p[0] = 0x00;
+	for (int i = 0; i < 8; i++) {
+		p[1 + i] = v >> (56 - 8 * i);
+	}
+	return 9;
+}
+
+static size_t
+lg_amf_prop(char *p, const char *key, const char *value)
+{
+	size_t len = strlen(key);
+	lg_put_be(p, len, 2);
+	memcpy(p + 2, key, len);
+	return 2 + len + lg_amf_str(p + 2 + len, value);
+}
+
+static void
+lg_rtmp_command(struct evbuffer *out, uint32_t msid, const char *name,
+	double txn, const char *arg)
+{
+	char buf[512];
+	size_t len = 0;
+	char tc[128];
+
+	len += lg_amf_str(buf + len, name);
+	len += lg_amf_num(buf + len, txn);
+	if (strcmp(name, "connect") == 0) {
+		snprintf(tc, sizeof(tc), "rtmp://%s:%d/%s", opts.host, opts.port, opts.prefix);
+		buf[len++] = 0x03;
+		len += lg_amf_prop(buf + len, "app", opts.prefix);
+		len += lg_amf_prop(buf + len, "tcUrl", tc);
+		memcpy(buf + len, "\0\0\x09", 3);
+		len += 3;
+	} else {
+		buf[len++] = 0x05;
+		if (arg) {
+			len += lg_amf_str(buf + len, arg);
+		}
+		if (strcmp(name, "publish") == 0) {
+			len += lg_amf_str(buf + len, "live");
+		} else if (strcmp(name, "play") == 0 && opts.timeshift > 0) {
+			len += lg_amf_num(buf + len, opts.timeshift);
+		}
+	}
+	lg_rtmp_msg(out, 3, 0x14, msid, 0, buf, len);
+}
+
+static void
+lg_rtmp_session(struct evbuffer *out, const char *cmd, const char *stream)
+{
+	char cs[4];
+
+	lg_put_be(cs, LG_CHUNK_SIZE, 4);
+	lg_rtmp_msg(out, 2, 0x01, 0, 0, cs, 4);
+	lg_rtmp_command(out, 0, "connect", 1, NULL);
+	lg_rtmp_command(out, 0, "createStream", 2, NULL);
+	lg_rtmp_command(out, 1, cmd, 0, stream);
+}
+
+// S0+S1+S2 in, C2 out. Returns 1 once the handshake has just completed.
+static int
+lg_rtmp_handshake(struct bufferevent *bev, int *done)
+{
+	struct evbuffer *in = bufferevent_get_input(bev);
+
+	if (*done || evbuffer_get_length(in) < 1 + 2 * LG_SIG_SIZE) {
+		return 0;
+	}
+	evbuffer_drain(in, 1);
+	evbuffer_remove_buffer(in, bufferevent_get_output(bev), LG_SIG_SIZE);
+	evbuffer_drain(in, LG_SIG_SIZE);
+	*done = 1;
+	return 1;
+}
+
+/* Producers */
+
+static void
+lg_producer_frame_cb(evutil_socket_t fd, short events, void *ctx)
+{
+	struct lg_producer *p = ctx;
+	struct evbuffer *out = bufferevent_get_output(p->bev);
+	uint32_t size = lg_frame_size(p->seq);
+	uint64_t now = lg_now_ns();
+	uint32_t ts = (now - p->start) / 1000000;
+	char hdr[LG_FRAME_HEADER];
+
+	if (opts.producer_proto == lg_http) {
+		lg_put_frame_header(hdr, p->seq, size, now);
+		evbuffer_add(out, hdr, LG_FRAME_HEADER);
+		evbuffer_add(out, filler, size - LG_FRAME_HEADER);
+		p->thread->stats.ingest_bytes += size;
+	} else {
+		char *msg = malloc(5 + size);
+		msg[0] = lg_is_key(p->seq) ? 0x17 : 0x27;
+		msg[1] = 1;
+		memset(msg + 2, 0, 3);
+		lg_put_frame_header(msg + 5, p->seq, size, now);
+		memcpy(msg + 5 + LG_FRAME_HEADER, filler, size - LG_FRAME_HEADER);
+		lg_rtmp_msg(out, 6, 0x09, 1, ts, msg, 5 + size);
+		free(msg);
+		p->thread->stats.ingest_bytes += 5 + size;
+
+		// About 128 kbit/s of AAC alongside the video
+		for (int i = 0; i < 43 / opts.fps + 1; i++) {
+			char aac[2 + 372] = { (char)0xAF, 1 };
+			memset(aac + 2, 0, sizeof(aac) - 2);
+			lg_rtmp_msg(out, 4, 0x08, 1, ts, aac, sizeof(aac));
+			p->thread->stats.ingest_bytes += sizeof(aac);
+		}
+	}
+	p->seq++;
+}
+
+static void
+lg_producer_start(struct lg_producer *p)
+{
+	struct timeval tv = { 0, 1000000 / opts.fps };
+
+	p->start = lg_now_ns();
+	p->frame_ev = event_new(p->thread->base, -1, EV_PERSIST,
+		lg_producer_frame_cb, p);
+	event_add(p->frame_ev, &tv);
+}
+
+static void
+lg_producer_read_cb(struct bufferevent *bev, void *ctx)
+{
+	struct lg_producer *p = ctx;
+	struct evbuffer *out = bufferevent_get_output(bev);
+	char stream[32];
+	char avc[5] = { 0x17, 0, 0, 0, 0 }, aac[4] = { (char)0xAF, 0, 0x12, 0x10 };
+
+	if (lg_rtmp_handshake(bev, &p->handshake)) {
+		char meta[128];
+		size_t len = 0;
+
+		snprintf(stream, sizeof(stream), "%d", p->id);
+		lg_rtmp_session(out, "publish", stream);
+
+		len += lg_amf_str(meta + len, "@setDataFrame");
+		len += lg_amf_str(meta + len, "onMetaData");
+		meta[len++] = 0x03;
+		len += lg_amf_prop(meta + len, "encoder", "loadgen");
+		memcpy(meta + len, "\0\0\x09", 3);
+		len += 3;
+		lg_rtmp_msg(out, 4, 0x12, 1, 0, meta, len);
+		// Sequence headers, so the server has configuration to cache
+		lg_rtmp_msg(out, 6, 0x09, 1, 0, avc, sizeof(avc));
+		lg_rtmp_msg(out, 4, 0x08, 1, 0, aac, sizeof(aac));
+		lg_producer_start(p);
+	}
+	// Nothing the server says after the handshake matters to a publisher
+	if (p->handshake) {
+		evbuffer_drain(bufferevent_get_input(bev),
+			evbuffer_get_length(bufferevent_get_input(bev)));
+	}
+}
+
+static void
+lg_producer_event_cb(struct bufferevent *bev, short events, void *ctx)
+{
+	struct lg_producer *p = ctx;
+	char req[300];
+
+	if (events & BEV_EVENT_CONNECTED) {
+		p->thread->stats.connected++;
+		if (opts.producer_proto == lg_http) {
+			snprintf(req, sizeof(req), "POST /%s/%d HTTP/1.1\r\n\r\n", opts.prefix, p->id);
+			evbuffer_add(bufferevent_get_output(bev), req, strlen(req));
+			lg_producer_start(p);
+		} else {
+			// C0 + C1
+			evbuffer_add(bufferevent_get_output(bev), "\x03", 1);
+			evbuffer_add(bufferevent_get_output(bev), filler, LG_SIG_SIZE);
+		}
+		return;
+	}
+
+	if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+		fprintf(stderr, "producer %d disconnected\n", p->id);
+		p->thread->stats.closed++;
+		if (p->frame_ev) {
+			event_free(p->frame_ev);
+			p->frame_ev = NULL;
+		}
+		bufferevent_free(bev);
+		p->bev = NULL;
+	}
+}
+
+/* Consumers */
+
+static void
+lg_consume_http(struct lg_consumer *c, struct evbuffer *in)
+{
+	uint64_t magic = LG_MAGIC;
+	char hdr[LG_FRAME_HEADER];
+	uint32_t seq, size;
+
+	for (;;) {
+		if (c->frame_left > 0) {
+			size_t n = evbuffer_get_length(in);
+			if (n == 0) {
+				return;
+			}
+			n = n < c->frame_left ? n : c->frame_left;
+			evbuffer_drain(in, n);
+			c->frame_left -= n;
+			if (c->frame_left == 0) {
+				lg_sample(c, c->frame_ts);
+			}
+			continue;
+		}
+
+		if (!c->synced) {
+			struct evbuffer_ptr p = evbuffer_search(in, (char *)&magic, 8, NULL);
+			if (p.pos < 0) {
+				size_t n = evbuffer_get_length(in);
+				evbuffer_drain(in, n > 7 ? n - 7 : 0);
+				return;
+			}
+			evbuffer_drain(in, p.pos);
+			c->synced = 1;
+		}
+
+		if (evbuffer_get_length(in) < LG_FRAME_HEADER) {
+			return;
+		}
+		evbuffer_copyout(in, hdr, LG_FRAME_HEADER);
+		if (memcmp(hdr, &magic, 8) != 0) {
+			c->synced = 0;
+			c->have_seq = 0;
+			continue;
+		}
+		memcpy(&seq, hdr + 8, 4);
+		memcpy(&size, hdr + 12, 4);
+		memcpy(&c->frame_ts, hdr + 16, 8);
+		lg_track_seq(c, seq);
+		evbuffer_drain(in, LG_FRAME_HEADER);
+		c->frame_left = size - LG_FRAME_HEADER;
+		if (c->frame_left == 0) {
+			lg_sample(c, c->frame_ts);
+		}
+	}
+}
+
+// Media payloads carry the frame header after a short codec header: 5
+// bytes for AVC video, 2 for AAC audio (which has none of ours)
+static void
+lg_consume_media(struct lg_consumer *c, uint8_t type, const char *data, uint32_t len)
+{
+	uint64_t magic, ts;
+	uint32_t seq;
+
+	if (type != 0x09 || len < 5 + LG_FRAME_HEADER) {
+		return;
+	}
+	memcpy(&magic, data + 5, 8);
+	if (magic != LG_MAGIC) {
+		return;
+	}
+	memcpy(&seq, data + 13, 4);
+	memcpy(&ts, data + 21, 8);
+	lg_track_seq(c, seq);
+	lg_sample(c, ts);
+}
+
+static uint32_t
+lg_get_be(const uint8_t *p, int n)
+{
+	uint32_t v = 0;
+	for (int i = 0; i < n; i++) {
+		v = v << 8 | p[i];
+	}
+	return v;
+}
+
+static void
+lg_consume_rtmp(struct lg_consumer *c, struct evbuffer *in)
+{
+	uint8_t hdr[18];
+	size_t avail, hdrlen;
+	uint32_t csid, n;
+	struct lg_chunk_stream *cs;
+	char stream[32];
+	int fmt;
+
+	if (lg_rtmp_handshake(c->bev, &c->handshake)) {
+		snprintf(stream, sizeof(stream), "%d", c->stream);
+		lg_rtmp_session(bufferevent_get_output(c->bev), "play", stream);
+	}
+	if (!c->handshake) {
+		return;
+	}
+
+	for (;;) {
+		avail = evbuffer_get_length(in);
+		if (avail < 1) {
+			return;
+		}
+		evbuffer_copyout(in, hdr, avail < sizeof(hdr) ? avail : sizeof(hdr));
+		fmt = hdr[0] >> 6;
+		csid = hdr[0] & 0x3F;
+		if (csid < 2 || csid >= 64) {
+			fprintf(stderr, "consumer: unsupported chunk stream %d\n", csid);
+			bufferevent_disable(c->bev, EV_READ);
+			return;
+		}
+		cs = &c->cs[csid];
+		hdrlen = 1 + (fmt == 0 ? 11 : fmt == 1 ? 7 : fmt == 2 ? 3 : 0);
+		if (avail < hdrlen) {
+			return;
+		}
+		if (fmt < 3 && lg_get_be(hdr + 1, 3) == 0xFFFFFF) {
+			hdrlen += 4;
+		}
+		if (fmt < 2) {
+			cs->len = lg_get_be(hdr + 4, 3);
+			cs->type = hdr[7];
+		}
+		n = cs->len - cs->received;
+		n = n < c->chunk_size ? n : c->chunk_size;
+		if (avail < hdrlen + n) {
+			return;
+		}
+		evbuffer_drain(in, hdrlen);
+		if (cs->received == 0) {
+			cs->buf = realloc(cs->buf, cs->len + 1);
+		}
+		evbuffer_remove(in, cs->buf + cs->received, n);
+		cs->received += n;
+		c->thread->stats.egress_bytes += hdrlen + n;
+
+		if (cs->received < cs->len) {
+			continue;
+		}
+		cs->received = 0;
+		if (cs->type == 0x01 && cs->len >= 4) {
+			c->chunk_size = lg_get_be((uint8_t *)cs->buf, 4);
+		} else {
+			lg_consume_media(c, cs->type, cs->buf, cs->len);
+		}
+	}
+}
+
+static void
+lg_consume_flv(struct lg_consumer *c, struct evbuffer *in)
+{
+	uint8_t tag[11];
+	uint32_t len;
+	char *data;
+
+	if (!c->handshake) {
+		// FLV header and the first PreviousTagSize
+		if (evbuffer_get_length(in) < 13) {
+			return;
+		}
+		evbuffer_drain(in, 13);
+		c->handshake = 1;
+	}
+
+	while (evbuffer_get_length(in) >= 11) {
+		evbuffer_copyout(in, tag, 11);
+		len = lg_get_be(tag + 1, 3);
+		if (evbuffer_get_length(in) < 11 + len + 4) {
+			return;
+		}
+		evbuffer_drain(in, 11);
+		data = (char *)evbuffer_pullup(in, len);
+		lg_consume_media(c, tag[0], data, len);
+		evbuffer_drain(in, len + 4);
+	}
+}
+
+static void
+lg_hls_request(struct lg_consumer *c)
+{
+	char req[300];
+
+	if (!c->hls_playlist) {
+		snprintf(req, sizeof(req), "GET /%s/%d/%d.%d.m4s HTTP/1.1\r\n\r\n",
+			opts.prefix, c->stream, c->hls_msn, c->hls_part);
+	} else if (c->hls_msn < 0) {
+		snprintf(req, sizeof(req), "GET /%s/%d/index.m3u8 HTTP/1.1\r\n\r\n",
+			opts.prefix, c->stream);
+	} else {
+		// Blocks until the part after the last one fetched exists
+		snprintf(req, sizeof(req),
+			"GET /%s/%d/index.m3u8?_HLS_msn=%d&_HLS_part=%d HTTP/1.1\r\n\r\n",
+			opts.prefix, c->stream, c->hls_msn, c->hls_part + 1);
+	}
+	evbuffer_add(bufferevent_get_output(c->bev), req, strlen(req));
+}
+
+// Pick the part to fetch next out of a playlist: the one listed after the
+// last fetched, or the preload hint to start with
+static void
+lg_hls_playlist(struct lg_consumer *c, char *body)
+{
+	const char *tag = c->hls_msn < 0 ? "#EXT-X-PRELOAD-HINT:" : "#EXT-X-PART:";
+	char *line, *uri, *save;
+	int msn, part, found = c->hls_msn < 0;
+
+	for (line = strtok_r(body, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+		if (strncmp(line, tag, strlen(tag)) != 0 || (uri = strstr(line, "URI=\"")) == NULL ||
+			sscanf(uri + 5, "%d.%d", &msn, &part) != 2) {
+			continue;
+		}
+		if (found) {
+			c->hls_msn = msn;
+			c->hls_part = part;
+			c->hls_playlist = 0;
+			return;
+		}
+		found = msn == c->hls_msn && part == c->hls_part;
+	}
+}
+
+static void
+lg_hls_part(struct lg_consumer *c, const char *body, size_t len)
+{
+	uint64_t magic = LG_MAGIC, ts;
+	const char *p = body, *end = body + len;
+	uint32_t seq;
+
+	while ((p = memmem(p, end - p, &magic, 8)) != NULL &&
+		end - p >= LG_FRAME_HEADER) {
+		memcpy(&seq, p + 8, 4);
+		memcpy(&ts, p + 16, 8);
+		lg_track_seq(c, seq);
+		lg_sample(c, ts);
+		p += LG_FRAME_HEADER;
+	}
+}
+
+// A player's LL-HLS loop over one kept-alive connection: a blocking
+// playlist reload for the next part, then the part
+static void
+lg_consume_hls(struct lg_consumer *c, struct evbuffer *in)
+{
+	char hdr[1024], *cl, *body;
+	struct evbuffer_ptr p;
+
+	for (;;) {
+		if (!c->header_done) {
+			p = evbuffer_search(in, "\r\n\r\n", 4, NULL);
+			if (p.pos < 0 || (size_t)p.pos >= sizeof(hdr)) {
+				return;
+			}
+			evbuffer_remove(in, hdr, p.pos + 4);
+			hdr[p.pos] = '\0';
+			c->hls_status = atoi(hdr + 9);
+			cl = strstr(hdr, "Content-Length: ");
+			c->frame_left = cl ? strtoul(cl + 16, NULL, 10) : 0;
+			c->header_done = 1;
+		}
+		if (evbuffer_get_length(in) < c->frame_left) {
+			return;
+		}
+
+		body = malloc(c->frame_left + 1);
+		evbuffer_remove(in, body, c->frame_left);
+		body[c->frame_left] = '\0';
+		if (c->hls_playlist && c->hls_status == 200) {
+			lg_hls_playlist(c, body);
+		} else if (!c->hls_playlist) {
+			// A hinted part that never came (the segment ended
+			// first) sends us back to the playlist too
+			if (c->hls_status == 200) {
+				lg_hls_part(c, body, c->frame_left);
+			}
+			c->hls_playlist = 1;
+		}
+		free(body);
+		c->frame_left = 0;
+		c->header_done = 0;
+		lg_hls_request(c);
+	}
+}
+
+static void
+lg_consumer_read_cb(struct bufferevent *bev, void *ctx)
+{
+	struct lg_consumer *c = ctx;
+	struct evbuffer *in = bufferevent_get_input(bev);
+
+	if (opts.consumer_proto != lg_rtmp) {
+		c->thread->stats.egress_bytes += evbuffer_get_length(in) - c->unparsed;
+	}
+
+	if (opts.consumer_proto != lg_rtmp && opts.consumer_proto != lg_hls &&
+		!c->header_done) {
+		struct evbuffer_ptr p = evbuffer_search(in, "\r\n\r\n", 4, NULL);
+		if (p.pos < 0) {
+			return;
+		}
+		evbuffer_drain(in, p.pos + 4);
+		c->header_done = 1;
+	}
+
+	switch (opts.consumer_proto) {
+		case lg_http:
+			lg_consume_http(c, in);
+			break;
+		case lg_rtmp:
+			lg_consume_rtmp(c, in);
+			break;
+		case lg_flv:
+			lg_consume_flv(c, in);
+			break;
+		case lg_hls:
+			lg_consume_hls(c, in);
+			break;
+	}
+	c->unparsed = evbuffer_get_length(in);
+}
+
+static void
+lg_consumer_event_cb(struct bufferevent *bev, short events, void *ctx)
+{
+	struct lg_consumer *c = ctx;
+	char req[300];
+	int n;
+
+	if (events & BEV_EVENT_CONNECTED) {
+		c->thread->stats.connected++;
+		c->joined = lg_now_ns();
+		switch (opts.consumer_proto) {
+			case lg_http:
+			case lg_flv:
+				n = snprintf(req, sizeof(req), "GET /%s/%d%s", opts.prefix, c->stream,
+					opts.consumer_proto == lg_flv ? ".flv" : "");
+				if (opts.timeshift > 0) {
+					n += snprintf(req + n, sizeof(req) - n, "?timeshift=%d",
+						opts.timeshift);
+				}
+				snprintf(req + n, sizeof(req) - n, " HTTP/1.1\r\n\r\n");
+				evbuffer_add(bufferevent_get_output(bev), req, strlen(req));
+				break;
+			case lg_hls:
+				c->hls_msn = -1;
+				c->hls_playlist = 1;
+				lg_hls_request(c);
+				break;
+			case lg_rtmp:
+				evbuffer_add(bufferevent_get_output(bev), "\x03", 1);
+				evbuffer_add(bufferevent_get_output(bev), filler, LG_SIG_SIZE);
+				break;
+		}
+		return;
+	}
+
+	if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+		c->thread->stats.closed++;
+		bufferevent_free(bev);
+		c->bev = NULL;
+	}
+}
+
+/* Threads and reporting */
+
+static void
+lg_ramp_cb(evutil_socket_t fd, short events, void *ctx)
+{
+	struct lg_thread *t = ctx;
+	int batch = opts.ramp >= 100 ? opts.ramp / 100 + 1 : 1;
+
+	// Consumers are spread round-robin over the streams
+	while (batch-- > 0 && t->next_consumer < t->nconsumers) {
+		int global = t->next_consumer * opts.threads + t->id;
+		struct lg_consumer *c = calloc(1, sizeof(struct lg_consumer));
+		c->thread = t;
+		c->stream = global % opts.producers;
+		c->chunk_size = 128;
+		c->bev = lg_connect(t->base, opts.consumer_port ? opts.consumer_port : opts.port,
+			c, lg_consumer_read_cb, lg_consumer_event_cb);
+		t->next_consumer++;
+	}
+	if (t->next_consumer >= t->nconsumers) {
+		event_del(t->ramp_ev);
+	}
+}
+
+static void *
+lg_run(void *arg)
+{
+	struct lg_thread *t = arg;
+	struct timeval ramp = { 0, 10000 }, warmup = { 0, 500000 };
+	struct timeval stop = { opts.duration, 0 };
+	int total = opts.producers * opts.consumers;
+
+	// Slower than a batch per tick: one consumer at a time, further apart
+	if (opts.ramp > 0 && opts.ramp < 100) {
+		ramp.tv_sec = 0;
+		ramp.tv_usec = 1000000 / opts.ramp;
+	}
+
+	for (int i = t->id; i < opts.producers; i += opts.threads) {
+		struct lg_producer *p = calloc(1, sizeof(struct lg_producer));
+		p->thread = t;
+		p->id = i;
+		p->bev = lg_connect(t->base, opts.port, p, lg_producer_read_cb,
+			lg_producer_event_cb);
+	}
+
+	// Give the streams a moment to exist before viewers arrive
+	t->nconsumers = total / opts.threads + (t->id < total % opts.threads);
+	t->ramp_ev = event_new(t->base, -1, EV_PERSIST, lg_ramp_cb, t);
+	event_base_loopexit(t->base, &warmup);
+	event_base_dispatch(t->base);
+	event_add(t->ramp_ev, &ramp);
+
+	event_base_loopexit(t->base, &stop);
+	event_base_dispatch(t->base);
+	return NULL;
+}
+
+static int
+lg_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double
+lg_server_cpu()
+{
+	char path[64];
+	unsigned long utime, stime;
+	FILE *f;
+
+	if (!opts.server_pid) {
+		return 0;
+	}
+	snprintf(path, sizeof(path), "/proc/%d/stat", opts.server_pid);
+	if ((f = fopen(path, "r")) == NULL) {
+		return 0;
+	}
+	if (fscanf(f, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+		&utime, &stime) != 2) {
+		utime = stime = 0;
+	}
+	fclose(f);
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+// Read and write calls the server has made, which io_uring does without
+static unsigned long
+lg_server_syscalls()
+{
+	char path[64], line[64];
+	unsigned long n, total = 0;
+	FILE *f;
+
+	if (!opts.server_pid) {
+		return 0;
+	}
+	snprintf(path, sizeof(path), "/proc/%d/io", opts.server_pid);
+	if ((f = fopen(path, "r")) == NULL) {
+		return 0;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "syscr: %lu", &n) == 1 ||
+			sscanf(line, "syscw: %lu", &n) == 1) {
+			total += n;
+		}
+	}
+	fclose(f);
+	return total;
+}
+
+static void
+lg_sum(struct lg_stats *sum)
+{
+	memset(sum, 0, sizeof(struct lg_stats));
+	for (int i = 0; i < opts.threads; i++) {
+		struct lg_stats *s = &threads[i].stats;
+		sum->ingest_bytes += __atomic_load_n(&s->ingest_bytes, __ATOMIC_RELAXED);
+		sum->egress_bytes += __atomic_load_n(&s->egress_bytes, __ATOMIC_RELAXED);
+		sum->frames += __atomic_load_n(&s->frames, __ATOMIC_RELAXED);
+		sum->gaps += __atomic_load_n(&s->gaps, __ATOMIC_RELAXED);
+		sum->connected += __atomic_load_n(&s->connected, __ATOMIC_RELAXED);
+		sum->closed += __atomic_load_n(&s->closed, __ATOMIC_RELAXED);
+	}
+}
+
+static enum lg_proto
+lg_parse_proto(const char *s)
+{
+	if (strcmp(s, "rtmp") == 0) {
+		return lg_rtmp;
+	}
+	if (strcmp(s, "flv") == 0) {
+		return lg_flv;
+	}
+	if (strcmp(s, "hls") == 0) {
+		return lg_hls;
+	}
+	return lg_http;
+}
+
+static void
+lg_usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -h host     server address (default 127.0.0.1)\n"
+		"  -p port     server port (default 1234)\n"
+		"  -e port     consumers connect to this port, an edge's, say\n"
+		"              (default: the server port)\n"
+		"  -P n        streams to publish (default 1)\n"
+		"  -C n        consumers per stream (default 10)\n"
+		"  -i proto    producer protocol: http or rtmp (default http)\n"
+		"  -o proto    consumer protocol: http, flv, rtmp or hls (default http)\n"
+		"  -b kbps     video bitrate per stream (default 4000)\n"
+		"  -f fps      frames per second (default 30)\n"
+		"  -g secs     keyframe interval (default 2)\n"
+		"  -k ratio    keyframe to inter frame size ratio (default 8)\n"
+		"  -d secs     test duration (default 10)\n"
+		"  -t threads  load generator threads (default 1)\n"
+		"  -r rate     consumer connects per second (default 1000)\n"
+		"  -S pid      server pid, to report CPU per Gbit delivered and syscalls\n"
+		"  -x prefix   stream path prefix / RTMP app (default bench)\n"
+		"  -s secs     consumers play the stream secs behind live (default 0)\n",
+		prog);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct lg_stats prev, cur;
+	struct rlimit rl;
+	double cpu0, cpu1, t0, elapsed;
+	unsigned long sys0, sys1;
+	uint32_t *all;
+	size_t n = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "h:p:e:P:C:i:o:b:f:g:k:d:t:r:S:x:s:")) != -1) {
+		switch (opt) {
+			case 'h': opts.host = optarg; break;
+			case 'p': opts.port = atoi(optarg); break;
+			case 'e': opts.consumer_port = atoi(optarg); break;
+			case 'P': opts.producers = atoi(optarg); break;
+			case 'C': opts.consumers = atoi(optarg); break;
+			case 'i': opts.producer_proto = lg_parse_proto(optarg); break;
+			case 'o': opts.consumer_proto = lg_parse_proto(optarg); break;
+			case 'b': opts.kbps = atoi(optarg); break;
+			case 'f': opts.fps = atoi(optarg); break;
+			case 'g': opts.gop = atof(optarg); break;
+			case 'k': opts.key_ratio = atoi(optarg); break;
+			case 'd': opts.duration = atoi(optarg); break;
+			case 't': opts.threads = atoi(optarg); break;
+			case 'r': opts.ramp = atoi(optarg); break;
+			case 'S': opts.server_pid = atoi(optarg); break;
+			case 'x': opts.prefix = optarg; break;
+			case 's': opts.timeshift = atoi(optarg); break;
+			default:
+				lg_usage(argv[0]);
+				return 1;
+		}
+	}
+	if (opts.threads < 1 || opts.threads > LG_MAX_THREADS || opts.producers < 1 ||
+		opts.fps < 1 || opts.gop * opts.fps < 1) {
+		lg_usage(argv[0]);
+		return 1;
+	}
+	if (opts.producer_proto == lg_flv || opts.producer_proto == lg_hls) {
+		fprintf(stderr, "producers publish over http or rtmp\n");
+		return 1;
+	}
+
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+
+	evthread_use_pthreads();
+	if (lg_frame_size(0) > filler_len) {
+		filler_len = lg_frame_size(0);
+	}
+	if (lg_frame_size(1) > filler_len) {
+		filler_len = lg_frame_size(1);
+	}
+	if ((filler = malloc(filler_len)) == NULL) {
+		fprintf(stderr, "no memory for %zu byte frames\n", filler_len);
+		return 1;
+	}
+	memset(filler, 'x', filler_len);
+
+	cpu0 = lg_server_cpu();
+	sys0 = lg_server_syscalls();
+	t0 = lg_now_ns() / 1e9;
+	for (int i = 0; i < opts.threads; i++) {
+		threads[i].id = i;
+		threads[i].base = event_base_new();
+		threads[i].stats.samples = malloc(LG_MAX_SAMPLES * sizeof(uint32_t));
+		pthread_create(&threads[i].thread, NULL, lg_run, &threads[i]);
+	}
+
+	memset(&prev, 0, sizeof(prev));
+	for (int s = 0; s < opts.duration + 1; s++) {
+		sleep(1);
+		lg_sum(&cur);
+		printf("%3ds  ingest %8.1f Mbit/s  egress %9.1f Mbit/s  frames %8lu/s  "
+			"conns %lu  closed %lu  gaps %lu\n", s + 1,
+			(cur.ingest_bytes - prev.ingest_bytes) * 8 / 1e6,
+			(cur.egress_bytes - prev.egress_bytes) * 8 / 1e6,
+			(unsigned long)(cur.frames - prev.frames),
+			(unsigned long)cur.connected, (unsigned long)cur.closed,
+			(unsigned long)cur.gaps);
+		fflush(stdout);
+		prev = cur;
+	}
+
+	for (int i = 0; i < opts.threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+	}
+	elapsed = lg_now_ns() / 1e9 - t0;
+	cpu1 = lg_server_cpu();
+	sys1 = lg_server_syscalls();
+	lg_sum(&cur);
+
+	all = malloc(opts.threads * LG_MAX_SAMPLES * sizeof(uint32_t));
+	for (int i = 0; i < opts.threads; i++) {
+		memcpy(all + n, threads[i].stats.samples,
+			threads[i].stats.nsamples * sizeof(uint32_t));
+		n += threads[i].stats.nsamples;
+	}
+	qsort(all, n, sizeof(uint32_t), lg_cmp);
+
+	printf("\n%d streams x %d consumers, %.1f s\n", opts.producers, opts.consumers, elapsed);
+	printf("ingest   %.1f Mbit/s\n", cur.ingest_bytes * 8 / elapsed / 1e6);
+	printf("egress   %.1f Mbit/s\n", cur.egress_bytes * 8 / elapsed / 1e6);
+	printf("frames   %lu delivered, %lu gaps\n",
+		(unsigned long)cur.frames, (unsigned long)cur.gaps);
+	if (n > 0) {
+		printf("latency  p50 %.2f ms  p99 %.2f ms  p999 %.2f ms  max %.2f ms\n",
+			all[n / 2] / 1e3, all[(size_t)(n * 0.99)] / 1e3,
+			all[(size_t)(n * 0.999)] / 1e3, all[n - 1] / 1e3);
+	}
+	if (opts.server_pid && cur.egress_bytes > 0) {
+		printf("server   %.2f CPU s over the run, %.3f CPU s per Gbit delivered\n",
+			cpu1 - cpu0, (cpu1 - cpu0) / (cur.egress_bytes * 8 / 1e9));
+		printf("server   %.0f read/write syscalls per second\n",
+			(sys1 - sys0) / elapsed);
+	}
+
+	return 0;
+}
@@ -0,0 +1,110 @@
+// Allocation counter, preloaded into the server: counts calls into the C
+// library's allocator and prints the totals to stderr on SIGUSR2. Two
+// readings a known stretch apart give the allocations the media path
+// makes in steady state.
+//
+// usage: LD_PRELOAD=bench/malloc-count.so ./servertest ...
+//        kill -USR2 <pid>
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t align, size_t size);
+
+static uint64_t calls;
+static uint64_t bytes;
+
+static void
+count(size_t size)
+{
+	__atomic_add_fetch(&calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&bytes, size, __ATOMIC_RELAXED);
+}
+
+void *
+malloc(size_t size)
+{
+	count(size);
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	count(n * size);
+	return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	count(size);
+	return __libc_realloc(ptr, size);
+}
+
+int
+posix_memalign(void **ptr, size_t align, size_t size)
+{
+	count(size);
+	*ptr = __libc_memalign(align, size);
+	return *ptr ? 0 : ENOMEM;
+}
+
+void *
+aligned_alloc(size_t align, size_t size)
+{
+	count(size);
+	return __libc_memalign(align, size);
+}
+
+void *
+memalign(size_t align, size_t size)
+{
+	count(size);
+	return __libc_memalign(align, size);
+}
+
+// No stdio in a signal handler
+static size_t
+format(char *p, const char *label, uint64_t v)
+{
+	char digits[20];
+	size_t n = 0, len = strlen(label);
+
+	memcpy(p, label, len);
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v > 0);
+	for (size_t i = 0; i < n; i++) {
+		p[len + i] = digits[n - 1 - i];
+	}
+	return len + n;
+}
+
+static void
+report(int sig)
+{
+	char line[96];
+	size_t n = 0;
+
+	n += format(line + n, "mallocs ", __atomic_load_n(&calls, __ATOMIC_RELAXED));
+	n += format(line + n, " bytes ", __atomic_load_n(&bytes, __ATOMIC_RELAXED));
+	line[n++] = '\n';
+	if (write(STDERR_FILENO, line, n) < 0) {
+		return;
+	}
+}
+
+__attribute__((constructor)) static void
+init()
+{
+	signal(SIGUSR2, report);
+}
@@ -65,7 +65,7 @@ int main(int argc, char* argv[])
 
 	freeaddrinfo(addrs);
 
-	char *post = "POST /example HTTP/1.1\r\n";
+	char *post = "POST /example HTTP/1.1\r\n\r\n";
 	int postlen = strlen(post);
 	sendall(fd, post, &postlen);
 
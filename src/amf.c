@@ -0,0 +1,706 @@
+#include "amf.h"
+
+#include <string.h>
+
+// Deeper nesting than any command has is taken for an attack on the stack
+#define AMF_MAX_DEPTH 32
+
+static uint32_t
+amf_read_be(const uint8_t *p, int n)
+{
+	uint32_t v = 0;
+	for (int i = 0; i < n; i++) {
+		v = v << 8 | p[i];
+	}
+	return v;
+}
+
+static double
+amf_read_double(const uint8_t *p)
+{
+	uint64_t v = 0;
+	double num;
+
+	for (int i = 0; i < 8; i++) {
+		v = v << 8 | p[i];
+	}
+	memcpy(&num, &v, sizeof(v));
+	return num;
+}
+
+void
+amf_reader_init(struct amf_reader *r, const void *data, size_t len)
+{
+	r->p = data;
+	r->end = r->p + len;
+	r->nstrs = 0;
+	r->ntraits = 0;
+}
+
+/* AMF3 */
+
+// The AMF3 marker of the value behind an avmplus marker at r->p, or -1 if
+// there isn't one
+static int
+amf3_marker(struct amf_reader *r)
+{
+	if (r->end - r->p < 2 || r->p[0] != AMF0_AVMPLUS) {
+		return -1;
+	}
+	return r->p[1];
+}
+
+// Step over the avmplus marker into a fresh AMF3 context
+static void
+amf3_enter(struct amf_reader *r)
+{
+	r->p++;
+	r->nstrs = 0;
+	r->ntraits = 0;
+}
+
+// Seven bits from each byte but the fourth, which gives all eight
+static int
+amf3_read_u29(struct amf_reader *r, uint32_t *v)
+{
+	uint32_t n = 0;
+	uint8_t b;
+
+	for (int i = 0; i < 4; i++) {
+		if (r->p >= r->end) {
+			return -1;
+		}
+		b = *r->p++;
+		if (i == 3) {
+			*v = n << 8 | b;
+			return 0;
+		}
+		n = n << 7 | (b & 0x7F);
+		if (!(b & 0x80)) {
+			break;
+		}
+	}
+	*v = n;
+	return 0;
+}
+
+// A string without its marker, inline or a reference to an earlier one.
+// Inline strings go into the reference table if keep is set.
+static int
+amf3_read_utf8(struct amf_reader *r, const char **str, size_t *len, int keep)
+{
+	uint32_t hdr;
+
+	if (amf3_read_u29(r, &hdr) != 0) {
+		return -1;
+	}
+	if (!(hdr & 1)) {
+		if (hdr >> 1 >= (uint32_t)r->nstrs) {
+			return -1;
+		}
+		*str = (const char *)r->strs[hdr >> 1];
+		*len = r->str_lens[hdr >> 1];
+		return 0;
+	}
+
+	hdr >>= 1;
+	if ((size_t)(r->end - r->p) < hdr) {
+		return -1;
+	}
+	*str = (const char *)r->p;
+	*len = hdr;
+	r->p += hdr;
+	// The empty string is never sent by reference
+	if (keep && hdr > 0) {
+		if (r->nstrs == AMF3_MAX_STRINGS) {
+			return -1;
+		}
+		r->strs[r->nstrs] = (const uint8_t *)*str;
+		r->str_lens[r->nstrs++] = hdr;
+	}
+	return 0;
+}
+
+// An inline object's traits, given its header: read inline or looked up.
+// Leaves the reader at the object's sealed member values.
+static int
+amf3_read_traits(struct amf_reader *r, uint32_t hdr, struct amf3_traits *t)
+{
+	const char *name;
+	size_t len;
+
+	if (!(hdr & 2)) {
+		if (hdr >> 2 >= (uint32_t)r->ntraits) {
+			return -1;
+		}
+		*t = r->traits[hdr >> 2];
+		return 0;
+	}
+	// Only the object's own class knows how to read it
+	if (hdr & 4) {
+		return -1;
+	}
+	t->dynamic = (hdr & 8) != 0;
+	t->count = hdr >> 4;
+
+	// The class name, then the member names
+	if (amf3_read_utf8(r, &name, &len, 1) != 0) {
+		return -1;
+	}
+	t->names = r->p;
+	for (uint32_t i = 0; i < t->count; i++) {
+		if (amf3_read_utf8(r, &name, &len, 1) != 0) {
+			return -1;
+		}
+	}
+	if (r->ntraits == AMF3_MAX_TRAITS) {
+		return -1;
+	}
+	r->traits[r->ntraits++] = *t;
+	return 0;
+}
+
+// Name the next sealed member, reading *names back out of the traits
+static int
+amf3_member_name(struct amf_reader *r, const uint8_t **names,
+	const char **name, size_t *len)
+{
+	const uint8_t *p = r->p;
+	int ret;
+
+	r->p = *names;
+	ret = amf3_read_utf8(r, name, len, 0);
+	*names = r->p;
+	r->p = p;
+	return ret;
+}
+
+// Step over one value, marker and all
+static int
+amf3_skip(struct amf_reader *r, int depth)
+{
+	struct amf3_traits t;
+	const char *name;
+	size_t len, n;
+	uint32_t hdr;
+
+	if (r->p >= r->end || depth > AMF_MAX_DEPTH) {
+		return -1;
+	}
+
+	switch (*r->p++) {
+		case AMF3_UNDEFINED:
+		case AMF3_NULL:
+		case AMF3_FALSE:
+		case AMF3_TRUE:
+			return 0;
+		case AMF3_INTEGER:
+			return amf3_read_u29(r, &hdr);
+		case AMF3_DOUBLE:
+			n = 8;
+			break;
+		case AMF3_STRING:
+			return amf3_read_utf8(r, &name, &len, 1);
+		case AMF3_XML_DOC:
+		case AMF3_XML:
+		case AMF3_BYTE_ARRAY:
+			if (amf3_read_u29(r, &hdr) != 0) {
+				return -1;
+			}
+			n = hdr & 1 ? hdr >> 1 : 0;
+			break;
+		case AMF3_DATE:
+			if (amf3_read_u29(r, &hdr) != 0) {
+				return -1;
+			}
+			n = hdr & 1 ? 8 : 0;
+			break;
+		case AMF3_ARRAY:
+			if (amf3_read_u29(r, &hdr) != 0) {
+				return -1;
+			}
+			if (!(hdr & 1)) {
+				return 0;
+			}
+			// Keyed members up to an empty key, then the dense ones
+			for (;;) {
+				if (amf3_read_utf8(r, &name, &len, 1) != 0) {
+					return -1;
+				}
+				if (len == 0) {
+					break;
+				}
+				if (amf3_skip(r, depth + 1) != 0) {
+					return -1;
+				}
+			}
+			for (n = hdr >> 1; n > 0; n--) {
+				if (amf3_skip(r, depth + 1) != 0) {
+					return -1;
+				}
+			}
+			return 0;
+		case AMF3_OBJECT:
+			if (amf3_read_u29(r, &hdr) != 0) {
+				return -1;
+			}
+			if (!(hdr & 1)) {
+				return 0;
+			}
+			if (amf3_read_traits(r, hdr, &t) != 0) {
+				return -1;
+			}
+			for (n = t.count; n > 0; n--) {
+				if (amf3_skip(r, depth + 1) != 0) {
+					return -1;
+				}
+			}
+			while (t.dynamic) {
+				if (amf3_read_utf8(r, &name, &len, 1) != 0) {
+					return -1;
+				}
+				if (len == 0) {
+					break;
+				}
+				if (amf3_skip(r, depth + 1) != 0) {
+					return -1;
+				}
+			}
+			return 0;
+		default:
+			return -1;
+	}
+
+	if ((size_t)(r->end - r->p) < n) {
+		return -1;
+	}
+	r->p += n;
+	return 0;
+}
+
+// Read the value of a member named key if it is a string, else skip it
+static int
+amf3_read_member(struct amf_reader *r, const char *name, size_t len,
+	const char *key, size_t klen, const char **str, size_t *slen)
+{
+	if (len == klen && memcmp(name, key, len) == 0 && r->p < r->end &&
+		r->p[0] == AMF3_STRING) {
+		r->p++;
+		return amf3_read_utf8(r, str, slen, 1);
+	}
+	return amf3_skip(r, 1);
+}
+
+// An AMF3 object (marker consumed), looking for string property key
+static int
+amf3_read_object_string(struct amf_reader *r, const char *key,
+	const char **str, size_t *len)
+{
+	size_t klen = strlen(key), n;
+	struct amf3_traits t;
+	const uint8_t *names;
+	const char *name;
+	uint32_t hdr;
+
+	if (amf3_read_u29(r, &hdr) != 0) {
+		return -1;
+	}
+	// A reference back to an object already read: nothing to find
+	if (!(hdr & 1)) {
+		return 0;
+	}
+	if (amf3_read_traits(r, hdr, &t) != 0) {
+		return -1;
+	}
+
+	names = t.names;
+	for (uint32_t i = 0; i < t.count; i++) {
+		if (amf3_member_name(r, &names, &name, &n) != 0 ||
+			amf3_read_member(r, name, n, key, klen, str, len) != 0) {
+			return -1;
+		}
+	}
+	while (t.dynamic) {
+		if (amf3_read_utf8(r, &name, &n, 1) != 0) {
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		if (amf3_read_member(r, name, n, key, klen, str, len) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* AMF0 */
+
+int
+amf_read_string(struct amf_reader *r, const char **str, size_t *len)
+{
+	const uint8_t *start = r->p;
+	size_t n;
+
+	if (amf3_marker(r) == AMF3_STRING) {
+		amf3_enter(r);
+		r->p++;
+		if (amf3_read_utf8(r, str, len, 1) != 0) {
+			r->p = start;
+			return -1;
+		}
+		return 0;
+	}
+
+	if (r->end - r->p < 3 || r->p[0] != AMF0_STRING) {
+		return -1;
+	}
+	n = amf_read_be(r->p + 1, 2);
+	if (r->end - r->p < 3 + n) {
+		return -1;
+	}
+	*str = (const char *)r->p + 3;
+	*len = n;
+	r->p += 3 + n;
+	return 0;
+}
+
+int
+amf_read_number(struct amf_reader *r, double *num)
+{
+	const uint8_t *start = r->p;
+	uint32_t v;
+
+	switch (amf3_marker(r)) {
+		case AMF3_DOUBLE:
+			if (r->end - r->p < 10) {
+				return -1;
+			}
+			*num = amf_read_double(r->p + 2);
+			r->p += 10;
+			return 0;
+
+		case AMF3_INTEGER:
+			amf3_enter(r);
+			r->p++;
+			if (amf3_read_u29(r, &v) != 0) {
+				r->p = start;
+				return -1;
+			}
+			// 29 bits, signed
+			*num = (int32_t)(v << 3) >> 3;
+			return 0;
+	}
+
+	if (r->end - r->p < 9 || r->p[0] != AMF0_NUMBER) {
+		return -1;
+	}
+	*num = amf_read_double(r->p + 1);
+	r->p += 9;
+	return 0;
+}
+
+static int amf_skip_value(struct amf_reader *r, int depth);
+
+// Skip the key/value pairs of an object or ECMA array up to and including
+// the end marker
+static int
+amf_skip_props(struct amf_reader *r, int depth)
+{
+	size_t n;
+
+	for (;;) {
+		if (r->end - r->p < 2) {
+			return -1;
+		}
+		n = amf_read_be(r->p, 2);
+		if (r->end - r->p < 2 + n) {
+			return -1;
+		}
+		r->p += 2 + n;
+		if (n == 0 && r->p < r->end && r->p[0] == AMF0_OBJECT_END) {
+			r->p++;
+			return 0;
+		}
+		if (amf_skip_value(r, depth + 1) != 0) {
+			return -1;
+		}
+	}
+}
+
+static int
+amf_skip_value(struct amf_reader *r, int depth)
+{
+	const uint8_t *start = r->p;
+	size_t n;
+
+	if (r->p >= r->end || depth > AMF_MAX_DEPTH) {
+		return -1;
+	}
+
+	switch (*r->p++) {
+		case AMF0_NUMBER:
+			n = 8;
+			break;
+		case AMF0_BOOLEAN:
+			n = 1;
+			break;
+		case AMF0_STRING:
+			if (r->end - r->p < 2) {
+				goto fail;
+			}
+			n = 2 + amf_read_be(r->p, 2);
+			break;
+		case AMF0_LONG_STRING:
+			if (r->end - r->p < 4) {
+				goto fail;
+			}
+			n = 4 + (size_t)amf_read_be(r->p, 4);
+			break;
+		case AMF0_NULL:
+		case AMF0_UNDEFINED:
+			n = 0;
+			break;
+		case AMF0_DATE:
+			n = 10;
+			break;
+		case AMF0_ECMA_ARRAY:
+			if (r->end - r->p < 4) {
+				goto fail;
+			}
+			r->p += 4;
+			// fall through
+		case AMF0_OBJECT:
+			if (amf_skip_props(r, depth) != 0) {
+				goto fail;
+			}
+			return 0;
+		case AMF0_STRICT_ARRAY:
+			if (r->end - r->p < 4) {
+				goto fail;
+			}
+			n = amf_read_be(r->p, 4);
+			r->p += 4;
+			while (n-- > 0) {
+				if (amf_skip_value(r, depth + 1) != 0) {
+					goto fail;
+				}
+			}
+			return 0;
+		case AMF0_AVMPLUS:
+			r->p--;
+			amf3_enter(r);
+			if (amf3_skip(r, depth) != 0) {
+				goto fail;
+			}
+			return 0;
+		default:
+			goto fail;
+	}
+
+	if (r->end - r->p < n) {
+		goto fail;
+	}
+	r->p += n;
+	return 0;
+
+fail:
+	r->p = start;
+	return -1;
+}
+
+int
+amf_skip(struct amf_reader *r)
+{
+	return amf_skip_value(r, 0);
+}
+
+int
+amf_read_object_string(struct amf_reader *r, const char *key,
+	const char **str, size_t *len)
+{
+	const uint8_t *start = r->p;
+	size_t klen = strlen(key), n;
+
+	*str = NULL;
+	*len = 0;
+	switch (amf3_marker(r)) {
+		case AMF3_NULL:
+			r->p += 2;
+			return 0;
+
+		case AMF3_OBJECT:
+			amf3_enter(r);
+			r->p++;
+			if (amf3_read_object_string(r, key, str, len) != 0) {
+				goto fail;
+			}
+			return 0;
+	}
+
+	if (r->p < r->end && r->p[0] == AMF0_NULL) {
+		r->p++;
+		return 0;
+	}
+	if (r->p >= r->end || r->p[0] != AMF0_OBJECT) {
+		return -1;
+	}
+	r->p++;
+
+	for (;;) {
+		if (r->end - r->p < 2) {
+			goto fail;
+		}
+		n = amf_read_be(r->p, 2);
+		if (r->end - r->p < 2 + n) {
+			goto fail;
+		}
+		if (n == 0 && r->end - r->p >= 3 && r->p[2] == AMF0_OBJECT_END) {
+			r->p += 3;
+			return 0;
+		}
+		if (n == klen && memcmp(r->p + 2, key, n) == 0) {
+			r->p += 2 + n;
+			if (amf_read_string(r, str, len) == 0) {
+				continue;
+			}
+		} else {
+			r->p += 2 + n;
+		}
+		if (amf_skip_value(r, 1) != 0) {
+			goto fail;
+		}
+	}
+
+fail:
+	r->p = start;
+	*str = NULL;
+	return -1;
+}
+
+/* Writing */
+
+void
+amf_writer_init(struct amf_writer *w, void *buf, size_t size)
+{
+	w->start = buf;
+	w->p = buf;
+	w->end = w->p + size;
+	w->overflow = 0;
+}
+
+size_t
+amf_writer_len(struct amf_writer *w)
+{
+	return w->p - w->start;
+}
+
+static uint8_t *
+amf_reserve(struct amf_writer *w, size_t len)
+{
+	uint8_t *p = w->p;
+
+	if ((size_t)(w->end - w->p) < len) {
+		w->overflow = 1;
+		return NULL;
+	}
+	w->p += len;
+	return p;
+}
+
+static void
+amf_write_key(struct amf_writer *w, const char *key)
+{
+	size_t len = strlen(key);
+	uint8_t *p;
+
+	if ((p = amf_reserve(w, 2 + len)) != NULL) {
+		p[0] = len >> 8;
+		p[1] = len;
+		memcpy(p + 2, key, len);
+	}
+}
+
+void
+amf_write_string(struct amf_writer *w, const char *str)
+{
+	uint8_t *p;
+
+	if ((p = amf_reserve(w, 1)) != NULL) {
+		*p = AMF0_STRING;
+		amf_write_key(w, str);
+	}
+}
+
+void
+amf_write_number(struct amf_writer *w, double num)
+{
+	uint8_t *p;
+	uint64_t v;
+
+	if ((p = amf_reserve(w, 9)) == NULL) {
+		return;
+	}
+	memcpy(&v, &num, sizeof(v));
+	p[0] = AMF0_NUMBER;
+	for (int i = 0; i < 8; i++) {
+		p[1 + i] = v >> (56 - 8 * i);
+	}
+}
+
+void
+amf_write_bool(struct amf_writer *w, int b)
+{
+	uint8_t *p;
+
+	if ((p = amf_reserve(w, 2)) != NULL) {
+		p[0] = AMF0_BOOLEAN;
+		p[1] = b != 0;
+	}
+}
+
+void
+amf_write_null(struct amf_writer *w)
+{
+	uint8_t *p;
+
+	if ((p = amf_reserve(w, 1)) != NULL) {
+		*p = AMF0_NULL;
+	}
+}
+
+void
+amf_write_object_start(struct amf_writer *w)
+{
+	uint8_t *p;
+
+	if ((p = amf_reserve(w, 1)) != NULL) {
+		*p = AMF0_OBJECT;
+	}
+}
+
+void
+amf_write_object_end(struct amf_writer *w)
+{
+	uint8_t *p;
+
+	if ((p = amf_reserve(w, 3)) != NULL) {
+		p[0] = 0;
+		p[1] = 0;
+		p[2] = AMF0_OBJECT_END;
+	}
+}
+
+void
+amf_write_prop_string(struct amf_writer *w, const char *key, const char *str)
+{
+	amf_write_key(w, key);
+	amf_write_string(w, str);
+}
+
+void
+amf_write_prop_number(struct amf_writer *w, const char *key, double num)
+{
+	amf_write_key(w, key);
+	amf_write_number(w, num);
+}
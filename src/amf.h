@@ -0,0 +1,111 @@
+#ifndef __TELEGENIC_AMF_H__
+#define __TELEGENIC_AMF_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Just enough AMF to hold an RTMP command conversation, without touching
+// the heap. Strings read out of a message point into it rather than being
+// copied, and commands are written into a buffer the caller owns.
+//
+// AMF3 values are read where an AMF0 value is expected behind the
+// avmplus marker, which is how AMF3 command messages and object encoding 3
+// carry them. Their string and traits reference tables are kept in the
+// reader and point into the message too.
+
+#define AMF0_NUMBER       0x00
+#define AMF0_BOOLEAN      0x01
+#define AMF0_STRING       0x02
+#define AMF0_OBJECT       0x03
+#define AMF0_NULL         0x05
+#define AMF0_UNDEFINED    0x06
+#define AMF0_ECMA_ARRAY   0x08
+#define AMF0_OBJECT_END   0x09
+#define AMF0_STRICT_ARRAY 0x0A
+#define AMF0_DATE         0x0B
+#define AMF0_LONG_STRING  0x0C
+#define AMF0_AVMPLUS      0x11
+
+#define AMF3_UNDEFINED    0x00
+#define AMF3_NULL         0x01
+#define AMF3_FALSE        0x02
+#define AMF3_TRUE         0x03
+#define AMF3_INTEGER      0x04
+#define AMF3_DOUBLE       0x05
+#define AMF3_STRING       0x06
+#define AMF3_XML_DOC      0x07
+#define AMF3_DATE         0x08
+#define AMF3_ARRAY        0x09
+#define AMF3_OBJECT       0x0A
+#define AMF3_XML          0x0B
+#define AMF3_BYTE_ARRAY   0x0C
+
+// More references than these in one AMF3 value fail to parse
+#define AMF3_MAX_STRINGS  64
+#define AMF3_MAX_TRAITS   16
+
+struct amf3_traits {
+	const uint8_t *names;   // the first sealed member name
+	uint32_t count;         // sealed members
+	int dynamic;
+};
+
+struct amf_reader {
+	const uint8_t *p;
+	const uint8_t *end;
+
+	// AMF3 reference tables, reset at every switch from AMF0
+	int nstrs;
+	int ntraits;
+	const uint8_t *strs[AMF3_MAX_STRINGS];
+	uint32_t str_lens[AMF3_MAX_STRINGS];
+	struct amf3_traits traits[AMF3_MAX_TRAITS];
+};
+
+void amf_reader_init(struct amf_reader *r, const void *data, size_t len);
+
+// Each read consumes one value and returns -1 if it is missing or of
+// another type, in which case nothing is consumed.
+int amf_read_string(struct amf_reader *r, const char **str, size_t *len);
+
+int amf_read_number(struct amf_reader *r, double *num);
+
+// Consume one value of any type.
+int amf_skip(struct amf_reader *r);
+
+// Consume an object (or null) and find the string property key in it. The
+// string is NULL if the property is absent.
+int amf_read_object_string(struct amf_reader *r, const char *key,
+	const char **str, size_t *len);
+
+// A write that doesn't fit sets overflow, so a whole command can be written
+// before checking once
+struct amf_writer {
+	uint8_t *start;
+	uint8_t *p;
+	uint8_t *end;
+	int overflow;
+};
+
+void amf_writer_init(struct amf_writer *w, void *buf, size_t size);
+
+size_t amf_writer_len(struct amf_writer *w);
+
+void amf_write_string(struct amf_writer *w, const char *str);
+
+void amf_write_number(struct amf_writer *w, double num);
+
+void amf_write_bool(struct amf_writer *w, int b);
+
+void amf_write_null(struct amf_writer *w);
+
+void amf_write_object_start(struct amf_writer *w);
+
+void amf_write_object_end(struct amf_writer *w);
+
+// Properties of the object being written
+void amf_write_prop_string(struct amf_writer *w, const char *key, const char *str);
+
+void amf_write_prop_number(struct amf_writer *w, const char *key, double num);
+
+#endif
@@ -0,0 +1,470 @@
+#include "config.h"
+#include "log.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CONFIG_MAX_LINE 1024
+
+struct config config = {
+	.port = 1234,
+	.backlog = 128,
+	.reactors = 1,
+	.stats_port = 0,
+	.lag_low = 256 * 1024,
+	.lag_high = 1024 * 1024,
+	.lag_max = 4 * 1024 * 1024,
+	.lag_time = 2000,
+	.gop_max_bytes = 8 * 1024 * 1024,
+	.rtmp_chunk_size = 64 * 1024,
+	.rtmp_max_partial = 8 * 1024 * 1024,
+	.record_threads = 2,
+	.record_rotate_secs = 3600,
+	.record_rotate_bytes = 1024 * 1024 * 1024,
+	.dvr_secs = 7200,
+	.dvr_bytes = 1024 * 1024 * 1024,
+	.relay_grace_ms = 10000,
+};
+
+static void
+config_usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-v] [-s] [-u] [-H] [-B] [-D path] [-p port] [-n reactors] [-m port]\n"
+		"       [-w low,high,max] [-W ms] [-g bytes] [-c bytes] [-M bytes]\n"
+		"       [-r dir] [-R secs,bytes] [-T threads] [-O] [-t dir] [-l secs,bytes]\n"
+		"       [-f file] [-L [role@]addr:port] [-S [role.]option=value]\n"
+		"       [-e addr:port] [-E ms] [-F consumers] [-U path]\n"
+		"  -v                log debug messages\n"
+		"  -s                splice opaque HTTP streams through the kernel\n"
+		"  -u                do socket I/O through io_uring\n"
+		"  -H                serve RTMP streams as low-latency HLS\n"
+		"  -B                back media buffers with 2 MiB huge pages\n"
+		"  -D path           log debug messages for one stream only\n"
+		"  -p port           listen port (default 1234)\n"
+		"  -n reactors       number of reactor threads (default: one per CPU)\n"
+		"  -m port           serve Prometheus metrics on port (default: off)\n"
+		"  -w low,high,max   consumer output watermarks in bytes\n"
+		"                    (default 262144,1048576,4194304)\n"
+		"  -W ms             consumer lag time before dropping (default 2000)\n"
+		"  -g bytes          GOP cache size per stream (default 8388608)\n"
+		"  -c bytes          outbound RTMP chunk size (default 65536)\n"
+		"  -M bytes          most an RTMP client may have in messages still\n"
+		"                    arriving, the largest it may send (default 8388608)\n"
+		"  -r dir            record every stream to files under dir\n"
+		"  -R secs,bytes     start a new recording file after secs or bytes,\n"
+		"                    0 for no limit (default 3600,1073741824)\n"
+		"  -T threads        recording I/O threads (default 2)\n"
+		"  -O                write recordings with O_DIRECT\n"
+		"  -t dir            keep a time-shift window of every RTMP stream under dir\n"
+		"  -l secs,bytes     time-shift window length and ring file size\n"
+		"                    (default 7200,1073741824)\n"
+		"  -f file           read listen, backlog and socket options from file,\n"
+		"                    one key = value a line\n"
+		"  -L [role@]addr:port\n"
+		"                    listen on addr:port (IPv4 or [IPv6]) instead of -p,\n"
+		"                    for producers (ingest), consumers (egress) or both\n"
+		"                    (any, the default); may be repeated\n"
+		"  -S [role.]option=value\n"
+		"                    set a socket option for ingest or egress connections\n"
+		"                    or, without a role, for all of them:\n"
+		"                    rcvbuf, sndbuf, nodelay, notsent_lowat, defer_accept,\n"
+		"                    keepalive_idle, keepalive_intvl, keepalive_cnt,\n"
+		"                    read_low, read_high (must hold a whole inbound RTMP\n"
+		"                    chunk), write_low (producers only); -S backlog=n sets\n"
+		"                    the listen backlog (default 128)\n"
+		"  -e addr:port      edge mode: pull streams not published here from the\n"
+		"                    origin server at addr:port\n"
+		"  -E ms             keep a pulled stream this long after its last\n"
+		"                    consumer leaves (default 10000)\n"
+		"  -F consumers      spread the consumers of a stream with more than this\n"
+		"                    many over all reactors (default: off)\n"
+		"  -U path           take over listeners and connections from the server\n"
+		"                    waiting on the Unix socket at path, then wait there\n"
+		"                    for the next upgrade\n",
+		prog);
+}
+
+const char *
+config_role_name(enum listen_role role)
+{
+	switch (role) {
+		case role_ingest:
+			return "ingest";
+		case role_egress:
+			return "egress";
+		default:
+			return "any";
+	}
+}
+
+static int
+config_parse_role(const char *name, size_t len, enum listen_role *role)
+{
+	for (int i = 0; i < role_count; i++) {
+		const char *s = config_role_name(i);
+		if (strlen(s) == len && memcmp(s, name, len) == 0) {
+			*role = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// addr:port, IPv4 or [IPv6], where a bare :port is every IPv4 address
+static int
+config_parse_addr(const char *spec, struct sockaddr_storage *addr, int *addr_len)
+{
+	char buf[128];
+	int port;
+
+	if (spec[0] == ':') {
+		snprintf(buf, sizeof(buf), "0.0.0.0%s", spec);
+		spec = buf;
+	}
+	memset(addr, 0, sizeof(*addr));
+	*addr_len = sizeof(*addr);
+	if (evutil_parse_sockaddr_port(spec, (struct sockaddr *)addr, addr_len) != 0) {
+		return -1;
+	}
+	port = addr->ss_family == AF_INET6 ?
+		ntohs(((struct sockaddr_in6 *)addr)->sin6_port) :
+		ntohs(((struct sockaddr_in *)addr)->sin_port);
+	return port == 0 ? -1 : 0;
+}
+
+// [role@]addr:port
+static int
+config_add_listener(struct config *config, const char *spec)
+{
+	struct config_listener *l = &config->listeners[config->nlisteners];
+	const char *addr = spec, *at = strchr(spec, '@');
+
+	if (config->nlisteners == CONFIG_MAX_LISTENERS) {
+		log_err("No more than %d listeners", CONFIG_MAX_LISTENERS);
+		return -1;
+	}
+	l->role = role_any;
+	if (at != NULL) {
+		if (config_parse_role(spec, at - spec, &l->role) != 0) {
+			log_err("Unknown listener role in %s", spec);
+			return -1;
+		}
+		addr = at + 1;
+	}
+	if (config_parse_addr(addr, &l->addr, &l->addr_len) != 0) {
+		log_err("Invalid listen address: %s", spec);
+		return -1;
+	}
+	if ((l->spec = strdup(spec)) == NULL) {
+		return -1;
+	}
+	config->nlisteners++;
+	return 0;
+}
+
+// A [role.]option, or backlog
+static int
+config_set_option(struct config *config, const char *key, const char *value)
+{
+	const char *dot = strchr(key, '.');
+	enum listen_role role;
+	int ret = 0;
+
+	if (strcmp(key, "backlog") == 0) {
+		config->backlog = atoi(value);
+		return config->backlog > 0 ? 0 : -1;
+	}
+	if (dot == NULL) {
+		for (int i = 0; i < role_count; i++) {
+			ret |= sockopt_set(&config->sockopts[i], key, value);
+		}
+		return ret;
+	}
+	if (config_parse_role(key, dot - key, &role) != 0 || role == role_any) {
+		return -1;
+	}
+	return sockopt_set(&config->sockopts[role], dot + 1, value);
+}
+
+static char *
+config_trim(char *s)
+{
+	char *end = s + strlen(s);
+
+	while (isspace((unsigned char)*s)) {
+		s++;
+	}
+	while (end > s && isspace((unsigned char)end[-1])) {
+		end--;
+	}
+	*end = '\0';
+	return s;
+}
+
+// Lines of key = value, where key is listen or anything -S takes, and #
+// starts a comment
+static int
+config_read_file(struct config *config, const char *path)
+{
+	char line[CONFIG_MAX_LINE], *key, *value, *eq;
+	int lineno = 0, ret = 0;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		log_err("Failed to open config file %s", path);
+		return -1;
+	}
+	while (ret == 0 && fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		if ((eq = strchr(line, '#')) != NULL) {
+			*eq = '\0';
+		}
+		key = config_trim(line);
+		if (*key == '\0') {
+			continue;
+		}
+		if ((eq = strchr(key, '=')) == NULL) {
+			log_err("%s:%d: expected key = value", path, lineno);
+			ret = -1;
+			break;
+		}
+		*eq = '\0';
+		key = config_trim(key);
+		value = config_trim(eq + 1);
+		if (strcmp(key, "listen") == 0) {
+			ret = config_add_listener(config, value);
+		} else if (config_set_option(config, key, value) != 0) {
+			log_err("%s:%d: invalid option %s = %s", path, lineno, key, value);
+			ret = -1;
+		}
+	}
+	fclose(f);
+	return ret;
+}
+
+static int
+config_parse_option(struct config *config, const char *arg)
+{
+	char key[64], *eq = strchr(arg, '=');
+
+	if (eq == NULL || eq - arg >= sizeof(key)) {
+		log_err("Invalid socket option: %s", arg);
+		return -1;
+	}
+	memcpy(key, arg, eq - arg);
+	key[eq - arg] = '\0';
+	if (config_set_option(config, key, eq + 1) != 0) {
+		log_err("Invalid socket option: %s", arg);
+		return -1;
+	}
+	return 0;
+}
+
+int
+config_parse_args(struct config *config, int argc, char *argv[])
+{
+	int opt;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	config->reactors = ncpu > 0 ? ncpu : 1;
+
+	while ((opt = getopt(argc, argv, "vsuHBOD:p:n:m:w:W:g:c:M:r:R:T:t:l:f:L:S:e:E:F:U:h")) != -1) {
+		switch (opt) {
+			case 'v':
+				log_level = LOG_DEBUG;
+				break;
+			case 's':
+				config->splice = 1;
+				break;
+			case 'u':
+				config->uring = 1;
+				break;
+			case 'H':
+				config->hls = 1;
+				break;
+			case 'B':
+				config->pool_hugepages = 1;
+				break;
+			case 'O':
+				config->record_direct = 1;
+				break;
+			case 'D':
+				log_debug_path = optarg;
+				break;
+			case 'p':
+				config->port = atoi(optarg);
+				break;
+			case 'n':
+				config->reactors = atoi(optarg);
+				break;
+			case 'm':
+				config->stats_port = atoi(optarg);
+				break;
+			case 'w':
+				if (sscanf(optarg, "%zu,%zu,%zu", &config->lag_low,
+					&config->lag_high, &config->lag_max) != 3) {
+					config_usage(argv[0]);
+					return -1;
+				}
+				break;
+			case 'W':
+				config->lag_time = atoi(optarg);
+				break;
+			case 'g':
+				config->gop_max_bytes = strtoul(optarg, NULL, 10);
+				break;
+			case 'c':
+				config->rtmp_chunk_size = strtoul(optarg, NULL, 10);
+				break;
+			case 'M':
+				config->rtmp_max_partial = strtoul(optarg, NULL, 10);
+				break;
+			case 'r':
+				config->record_dir = optarg;
+				break;
+			case 'R':
+				if (sscanf(optarg, "%d,%zu", &config->record_rotate_secs,
+					&config->record_rotate_bytes) != 2) {
+					config_usage(argv[0]);
+					return -1;
+				}
+				break;
+			case 'T':
+				config->record_threads = atoi(optarg);
+				break;
+			case 't':
+				config->dvr_dir = optarg;
+				break;
+			case 'l':
+				if (sscanf(optarg, "%d,%zu", &config->dvr_secs,
+					&config->dvr_bytes) != 2) {
+					config_usage(argv[0]);
+					return -1;
+				}
+				break;
+			case 'f':
+				if (config_read_file(config, optarg) != 0) {
+					return -1;
+				}
+				break;
+			case 'L':
+				if (config_add_listener(config, optarg) != 0) {
+					return -1;
+				}
+				break;
+			case 'S':
+				if (config_parse_option(config, optarg) != 0) {
+					return -1;
+				}
+				break;
+			case 'e':
+				config->origin_spec = optarg;
+				if (config_parse_addr(optarg, &config->origin,
+					&config->origin_len) != 0) {
+					log_err("Invalid origin address: %s", optarg);
+					return -1;
+				}
+				break;
+			case 'E':
+				config->relay_grace_ms = atoi(optarg);
+				break;
+			case 'F':
+				config->fanout_threshold = strtoul(optarg, NULL, 10);
+				break;
+			case 'U':
+				config->upgrade_path = optarg;
+				break;
+			default:
+				config_usage(argv[0]);
+				return -1;
+		}
+	}
+
+	if (config->port <= 0 || config->port > 65535) {
+		log_err("Invalid port: %d", config->port);
+		return -1;
+	}
+	if (config->nlisteners == 0) {
+		char spec[16];
+		snprintf(spec, sizeof(spec), ":%d", config->port);
+		if (config_add_listener(config, spec) != 0) {
+			return -1;
+		}
+	}
+	if (config->stats_port < 0 || config->stats_port > 65535) {
+		log_err("Invalid metrics port: %d", config->stats_port);
+		return -1;
+	}
+	for (int i = 0; i < config->nlisteners; i++) {
+		struct config_listener *l = &config->listeners[i];
+		if (l->addr.ss_family == AF_INET && config->stats_port ==
+			ntohs(((struct sockaddr_in *)&l->addr)->sin_port)) {
+			log_err("Metrics port %d is already listened on", config->stats_port);
+			return -1;
+		}
+	}
+	for (int i = 0; i < role_count; i++) {
+		struct sock_opts *opts = &config->sockopts[i];
+		// Input over read_high isn't read until the callback consumes
+		// some, which it can't while a whole header or chunk isn't there
+		if (opts->read_high && (opts->read_high < opts->read_low ||
+			opts->read_high < 64 * 1024)) {
+			log_err("The %s read watermarks must satisfy low <= high, "
+				"high >= 65536", config_role_name(i));
+			return -1;
+		}
+	}
+	if (config->lag_low > config->lag_high || config->lag_high > config->lag_max) {
+		log_err("Watermarks must satisfy low <= high <= max");
+		return -1;
+	}
+	// A chunk never needs to be longer than the longest message
+	if (config->rtmp_chunk_size < 128 || config->rtmp_chunk_size > 0xFFFFFF) {
+		log_err("RTMP chunk size must be between 128 and 16777215");
+		return -1;
+	}
+#ifndef HAVE_URING
+	if (config->uring) {
+		log_err("Built without io_uring support (make URING=1)");
+		return -1;
+	}
+#endif
+	// Splicing needs the sockets to itself
+	if (config->uring && config->splice) {
+		log_err("-s and -u can't be used together");
+		return -1;
+	}
+	// A spliced stream never passes through the recorder
+	if (config->record_dir && config->splice) {
+		log_err("-r and -s can't be used together");
+		return -1;
+	}
+	// Connections doing their I/O through a ring or a pipe can't be
+	// handed over mid-stream
+	if (config->upgrade_path && (config->uring || config->splice)) {
+		log_err("-U can't be used together with -u or -s");
+		return -1;
+	}
+	if (config->record_threads < 1 || config->record_rotate_secs < 0) {
+		log_err("Invalid recording threads or rotation");
+		return -1;
+	}
+	if (config->dvr_secs < 1 || config->dvr_secs > 1000000 || config->dvr_bytes == 0) {
+		log_err("Invalid time-shift window");
+		return -1;
+	}
+	if (config->relay_grace_ms < 0) {
+		log_err("Invalid relay grace period: %d", config->relay_grace_ms);
+		return -1;
+	}
+	if (config->reactors < 1) {
+		log_err("Invalid number of reactors: %d", config->reactors);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,108 @@
+#ifndef __TELEGENIC_CONFIG_H__
+#define __TELEGENIC_CONFIG_H__
+
+#include "sockopt.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define CONFIG_MAX_LISTENERS 16
+
+// Which clients a listener takes, and whose socket options they get
+enum listen_role {
+	role_any,
+	role_ingest,    // producers only
+	role_egress,    // consumers only
+	role_count
+};
+
+struct config_listener {
+	const char *spec;       // as given, for logging
+	enum listen_role role;
+	struct sockaddr_storage addr;
+	int addr_len;
+};
+
+struct config {
+	// Listens on all IPv4 addresses on port unless listeners are given
+	int port;
+	struct config_listener listeners[CONFIG_MAX_LISTENERS];
+	int nlisteners;
+	int backlog;
+	// By role. Options given without a role go to all three, and a
+	// connection to a role_any listener takes on the options of its role
+	// once it says whether it publishes or plays.
+	struct sock_opts sockopts[role_count];
+
+	int reactors;
+	// A stream with more live consumers than this has the rest spread over
+	// the other reactors, see fanout.h; 0 keeps every consumer on the
+	// stream's own reactor
+	size_t fanout_threshold;
+	// Prometheus metrics listener, 0 to disable
+	int stats_port;
+
+	// Consumer output watermarks. Above lag_high (or when the output has
+	// not drained below lag_low for lag_time ms) inter frames are dropped,
+	// above lag_max whole GOPs are; delivery resumes at a keyframe once
+	// the output is back under lag_low.
+	size_t lag_low;
+	size_t lag_high;
+	size_t lag_max;
+	int lag_time;
+
+	// Upper bound on the GOP kept per stream for joining consumers
+	size_t gop_max_bytes;
+
+	// Chunk size the server announces and sends RTMP messages with
+	uint32_t rtmp_chunk_size;
+	// Bound on the messages an RTMP client has partly sent, together
+	size_t rtmp_max_partial;
+
+	// Pass opaque HTTP streams through kernel pipes, see splice.h
+	int splice;
+
+	// Do socket I/O through io_uring, see uring.h
+	int uring;
+
+	// Back the media buffer pool with huge pages, see pool.h
+	int pool_hugepages;
+
+	// Serve RTMP streams as LL-HLS, see hls.h
+	int hls;
+
+	// Record every stream under record_dir, see record.h. A new file is
+	// started once the current one is record_rotate_secs old or
+	// record_rotate_bytes long (0 for no limit).
+	const char *record_dir;
+	int record_threads;
+	int record_rotate_secs;
+	size_t record_rotate_bytes;
+	int record_direct;      // write recordings with O_DIRECT
+
+	// Edge mode: pull streams nobody publishes here from the origin, and
+	// let go of one relay_grace_ms after its last consumer, see relay.h
+	const char *origin_spec;
+	struct sockaddr_storage origin;
+	int origin_len;
+	int relay_grace_ms;
+
+	// Keep the last dvr_secs (at most dvr_bytes) of every RTMP stream in a
+	// ring file under dvr_dir for time-shifted playback, see dvr.h
+	const char *dvr_dir;
+	int dvr_secs;
+	size_t dvr_bytes;
+
+	// Unix socket a new server takes over this one's listeners and
+	// connections through, see upgrade.h
+	const char *upgrade_path;
+};
+
+extern struct config config;
+
+int config_parse_args(struct config *config, int argc, char *argv[]);
+
+const char *config_role_name(enum listen_role role);
+
+#endif
@@ -1,34 +1,163 @@
 #include "conn.h"
+#include "config.h"
+#include "dvr.h"
+#include "epoch.h"
+#include "fanout.h"
+#include "flv.h"
+#include "hls.h"
+#include "reactor.h"
+#include "record.h"
+#include "pool.h"
+#include "registry.h"
+#include "relay.h"
 #include "rtmp.h"
+#include "slab.h"
+#include "splice.h"
+#include "stats.h"
+#include "upgrade.h"
+#include "uring.h"
 
-#include <apr-1/apr_general.h>
-#include <apr-1/apr_pools.h>
-#include <apr-1/apr_hash.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <string.h>
 
-static apr_pool_t *mp;
-static apr_hash_t *ht;
+static struct slab_class client_slab = SLAB_CLASS(struct conn_client);
+static struct slab_class producer_slab = SLAB_CLASS(struct producer);
+
+static void conn_migrate(struct conn_client *client, struct reactor *reactor);
+
+struct conn_handoff {
+	struct conn_client *client;
+	struct reactor *from;
+	struct bufferevent *bev;
+	evutil_socket_t fd;
+	struct evbuffer *input;
+	struct evbuffer *output;
+};
+
+static void
+conn_link_client(struct reactor *reactor, struct conn_client *client)
+{
+	client->prev = NULL;
+	client->next = reactor->clients;
+	if (client->next) {
+		client->next->prev = client;
+	}
+	reactor->clients = client;
+}
 
 static void
-conn_add_producer(const char *path, struct conn_client *client)
+conn_unlink_client(struct reactor *reactor, struct conn_client *client)
 {
-	log_debug("Adding producer for: %s", client->path);
-	struct producer *producer = malloc(sizeof(struct producer));
+	if (client->prev) {
+		client->prev->next = client->next;
+	} else {
+		reactor->clients = client->next;
+	}
+	if (client->next) {
+		client->next->prev = client->prev;
+	}
+}
+
+static void
+conn_link_producer(struct reactor *reactor, struct producer *producer)
+{
+	producer->next = reactor->producers;
+	if (producer->next) {
+		producer->next->prev = producer;
+	}
+	reactor->producers = producer;
+}
+
+static void
+conn_unlink_producer(struct reactor *reactor, struct producer *producer)
+{
+	if (producer->prev) {
+		producer->prev->next = producer->next;
+	} else {
+		reactor->producers = producer->next;
+	}
+	if (producer->next) {
+		producer->next->prev = producer->prev;
+	}
+}
+
+static int
+conn_add_producer(struct conn_client *client)
+{
+	log_path_debug(client->path, "Adding producer for: %s", client->path);
+	struct producer *producer = slab_calloc(&producer_slab);
+	if (producer == NULL) {
+		return -1;
+	}
 	producer->client = client;
-	producer->consumer_list = NULL;
+	cset_init(&producer->consumers);
+	cset_init(&producer->shifted);
+	gop_cache_init(&producer->gop);
+	if (registry_add(client->path, client->path_len, client->path_hash,
+		producer) != 0) {
+		slab_free(producer);
+		return -1;
+	}
+
+	// The stream owns the one copy of the path its clients share
+	producer->path = client->path;
+	client->path_owned = 0;
+	producer->recorder = record_open(producer->path,
+		client->proto == protocol_rtmp);
+	if (config.hls && client->proto == protocol_rtmp) {
+		producer->hls = hls_new(client->reactor->base);
+	}
+	if (client->proto == protocol_rtmp) {
+		producer->dvr = dvr_open(producer->path);
+	}
 	client->producer = producer;
 	client->is_producer = 1;
-	apr_hash_set(ht, path, APR_HASH_KEY_STRING, producer);
+	conn_link_producer(client->reactor, producer);
+	return 0;
+}
+
+static void
+conn_free_producer(void *ptr)
+{
+	struct producer *producer = ptr;
+	free(producer->path);
+	slab_free(producer);
 }
 
+// Streams only change on their owning reactor, so the producer returned
+// here stays valid for as long as the caller runs on that reactor.
 static struct producer *
-conn_get_producer(const char *path)
+conn_get_producer(struct conn_client *client)
 {
-	struct producer *producer = apr_hash_get(ht, path, APR_HASH_KEY_STRING);
+	struct producer *producer;
+
+	epoch_enter();
+	producer = registry_get(client->path, client->path_len, client->path_hash);
+	epoch_exit();
 	return producer;
 }
 
+// The stream is over, take every consumer down with it
+static void
+conn_end_stream(struct producer *producer)
+{
+	struct conn_client *consumer;
+	size_t i;
+
+	cset_foreach(&producer->consumers, i, consumer) {
+		consumer->producer = NULL;
+		conn_free_client(consumer);
+	}
+	cset_free(&producer->consumers);
+	cset_foreach(&producer->shifted, i, consumer) {
+		consumer->producer = NULL;
+		conn_free_client(consumer);
+	}
+	cset_free(&producer->shifted);
+	gop_cache_free(&producer->gop);
+}
+
 static void
 conn_del_producer(struct conn_client *client)
 {
@@ -36,74 +165,197 @@ conn_del_producer(struct conn_client *client)
 	if (producer == NULL) {
 		return;
 	}
-	struct consumer *tmp_c, *c = producer->consumer_list;
-	while (c != NULL) {
-		tmp_c = c;
-		c = c->next;
-		free(tmp_c);
+	conn_end_stream(producer);
+	if (producer->fanout) {
+		fanout_free(producer->fanout);
+		producer->fanout = NULL;
+	}
+	if (producer->splice) {
+		splice_source_free(producer->splice);
+		producer->splice = NULL;
+	}
+	if (producer->recorder) {
+		record_close(producer->recorder);
+		producer->recorder = NULL;
+	}
+	if (producer->hls) {
+		hls_free(producer->hls);
+		producer->hls = NULL;
+	}
+	if (producer->dvr) {
+		dvr_close(producer->dvr);
+		producer->dvr = NULL;
+	}
+	if (producer->relay) {
+		relay_free(producer->relay);
+		producer->relay = NULL;
+	}
+	registry_del(client->path, client->path_len, client->path_hash, producer);
+	client->producer = NULL;
+	conn_unlink_producer(client->reactor, producer);
+
+	// Lookups from other reactors may still hold the producer
+	epoch_retire(producer, conn_free_producer);
+}
+
+// Shards aren't in the registry, so nothing else can be looking at one
+struct producer *
+conn_add_shard(struct reactor *reactor, struct shard *shard, const char *path)
+{
+	struct producer *producer = slab_calloc(&producer_slab);
+
+	if (producer == NULL) {
+		return NULL;
+	}
+	if ((producer->path = strdup(path)) == NULL) {
+		slab_free(producer);
+		return NULL;
 	}
-	if (producer != NULL) {
-		apr_hash_set(ht, client->path, APR_HASH_KEY_STRING, NULL);
-		free(producer);
+	producer->shard = shard;
+	cset_init(&producer->consumers);
+	cset_init(&producer->shifted);
+	gop_cache_init(&producer->gop);
+	conn_link_producer(reactor, producer);
+	return producer;
+}
+
+void
+conn_del_shard(struct reactor *reactor, struct producer *producer)
+{
+	conn_end_stream(producer);
+	conn_unlink_producer(reactor, producer);
+	conn_free_producer(producer);
+}
+
+// Queue msg in whatever form the consumer takes its stream
+static void
+conn_queue_msg(struct conn_client *client, struct evbuffer *out, struct msg *msg)
+{
+	switch (client->egress) {
+		case egress_flv:
+			if (flv_is_tag(msg)) {
+				flv_add_tag(out, msg);
+			}
+			break;
+
+		case egress_rtmp:
+			rtmp_queue_msg(client, out, msg);
+			break;
+
+		default:
+			msg_add(out, msg);
+			break;
+	}
+}
+
+static void
+conn_burst_cb(struct msg *msg, void *arg)
+{
+	struct conn_client *client = arg;
+	conn_queue_msg(client, bufferevent_get_output(client->bev), msg);
+}
+
+static uint64_t
+conn_now_ms(struct conn_client *client)
+{
+	struct timeval tv;
+	event_base_gettimeofday_cached(client->reactor->base, &tv);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+// Start a time-shifted consumer off in the stream's window. It gets the
+// stream's current codec configuration, then everything from the reader's
+// keyframe on, paced by conn_feed_shifted.
+static int
+conn_add_shifted(struct producer *producer, struct conn_client *client)
+{
+	struct gop_cache *gop = &producer->gop;
+	struct evbuffer *out = bufferevent_get_output(client->bev);
+
+	if (cset_add(&producer->shifted, client) != 0) {
+		return -1;
 	}
+	if (gop->metadata) {
+		conn_queue_msg(client, out, gop->metadata);
+	}
+	if (gop->video_config) {
+		conn_queue_msg(client, out, gop->video_config);
+	}
+	if (gop->audio_config) {
+		conn_queue_msg(client, out, gop->audio_config);
+	}
+	return 0;
 }
 
+// Let a pulled stream know whether anyone is still watching it
 static void
+conn_relay_update(struct producer *producer)
+{
+	if (producer->relay) {
+		relay_consumers(producer->relay, cset_count(&producer->consumers) +
+			cset_count(&producer->shifted));
+	}
+}
+
+static int
 conn_add_consumer(struct producer *producer, struct conn_client *client)
 {
-	log_debug("Adding consumer to: %s", producer->client->path);
-	struct consumer *c, *consumer;
-	consumer = malloc(sizeof(struct consumer));
-	consumer->client = client;
-	consumer->next = NULL;
-	if (producer->consumer_list == NULL) {
-		producer->consumer_list = consumer;
-		return;
+	log_path_debug(client->path, "Adding consumer to: %s", producer->path);
+	// Played live if the window has no keyframe to start from yet
+	if (client->timeshift > 0 && producer->dvr && (client->dvr =
+		dvr_reader_new(producer->dvr, client->timeshift, conn_now_ms(client)))) {
+		if (conn_add_shifted(producer, client) != 0) {
+			return -1;
+		}
+	} else if (cset_add(&producer->consumers, client) != 0) {
+		return -1;
 	}
-	c = producer->consumer_list;
-	while (c->next != NULL) {
-		c = c->next;
+	client->producer = producer;
+	conn_relay_update(producer);
+	if (client->path_owned) {
+		free(client->path);
+		client->path = producer->path;
+		client->path_owned = 0;
 	}
-	c->next = consumer;
+
+	// Hear about the output draining so lag is measured from when it
+	// first stopped keeping up
+	bufferevent_setwatermark(client->bev, EV_WRITE, config.lag_low, 0);
+	bufferevent_set_max_single_write(client->bev, CONN_MAX_WRITE);
+
+	// Start the consumer off at the last keyframe rather than making it
+	// wait for the next one, unless it is already under way
+	if (client->dvr == NULL && !client->resumed) {
+		gop_cache_foreach(&producer->gop, conn_burst_cb, client);
+	}
+	client->resumed = 0;
+	return 0;
 }
 
 static void
 conn_del_consumer(struct conn_client *client)
 {
-	struct producer *producer = client->producer;
-	struct consumer *c, *c_prev;
 	if (client->producer == NULL) {
 		return;
 	}
-	c = producer->consumer_list;
-	while (c != NULL) {
-		if (c->client == client) {
-			if (c == producer->consumer_list) {
-				producer->consumer_list = c->next;
-			} else {
-				c_prev->next = c->next;
-			}
-
-			free(c);
-		}
-		c_prev = c;
-	}
+	cset_del(client->dvr ? &client->producer->shifted :
+		&client->producer->consumers, client);
+	conn_relay_update(client->producer);
+	client->producer = NULL;
 }
 
-void
+int
 conn_init()
 {
-	apr_initialize();
-	apr_pool_create(&mp, NULL);
-	apr_palloc(mp, MEM_ALLOC_SIZE);
-	ht = apr_hash_make(mp);
+	registry_init();
+	return splice_init();
 }
 
 void
 conn_terminate()
 {
-	apr_pool_destroy(mp);
-	apr_terminate();
+	splice_terminate();
+	registry_terminate();
 }
 
 void
@@ -113,90 +365,827 @@ conn_buffer_write(struct conn_client *client, char *data, size_t len)
 	evbuffer_add(out, data, len);
 }
 
+// Decides whether msg may be queued for a consumer whose output already
+// holds queued bytes. Returns 1 to send, 0 to drop and -1 if the consumer
+// has fallen so far behind on an opaque stream that it must be cut off.
+static int
+conn_lag_admit(struct conn_client *client, struct msg *msg, size_t queued)
+{
+	int over_time = 0;
+
+	if (queued > config.lag_low) {
+		uint64_t now = conn_now_ms(client);
+		if (client->lag_since == 0) {
+			client->lag_since = now;
+		} else if (now - client->lag_since > config.lag_time) {
+			over_time = 1;
+		}
+	} else {
+		client->lag_since = 0;
+	}
+
+	// Opaque bytes can't be dropped without corrupting the stream
+	if (msg->type != RTMP_TYPE_AUDIO_PACKET && msg->type != RTMP_TYPE_VIDEO_PACKET) {
+		if (msg->type == 0 && queued > config.lag_max) {
+			return -1;
+		}
+		return 1;
+	}
+
+	if (msg->flags & MSG_CONFIG) {
+		return 1;
+	}
+
+	if (queued > config.lag_max) {
+		client->lag = lag_skip_gop;
+	} else if (client->lag == lag_ok && (queued > config.lag_high || over_time)) {
+		client->lag = lag_skip_inter;
+	}
+
+	switch (client->lag) {
+		case lag_ok:
+			return 1;
+
+		case lag_skip_inter:
+			if (msg->flags & MSG_KEYFRAME) {
+				// Caught up: carry on from this keyframe as normal
+				if (queued <= config.lag_low) {
+					client->lag = lag_ok;
+				}
+				return 1;
+			}
+			return msg->type == RTMP_TYPE_AUDIO_PACKET;
+
+		case lag_skip_gop:
+			if ((msg->flags & MSG_KEYFRAME) && queued <= config.lag_low) {
+				client->lag = lag_ok;
+				return 1;
+			}
+			return 0;
+	}
+
+	return 1;
+}
+
+static void
+conn_send_msg(struct conn_client *client, struct msg *msg)
+{
+	struct evbuffer *out = bufferevent_get_output(client->bev);
+
+	switch (conn_lag_admit(client, msg, evbuffer_get_length(out))) {
+		case 1:
+			conn_queue_msg(client, out, msg);
+			break;
+
+		case 0:
+			client->dropped_bytes += msg->len;
+			client->dropped_msgs++;
+			client->producer->dropped_bytes += msg->len;
+			client->producer->dropped_msgs++;
+			client->reactor->stats.dropped_bytes += msg->len;
+			break;
+
+		default:
+			client->reactor->stats.consumers_cut++;
+			log_info("Dropping consumer of %s: %zu bytes behind",
+				client->path, evbuffer_get_length(out));
+			conn_close_client(client);
+			break;
+	}
+}
+
+// Queue whatever of the window has come due for the time-shifted
+// consumers. They keep up by pace rather than by dropping: a consumer whose
+// output is full is simply fed later, until the writer laps it.
+static void
+conn_feed_shifted(struct producer *producer)
+{
+	struct conn_client *consumer;
+	struct evbuffer *out;
+	struct msg *msg;
+	uint64_t now = conn_now_ms(producer->client);
+	size_t i;
+
+	cset_foreach(&producer->shifted, i, consumer) {
+		out = bufferevent_get_output(consumer->bev);
+		while (evbuffer_get_length(out) < config.lag_high &&
+			(msg = dvr_read(producer->dvr, consumer->dvr, now)) != NULL) {
+			conn_queue_msg(consumer, out, msg);
+			msg_unref(msg);
+		}
+	}
+}
+
+void
+conn_fanout(struct producer *producer, struct msg *msg)
+{
+	struct conn_client *consumer;
+	size_t i;
+
+	producer->ingest_bytes += msg->len;
+	gop_cache_add(&producer->gop, msg);
+	if (producer->recorder) {
+		record_msg(producer->recorder, msg);
+	}
+	if (producer->hls) {
+		hls_msg(producer->hls, msg);
+	}
+	if (producer->dvr) {
+		dvr_msg(producer->dvr, msg);
+		if (cset_count(&producer->shifted) > 0) {
+			conn_feed_shifted(producer);
+		}
+	}
+	// Wake the other reactors first so they write to their consumers
+	// while this one writes to its own
+	if (producer->fanout) {
+		fanout_publish(producer->fanout, msg);
+	}
+
+	cset_begin(&producer->consumers);
+	cset_foreach(&producer->consumers, i, consumer) {
+		conn_send_msg(consumer, msg);
+	}
+	cset_end(&producer->consumers);
+}
+
+// The output depth and lag of a stream's live or time-shifted consumers
+static void
+conn_collect_consumers(struct stats_snapshot *snap, struct stats_stream *stream,
+	struct cset *set, uint64_t now)
+{
+	struct conn_client *consumer;
+	struct stats_consumer *c;
+	uint64_t queued;
+	size_t i;
+
+	cset_foreach(set, i, consumer) {
+		queued = evbuffer_get_length(bufferevent_get_output(consumer->bev));
+		if (consumer->egress == egress_splice) {
+			queued += splice_queued(consumer);
+		}
+		stream->output_bytes += queued;
+		if (queued > stream->output_max) {
+			stream->output_max = queued;
+		}
+		if (consumer->lag != lag_ok) {
+			stream->lagging++;
+		}
+
+		if (!snap->want_consumers || (c = stats_add_consumer(snap)) == NULL) {
+			continue;
+		}
+		c->stream = snap->nstreams - 1;
+		c->fd = consumer->uring ? uring_conn_fd(consumer->uring)
+			: bufferevent_getfd(consumer->bev);
+		c->output_bytes = queued;
+		c->lag = consumer->lag;
+		c->lag_seconds = consumer->lag_since && now > consumer->lag_since ?
+			(now - consumer->lag_since) / 1000.0 : 0;
+		c->dropped_bytes = consumer->dropped_bytes;
+	}
+}
+
+void
+conn_collect_stats(struct reactor *reactor, struct stats_snapshot *snap)
+{
+	struct producer *producer;
+	struct stats_stream *stream;
+	struct timeval tv;
+	uint64_t now;
+
+	event_base_gettimeofday_cached(reactor->base, &tv);
+	now = (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+	for (producer = reactor->producers; producer; producer = producer->next) {
+		if ((stream = stats_add_stream(snap)) == NULL) {
+			return;
+		}
+		if ((stream->path = strdup(producer->path)) == NULL) {
+			snap->nstreams--;
+			return;
+		}
+		stream->ingest_bytes = producer->ingest_bytes;
+
+		stream->consumers = cset_count(&producer->consumers) +
+			cset_count(&producer->shifted);
+		stream->gop_bytes = producer->gop.bytes;
+		stream->dropped_bytes = producer->dropped_bytes;
+		stream->dropped_msgs = producer->dropped_msgs;
+		if (producer->recorder) {
+			stream->record_lag_bytes = record_lag_bytes(producer->recorder);
+			stream->record_lag_seconds = record_lag_seconds(producer->recorder);
+			stream->record_dropped_msgs = record_dropped_msgs(producer->recorder);
+		}
+
+		conn_collect_consumers(snap, stream, &producer->consumers, now);
+		conn_collect_consumers(snap, stream, &producer->shifted, now);
+	}
+}
+
 struct conn_client *
-conn_alloc_client(struct bufferevent *bev)
+conn_alloc_client(struct reactor *reactor, struct bufferevent *bev)
 {
-	struct conn_client *client = malloc(sizeof(struct conn_client));
+	struct conn_client *client = slab_calloc(&client_slab);
+	if (client == NULL) {
+		return NULL;
+	}
+	client->reactor = reactor;
 	client->bev = bev;
-	client->path = NULL;
-	client->is_producer = 0;
-	client->producer = NULL;
+	client->lag = lag_ok;
+	client->proto = protocol_none;
+	reactor->stats.clients++;
+	conn_link_client(reactor, client);
 	return client;
 }
 
 void
 conn_free_client(struct conn_client *client)
 {
-	// Socket is closed when bufferevent is free'd
-	bufferevent_free(client->bev);
-	free(client);
+	// Socket is closed when bufferevent is free'd, or by the ring once it
+	// is done with it
+	if (client->uring) {
+		uring_conn_close(client->uring);
+	}
+	if (client->bev) {
+		bufferevent_free(client->bev);
+	}
+	if (client->proto_data && client->proto == protocol_rtmp) {
+		rtmp_free_info(client->proto_data);
+	} else if (client->proto_data && client->egress == egress_splice) {
+		splice_sink_free(client->proto_data);
+	} else if (client->proto_data && client->egress == egress_hls) {
+		hls_request_free(client->proto_data);
+	}
+	if (client->dvr) {
+		dvr_reader_free(client->dvr);
+	}
+	if (client->path_owned) {
+		free(client->path);
+	}
+	if (client->shard) {
+		fanout_leave(client->shard);
+	}
+	client->reactor->stats.clients--;
+	conn_unlink_client(client->reactor, client);
+	slab_free(client);
 }
 
 static enum protocol
-conn_determine_protocol(const char *data, size_t len)
+conn_determine_protocol(struct evbuffer *input)
 {
+	char c;
+	evbuffer_copyout(input, &c, 1);
+
 	// RTMP: First packet will be the client RTMP version
-	if (data[0] >= 0x03 && data[0] <= 0x1F) {
+	if (c >= 0x03 && c <= 0x1F) {
 		log_debug("Detected protocol: rtmp");
 		return protocol_rtmp;
 	}
 
+	switch (toupper(c)) {
+		case 'P':
+		case 'G':
+			log_debug("Detected protocol: http");
+			return protocol_http;
+	}
+
 	return protocol_none;
 }
 
-static char *
-conn_read_header(const char *data, struct conn_client *client)
+static int
+conn_set_path(struct conn_client *client, const char *path, size_t len)
+{
+	if ((client->path = strndup(path, len)) == NULL) {
+		return -1;
+	}
+	client->path_owned = 1;
+	client->path_len = len;
+	client->path_hash = registry_hash(client->path, len);
+	return 0;
+}
+
+static int
+conn_published(const char *path, size_t len)
+{
+	void *exact;
+
+	epoch_enter();
+	exact = registry_get(path, len, registry_hash(path, len));
+	epoch_exit();
+	return exact != NULL;
+}
+
+// GET /name.flv plays stream /name remuxed to FLV, unless something was
+// published under /name.flv itself
+static int
+conn_flv_path(const char *path, size_t len)
+{
+	if (len <= 4 || strncmp(path + len - 4, ".flv", 4) != 0) {
+		return 0;
+	}
+	return !conn_published(path, len);
+}
+
+// GET /name/index.m3u8 and the rest of stream /name's HLS resources, on
+// the same terms. *len is cut down to the stream's path.
+static struct hls_request *
+conn_hls_path(const char *path, size_t *len)
+{
+	struct hls_request *req;
+	size_t stream_len;
+
+	if ((req = hls_parse(path, *len, &stream_len)) == NULL) {
+		return NULL;
+	}
+	if (conn_published(path, *len)) {
+		hls_request_free(req);
+		return NULL;
+	}
+	*len = stream_len;
+	return req;
+}
+
+// Parses the HTTP request header out of input and records the stream it
+// names. Returns 1 once the header has been consumed, 0 if more data is
+// needed and -1 if the client should be dropped.
+static int
+conn_read_header(struct evbuffer *input, struct conn_client *client)
 {
 	size_t len;
-	int is_producer;
-	struct producer *producer;
-	char *pos;
+	struct evbuffer_ptr eoh;
+	char *line, *pos, *end, *query;
+	struct hls_request *req;
+
+	eoh = evbuffer_search(input, "\r\n\r\n", 4, NULL);
+	if (eoh.pos == -1) {
+		return evbuffer_get_length(input) > CONN_MAX_HEADER_SIZE ? -1 : 0;
+	}
+
+	// Allocated by libevent, so by the pool
+	line = evbuffer_readln(input, &len, EVBUFFER_EOL_CRLF_STRICT);
+	evbuffer_drain(input, eoh.pos + 4 - (len + 2));
 
 	// Read HTTP Method
-	switch (toupper(data[0])) {
+	switch (toupper(line[0])) {
 		case 'P': // POST
 			log_debug("HTTP method POST");
-			is_producer = 1;
+			client->is_producer = 1;
 			break;
 		case 'G': // GET
 			log_debug("HTTP method GET");
-			is_producer = 0;
+			client->is_producer = 0;
 			break;
 
 		default:
-			return NULL;
+			pool_free(line);
+			return -1;
 	}
 
 	// Read path
-	pos = strpbrk(data, " ") + 1;
-	if (!pos) return NULL;
+	pos = strchr(line, ' ');
+	end = pos ? strchr(pos + 1, ' ') : NULL;
+	if (end == NULL) {
+		pool_free(line);
+		return -1;
+	}
+
+	pos++;
+	len = end - pos;
+	if (!client->is_producer && config.hls &&
+		(req = conn_hls_path(pos, &len)) != NULL) {
+		client->egress = egress_hls;
+		client->proto_data = req;
+	} else if (!client->is_producer) {
+		// Playback options ride along as a query string
+		if ((query = memchr(pos, '?', len)) != NULL) {
+			client->timeshift = dvr_query_shift(query + 1, end - query - 1);
+			len = query - pos;
+		}
+		if (conn_flv_path(pos, len)) {
+			client->egress = egress_flv;
+			len -= 4;
+		}
+	}
+	if (conn_set_path(client, pos, len) != 0) {
+		pool_free(line);
+		return -1;
+	}
+	pool_free(line);
+	log_path_debug(client->path, "Read path %s", client->path);
+
+	return 1;
+}
 
-	len = (strchr(pos, ' ') - pos);
-	client->path = malloc(len + 1);
-	strncpy(client->path, pos, len);
-	log_debug("Read path %s", client->path);
+static int
+conn_http_respond(struct conn_client *client)
+{
+	struct evbuffer *out = bufferevent_get_output(client->bev);
 
-	// Move pos to the end of the HTTP header
-	pos = strstr(pos, "\r\n") + 2;
-	if (!pos) return NULL;
+	switch (client->egress) {
+		case egress_flv:
+			evbuffer_add_printf(out, "HTTP/1.0 200 OK\r\n"
+				"Content-Type: video/x-flv\r\n\r\n");
+			flv_write_header(out);
+			break;
 
-	producer = conn_get_producer(client->path);
+		case egress_splice:
+			// Nothing goes through the output buffer, or it could
+			// overtake what is in the pipe
+			return splice_attach(client, "HTTP/1.0 200 OK\r\n\r\n", 19);
 
-	if (is_producer) {
+		default:
+			conn_buffer_write(client, "HTTP/1.0 200 OK\r\n\r\n", 19);
+			break;
+	}
+	return 0;
+}
+
+// Hold a client to its listener's role. One from a listener for either
+// gets its role's socket options now that it has one; the rest got theirs
+// from the listening socket. Watermarks belong to the bufferevent, which a
+// migration replaces, so they are set every time.
+static int
+conn_apply_role(struct conn_client *client)
+{
+	int role = client->is_producer ? role_ingest : role_egress;
+	const struct sock_opts *opts = &config.sockopts[role];
+
+	if (client->role == role_any) {
+		if (client->uring == NULL) {
+			sockopt_apply(bufferevent_getfd(client->bev), opts);
+		} else {
+			sockopt_apply(uring_conn_fd(client->uring), opts);
+		}
+		client->role = role;
+	} else if (client->role != role) {
+		log_info("%s client on an %s listener",
+			config_role_name(role), config_role_name(client->role));
+		return -1;
+	}
+
+	bufferevent_setwatermark(client->bev, EV_READ, opts->read_low, opts->read_high);
+	if (client->is_producer) {
+		bufferevent_setwatermark(client->bev, EV_WRITE, opts->write_low, 0);
+	}
+	return 0;
+}
+
+// Start pulling a stream nobody publishes here from the origin. The stream
+// exists from now on, so consumers join it before its first message.
+static struct producer *
+conn_pull(struct conn_client *client)
+{
+	struct conn_client *upstream = conn_alloc_client(client->reactor, NULL);
+
+	if (upstream == NULL) {
+		return NULL;
+	}
+	// What the origin sends is RTMP messages framed as FLV tags, so the
+	// stream is treated as one published over RTMP
+	upstream->proto = protocol_rtmp;
+	upstream->role = role_ingest;
+	upstream->is_producer = 1;
+	if (conn_set_path(upstream, client->path, client->path_len) != 0 ||
+		conn_add_producer(upstream) != 0 ||
+		(upstream->producer->relay = relay_new(upstream)) == NULL) {
+		conn_close_client(upstream);
+		return NULL;
+	}
+	return upstream->producer;
+}
+
+// Attaches a client whose path is known to its stream. Must run on the
+// reactor that owns the path, or on the one the client was placed on for a
+// wide stream. Returns 1 if the client is attached, 0 if it was handed to
+// another reactor and -1 if it should be dropped.
+static int
+conn_attach(struct conn_client *client)
+{
+	struct producer *producer;
+	struct reactor *reactor;
+
+	if (conn_apply_role(client) != 0) {
+		return -1;
+	}
+
+	// Handed over by the stream's reactor, which has already answered it
+	if (client->shard) {
+		if ((producer = fanout_join(client->shard)) == NULL ||
+			conn_add_consumer(producer, client) != 0) {
+			return -1;
+		}
+		return 1;
+	}
+
+	producer = conn_get_producer(client);
+	if (client->is_producer) {
 		if (producer != NULL) {
-			return NULL;
+			return -1;
 		}
 
-		conn_add_producer(client->path, client);
+		if (conn_add_producer(client) != 0) {
+			return -1;
+		}
+		if (config.splice && client->proto == protocol_http &&
+			splice_start(client) != 0) {
+			return -1;
+		}
+	} else if (client->egress == egress_hls) {
+		// Answered from the stream's segments rather than fanned out to
+		bufferevent_set_max_single_write(client->bev, CONN_MAX_WRITE);
+		return hls_serve(producer ? producer->hls : NULL, client) == 0 ? 1 : -1;
 	} else {
+		if (producer == NULL && config.origin_spec) {
+			producer = conn_pull(client);
+		}
 		if (producer == NULL) {
-			return NULL;
+			return -1;
+		}
+
+		// Only RTMP streams have messages to remux; anything else is
+		// passed on as it came in, which RTMP players can't take
+		if (client->proto == protocol_rtmp) {
+			if (producer->client->proto != protocol_rtmp) {
+				return -1;
+			}
+			client->egress = egress_rtmp;
+			rtmp_attached(client);
+		} else {
+			if (producer->client->proto != protocol_rtmp) {
+				client->egress = producer->splice ? egress_splice : egress_raw;
+			}
+			if (conn_http_respond(client) != 0) {
+				return -1;
+			}
+		}
+		if ((reactor = fanout_place(producer, client)) != NULL) {
+			conn_migrate(client, reactor);
+			return 0;
+		}
+		if (conn_add_consumer(producer, client) != 0) {
+			return -1;
+		}
+		return 1;
+	}
+
+	if (client->proto == protocol_rtmp) {
+		rtmp_attached(client);
+	}
+	return 1;
+}
+
+// A bufferevent for a socket on the reactor, doing its I/O through the
+// reactor's ring if it has one. The socket is closed on failure.
+static struct bufferevent *
+conn_socket_new(struct reactor *reactor, evutil_socket_t fd,
+	struct uring_conn **uc)
+{
+	struct bufferevent *bev = NULL;
+
+	*uc = NULL;
+	if (reactor->uring) {
+		if ((*uc = uring_conn_new(reactor->uring, fd, &bev)) == NULL) {
+			evutil_closesocket(fd);
+		}
+		return bev;
+	}
+	return bufferevent_socket_new(reactor->base, fd, BEV_OPT_CLOSE_ON_FREE);
+}
+
+static void
+conn_adopt_cb(void *arg)
+{
+	struct conn_handoff *handoff = arg;
+	struct conn_client *client = handoff->client;
+	struct reactor *reactor = client->reactor;
+
+	reactor->stats.clients++;
+	conn_link_client(reactor, client);
+	client->bev = conn_socket_new(reactor, handoff->fd, &client->uring);
+	if (client->bev == NULL) {
+		log_err("Failed to adopt client for %s", client->path);
+		evbuffer_free(handoff->input);
+		evbuffer_free(handoff->output);
+		free(handoff);
+		conn_free_client(client);
+		return;
+	}
+	evbuffer_prepend_buffer(bufferevent_get_input(client->bev), handoff->input);
+	evbuffer_add_buffer(bufferevent_get_output(client->bev), handoff->output);
+	evbuffer_free(handoff->input);
+	evbuffer_free(handoff->output);
+	free(handoff);
+
+	bufferevent_setcb(client->bev, conn_read_cb, conn_write_cb, conn_event_cb, client);
+
+	// Handed over before the reactor froze for an upgrade, and saved
+	// as it is
+	if (reactor->frozen) {
+		return;
+	}
+	bufferevent_enable(client->bev, EV_READ|EV_WRITE);
+
+	log_path_debug(client->path, "Adopted client for %s on reactor %d",
+		client->path, reactor->id);
+	switch (conn_attach(client)) {
+		case 0:
+			return;
+
+		case -1:
+			reactor->stats.handshake_failures++;
+			conn_free_client(client);
+			return;
+	}
+
+	// Whatever followed the header is still waiting in the input buffer
+	conn_read_cb(client->bev, client);
+}
+
+// Take what the old bufferevent buffered and post the client to its new
+// reactor. Runs once nothing will touch the socket on the old one.
+static void
+conn_handoff_post(void *arg)
+{
+	struct conn_handoff *handoff = arg;
+	struct conn_client *client = handoff->client;
+	struct reactor *reactor = client->reactor;
+
+	handoff->input = evbuffer_new();
+	handoff->output = evbuffer_new();
+	evbuffer_add_buffer(handoff->input, bufferevent_get_input(handoff->bev));
+	// A socket bufferevent keeps the front of its output frozen for the
+	// writer; it is about to go, so let go of whatever it had queued
+	evbuffer_unfreeze(bufferevent_get_output(handoff->bev), 1);
+	evbuffer_add_buffer(handoff->output, bufferevent_get_output(handoff->bev));
+
+	if (reactor_post(reactor, conn_adopt_cb, handoff) != 0) {
+		log_err("Failed to hand client over to reactor %d", reactor->id);
+		evutil_closesocket(handoff->fd);
+		evbuffer_free(handoff->input);
+		evbuffer_free(handoff->output);
+		client->reactor = handoff->from;
+		handoff->from->stats.clients++;
+		conn_link_client(handoff->from, client);
+		free(handoff);
+		conn_free_client(client);
+	}
+}
+
+// Moves a client to the given reactor. The socket and any buffered input
+// and output travel with it; the client must not be touched again on this
+// thread.
+static void
+conn_migrate(struct conn_client *client, struct reactor *reactor)
+{
+	struct conn_handoff *handoff = malloc(sizeof(struct conn_handoff));
+	struct bufferevent *bev = client->bev;
+
+	log_path_debug(client->path, "Migrating client for %s from reactor %d to %d",
+		client->path, client->reactor->id, reactor->id);
+
+	bufferevent_disable(bev, EV_READ|EV_WRITE);
+	handoff->client = client;
+	handoff->from = client->reactor;
+	handoff->bev = bev;
+	client->bev = NULL;
+	conn_unlink_client(client->reactor, client);
+	client->reactor = reactor;
+	handoff->from->stats.clients--;
+	handoff->from->stats.migrations++;
+
+	if (client->uring) {
+		// The ring may still be receiving into the buffers or sending from
+		// them; hand over once it has stopped
+		handoff->fd = uring_conn_fd(client->uring);
+		uring_conn_detach(client->uring, conn_handoff_post, handoff);
+		client->uring = NULL;
+		bufferevent_free(bev);
+		return;
+	}
+
+	// Release the bufferevent without closing the socket
+	handoff->fd = bufferevent_getfd(bev);
+	bufferevent_setfd(bev, -1);
+	conn_handoff_post(handoff);
+	bufferevent_free(bev);
+}
+
+// Places a client whose path just became known on the reactor that owns
+// the stream. Returns 1 if the client stays here and is attached, 0 if it
+// has been handed to another reactor and -1 if it should be dropped.
+static int
+conn_place(struct conn_client *client)
+{
+	struct reactor *owner = reactor_for_hash(client->path_hash);
+
+	if (owner != client->reactor) {
+		conn_migrate(client, owner);
+		return 0;
+	}
+
+	return conn_attach(client);
+}
+
+int
+conn_join(struct conn_client *client, const char *path, size_t len,
+	int is_producer)
+{
+	if (client->path != NULL) {
+		log_info("Client already joined %s", client->path);
+		return -1;
+	}
+	if (conn_set_path(client, path, len) != 0) {
+		return -1;
+	}
+	client->is_producer = is_producer;
+	log_path_debug(client->path, "Joining %s", client->path);
+	return conn_place(client);
+}
+
+static int
+conn_http_read(struct conn_client *client, struct evbuffer *input)
+{
+	struct msg *msg;
+	size_t len;
+	int ret;
+
+	if (client->path == NULL) {
+		ret = conn_read_header(input, client);
+		if (ret <= 0) {
+			return ret;
 		}
+		if ((ret = conn_place(client)) <= 0) {
+			return ret;
+		}
+	}
+
+	len = evbuffer_get_length(input);
+	if (!client->is_producer) {
+		// Consumers have nothing to say once they're attached, except
+		// HLS clients, whose next request may already be in there
+		if (client->path != NULL && client->egress != egress_hls) {
+			evbuffer_drain(input, len);
+		}
+		return 1;
+	}
 
-		conn_add_consumer(producer, client);
+	if (len == 0) {
+		return 1;
 	}
 
-	return pos;
+	// Copy the read out of the socket buffer once; every consumer then
+	// references the same bytes.
+	if ((msg = msg_alloc(len)) == NULL) {
+		return -1;
+	}
+	evbuffer_remove(input, msg->data, len);
+	conn_fanout(client->producer, msg);
+	msg_unref(msg);
+
+	return 1;
+}
+
+void
+conn_http_done(struct conn_client *client)
+{
+	if (client->proto_data && client->egress == egress_hls) {
+		hls_request_free(client->proto_data);
+	}
+	client->proto_data = NULL;
+	client->egress = egress_raw;
+	if (client->path_owned) {
+		free(client->path);
+	}
+	client->path = NULL;
+	client->path_owned = 0;
+
+	// Pipelined requests are read once this one is on its way
+	if (evbuffer_get_length(bufferevent_get_input(client->bev)) > 0) {
+		bufferevent_trigger(client->bev, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+	}
+}
+
+// A client that fails before it has joined a stream never got through
+// its handshake
+static void
+conn_fail_client(struct conn_client *client)
+{
+	if (client->producer == NULL) {
+		client->reactor->stats.handshake_failures++;
+	}
+	conn_close_client(client);
+}
+
+void
+conn_close_client(struct conn_client *client)
+{
+	if (client->is_producer) {
+		conn_del_producer(client);
+	} else {
+		conn_del_consumer(client);
+	}
+	conn_free_client(client);
 }
 
 void
@@ -205,62 +1194,45 @@ conn_read_cb(struct bufferevent *bev, void *ctx)
 	struct conn_client *client = ctx;
 	struct evbuffer *input = bufferevent_get_input(bev);
 	size_t len = evbuffer_get_length(input);
-	char *data;
-	// struct consumer *consumer;
-
-	if (len) {
-		data = calloc(1, sizeof(char) * len);
-		evbuffer_remove(input, data, len);
-
-		if (client->proto == protocol_none) {
-			client->proto = conn_determine_protocol(data, len);
-		}
 
-		switch (client->proto) {
-			case protocol_rtmp:
-				rtmp_read(client, data, len);
-				break;
-
-			default:
-				log_info("Failed to determine client protocol: %s", data);
-				conn_free_client(client);
-				return;
-		}
+	if (len == 0) {
+		return;
+	}
 
-		// printf("Reading data\n");
-		// for (int i = 0; i < strlen(data); i++) {
-		// 	printf("%#08x ", data[i]);
-		// }
-		// printf("\n");
+	if (client->proto == protocol_none) {
+		client->proto = conn_determine_protocol(input);
+	}
 
-		// if (client->path == NULL) {
-		// 	pos = conn_read_header(data, client);
-		// 	if (pos == NULL) {
-		// 		log_debug("Failed to read HTTP header: %s", data);
-		// 		conn_free_client(client);
-		// 		return;
-		// 	}
-		// } else {
-		// 	pos = data;
-		// }
+	switch (client->proto) {
+		case protocol_rtmp:
+			if (rtmp_read(client, input) < 0) {
+				log_info("RTMP protocol error");
+				conn_fail_client(client);
+			}
+			break;
 
-		// if (client->is_producer && client->producer) {
-		// 	consumer = client->producer->consumer_list;
-		// 	while (consumer != NULL) {
-		// 		out = bufferevent_get_output(consumer->client->bev);
-		// 		evbuffer_add(out, pos, len);
-		// 		consumer = consumer->next;
-		// 	}
-		// }
+		case protocol_http:
+			if (conn_http_read(client, input) < 0) {
+				log_info("Failed to read HTTP request");
+				conn_fail_client(client);
+			}
+			break;
 
-		free(data);
+		default:
+			log_info("Failed to determine client protocol");
+			client->reactor->stats.handshake_failures++;
+			conn_free_client(client);
+			return;
 	}
 }
 
 void
 conn_write_cb(struct bufferevent *bev, void *ctx)
 {
-	// ...
+	struct conn_client *client = ctx;
+
+	// Output is back under the low watermark
+	client->lag_since = 0;
 }
 
 void
@@ -271,31 +1243,287 @@ conn_event_cb(struct bufferevent *bev, short events, void *ctx)
 		log_err("Error from bufferevent");
     }
     if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
-		log_debug("Client connection closed");
-		if (client->is_producer) {
-			conn_del_producer(client);
-		} else {
-			conn_del_consumer(client);
+		log_path_debug(client->path, "Client connection closed");
+		conn_close_client(client);
+    }
+}
+
+// Where a saved client was, see conn_save
+enum conn_saved {
+	conn_saved_idle,        // not on a stream yet
+	conn_saved_joining,     // on its way to its stream's reactor
+	conn_saved_placed,      // answered and on its way to a shard
+	conn_saved_consumer,
+	conn_saved_producer
+};
+
+static void
+conn_save_msg_cb(struct msg *msg, void *arg)
+{
+	struct evbuffer *buf = arg;
+
+	upgrade_put_u8(buf, 1);
+	upgrade_put_u8(buf, msg->type);
+	upgrade_put_u8(buf, msg->flags);
+	upgrade_put_u32(buf, msg->timestamp);
+	upgrade_put_u64(buf, msg->len);
+	msg_add(buf, msg);
+}
+
+evutil_socket_t
+conn_save(struct conn_client *client, struct evbuffer *buf,
+	struct reactor **reactor)
+{
+	struct producer *producer = client->producer;
+	struct evbuffer *output;
+	evutil_socket_t fd;
+	uint8_t state;
+
+	// An HLS request is answered from segments only this server has
+	if (client->bev == NULL || (fd = bufferevent_getfd(client->bev)) < 0 ||
+		(client->proto_data && client->egress == egress_hls)) {
+		return -1;
+	}
+
+	if (client->is_producer && producer) {
+		state = conn_saved_producer;
+	} else if (producer) {
+		state = conn_saved_consumer;
+	} else if (client->shard) {
+		state = conn_saved_placed;
+	} else if (client->path) {
+		state = conn_saved_joining;
+	} else {
+		state = conn_saved_idle;
+	}
+	*reactor = client->path ? reactor_for_hash(client->path_hash) :
+		client->reactor;
+
+	upgrade_put_u8(buf, state);
+	upgrade_put_u8(buf, client->proto);
+	upgrade_put_u8(buf, client->egress);
+	upgrade_put_u8(buf, client->lag);
+	upgrade_put_u8(buf, client->role);
+	upgrade_put_u8(buf, client->is_producer);
+	upgrade_put_u32(buf, client->timeshift);
+	upgrade_put_str(buf, client->path, client->path_len);
+	upgrade_put_u8(buf, client->proto == protocol_rtmp && client->proto_data);
+	if (client->proto == protocol_rtmp && client->proto_data) {
+		rtmp_save(client, buf);
+	}
+
+	// The socket goes as it is, with whatever was read and not handled
+	// yet and whatever was queued and not written yet
+	output = bufferevent_get_output(client->bev);
+	upgrade_put_buffer(buf, bufferevent_get_input(client->bev));
+	evbuffer_unfreeze(output, 1);
+	upgrade_put_buffer(buf, output);
+
+	// And for a stream, what its next consumer starts from
+	if (state == conn_saved_producer) {
+		upgrade_put_u8(buf, producer->relay != NULL);
+		if (producer->relay) {
+			relay_save(producer->relay, buf);
+		}
+		gop_cache_foreach(&producer->gop, conn_save_msg_cb, buf);
+		upgrade_put_u8(buf, 0);
+	}
+
+	bufferevent_setfd(client->bev, -1);
+	return fd;
+}
+
+static int
+conn_restore_producer(struct conn_client *client, struct evbuffer *buf)
+{
+	struct producer *producer;
+	struct msg *msg;
+	uint8_t more, has_relay, type, flags;
+	uint32_t timestamp;
+	uint64_t len;
+
+	if (conn_apply_role(client) != 0 || conn_add_producer(client) != 0) {
+		return -1;
+	}
+	producer = client->producer;
+	if (upgrade_get_u8(buf, &has_relay) != 0 ||
+		(has_relay && (producer->relay = relay_restore(client, buf)) == NULL)) {
+		return -1;
+	}
+
+	for (;;) {
+		if (upgrade_get_u8(buf, &more) != 0) {
+			return -1;
+		}
+		if (!more) {
+			return 1;
+		}
+		if (upgrade_get_u8(buf, &type) != 0 || upgrade_get_u8(buf, &flags) != 0 ||
+			upgrade_get_u32(buf, &timestamp) != 0 ||
+			upgrade_get_u64(buf, &len) != 0 || evbuffer_get_length(buf) < len ||
+			(msg = msg_alloc(len)) == NULL) {
+			return -1;
 		}
+		msg->type = type;
+		msg->flags = flags;
+		msg->timestamp = timestamp;
+		evbuffer_remove(buf, msg->data, len);
+		if (flv_is_tag(msg)) {
+			flv_tag_prepare(msg);
+		}
+		gop_cache_add(&producer->gop, msg);
+		msg_unref(msg);
+	}
+}
+
+// A consumer whose player has had its answer, and unless resumed is 0 is
+// already under way, so it isn't sent either again
+static int
+conn_restore_consumer(struct conn_client *client, int resumed)
+{
+	struct producer *producer;
+	struct reactor *reactor;
+
+	if (conn_apply_role(client) != 0) {
+		return -1;
+	}
+	producer = conn_get_producer(client);
+	if (producer == NULL && config.origin_spec) {
+		producer = conn_pull(client);
+	}
+	if (producer == NULL) {
+		return -1;
+	}
+
+	// The window it played from didn't make it into this server
+	client->timeshift = 0;
+	client->resumed = resumed;
+	if ((reactor = fanout_place(producer, client)) != NULL) {
+		conn_migrate(client, reactor);
+		return 0;
+	}
+	return conn_add_consumer(producer, client) == 0 ? 1 : -1;
+}
+
+int
+conn_restore(struct reactor *reactor, evutil_socket_t fd, struct evbuffer *buf)
+{
+	struct bufferevent *bev;
+	struct conn_client *client;
+	uint8_t state, proto, egress, lag, role, is_producer, has_rtmp;
+	char *path;
+	size_t len;
+	int ret;
+
+	bev = bufferevent_socket_new(reactor->base, fd, BEV_OPT_CLOSE_ON_FREE);
+	if (bev == NULL) {
+		evutil_closesocket(fd);
+		return -1;
+	}
+	if ((client = conn_alloc_client(reactor, bev)) == NULL) {
+		bufferevent_free(bev);
+		return -1;
+	}
+	bufferevent_setcb(bev, conn_read_cb, conn_write_cb, conn_event_cb, client);
+
+	if (upgrade_get_u8(buf, &state) != 0 || upgrade_get_u8(buf, &proto) != 0 ||
+		upgrade_get_u8(buf, &egress) != 0 || upgrade_get_u8(buf, &lag) != 0 ||
+		upgrade_get_u8(buf, &role) != 0 || upgrade_get_u8(buf, &is_producer) != 0 ||
+		upgrade_get_u32(buf, &client->timeshift) != 0 ||
+		upgrade_get_str(buf, &path, &len) != 0) {
 		conn_free_client(client);
-    }
+		return -1;
+	}
+	client->proto = proto;
+	client->egress = egress;
+	client->lag = lag;
+	client->role = role;
+	client->is_producer = is_producer;
+	ret = path ? conn_set_path(client, path, len) : 0;
+	free(path);
+	if (ret != 0 || upgrade_get_u8(buf, &has_rtmp) != 0 ||
+		(has_rtmp && rtmp_restore(client, buf) != 0) ||
+		upgrade_get_buffer(buf, bufferevent_get_input(bev)) != 0 ||
+		upgrade_get_buffer(buf, bufferevent_get_output(bev)) != 0) {
+		conn_free_client(client);
+		return -1;
+	}
+
+	switch (state) {
+		case conn_saved_idle:
+			ret = 1;
+			break;
+
+		case conn_saved_joining:
+			ret = conn_place(client);
+			break;
+
+		case conn_saved_placed:
+		case conn_saved_consumer:
+			ret = conn_restore_consumer(client, state == conn_saved_consumer);
+			break;
+
+		case conn_saved_producer:
+			ret = conn_restore_producer(client, buf);
+			break;
+
+		default:
+			ret = -1;
+			break;
+	}
+	if (ret < 0) {
+		log_path_debug(client->path, "Failed to restore client for %s",
+			client->path);
+		conn_close_client(client);
+		return -1;
+	}
+	if (ret == 0) {
+		return 0;
+	}
+
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+	if (evbuffer_get_length(bufferevent_get_input(bev)) > 0) {
+		bufferevent_trigger(bev, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+	}
+	return 0;
 }
 
 void
-conn_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
-	struct sockaddr *address, int socklen, void *ctx)
+conn_accept(struct reactor *reactor, evutil_socket_t fd, int role)
 {
 	log_debug("New client connection");
 
-	struct event_base *base = evconnlistener_get_base(listener);
-	struct bufferevent *bev = bufferevent_socket_new(
-		base, fd, BEV_OPT_CLOSE_ON_FREE);
-	struct conn_client *client = conn_alloc_client(bev);
+	struct uring_conn *uc;
+	struct bufferevent *bev = conn_socket_new(reactor, fd, &uc);
+	struct conn_client *client;
 
+	reactor->stats.accepted++;
+	if (bev == NULL) {
+		log_err("Failed to set up client connection");
+		return;
+	}
+	if ((client = conn_alloc_client(reactor, bev)) == NULL) {
+		log_err("Failed to allocate client");
+		if (uc) {
+			uring_conn_close(uc);
+		}
+		bufferevent_free(bev);
+		return;
+	}
+	client->uring = uc;
+	client->role = role;
 	bufferevent_setcb(bev, conn_read_cb, conn_write_cb, conn_event_cb, client);
 	bufferevent_enable(bev, EV_READ|EV_WRITE);
 }
 
+void
+conn_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+	struct sockaddr *address, int socklen, void *ctx)
+{
+	struct reactor_listener *l = ctx;
+	conn_accept(l->reactor, fd, l->conf->role);
+}
+
 void
 conn_accept_error_cb(struct evconnlistener *listener, void *ctx)
 {
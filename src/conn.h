@@ -2,52 +2,177 @@
 #define __TELEGENIC_CONN_H__
 
 #include "log.h"
+#include "cset.h"
+#include "gop.h"
+#include "msg.h"
 
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 #include <event2/listener.h>
+#include <stdint.h>
 
-#define MEM_ALLOC_SIZE 80*1024
+#define CONN_MAX_HEADER_SIZE 8192
+
+// Most a consumer's output is written with in one call. libevent's default
+// of 16 KiB would split every keyframe over several syscalls.
+#define CONN_MAX_WRITE (256 * 1024)
 
 enum protocol {
 	protocol_none,
-	protocol_rtmp
+	protocol_rtmp,
+	protocol_http
 };
 
-struct consumer {
-	struct conn_client *client;
-	struct consumer* next;
+// What a consumer's output carries
+enum egress {
+	egress_raw,     // the producer's messages as they are
+	egress_flv,     // an FLV file remuxed from an RTMP stream
+	egress_rtmp,    // RTMP play
+	egress_splice,  // an opaque stream moved through kernel pipes
+	egress_hls      // LL-HLS requests answered from an RTMP stream
+};
+
+// How far a consumer's output may fall behind before its media is dropped
+enum lag_state {
+	lag_ok,         // everything is delivered
+	lag_skip_inter, // non-keyframe video is dropped until the next keyframe
+	lag_skip_gop    // all media is dropped until the next keyframe
 };
 
 struct producer {
 	struct conn_client *client;
-	struct consumer* consumer_list;
+	struct cset consumers;
+	struct gop_cache gop;
+	char *path;
+	// Set when the stream bypasses user space, see splice.h
+	struct splice_source *splice;
+	// Set when the stream is being recorded, see record.h
+	struct recorder *recorder;
+	// Set when an RTMP stream is segmented for HLS, see hls.h
+	struct hls_stream *hls;
+	// Set when the stream keeps a time-shift window, see dvr.h
+	struct dvr *dvr;
+	// Consumers fed out of that window rather than live
+	struct cset shifted;
+	// Set when the stream is pulled from the origin, see relay.h
+	struct relay *relay;
+	// Set once consumers have been handed to other reactors, see fanout.h
+	struct fanout *fanout;
+	// Set when this is another reactor's stream's share of consumers on
+	// this one, which has no client of its own
+	struct shard *shard;
+
+	// Streams owned by the same reactor
+	struct producer *next;
+	struct producer *prev;
+
+	uint64_t ingest_bytes;
+	uint64_t dropped_bytes;
+	uint64_t dropped_msgs;
 };
 
+struct dvr;
+struct dvr_reader;
+struct fanout;
+struct hls_stream;
+struct reactor;
+struct recorder;
+struct relay;
+struct shard;
+struct splice_source;
+struct stats_snapshot;
+struct uring_conn;
+
+// Laid out so that everything fan-out touches for a consumer sits in the
+// first cache line; the rest is only needed on connect and teardown.
 struct conn_client {
 	struct bufferevent *bev;
-	char *path;
-	int is_producer;
+	uint64_t lag_since;
+	uint8_t lag;            // enum lag_state
+	uint8_t proto;          // enum protocol
+	uint8_t is_producer;
+	uint8_t path_owned;     // path is ours rather than the stream's
+	uint8_t egress;         // enum egress
 	struct producer *producer;
-
-	enum protocol proto;
+	struct reactor *reactor;
 	void *proto_data;
+
+	uint64_t dropped_bytes;
+	uint64_t dropped_msgs;
+	char *path;
+	uint64_t path_hash;
+	uint32_t path_len;
+	uint32_t cset_idx;
+	struct uring_conn *uring;       // set when the reactor's ring does its I/O
+	uint32_t timeshift;             // seconds behind live the client asked for
+	uint8_t role;                   // enum listen_role, of its listener until it joins
+	uint8_t resumed;                // carried over by an upgrade, see upgrade.h
+	struct dvr_reader *dvr;         // set while it is fed from the stream's past
+	struct shard *shard;            // set when placed on a wide stream's shard
+	// Every client on the same reactor
+	struct conn_client *next;
+	struct conn_client *prev;
 };
 
-void conn_init();
+int conn_init();
 void conn_terminate();
 void conn_buffer_write(struct conn_client *client, char *data, size_t len);
 
-struct conn_client *conn_alloc_client(struct bufferevent *bev);
+// Name the stream a client publishes or consumes and attach it, moving it
+// to the reactor that owns the stream first if need be. Returns 1 if the
+// client is attached here, 0 if it was handed to another reactor (and must
+// not be touched again on this thread) and -1 if it should be dropped.
+int conn_join(struct conn_client *client, const char *path, size_t len,
+	int is_producer);
+
+void conn_fanout(struct producer *producer, struct msg *msg);
+
+// Open reactor's share of the consumers of the stream at path, which
+// another reactor owns, see fanout.h. Runs on reactor.
+struct producer *conn_add_shard(struct reactor *reactor, struct shard *shard,
+	const char *path);
+
+// Close a shard on reactor and every consumer on it
+void conn_del_shard(struct reactor *reactor, struct producer *producer);
+
+// Ready a kept-alive HTTP client for its next request once the last one
+// has been answered
+void conn_http_done(struct conn_client *client);
+
+// Fill in the streams (and consumers, if asked for) owned by reactor. Must
+// run on that reactor's thread.
+void conn_collect_stats(struct reactor *reactor, struct stats_snapshot *snap);
+
+struct conn_client *conn_alloc_client(struct reactor *reactor,
+	struct bufferevent *bev);
 
 void conn_free_client(struct conn_client *client);
 
+// Take a client off its stream (the whole stream, for a producer) and
+// free it
+void conn_close_client(struct conn_client *client);
+
 void conn_read_cb(struct bufferevent *bev, void *ctx);
 
 void conn_write_cb(struct bufferevent *bev, void *ctx);
 
 void conn_event_cb(struct bufferevent *bev, short events, void *ctx);
 
+// Write everything needed to carry on with client in another process to
+// buf, and let go of its socket, which is returned; -1 if it can't be
+// handed over. *reactor is set to the reactor it should be restored on.
+// See upgrade.h.
+evutil_socket_t conn_save(struct conn_client *client, struct evbuffer *buf,
+	struct reactor **reactor);
+
+// Carry on with a client saved by conn_save, on the reactor conn_save
+// named. Takes fd over, closing it if the client can't be restored.
+int conn_restore(struct reactor *reactor, evutil_socket_t fd,
+	struct evbuffer *buf);
+
+// Take on a newly accepted socket from a listener for role
+void conn_accept(struct reactor *reactor, evutil_socket_t fd, int role);
+
 void conn_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
 	struct sockaddr *address, int socklen, void *ctx);
 
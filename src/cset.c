@@ -0,0 +1,101 @@
+#include "cset.h"
+#include "conn.h"
+#include "log.h"
+
+#include <stdlib.h>
+
+#define CSET_MIN_CAP 8
+
+void
+cset_init(struct cset *set)
+{
+	set->clients = NULL;
+	set->len = 0;
+	set->cap = 0;
+	set->holes = 0;
+	set->iterating = 0;
+}
+
+void
+cset_free(struct cset *set)
+{
+	free(set->clients);
+	cset_init(set);
+}
+
+int
+cset_add(struct cset *set, struct conn_client *client)
+{
+	if (set->len == set->cap) {
+		size_t cap = set->cap ? set->cap * 2 : CSET_MIN_CAP;
+		struct conn_client **clients = realloc(set->clients,
+			cap * sizeof(struct conn_client *));
+		if (clients == NULL) {
+			log_err("Failed to grow consumer set to %zu", cap);
+			return -1;
+		}
+		set->clients = clients;
+		set->cap = cap;
+	}
+
+	client->cset_idx = set->len;
+	set->clients[set->len++] = client;
+	return 0;
+}
+
+void
+cset_del(struct cset *set, struct conn_client *client)
+{
+	size_t idx = client->cset_idx;
+	struct conn_client *last;
+
+	if (idx >= set->len || set->clients[idx] != client) {
+		return;
+	}
+
+	if (set->iterating) {
+		set->clients[idx] = NULL;
+		set->holes++;
+		return;
+	}
+
+	last = set->clients[--set->len];
+	set->clients[idx] = last;
+	last->cset_idx = idx;
+
+	// Give memory back once a big audience has mostly left
+	if (set->cap > CSET_MIN_CAP && set->len < set->cap / 4) {
+		struct conn_client **clients = realloc(set->clients,
+			(set->cap / 2) * sizeof(struct conn_client *));
+		if (clients != NULL) {
+			set->clients = clients;
+			set->cap /= 2;
+		}
+	}
+}
+
+void
+cset_begin(struct cset *set)
+{
+	set->iterating++;
+}
+
+void
+cset_end(struct cset *set)
+{
+	size_t i, j;
+
+	if (--set->iterating > 0 || set->holes == 0) {
+		return;
+	}
+
+	for (i = 0, j = 0; i < set->len; i++) {
+		if (set->clients[i] != NULL) {
+			set->clients[j] = set->clients[i];
+			set->clients[j]->cset_idx = j;
+			j++;
+		}
+	}
+	set->len = j;
+	set->holes = 0;
+}
@@ -0,0 +1,61 @@
+#ifndef __TELEGENIC_CSET_H__
+#define __TELEGENIC_CSET_H__
+
+#include <stddef.h>
+
+struct conn_client;
+
+// The set of consumers attached to a producer. Consumers live in one
+// contiguous array so fan-out walks memory linearly, and each client keeps
+// its own slot index so joining and leaving are O(1): a leaving client's
+// slot is filled with the last one.
+//
+// Removing clients while the set is being iterated (a write error tearing
+// down a consumer mid fan-out, say) only clears the slot; the array is
+// compacted once the outermost iteration finishes.
+struct cset {
+	struct conn_client **clients;
+	size_t len;
+	size_t cap;
+	size_t holes;
+	int iterating;
+};
+
+void cset_init(struct cset *set);
+
+void cset_free(struct cset *set);
+
+int cset_add(struct cset *set, struct conn_client *client);
+
+void cset_del(struct cset *set, struct conn_client *client);
+
+static inline size_t
+cset_count(const struct cset *set)
+{
+	return set->len - set->holes;
+}
+
+void cset_begin(struct cset *set);
+
+void cset_end(struct cset *set);
+
+#define CSET_PREFETCH_DISTANCE 8
+
+// Fetch slot i while pulling a client a few slots ahead into cache, so
+// the fan-out loop isn't stalled on a miss per consumer.
+static inline struct conn_client *
+cset_get(const struct cset *set, size_t i)
+{
+	if (i + CSET_PREFETCH_DISTANCE < set->len) {
+		__builtin_prefetch(set->clients[i + CSET_PREFETCH_DISTANCE]);
+	}
+	return set->clients[i];
+}
+
+// Iterate over the live clients of set, binding each to client. Wrap the
+// loop in cset_begin/cset_end if the body may remove clients.
+#define cset_foreach(set, i, client) \
+	for ((i) = 0; (i) < (set)->len; (i)++) \
+		if (((client) = cset_get((set), (i))) != NULL)
+
+#endif
@@ -0,0 +1,350 @@
+#include "dvr.h"
+#include "config.h"
+#include "flv.h"
+#include "log.h"
+#include "rtmp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Records are 8 byte aligned and never wrap: one that doesn't fit before
+// the end of the ring starts the next lap, behind a pad record if there is
+// room for one.
+#define DVR_ALIGN 8
+#define DVR_PAD 0xff
+// The ring is dropped from the page tables a chunk at a time once the
+// writer or a reader is past it. The bytes stay in the page cache; only
+// the resident set is given back.
+#define DVR_CHUNK (4 * 1024 * 1024)
+// How far ahead of the stream's own pace a reader is fed
+#define DVR_LEAD_MS 1000
+#define DVR_MAX_NAME 1024
+
+struct dvr_record {
+	uint32_t len;
+	uint32_t timestamp;
+	uint8_t type;
+	uint8_t flags;
+	uint8_t unused[6];
+};
+
+struct dvr_keyframe {
+	uint64_t pos;
+	uint32_t timestamp;
+};
+
+struct dvr {
+	uint8_t *ring;
+	size_t size;
+	// Offsets into the stream, which only grow: the ring holds [tail, head)
+	uint64_t head;
+	uint64_t tail;
+	uint64_t trimmed;       // chunks the writer is done with
+	uint32_t newest;        // timestamp of the newest message
+
+	// Keyframes in the ring, oldest first, from index[first]
+	struct dvr_keyframe *index;
+	size_t first;
+	size_t len;
+	size_t cap;
+};
+
+struct dvr_reader {
+	uint64_t pos;
+	uint64_t trimmed;
+	// The timestamp fed at start_ms; the rest follow at the same pace
+	uint32_t start_ts;
+	uint64_t start_ms;
+};
+
+static size_t
+dvr_record_size(uint32_t len)
+{
+	return (sizeof(struct dvr_record) + len + DVR_ALIGN - 1) & ~(size_t)(DVR_ALIGN - 1);
+}
+
+static struct dvr_record *
+dvr_record_at(struct dvr *dvr, uint64_t pos)
+{
+	return (struct dvr_record *)(dvr->ring + pos % dvr->size);
+}
+
+// Where the record at pos, which must be in the ring, really starts: the
+// next lap if pos is at the end of one
+static uint64_t
+dvr_skip_pad(struct dvr *dvr, uint64_t pos)
+{
+	size_t left = dvr->size - pos % dvr->size;
+
+	if (left < sizeof(struct dvr_record) || dvr_record_at(dvr, pos)->type == DVR_PAD) {
+		return pos + left;
+	}
+	return pos;
+}
+
+static void
+dvr_trim(struct dvr *dvr, uint64_t *trimmed, uint64_t pos)
+{
+	for (; *trimmed < pos / DVR_CHUNK; (*trimmed)++) {
+		madvise(dvr->ring + *trimmed * DVR_CHUNK % dvr->size, DVR_CHUNK,
+			MADV_DONTNEED);
+	}
+}
+
+struct dvr *
+dvr_open(const char *path)
+{
+	char file[DVR_MAX_NAME], name[DVR_MAX_NAME], *p;
+	struct dvr *dvr;
+	int fd, err;
+
+	if (config.dvr_dir == NULL) {
+		return NULL;
+	}
+
+	// One file name component, whatever the client asked for
+	while (*path == '/') {
+		path++;
+	}
+	snprintf(name, sizeof(name), "%s", *path ? path : "stream");
+	for (p = name; *p; p++) {
+		if (!(*p >= 'a' && *p <= 'z') && !(*p >= 'A' && *p <= 'Z') &&
+			!(*p >= '0' && *p <= '9') && *p != '-' && *p != '.') {
+			*p = '_';
+		}
+	}
+	if (snprintf(file, sizeof(file), "%s/%s.dvr", config.dvr_dir, name) >=
+		(int)sizeof(file)) {
+		log_err("Time-shift ring name too long for %s", path);
+		return NULL;
+	}
+
+	if ((dvr = calloc(1, sizeof(struct dvr))) == NULL) {
+		return NULL;
+	}
+	dvr->size = (config.dvr_bytes + DVR_CHUNK - 1) / DVR_CHUNK * DVR_CHUNK;
+	if (dvr->size < 2 * DVR_CHUNK) {
+		dvr->size = 2 * DVR_CHUNK;
+	}
+
+	if ((fd = open(file, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) {
+		log_err("Failed to open time-shift ring %s: %s", file, strerror(errno));
+		free(dvr);
+		return NULL;
+	}
+	// Blocks are allocated up front: running out of space under a
+	// mapping would be a SIGBUS rather than an error
+	if ((err = posix_fallocate(fd, 0, dvr->size)) != 0) {
+		log_err("Failed to allocate time-shift ring %s: %s", file, strerror(err));
+	} else {
+		dvr->ring = mmap(NULL, dvr->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (dvr->ring == MAP_FAILED) {
+			log_err("Failed to map time-shift ring %s: %s", file, strerror(errno));
+			dvr->ring = NULL;
+		}
+	}
+	// The mapping keeps the file for as long as it needs it
+	close(fd);
+	unlink(file);
+	if (dvr->ring == NULL) {
+		free(dvr);
+		return NULL;
+	}
+	log_path_debug(path, "Time-shifting %s in %zu bytes", path, dvr->size);
+	return dvr;
+}
+
+void
+dvr_close(struct dvr *dvr)
+{
+	munmap(dvr->ring, dvr->size);
+	free(dvr->index);
+	free(dvr);
+}
+
+static void
+dvr_index_keyframe(struct dvr *dvr, uint64_t pos, uint32_t timestamp)
+{
+	if (dvr->len == dvr->cap) {
+		// Slide the live entries down before growing
+		if (dvr->first > 0) {
+			memmove(dvr->index, dvr->index + dvr->first,
+				(dvr->len - dvr->first) * sizeof(struct dvr_keyframe));
+			dvr->len -= dvr->first;
+			dvr->first = 0;
+		}
+		if (dvr->len == dvr->cap) {
+			size_t cap = dvr->cap ? dvr->cap * 2 : 256;
+			struct dvr_keyframe *index = realloc(dvr->index,
+				cap * sizeof(struct dvr_keyframe));
+			if (index == NULL) {
+				return;
+			}
+			dvr->index = index;
+			dvr->cap = cap;
+		}
+	}
+	dvr->index[dvr->len].pos = pos;
+	dvr->index[dvr->len].timestamp = timestamp;
+	dvr->len++;
+}
+
+void
+dvr_msg(struct dvr *dvr, struct msg *msg)
+{
+	size_t n = dvr_record_size(msg->len), left;
+	uint64_t pos = dvr->head;
+	uint32_t window = (uint32_t)config.dvr_secs * 1000;
+	struct dvr_record *rec;
+
+	if (!flv_is_tag(msg) || n > dvr->size / 2) {
+		return;
+	}
+	left = dvr->size - pos % dvr->size;
+	if (left < n) {
+		pos += left;
+	}
+
+	// Give up whatever the record is about to overwrite
+	while (dvr->tail < dvr->head && dvr->tail + dvr->size < pos + n) {
+		dvr->tail = dvr_skip_pad(dvr, dvr->tail);
+		if (dvr->tail < dvr->head) {
+			dvr->tail += dvr_record_size(dvr_record_at(dvr, dvr->tail)->len);
+		}
+	}
+	if (dvr->tail > dvr->head) {
+		dvr->tail = dvr->head;
+	}
+	while (dvr->first < dvr->len && (dvr->index[dvr->first].pos < dvr->tail ||
+		(dvr->first + 1 < dvr->len &&
+			msg->timestamp - dvr->index[dvr->first + 1].timestamp > window))) {
+		dvr->first++;
+	}
+
+	if (pos != dvr->head && left >= sizeof(struct dvr_record)) {
+		dvr_record_at(dvr, dvr->head)->type = DVR_PAD;
+	}
+	rec = dvr_record_at(dvr, pos);
+	rec->len = msg->len;
+	rec->timestamp = msg->timestamp;
+	rec->type = msg->type;
+	rec->flags = msg->flags;
+	memcpy(rec + 1, msg->data, msg->len);
+	if (dvr->tail == dvr->head) {
+		dvr->tail = pos;
+	}
+	dvr->head = pos + n;
+	dvr->newest = msg->timestamp;
+
+	if (msg->type == RTMP_TYPE_VIDEO_PACKET && (msg->flags & MSG_KEYFRAME)) {
+		dvr_index_keyframe(dvr, pos, msg->timestamp);
+	}
+	dvr_trim(dvr, &dvr->trimmed, dvr->head);
+}
+
+uint32_t
+dvr_query_shift(const char *query, size_t len)
+{
+	const char *end = query + len, *amp;
+	uint32_t secs = 0;
+
+	for (; query < end; query = amp + 1) {
+		if ((amp = memchr(query, '&', end - query)) == NULL) {
+			amp = end;
+		}
+		if (amp - query > 10 && memcmp(query, "timeshift=", 10) == 0) {
+			for (query += 10, secs = 0; query < amp && *query >= '0' &&
+				*query <= '9' && secs < 1000000; query++) {
+				secs = secs * 10 + *query - '0';
+			}
+		}
+	}
+	return secs;
+}
+
+struct dvr_reader *
+dvr_reader_new(struct dvr *dvr, uint32_t secs, uint64_t now_ms)
+{
+	struct dvr_reader *rd;
+	size_t lo = dvr->first, hi = dvr->len, mid;
+	uint32_t back;
+
+	if (dvr->first == dvr->len) {
+		return NULL;
+	}
+	if (secs > (uint32_t)config.dvr_secs) {
+		secs = config.dvr_secs;
+	}
+	back = secs * 1000;
+
+	// The last keyframe at least back behind the newest message
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (dvr->newest - dvr->index[mid].timestamp >= back) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if ((rd = calloc(1, sizeof(struct dvr_reader))) == NULL) {
+		return NULL;
+	}
+	rd->pos = dvr->index[lo].pos;
+	rd->trimmed = rd->pos / DVR_CHUNK;
+	rd->start_ts = dvr->index[lo].timestamp;
+	rd->start_ms = now_ms;
+	return rd;
+}
+
+void
+dvr_reader_free(struct dvr_reader *rd)
+{
+	free(rd);
+}
+
+struct msg *
+dvr_read(struct dvr *dvr, struct dvr_reader *rd, uint64_t now_ms)
+{
+	struct dvr_record *rec;
+	struct msg *msg;
+
+	if (rd->pos < dvr->tail) {
+		// Lapped by the writer: carry on from the oldest keyframe left
+		if (dvr->first == dvr->len) {
+			return NULL;
+		}
+		rd->pos = dvr->index[dvr->first].pos;
+		rd->trimmed = rd->pos / DVR_CHUNK;
+		rd->start_ts = dvr->index[dvr->first].timestamp;
+		rd->start_ms = now_ms;
+	}
+	if (rd->pos >= dvr->head || (rd->pos = dvr_skip_pad(dvr, rd->pos)) >= dvr->head) {
+		return NULL;
+	}
+
+	rec = dvr_record_at(dvr, rd->pos);
+	// Due once the stream had got as far past where the reader started
+	if ((int64_t)(int32_t)(rec->timestamp - rd->start_ts) >
+		(int64_t)(now_ms - rd->start_ms) + DVR_LEAD_MS) {
+		return NULL;
+	}
+
+	if ((msg = msg_alloc(rec->len)) == NULL) {
+		return NULL;
+	}
+	memcpy(msg->data, rec + 1, rec->len);
+	msg->type = rec->type;
+	msg->flags = rec->flags;
+	msg->timestamp = rec->timestamp;
+	flv_tag_prepare(msg);
+
+	rd->pos += dvr_record_size(rec->len);
+	dvr_trim(dvr, &rd->trimmed, rd->pos);
+	return msg;
+}
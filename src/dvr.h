@@ -0,0 +1,43 @@
+#ifndef __TELEGENIC_DVR_H__
+#define __TELEGENIC_DVR_H__
+
+#include "msg.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Time-shift (-t). Each RTMP stream keeps its last -l seconds (or bytes) of
+// messages in a ring file under -t dir that is mapped into memory, so a
+// window of hours sits in the page cache rather than on the heap. A
+// compact index of its keyframes, timestamp to ring offset, finds where
+// "now minus X seconds" starts with a binary search. A consumer asks for
+// that with GET /app/name.flv?timeshift=X, or over RTMP with a play start
+// of X (or ?timeshift=X on the stream name), and is then fed out of the
+// ring as fast as the stream was published, staying X behind.
+
+struct dvr;
+struct dvr_reader;
+
+// Start keeping a stream's window. Returns NULL when time-shift is off or
+// the ring can't be set up.
+struct dvr *dvr_open(const char *path);
+
+void dvr_close(struct dvr *dvr);
+
+void dvr_msg(struct dvr *dvr, struct msg *msg);
+
+// The seconds a query string's timeshift parameter asks for, 0 if none
+uint32_t dvr_query_shift(const char *query, size_t len);
+
+// A reader starting at the last keyframe at least secs older than the
+// newest message, or the oldest kept. NULL if there is no keyframe yet.
+struct dvr_reader *dvr_reader_new(struct dvr *dvr, uint32_t secs,
+	uint64_t now_ms);
+
+void dvr_reader_free(struct dvr_reader *rd);
+
+// The reader's next message, copied out of the ring, if it is due by now_ms;
+// NULL if not
+struct msg *dvr_read(struct dvr *dvr, struct dvr_reader *rd, uint64_t now_ms);
+
+#endif
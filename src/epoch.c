@@ -0,0 +1,158 @@
+#include "epoch.h"
+#include "log.h"
+
+#include <sched.h>
+#include <stdlib.h>
+
+#define EPOCH_MAX_THREADS 256
+
+struct epoch_garbage {
+	void *ptr;
+	void (*fn)(void *);
+	unsigned long epoch;
+	struct epoch_garbage *next;
+};
+
+// One per thread, each on its own cache line so that entering and leaving
+// a critical section never bounces a line between cores.
+struct epoch_record {
+	unsigned long epoch;
+	int active;
+	struct epoch_garbage *head;
+	struct epoch_garbage *tail;
+	unsigned long pending;
+} __attribute__((aligned(64)));
+
+static struct epoch_record records[EPOCH_MAX_THREADS];
+static int nrecords;
+static unsigned long global_epoch __attribute__((aligned(64)));
+
+static __thread struct epoch_record *self;
+
+int
+epoch_register()
+{
+	int id;
+
+	if (self != NULL) {
+		return 0;
+	}
+
+	id = __atomic_fetch_add(&nrecords, 1, __ATOMIC_ACQ_REL);
+	if (id >= EPOCH_MAX_THREADS) {
+		log_err("Too many threads for epoch reclamation");
+		return -1;
+	}
+	self = &records[id];
+	return 0;
+}
+
+void
+epoch_enter()
+{
+	if (self->active++ == 0) {
+		__atomic_store_n(&self->epoch,
+			__atomic_load_n(&global_epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+		__atomic_store_n(&self->active, 1, __ATOMIC_RELAXED);
+		// Publish that we're active before reading any shared pointer
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+void
+epoch_exit()
+{
+	if (--self->active == 0) {
+		__atomic_store_n(&self->active, 0, __ATOMIC_RELEASE);
+	}
+}
+
+// The global epoch may only move forward once every active thread has
+// observed the current one.
+static unsigned long
+epoch_try_advance()
+{
+	unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+	int n = __atomic_load_n(&nrecords, __ATOMIC_ACQUIRE);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (int i = 0; i < n && i < EPOCH_MAX_THREADS; i++) {
+		struct epoch_record *rec = &records[i];
+		if (__atomic_load_n(&rec->active, __ATOMIC_ACQUIRE) &&
+			__atomic_load_n(&rec->epoch, __ATOMIC_ACQUIRE) != epoch) {
+			return epoch;
+		}
+	}
+
+	if (__atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		return epoch + 1;
+	}
+	return epoch;
+}
+
+void
+epoch_poll()
+{
+	struct epoch_garbage *g;
+	unsigned long epoch;
+
+	if (self->head == NULL) {
+		return;
+	}
+
+	epoch = epoch_try_advance();
+
+	// Anything retired two epochs ago can no longer be referenced
+	while ((g = self->head) != NULL && g->epoch + 2 <= epoch) {
+		self->head = g->next;
+		g->fn(g->ptr);
+		free(g);
+		self->pending--;
+	}
+	if (self->head == NULL) {
+		self->tail = NULL;
+	}
+}
+
+// Wait out two epochs on the spot. Readers never block, so this only
+// takes as long as the critical sections already under way; the caller
+// must not be in one itself.
+static void
+epoch_synchronize()
+{
+	unsigned long target = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE) + 2;
+
+	while (epoch_try_advance() < target) {
+		sched_yield();
+	}
+}
+
+void
+epoch_retire(void *ptr, void (*fn)(void *))
+{
+	struct epoch_garbage *g = malloc(sizeof(struct epoch_garbage));
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (g == NULL) {
+		// Nowhere to defer it to
+		epoch_synchronize();
+		fn(ptr);
+		return;
+	}
+	g->ptr = ptr;
+	g->fn = fn;
+	g->epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+	g->next = NULL;
+
+	if (self->tail) {
+		self->tail->next = g;
+	} else {
+		self->head = g;
+	}
+	self->tail = g;
+
+	if (++self->pending >= 64) {
+		epoch_poll();
+	}
+}
@@ -0,0 +1,24 @@
+#ifndef __TELEGENIC_EPOCH_H__
+#define __TELEGENIC_EPOCH_H__
+
+// Epoch-based reclamation. Readers bracket their access to shared
+// structures with epoch_enter/epoch_exit and never block; writers unlink an
+// object and hand it to epoch_retire, which frees it only once every thread
+// that could still be looking at it has left its critical section.
+//
+// Every thread that reads or retires must call epoch_register first.
+
+int epoch_register();
+
+void epoch_enter();
+
+void epoch_exit();
+
+// Called outside a critical section: should there be no memory to defer
+// fn with, it waits for the readers and calls fn itself.
+void epoch_retire(void *ptr, void (*fn)(void *));
+
+// Free whatever the calling thread retired that is now unreachable.
+void epoch_poll();
+
+#endif
@@ -0,0 +1,337 @@
+#include "fanout.h"
+#include "config.h"
+#include "conn.h"
+#include "log.h"
+#include "reactor.h"
+
+#include <event2/event.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Messages a shard may fall behind its stream by; a power of two
+#define FANOUT_RING_SIZE 4096
+
+struct shard {
+	struct reactor *reactor;
+	// The reactor's share of the stream, only touched on the reactor
+	struct producer *producer;
+	char *path;
+	struct event *ev;
+	// One for the stream and one per client placed on the shard
+	int refs;
+	// Clients placed on the shard and not yet gone
+	int consumers;
+	// The reactor has been woken and not yet drained the ring
+	int signalled;
+	// Messages were lost to a full ring; a NULL is queued in their place
+	// once there is room. Only touched by the stream's reactor.
+	int gap;
+
+	// Written by the stream's reactor only
+	uint64_t tail __attribute__((aligned(64)));
+	// Written by the shard's reactor only
+	uint64_t head __attribute__((aligned(64)));
+	struct msg *ring[FANOUT_RING_SIZE];
+};
+
+struct fanout {
+	// By reactor id: NULL for the stream's own and those without a shard yet
+	struct shard **shards;
+	int nshards;
+};
+
+static void
+fanout_push(struct shard *shard, struct msg *msg)
+{
+	uint64_t head = __atomic_load_n(&shard->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = shard->tail;
+
+	if (tail - head + shard->gap >= FANOUT_RING_SIZE) {
+		shard->gap = 1;
+		return;
+	}
+	if (shard->gap) {
+		shard->ring[tail++ & (FANOUT_RING_SIZE - 1)] = NULL;
+		shard->gap = 0;
+	}
+	msg_ref(msg);
+	shard->ring[tail++ & (FANOUT_RING_SIZE - 1)] = msg;
+	__atomic_store_n(&shard->tail, tail, __ATOMIC_RELEASE);
+}
+
+// Wake the shard's reactor, unless it has yet to get round to the last
+// wake-up, in which case it will find this message too
+static void
+fanout_signal(struct shard *shard)
+{
+	if (__atomic_exchange_n(&shard->signalled, 1, __ATOMIC_ACQ_REL) == 0) {
+		event_active(shard->ev, EV_READ, 0);
+	}
+}
+
+// Whatever was lost may have been anything up to a keyframe, so nothing
+// is any use until the next one
+static void
+fanout_gap(struct shard *shard)
+{
+	struct producer *producer = shard->producer;
+	struct conn_client *consumer;
+	size_t i;
+
+	log_info("Reactor %d fell behind on %s, resuming at the next keyframe",
+		shard->reactor->id, shard->path);
+	gop_cache_skip(&producer->gop);
+	cset_foreach(&producer->consumers, i, consumer) {
+		consumer->lag = lag_skip_gop;
+	}
+}
+
+static void
+fanout_drain_cb(evutil_socket_t fd, short events, void *ctx)
+{
+	struct shard *shard = ctx;
+	struct producer *producer = shard->producer;
+	struct msg *msg;
+	uint64_t head, tail;
+
+	// Not open yet, which will drain it, or already closed
+	if (producer == NULL) {
+		return;
+	}
+
+	// Cleared before looking for messages: one published after this is
+	// either seen below or wakes the reactor again
+	__atomic_exchange_n(&shard->signalled, 0, __ATOMIC_ACQ_REL);
+	tail = __atomic_load_n(&shard->tail, __ATOMIC_ACQUIRE);
+	for (head = shard->head; head != tail; head++) {
+		msg = shard->ring[head & (FANOUT_RING_SIZE - 1)];
+		if (msg == NULL) {
+			fanout_gap(shard);
+		} else {
+			conn_fanout(producer, msg);
+			msg_unref(msg);
+		}
+		// Hand the slot back as soon as it is free, not once the whole
+		// batch has gone out
+		__atomic_store_n(&shard->head, head + 1, __ATOMIC_RELEASE);
+	}
+}
+
+static void
+fanout_shard_free(void *arg)
+{
+	struct shard *shard = arg;
+
+	for (uint64_t i = shard->head; i != shard->tail; i++) {
+		if (shard->ring[i & (FANOUT_RING_SIZE - 1)]) {
+			msg_unref(shard->ring[i & (FANOUT_RING_SIZE - 1)]);
+		}
+	}
+	event_free(shard->ev);
+	free(shard->path);
+	free(shard);
+}
+
+// Shards are only ever freed on their own reactor, which is the one that
+// might still have the drain event pending
+static void
+fanout_release(struct shard *shard)
+{
+	if (__atomic_sub_fetch(&shard->refs, 1, __ATOMIC_ACQ_REL) == 0 &&
+		reactor_post(shard->reactor, fanout_shard_free, shard) != 0) {
+		log_err("Failed to free shard of %s", shard->path);
+	}
+}
+
+static void
+fanout_open_cb(void *arg)
+{
+	struct shard *shard = arg;
+
+	shard->producer = conn_add_shard(shard->reactor, shard, shard->path);
+	if (shard->producer == NULL) {
+		log_err("Failed to open shard of %s on reactor %d", shard->path,
+			shard->reactor->id);
+		return;
+	}
+	log_path_debug(shard->path, "Fanning out %s on reactor %d", shard->path,
+		shard->reactor->id);
+	// Whatever the stream published in the meantime, starting with the
+	// GOP it was seeded with
+	fanout_drain_cb(-1, 0, shard);
+}
+
+static void
+fanout_close_cb(void *arg)
+{
+	struct shard *shard = arg;
+
+	if (shard->producer != NULL) {
+		fanout_drain_cb(-1, 0, shard);
+		conn_del_shard(shard->reactor, shard->producer);
+		shard->producer = NULL;
+	}
+	fanout_release(shard);
+}
+
+static void
+fanout_seed_cb(struct msg *msg, void *arg)
+{
+	fanout_push(arg, msg);
+}
+
+// A shard on reactor for producer's stream. It is opened on the reactor by
+// a job posted ahead of any client placed on it, so the client always finds
+// it open.
+static struct shard *
+fanout_shard_new(struct producer *producer, struct reactor *reactor)
+{
+	struct shard *shard;
+
+	if (posix_memalign((void **)&shard, 64, sizeof(struct shard)) != 0) {
+		return NULL;
+	}
+	memset(shard, 0, sizeof(struct shard));
+	shard->reactor = reactor;
+	shard->refs = 1;
+	if ((shard->path = strdup(producer->path)) == NULL) {
+		free(shard);
+		return NULL;
+	}
+	shard->ev = event_new(reactor->base, -1, 0, fanout_drain_cb, shard);
+	if (shard->ev == NULL) {
+		free(shard->path);
+		free(shard);
+		return NULL;
+	}
+
+	// Consumers joining the shard start at the last keyframe too
+	gop_cache_foreach(&producer->gop, fanout_seed_cb, shard);
+	if (reactor_post(reactor, fanout_open_cb, shard) != 0) {
+		fanout_shard_free(shard);
+		return NULL;
+	}
+	return shard;
+}
+
+static struct fanout *
+fanout_new()
+{
+	struct fanout *fanout = malloc(sizeof(struct fanout));
+
+	if (fanout == NULL) {
+		return NULL;
+	}
+	fanout->nshards = reactor_count();
+	if ((fanout->shards = calloc(fanout->nshards, sizeof(struct shard *))) == NULL) {
+		free(fanout);
+		return NULL;
+	}
+	return fanout;
+}
+
+struct reactor *
+fanout_place(struct producer *producer, struct conn_client *client)
+{
+	struct fanout *fanout = producer->fanout;
+	struct shard *shard;
+	int i, n, best = -1, least = INT_MAX;
+
+	// Only RTMP messages can be dropped up to a keyframe should a shard
+	// fall behind, and time-shifted consumers are fed from the stream's
+	// own window
+	if (config.fanout_threshold == 0 || reactor_count() < 2 ||
+		cset_count(&producer->consumers) < config.fanout_threshold ||
+		producer->client->proto != protocol_rtmp ||
+		(client->timeshift > 0 && producer->dvr)) {
+		return NULL;
+	}
+	if (fanout == NULL && (fanout = producer->fanout = fanout_new()) == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < fanout->nshards; i++) {
+		if (i == producer->client->reactor->id) {
+			continue;
+		}
+		n = fanout->shards[i] ?
+			__atomic_load_n(&fanout->shards[i]->consumers, __ATOMIC_RELAXED) : 0;
+		if (n < least) {
+			least = n;
+			best = i;
+		}
+	}
+	if ((shard = fanout->shards[best]) == NULL) {
+		if ((shard = fanout_shard_new(producer, reactor_get(best))) == NULL) {
+			log_err("Failed to fan %s out to reactor %d", producer->path, best);
+			return NULL;
+		}
+		fanout->shards[best] = shard;
+	}
+
+	__atomic_add_fetch(&shard->refs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&shard->consumers, 1, __ATOMIC_RELAXED);
+	client->shard = shard;
+	return shard->reactor;
+}
+
+void
+fanout_publish(struct fanout *fanout, struct msg *msg)
+{
+	struct shard *shard;
+
+	for (int i = 0; i < fanout->nshards; i++) {
+		if ((shard = fanout->shards[i]) != NULL) {
+			fanout_push(shard, msg);
+			fanout_signal(shard);
+		}
+	}
+}
+
+void
+fanout_free(struct fanout *fanout)
+{
+	struct shard *shard;
+
+	for (int i = 0; i < fanout->nshards; i++) {
+		if ((shard = fanout->shards[i]) != NULL &&
+			reactor_post(shard->reactor, fanout_close_cb, shard) != 0) {
+			log_err("Failed to close shard of %s on reactor %d", shard->path, i);
+		}
+	}
+	free(fanout->shards);
+	free(fanout);
+}
+
+size_t
+fanout_consumers(struct fanout *fanout)
+{
+	size_t n = 0;
+
+	for (int i = 0; i < fanout->nshards; i++) {
+		if (fanout->shards[i] != NULL) {
+			n += __atomic_load_n(&fanout->shards[i]->consumers, __ATOMIC_RELAXED);
+		}
+	}
+	return n;
+}
+
+struct producer *
+fanout_join(struct shard *shard)
+{
+	return shard->producer;
+}
+
+void
+fanout_leave(struct shard *shard)
+{
+	__atomic_sub_fetch(&shard->consumers, 1, __ATOMIC_RELAXED);
+	fanout_release(shard);
+}
+
+void
+fanout_flush(struct shard *shard)
+{
+	fanout_drain_cb(-1, 0, shard);
+}
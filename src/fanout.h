@@ -0,0 +1,55 @@
+#ifndef __TELEGENIC_FANOUT_H__
+#define __TELEGENIC_FANOUT_H__
+
+#include "msg.h"
+
+#include <stddef.h>
+
+// Wide streams (-F). Every consumer of a stream normally sits on the
+// reactor that owns it, so a single thread writes every copy of every
+// message. Once a stream has more live consumers than the threshold, those
+// joining after are handed to the other reactors instead. A reactor's share
+// of the stream is a shard: a producer of its own, with its own consumers
+// and GOP cache, fed through a single-producer single-consumer ring of
+// message references. The owning reactor publishes each message once per
+// shard rather than once per consumer, and every reactor writes to its own
+// consumers in parallel.
+//
+// A shard lasts as long as its stream. One that falls a whole ring behind
+// loses messages and resumes its consumers at the next keyframe, as if
+// each of them had lagged.
+
+struct conn_client;
+struct fanout;
+struct producer;
+struct reactor;
+struct shard;
+
+// The reactor a new consumer of producer's stream should go to, with
+// client->shard set, or NULL to attach it here. Runs on the stream's
+// reactor.
+struct reactor *fanout_place(struct producer *producer,
+	struct conn_client *client);
+
+// Pass msg on to every shard. Runs on the stream's reactor.
+void fanout_publish(struct fanout *fanout, struct msg *msg);
+
+// The stream is over. Each shard delivers what it has already been sent,
+// then closes its consumers.
+void fanout_free(struct fanout *fanout);
+
+// Consumers on the stream's shards, as last counted
+size_t fanout_consumers(struct fanout *fanout);
+
+// The shard's producer for a client fanout_place handed to its reactor, or
+// NULL if the stream has ended since. Runs on the shard's reactor.
+struct producer *fanout_join(struct shard *shard);
+
+// A client placed on shard has gone
+void fanout_leave(struct shard *shard);
+
+// Deliver everything the stream has published to shard so far. Runs on
+// the shard's reactor.
+void fanout_flush(struct shard *shard);
+
+#endif
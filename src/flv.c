@@ -0,0 +1,108 @@
+#include "flv.h"
+#include "rtmp.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// Signature, version 1, audio and video present, 9 byte header
+const uint8_t flv_file_header[FLV_FILE_HEADER_SIZE] = {
+	'F', 'L', 'V', 0x01, 0x05, 0, 0, 0, 9,
+	0, 0, 0, 0
+};
+
+void
+flv_write_header(struct evbuffer *out)
+{
+	evbuffer_add(out, flv_file_header, sizeof(flv_file_header));
+}
+
+int
+flv_is_tag(const struct msg *msg)
+{
+	return msg->type == RTMP_TYPE_AUDIO_PACKET ||
+		msg->type == RTMP_TYPE_VIDEO_PACKET ||
+		msg->type == RTMP_TYPE_INVOKE_COMMAND;
+}
+
+void
+flv_tag_prepare(struct msg *msg)
+{
+	uint8_t *h = (uint8_t *)msg->data - FLV_TAG_HEADER_SIZE;
+	uint8_t *t = (uint8_t *)msg->data + msg->len;
+	uint32_t size = FLV_TAG_HEADER_SIZE + msg->len;
+
+	h[0] = msg->type;
+	h[1] = msg->len >> 16;
+	h[2] = msg->len >> 8;
+	h[3] = msg->len;
+	// Lower 24 bits of the timestamp, then the upper 8
+	h[4] = msg->timestamp >> 16;
+	h[5] = msg->timestamp >> 8;
+	h[6] = msg->timestamp;
+	h[7] = msg->timestamp >> 24;
+	h[8] = h[9] = h[10] = 0;
+
+	t[0] = size >> 24;
+	t[1] = size >> 16;
+	t[2] = size >> 8;
+	t[3] = size;
+}
+
+int
+flv_add_tag(struct evbuffer *out, struct msg *msg)
+{
+	return msg_add_span(out, msg, msg->data - FLV_TAG_HEADER_SIZE,
+		FLV_TAG_HEADER_SIZE + msg->len + FLV_TAG_TRAILER_SIZE);
+}
+
+int
+flv_read_header(struct evbuffer *in)
+{
+	uint8_t h[9];
+	uint32_t offset;
+
+	if (evbuffer_copyout(in, h, sizeof(h)) < (ssize_t)sizeof(h)) {
+		return 0;
+	}
+	if (memcmp(h, "FLV", 3) != 0) {
+		return -1;
+	}
+	offset = (uint32_t)h[5] << 24 | h[6] << 16 | h[7] << 8 | h[8];
+	if (offset < 9 || offset > 1024) {
+		return -1;
+	}
+	if (evbuffer_get_length(in) < offset + 4) {
+		return 0;
+	}
+	evbuffer_drain(in, offset + 4);
+	return 1;
+}
+
+int
+flv_read_tag(struct evbuffer *in, struct msg **msg)
+{
+	uint8_t h[FLV_TAG_HEADER_SIZE];
+	uint32_t len;
+
+	if (evbuffer_copyout(in, h, sizeof(h)) < (ssize_t)sizeof(h)) {
+		return 0;
+	}
+	// The filter and reserved bits must be clear
+	if (h[0] & 0xE0) {
+		return -1;
+	}
+	len = h[1] << 16 | h[2] << 8 | h[3];
+	if (evbuffer_get_length(in) < FLV_TAG_HEADER_SIZE + len + FLV_TAG_TRAILER_SIZE) {
+		return 0;
+	}
+	if ((*msg = msg_alloc(len)) == NULL) {
+		return -1;
+	}
+	(*msg)->type = h[0];
+	(*msg)->timestamp = (uint32_t)h[7] << 24 | h[4] << 16 | h[5] << 8 | h[6];
+	evbuffer_drain(in, FLV_TAG_HEADER_SIZE);
+	evbuffer_remove(in, (*msg)->data, len);
+	evbuffer_drain(in, FLV_TAG_TRAILER_SIZE);
+	flv_tag_prepare(*msg);
+	return 1;
+}
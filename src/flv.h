@@ -0,0 +1,37 @@
+#ifndef __TELEGENIC_FLV_H__
+#define __TELEGENIC_FLV_H__
+
+#include "msg.h"
+
+#include <event2/buffer.h>
+#include <stdint.h>
+
+#define FLV_TAG_HEADER_SIZE 11
+#define FLV_TAG_TRAILER_SIZE 4
+#define FLV_FILE_HEADER_SIZE 13
+
+// The FLV file header and the zero PreviousTagSize after it
+extern const uint8_t flv_file_header[FLV_FILE_HEADER_SIZE];
+
+void flv_write_header(struct evbuffer *out);
+
+// Whether msg is carried by an FLV tag (audio, video or script data)
+int flv_is_tag(const struct msg *msg);
+
+// Frame msg as an FLV tag in its head- and tailroom. Done once as the
+// message comes in; every FLV consumer then shares the same bytes.
+void flv_tag_prepare(struct msg *msg);
+
+// Queue the tag framed by flv_tag_prepare as a single reference.
+int flv_add_tag(struct evbuffer *out, struct msg *msg);
+
+// Reading an FLV file as it arrives: each returns 1 once it has consumed
+// what it reads, 0 if that isn't all in yet and -1 if it isn't FLV.
+
+// The file header and the PreviousTagSize after it
+int flv_read_header(struct evbuffer *in);
+
+// The next tag as a message, framed by flv_tag_prepare
+int flv_read_tag(struct evbuffer *in, struct msg **msg);
+
+#endif
@@ -0,0 +1,630 @@
+#include "fmp4.h"
+
+#include <string.h>
+
+// Boxes are written in two passes over the same code: one with no buffer
+// that only counts, so the message can be allocated at its exact size, and
+// one that fills it. Sample data is copied exactly once.
+struct fmp4_writer {
+	uint8_t *buf;
+	size_t len;
+};
+
+static void
+fmp4_put(struct fmp4_writer *w, const void *data, size_t len)
+{
+	if (w->buf) {
+		memcpy(w->buf + w->len, data, len);
+	}
+	w->len += len;
+}
+
+static void
+fmp4_zero(struct fmp4_writer *w, size_t len)
+{
+	if (w->buf) {
+		memset(w->buf + w->len, 0, len);
+	}
+	w->len += len;
+}
+
+static void
+fmp4_u8(struct fmp4_writer *w, uint8_t v)
+{
+	fmp4_put(w, &v, 1);
+}
+
+static void
+fmp4_u16(struct fmp4_writer *w, uint16_t v)
+{
+	uint8_t b[2] = { v >> 8, v };
+	fmp4_put(w, b, sizeof(b));
+}
+
+static void
+fmp4_u32(struct fmp4_writer *w, uint32_t v)
+{
+	uint8_t b[4] = { v >> 24, v >> 16, v >> 8, v };
+	fmp4_put(w, b, sizeof(b));
+}
+
+static void
+fmp4_u64(struct fmp4_writer *w, uint64_t v)
+{
+	fmp4_u32(w, v >> 32);
+	fmp4_u32(w, v);
+}
+
+// Open a box, returning where its size goes once fmp4_end knows it
+static size_t
+fmp4_box(struct fmp4_writer *w, const char *type)
+{
+	size_t start = w->len;
+	fmp4_u32(w, 0);
+	fmp4_put(w, type, 4);
+	return start;
+}
+
+static size_t
+fmp4_full_box(struct fmp4_writer *w, const char *type, uint8_t version,
+	uint32_t flags)
+{
+	size_t start = fmp4_box(w, type);
+	fmp4_u32(w, (uint32_t)version << 24 | flags);
+	return start;
+}
+
+static void
+fmp4_end(struct fmp4_writer *w, size_t start)
+{
+	uint32_t size = w->len - start;
+	if (w->buf) {
+		w->buf[start] = size >> 24;
+		w->buf[start + 1] = size >> 16;
+		w->buf[start + 2] = size >> 8;
+		w->buf[start + 3] = size;
+	}
+}
+
+static void
+fmp4_matrix(struct fmp4_writer *w)
+{
+	static const uint32_t unity[9] = {
+		0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000
+	};
+	int i;
+
+	for (i = 0; i < 9; i++) {
+		fmp4_u32(w, unity[i]);
+	}
+}
+
+// An MPEG-4 descriptor, with its length in the four byte form so it can
+// be written before the contents are known
+static size_t
+fmp4_descriptor(struct fmp4_writer *w, uint8_t tag)
+{
+	size_t start;
+
+	fmp4_u8(w, tag);
+	start = w->len;
+	fmp4_u32(w, 0);
+	return start;
+}
+
+static void
+fmp4_descriptor_end(struct fmp4_writer *w, size_t start)
+{
+	uint32_t size = w->len - start - 4;
+	if (w->buf) {
+		w->buf[start] = 0x80 | ((size >> 21) & 0x7f);
+		w->buf[start + 1] = 0x80 | ((size >> 14) & 0x7f);
+		w->buf[start + 2] = 0x80 | ((size >> 7) & 0x7f);
+		w->buf[start + 3] = size & 0x7f;
+	}
+}
+
+// H.264 sequence parameter sets are read with Exp-Golomb codes after the
+// emulation prevention bytes are taken out
+struct fmp4_bits {
+	uint8_t rbsp[256];
+	size_t len;
+	size_t pos;             // in bits
+};
+
+static int
+fmp4_bit(struct fmp4_bits *b)
+{
+	int bit;
+
+	if (b->pos >= b->len * 8) {
+		return -1;
+	}
+	bit = (b->rbsp[b->pos / 8] >> (7 - b->pos % 8)) & 1;
+	b->pos++;
+	return bit;
+}
+
+static int64_t
+fmp4_bits(struct fmp4_bits *b, int n)
+{
+	int64_t v = 0;
+	int bit;
+
+	while (n-- > 0) {
+		if ((bit = fmp4_bit(b)) < 0) {
+			return -1;
+		}
+		v = v << 1 | bit;
+	}
+	return v;
+}
+
+static int64_t
+fmp4_ue(struct fmp4_bits *b)
+{
+	int zeros = 0;
+	int bit;
+	int64_t rest;
+
+	while ((bit = fmp4_bit(b)) == 0) {
+		if (++zeros > 31) {
+			return -1;
+		}
+	}
+	if (bit < 0 || (rest = fmp4_bits(b, zeros)) < 0) {
+		return -1;
+	}
+	return ((int64_t)1 << zeros) - 1 + rest;
+}
+
+static int
+fmp4_skip_scaling_list(struct fmp4_bits *b, int size)
+{
+	int last = 8, next = 8;
+	int64_t delta;
+	int i;
+
+	for (i = 0; i < size; i++) {
+		if (next != 0) {
+			if ((delta = fmp4_ue(b)) < 0) {
+				return -1;
+			}
+			// se(v) from ue(v)
+			delta = delta & 1 ? (delta + 1) / 2 : -(delta / 2);
+			next = (last + delta + 256) % 256;
+		}
+		last = next == 0 ? last : next;
+	}
+	return 0;
+}
+
+// Picture size from the first SPS of an AVCDecoderConfigurationRecord
+static int
+fmp4_avc_size(const uint8_t *avcc, size_t len, uint16_t *width, uint16_t *height)
+{
+	struct fmp4_bits b = { .len = 0, .pos = 0 };
+	size_t sps_len, i;
+	int zeros = 0;
+	int64_t profile, chroma = 1, v, w, h, frame_mbs_only;
+	int64_t crop[4] = { 0, 0, 0, 0 };
+
+	if (len < 8 || (avcc[5] & 0x1f) == 0) {
+		return -1;
+	}
+	sps_len = avcc[6] << 8 | avcc[7];
+	if (sps_len < 4 || 8 + sps_len > len) {
+		return -1;
+	}
+	// Skip the NAL header
+	for (i = 9; i < 8 + sps_len && b.len < sizeof(b.rbsp); i++) {
+		if (zeros >= 2 && avcc[i] == 3) {
+			zeros = 0;
+			continue;
+		}
+		zeros = avcc[i] == 0 ? zeros + 1 : 0;
+		b.rbsp[b.len++] = avcc[i];
+	}
+
+	profile = fmp4_bits(&b, 8);
+	fmp4_bits(&b, 16);      // constraint flags and level
+	fmp4_ue(&b);            // seq_parameter_set_id
+	if (profile == 100 || profile == 110 || profile == 122 ||
+		profile == 244 || profile == 44 || profile == 83 ||
+		profile == 86 || profile == 118 || profile == 128 ||
+		profile == 138 || profile == 139 || profile == 134) {
+		if ((chroma = fmp4_ue(&b)) == 3) {
+			fmp4_bit(&b);   // separate_colour_plane_flag
+		}
+		fmp4_ue(&b);    // bit_depth_luma_minus8
+		fmp4_ue(&b);    // bit_depth_chroma_minus8
+		fmp4_bit(&b);   // qpprime_y_zero_transform_bypass_flag
+		if (fmp4_bit(&b) == 1) {
+			for (i = 0; i < (chroma != 3 ? 8 : 12); i++) {
+				if (fmp4_bit(&b) == 1 &&
+					fmp4_skip_scaling_list(&b, i < 6 ? 16 : 64) != 0) {
+					return -1;
+				}
+			}
+		}
+	}
+	fmp4_ue(&b);            // log2_max_frame_num_minus4
+	if ((v = fmp4_ue(&b)) == 0) {
+		fmp4_ue(&b);    // log2_max_pic_order_cnt_lsb_minus4
+	} else if (v == 1) {
+		fmp4_bit(&b);
+		fmp4_ue(&b);
+		fmp4_ue(&b);
+		if ((v = fmp4_ue(&b)) < 0) {
+			return -1;
+		}
+		while (v-- > 0) {
+			fmp4_ue(&b);
+		}
+	}
+	fmp4_ue(&b);            // max_num_ref_frames
+	fmp4_bit(&b);           // gaps_in_frame_num_value_allowed_flag
+	w = fmp4_ue(&b);
+	h = fmp4_ue(&b);
+	frame_mbs_only = fmp4_bit(&b);
+	if (frame_mbs_only == 0) {
+		fmp4_bit(&b);   // mb_adaptive_frame_field_flag
+	}
+	fmp4_bit(&b);           // direct_8x8_inference_flag
+	if (fmp4_bit(&b) == 1) {
+		for (i = 0; i < 4; i++) {
+			crop[i] = fmp4_ue(&b);
+		}
+	}
+	if (profile < 0 || w < 0 || h < 0 || frame_mbs_only < 0 ||
+		crop[0] < 0 || crop[1] < 0 || crop[2] < 0 || crop[3] < 0) {
+		return -1;
+	}
+
+	w = (w + 1) * 16 - (crop[0] + crop[1]) * (chroma == 0 || chroma == 3 ? 1 : 2);
+	h = (h + 1) * 16 * (2 - frame_mbs_only) -
+		(crop[2] + crop[3]) * (chroma == 1 ? 2 : 1) * (2 - frame_mbs_only);
+	if (w <= 0 || h <= 0 || w > 0xffff || h > 0xffff) {
+		return -1;
+	}
+	*width = w;
+	*height = h;
+	return 0;
+}
+
+void
+fmp4_track_init(struct fmp4_track *track)
+{
+	static const uint32_t rates[13] = {
+		96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050,
+		16000, 12000, 11025, 8000, 7350
+	};
+	const uint8_t *c = track->config;
+	uint8_t rate;
+
+	if (track->video) {
+		if (fmp4_avc_size(c, track->config_len, &track->width,
+			&track->height) != 0) {
+			track->width = track->height = 0;
+		}
+		return;
+	}
+
+	// AudioSpecificConfig: 5 bits of object type, 4 of sampling
+	// frequency index and 4 of channel configuration
+	track->sample_rate = 44100;
+	track->channels = 2;
+	if (track->config_len >= 2) {
+		rate = (c[0] & 0x07) << 1 | c[1] >> 7;
+		if (rate < 13) {
+			track->sample_rate = rates[rate];
+		}
+		if (rate != 15 && (c[1] >> 3 & 0x0f) != 0) {
+			track->channels = c[1] >> 3 & 0x0f;
+		}
+	}
+}
+
+static void
+fmp4_sample_entry(struct fmp4_writer *w, const struct fmp4_track *t)
+{
+	size_t entry, box, es, dc, dsi, sl;
+
+	if (t->video) {
+		entry = fmp4_box(w, "avc1");
+		fmp4_zero(w, 6);
+		fmp4_u16(w, 1);         // data_reference_index
+		fmp4_zero(w, 16);
+		fmp4_u16(w, t->width);
+		fmp4_u16(w, t->height);
+		fmp4_u32(w, 0x00480000);        // 72 dpi
+		fmp4_u32(w, 0x00480000);
+		fmp4_u32(w, 0);
+		fmp4_u16(w, 1);         // frame_count
+		fmp4_zero(w, 32);       // compressorname
+		fmp4_u16(w, 0x0018);    // depth
+		fmp4_u16(w, 0xffff);
+		box = fmp4_box(w, "avcC");
+		fmp4_put(w, t->config, t->config_len);
+		fmp4_end(w, box);
+		fmp4_end(w, entry);
+		return;
+	}
+
+	entry = fmp4_box(w, "mp4a");
+	fmp4_zero(w, 6);
+	fmp4_u16(w, 1);
+	fmp4_zero(w, 8);
+	fmp4_u16(w, t->channels);
+	fmp4_u16(w, 16);                // samplesize
+	fmp4_zero(w, 4);
+	fmp4_u32(w, (t->sample_rate > 0xffff ? 0 : t->sample_rate) << 16);
+	box = fmp4_full_box(w, "esds", 0, 0);
+	es = fmp4_descriptor(w, 0x03);
+	fmp4_u16(w, t->id);
+	fmp4_u8(w, 0);
+	dc = fmp4_descriptor(w, 0x04);
+	fmp4_u8(w, 0x40);               // MPEG-4 audio
+	fmp4_u8(w, 0x15);               // audio stream
+	fmp4_zero(w, 3 + 4 + 4);        // buffer size, max and average bitrate
+	dsi = fmp4_descriptor(w, 0x05);
+	fmp4_put(w, t->config, t->config_len);
+	fmp4_descriptor_end(w, dsi);
+	fmp4_descriptor_end(w, dc);
+	sl = fmp4_descriptor(w, 0x06);
+	fmp4_u8(w, 0x02);
+	fmp4_descriptor_end(w, sl);
+	fmp4_descriptor_end(w, es);
+	fmp4_end(w, box);
+	fmp4_end(w, entry);
+}
+
+static void
+fmp4_trak(struct fmp4_writer *w, const struct fmp4_track *t)
+{
+	size_t trak, box, mdia, minf, dinf, dref, stbl, stsd;
+	static const char video_name[] = "VideoHandler";
+	static const char audio_name[] = "SoundHandler";
+
+	trak = fmp4_box(w, "trak");
+
+	// Enabled and in the movie
+	box = fmp4_full_box(w, "tkhd", 0, 0x000003);
+	fmp4_zero(w, 8);                // creation and modification time
+	fmp4_u32(w, t->id);
+	fmp4_zero(w, 4 + 4 + 8);        // reserved, duration, reserved
+	fmp4_u16(w, 0);                 // layer
+	fmp4_u16(w, 0);                 // alternate_group
+	fmp4_u16(w, t->video ? 0 : 0x0100);
+	fmp4_u16(w, 0);
+	fmp4_matrix(w);
+	fmp4_u32(w, (uint32_t)t->width << 16);
+	fmp4_u32(w, (uint32_t)t->height << 16);
+	fmp4_end(w, box);
+
+	mdia = fmp4_box(w, "mdia");
+	box = fmp4_full_box(w, "mdhd", 0, 0);
+	fmp4_zero(w, 8);
+	fmp4_u32(w, FMP4_TIMESCALE);
+	fmp4_u32(w, 0);
+	fmp4_u16(w, 0x55c4);            // "und"
+	fmp4_u16(w, 0);
+	fmp4_end(w, box);
+
+	box = fmp4_full_box(w, "hdlr", 0, 0);
+	fmp4_u32(w, 0);
+	fmp4_put(w, t->video ? "vide" : "soun", 4);
+	fmp4_zero(w, 12);
+	fmp4_put(w, t->video ? video_name : audio_name, sizeof(video_name));
+	fmp4_end(w, box);
+
+	minf = fmp4_box(w, "minf");
+	if (t->video) {
+		box = fmp4_full_box(w, "vmhd", 0, 0x000001);
+		fmp4_zero(w, 8);
+	} else {
+		box = fmp4_full_box(w, "smhd", 0, 0);
+		fmp4_zero(w, 4);
+	}
+	fmp4_end(w, box);
+
+	dinf = fmp4_box(w, "dinf");
+	dref = fmp4_full_box(w, "dref", 0, 0);
+	fmp4_u32(w, 1);
+	// The media is in this file
+	box = fmp4_full_box(w, "url ", 0, 0x000001);
+	fmp4_end(w, box);
+	fmp4_end(w, dref);
+	fmp4_end(w, dinf);
+
+	// Every sample is described by the fragments
+	stbl = fmp4_box(w, "stbl");
+	stsd = fmp4_full_box(w, "stsd", 0, 0);
+	fmp4_u32(w, 1);
+	fmp4_sample_entry(w, t);
+	fmp4_end(w, stsd);
+	box = fmp4_full_box(w, "stts", 0, 0);
+	fmp4_u32(w, 0);
+	fmp4_end(w, box);
+	box = fmp4_full_box(w, "stsc", 0, 0);
+	fmp4_u32(w, 0);
+	fmp4_end(w, box);
+	box = fmp4_full_box(w, "stsz", 0, 0);
+	fmp4_u32(w, 0);
+	fmp4_u32(w, 0);
+	fmp4_end(w, box);
+	box = fmp4_full_box(w, "stco", 0, 0);
+	fmp4_u32(w, 0);
+	fmp4_end(w, box);
+	fmp4_end(w, stbl);
+
+	fmp4_end(w, minf);
+	fmp4_end(w, mdia);
+	fmp4_end(w, trak);
+}
+
+static void
+fmp4_write_init(struct fmp4_writer *w, const struct fmp4_track *tracks,
+	int ntracks)
+{
+	size_t moov, box, mvex;
+	int i;
+
+	box = fmp4_box(w, "ftyp");
+	fmp4_put(w, "iso6", 4);
+	fmp4_u32(w, 0);
+	fmp4_put(w, "iso6cmfcmp41", 12);
+	fmp4_end(w, box);
+
+	moov = fmp4_box(w, "moov");
+	box = fmp4_full_box(w, "mvhd", 0, 0);
+	fmp4_zero(w, 8);
+	fmp4_u32(w, FMP4_TIMESCALE);
+	fmp4_u32(w, 0);                 // duration, which fragments extend
+	fmp4_u32(w, 0x00010000);        // rate 1.0
+	fmp4_u16(w, 0x0100);            // volume 1.0
+	fmp4_zero(w, 10);
+	fmp4_matrix(w);
+	fmp4_zero(w, 24);
+	fmp4_u32(w, ntracks + 1);       // next_track_ID
+	fmp4_end(w, box);
+
+	for (i = 0; i < ntracks; i++) {
+		fmp4_trak(w, &tracks[i]);
+	}
+
+	mvex = fmp4_box(w, "mvex");
+	for (i = 0; i < ntracks; i++) {
+		box = fmp4_full_box(w, "trex", 0, 0);
+		fmp4_u32(w, tracks[i].id);
+		fmp4_u32(w, 1);         // default_sample_description_index
+		fmp4_zero(w, 12);       // duration, size and flags
+		fmp4_end(w, box);
+	}
+	fmp4_end(w, mvex);
+	fmp4_end(w, moov);
+}
+
+struct msg *
+fmp4_init_segment(const struct fmp4_track *tracks, int ntracks)
+{
+	struct fmp4_writer w = { NULL, 0 };
+	struct msg *msg;
+
+	fmp4_write_init(&w, tracks, ntracks);
+	if ((msg = msg_alloc(w.len)) == NULL) {
+		return NULL;
+	}
+	w.buf = (uint8_t *)msg->data;
+	w.len = 0;
+	fmp4_write_init(&w, tracks, ntracks);
+	return msg;
+}
+
+// Sync samples depend on nothing; the rest depend on others and aren't
+// sync samples
+#define FMP4_SAMPLE_SYNC     0x02000000
+#define FMP4_SAMPLE_NON_SYNC 0x01010000
+
+// trun flags
+#define FMP4_TRUN_DATA_OFFSET 0x000001
+#define FMP4_TRUN_DURATION    0x000100
+#define FMP4_TRUN_SIZE        0x000200
+#define FMP4_TRUN_FLAGS       0x000400
+#define FMP4_TRUN_CTO         0x000800
+
+// tfhd: data offsets are from the start of the moof
+#define FMP4_TFHD_BASE_IS_MOOF 0x020000
+
+static void
+fmp4_write_fragment(struct fmp4_writer *w, uint32_t seq,
+	const struct fmp4_track *tracks, const struct fmp4_run *runs,
+	int ntracks, size_t moof_len)
+{
+	size_t moof, traf, box, mdat;
+	size_t data_offset = moof_len + 8;
+	const struct fmp4_sample *s;
+	uint32_t flags;
+	int i;
+	size_t j;
+
+	moof = fmp4_box(w, "moof");
+	box = fmp4_full_box(w, "mfhd", 0, 0);
+	fmp4_u32(w, seq);
+	fmp4_end(w, box);
+
+	for (i = 0; i < ntracks; i++) {
+		if (runs[i].nsamples == 0) {
+			continue;
+		}
+		traf = fmp4_box(w, "traf");
+		box = fmp4_full_box(w, "tfhd", 0, FMP4_TFHD_BASE_IS_MOOF);
+		fmp4_u32(w, tracks[i].id);
+		fmp4_end(w, box);
+
+		box = fmp4_full_box(w, "tfdt", 1, 0);
+		fmp4_u64(w, runs[i].base_dts);
+		fmp4_end(w, box);
+
+		// Version 1 for signed composition offsets
+		flags = FMP4_TRUN_DATA_OFFSET | FMP4_TRUN_DURATION |
+			FMP4_TRUN_SIZE | FMP4_TRUN_FLAGS;
+		if (tracks[i].video) {
+			flags |= FMP4_TRUN_CTO;
+		}
+		box = fmp4_full_box(w, "trun", 1, flags);
+		fmp4_u32(w, runs[i].nsamples);
+		fmp4_u32(w, data_offset);
+		for (j = 0; j < runs[i].nsamples; j++) {
+			s = &runs[i].samples[j];
+			fmp4_u32(w, s->duration);
+			fmp4_u32(w, s->len);
+			fmp4_u32(w, s->key ? FMP4_SAMPLE_SYNC : FMP4_SAMPLE_NON_SYNC);
+			if (tracks[i].video) {
+				fmp4_u32(w, s->cto);
+			}
+			data_offset += s->len;
+		}
+		fmp4_end(w, box);
+		fmp4_end(w, traf);
+	}
+	fmp4_end(w, moof);
+
+	mdat = fmp4_box(w, "mdat");
+	for (i = 0; i < ntracks; i++) {
+		for (j = 0; j < runs[i].nsamples; j++) {
+			fmp4_put(w, runs[i].samples[j].data, runs[i].samples[j].len);
+		}
+	}
+	fmp4_end(w, mdat);
+}
+
+struct msg *
+fmp4_fragment(uint32_t seq, const struct fmp4_track *tracks,
+	const struct fmp4_run *runs, int ntracks)
+{
+	struct fmp4_writer w = { NULL, 0 };
+	struct msg *msg;
+	size_t moof_len, len;
+	int i;
+	size_t j;
+
+	// The moof's size is needed for the data offsets in it, so count it
+	// on its own first: everything after it is the mdat
+	fmp4_write_fragment(&w, seq, tracks, runs, ntracks, 0);
+	len = w.len;
+	moof_len = len - 8;
+	for (i = 0; i < ntracks; i++) {
+		for (j = 0; j < runs[i].nsamples; j++) {
+			moof_len -= runs[i].samples[j].len;
+		}
+	}
+
+	if ((msg = msg_alloc(len)) == NULL) {
+		return NULL;
+	}
+	w.buf = (uint8_t *)msg->data;
+	w.len = 0;
+	fmp4_write_fragment(&w, seq, tracks, runs, ntracks, moof_len);
+	return msg;
+}
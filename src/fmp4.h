@@ -0,0 +1,54 @@
+#ifndef __TELEGENIC_FMP4_H__
+#define __TELEGENIC_FMP4_H__
+
+#include "msg.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Fragmented MP4 (CMAF) for H.264 and AAC with a 1 ms timescale, the
+// resolution RTMP timestamps come in. Samples are the payloads of RTMP
+// media messages as they are: AVC video is already length-prefixed NAL
+// units and AAC audio raw access units.
+
+#define FMP4_TIMESCALE 1000
+
+struct fmp4_track {
+	uint32_t id;
+	int video;
+	// AVCDecoderConfigurationRecord or AudioSpecificConfig
+	const uint8_t *config;
+	size_t config_len;
+	// Read from the configuration by fmp4_track_init
+	uint16_t width;
+	uint16_t height;
+	uint32_t sample_rate;
+	uint8_t channels;
+};
+
+struct fmp4_sample {
+	const uint8_t *data;
+	uint32_t len;
+	uint32_t duration;
+	int32_t cto;            // composition time offset
+	uint8_t key;
+};
+
+// A track's samples in one fragment
+struct fmp4_run {
+	uint64_t base_dts;
+	struct fmp4_sample *samples;
+	size_t nsamples;
+};
+
+// Fill in what the track's configuration says about its picture or sound
+void fmp4_track_init(struct fmp4_track *track);
+
+// The initialization segment: ftyp and moov
+struct msg *fmp4_init_segment(const struct fmp4_track *tracks, int ntracks);
+
+// One fragment, moof and mdat, with runs[i] holding tracks[i]'s samples
+struct msg *fmp4_fragment(uint32_t seq, const struct fmp4_track *tracks,
+	const struct fmp4_run *runs, int ntracks);
+
+#endif
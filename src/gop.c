@@ -0,0 +1,154 @@
+#include "gop.h"
+#include "config.h"
+#include "log.h"
+#include "rtmp.h"
+
+#include <stdlib.h>
+
+void
+gop_cache_init(struct gop_cache *gop)
+{
+	gop->metadata = NULL;
+	gop->video_config = NULL;
+	gop->audio_config = NULL;
+	gop->msgs = NULL;
+	gop->len = 0;
+	gop->cap = 0;
+	gop->bytes = 0;
+	gop->overflow = 0;
+}
+
+static void
+gop_cache_clear(struct gop_cache *gop)
+{
+	for (size_t i = 0; i < gop->len; i++) {
+		msg_unref(gop->msgs[i]);
+	}
+	gop->len = 0;
+	gop->bytes = 0;
+}
+
+void
+gop_cache_free(struct gop_cache *gop)
+{
+	gop_cache_clear(gop);
+	free(gop->msgs);
+	if (gop->metadata) {
+		msg_unref(gop->metadata);
+	}
+	if (gop->video_config) {
+		msg_unref(gop->video_config);
+	}
+	if (gop->audio_config) {
+		msg_unref(gop->audio_config);
+	}
+	gop_cache_init(gop);
+}
+
+static void
+gop_cache_set(struct msg **slot, struct msg *msg)
+{
+	if (*slot) {
+		msg_unref(*slot);
+	}
+	msg_ref(msg);
+	*slot = msg;
+}
+
+static int
+gop_cache_push(struct gop_cache *gop, struct msg *msg)
+{
+	if (gop->bytes + msg->len > config.gop_max_bytes) {
+		return -1;
+	}
+
+	if (gop->len == gop->cap) {
+		size_t cap = gop->cap ? gop->cap * 2 : 256;
+		struct msg **msgs = realloc(gop->msgs, cap * sizeof(struct msg *));
+		if (msgs == NULL) {
+			return -1;
+		}
+		gop->msgs = msgs;
+		gop->cap = cap;
+	}
+
+	msg_ref(msg);
+	gop->msgs[gop->len++] = msg;
+	gop->bytes += msg->len;
+	return 0;
+}
+
+void
+gop_cache_add(struct gop_cache *gop, struct msg *msg)
+{
+	switch (msg->type) {
+		case RTMP_TYPE_INVOKE_COMMAND:
+			// Only onMetaData; any other data message is of no use to a
+			// consumer that joins after it
+			if (msg->flags & MSG_CONFIG) {
+				gop_cache_set(&gop->metadata, msg);
+			}
+			return;
+
+		case RTMP_TYPE_VIDEO_PACKET:
+			if (msg->flags & MSG_CONFIG) {
+				gop_cache_set(&gop->video_config, msg);
+				return;
+			}
+			if (msg->flags & MSG_KEYFRAME) {
+				gop_cache_clear(gop);
+				gop->overflow = 0;
+			}
+			break;
+
+		case RTMP_TYPE_AUDIO_PACKET:
+			if (msg->flags & MSG_CONFIG) {
+				gop_cache_set(&gop->audio_config, msg);
+				return;
+			}
+			break;
+
+		default:
+			// Opaque streams have no notion of where decoding can start
+			return;
+	}
+
+	// Nothing before the first keyframe is any use to a new consumer
+	if (gop->len == 0 && !(msg->flags & MSG_KEYFRAME)) {
+		return;
+	}
+	if (gop->overflow) {
+		return;
+	}
+
+	if (gop_cache_push(gop, msg) != 0) {
+		log_debug("GOP exceeds %zu bytes, not caching it", config.gop_max_bytes);
+		gop_cache_clear(gop);
+		gop->overflow = 1;
+	}
+}
+
+void
+gop_cache_skip(struct gop_cache *gop)
+{
+	gop_cache_clear(gop);
+	gop->overflow = 1;
+}
+
+void
+gop_cache_foreach(struct gop_cache *gop,
+	void (*fn)(struct msg *msg, void *arg), void *arg)
+{
+	if (gop->metadata) {
+		fn(gop->metadata, arg);
+	}
+	if (gop->video_config) {
+		fn(gop->video_config, arg);
+	}
+	if (gop->audio_config) {
+		fn(gop->audio_config, arg);
+	}
+	for (size_t i = 0; i < gop->len; i++) {
+		fn(gop->msgs[i], arg);
+	}
+}
@@ -0,0 +1,41 @@
+#ifndef __TELEGENIC_GOP_H__
+#define __TELEGENIC_GOP_H__
+
+#include "msg.h"
+
+#include <event2/buffer.h>
+#include <stddef.h>
+
+// Everything a new consumer needs to start decoding immediately: the
+// latest stream metadata, the audio/video codec configuration, and every
+// message since the most recent keyframe. The cache only holds references
+// to the messages the producer is fanning out anyway.
+struct gop_cache {
+	struct msg *metadata;
+	struct msg *video_config;
+	struct msg *audio_config;
+
+	struct msg **msgs;
+	size_t len;
+	size_t cap;
+	size_t bytes;
+	// The current GOP outgrew the cache and is skipped until the next
+	// keyframe
+	int overflow;
+};
+
+void gop_cache_init(struct gop_cache *gop);
+
+void gop_cache_free(struct gop_cache *gop);
+
+void gop_cache_add(struct gop_cache *gop, struct msg *msg);
+
+// Messages went missing: drop the current GOP and cache nothing until the
+// next keyframe
+void gop_cache_skip(struct gop_cache *gop);
+
+// Call fn for each cached message in the order a consumer needs them.
+void gop_cache_foreach(struct gop_cache *gop,
+	void (*fn)(struct msg *msg, void *arg), void *arg);
+
+#endif
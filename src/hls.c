@@ -0,0 +1,838 @@
+#include "hls.h"
+#include "fmp4.h"
+#include "log.h"
+#include "rtmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// A part is cut before the lead track's sample that would take it past
+// HLS_PART_MS, less some slack for millisecond timestamps jittering, and a
+// segment at the first keyframe at least HLS_SEGMENT_MS in, so segments
+// follow the publisher's GOPs.
+#define HLS_PART_MS 500
+#define HLS_PART_SLACK_MS 10
+#define HLS_SEGMENT_MS 1000
+// Complete segments listed in the playlist
+#define HLS_WINDOW 6
+// Parts are listed for the segments in this many target durations from
+// the live edge
+#define HLS_PART_SPAN 3
+// A waiting request is answered 503 after this many target durations
+#define HLS_WAIT_TARGETS 3
+
+enum hls_resource {
+	hls_bad,
+	hls_playlist,
+	hls_init,
+	hls_segment,
+	hls_part
+};
+
+struct hls_request {
+	struct conn_client *client;
+	// Set while waiting on a stream
+	struct hls_stream *stream;
+	struct hls_request *next;
+	struct hls_request *prev;
+	uint64_t since;
+
+	uint8_t resource;       // enum hls_resource
+	int64_t msn;            // -1 when not given
+	int64_t part;
+};
+
+struct hls_part {
+	struct msg *data;       // moof and mdat
+	uint32_t duration;
+	uint8_t independent;
+};
+
+struct hls_segment {
+	struct hls_part *parts;
+	size_t nparts;
+	size_t cap;
+	uint32_t duration;
+};
+
+struct hls_track {
+	struct fmp4_track info; // info.id is 0 for a track not being muxed
+	struct msg *config;     // the sequence header info.config points into
+
+	// Samples for the next part and the messages holding them
+	struct fmp4_sample *samples;
+	struct msg **msgs;
+	size_t nsamples;
+	size_t cap;
+	uint64_t base_dts;
+
+	// The newest sample, held back until the next one gives its duration
+	struct fmp4_sample held;
+	struct msg *held_msg;
+	uint64_t held_dts;
+
+	uint64_t dts;           // RTMP timestamps extended past 32 bits
+	int timed;
+	uint32_t last_duration;
+};
+
+struct hls_stream {
+	struct event_base *base;
+	struct hls_track video;
+	struct hls_track audio;
+	// Parts are cut on the video track, or the audio of an audio-only
+	// stream
+	struct hls_track *lead;
+	int started;
+
+	struct msg *init;
+	struct msg *playlist;
+
+	// The segments from first_msn up to msn, the one still growing
+	struct hls_segment segments[HLS_WINDOW + 1];
+	int64_t msn;
+	uint64_t segment_start;
+	uint64_t part_start;
+	uint32_t fragments;
+	uint32_t target;        // seconds
+
+	struct hls_request *waiters;
+	struct event *timer;
+};
+
+static struct hls_segment *
+hls_segment_at(struct hls_stream *hls, int64_t msn)
+{
+	return &hls->segments[msn % (HLS_WINDOW + 1)];
+}
+
+static int64_t
+hls_first_msn(struct hls_stream *hls)
+{
+	return hls->msn > HLS_WINDOW ? hls->msn - HLS_WINDOW : 0;
+}
+
+static void
+hls_segment_clear(struct hls_segment *seg)
+{
+	for (size_t i = 0; i < seg->nparts; i++) {
+		msg_unref(seg->parts[i].data);
+	}
+	seg->nparts = 0;
+	seg->duration = 0;
+}
+
+static void
+hls_track_clear(struct hls_track *track)
+{
+	for (size_t i = 0; i < track->nsamples; i++) {
+		msg_unref(track->msgs[i]);
+	}
+	track->nsamples = 0;
+}
+
+static void
+hls_track_free(struct hls_track *track)
+{
+	hls_track_clear(track);
+	free(track->samples);
+	free(track->msgs);
+	if (track->held_msg) {
+		msg_unref(track->held_msg);
+	}
+	if (track->config) {
+		msg_unref(track->config);
+	}
+}
+
+static void hls_timer_cb(evutil_socket_t fd, short events, void *arg);
+
+struct hls_stream *
+hls_new(struct event_base *base)
+{
+	struct hls_stream *hls = calloc(1, sizeof(struct hls_stream));
+	if (hls == NULL) {
+		log_err("Failed to allocate HLS stream");
+		return NULL;
+	}
+	hls->base = base;
+	hls->target = HLS_SEGMENT_MS / 1000;
+	hls->timer = evtimer_new(base, hls_timer_cb, hls);
+	if (hls->timer == NULL) {
+		free(hls);
+		return NULL;
+	}
+	return hls;
+}
+
+static uint64_t
+hls_now_ms(struct hls_stream *hls)
+{
+	struct timeval tv;
+	event_base_gettimeofday_cached(hls->base, &tv);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void
+hls_unlink(struct hls_request *req)
+{
+	if (req->prev) {
+		req->prev->next = req->next;
+	} else {
+		req->stream->waiters = req->next;
+	}
+	if (req->next) {
+		req->next->prev = req->prev;
+	}
+	req->stream = NULL;
+}
+
+static void
+hls_send(struct conn_client *client, const char *type, const char *cache,
+	struct msg **msgs, size_t n)
+{
+	struct evbuffer *out = bufferevent_get_output(client->bev);
+	size_t len = 0, i;
+
+	for (i = 0; i < n; i++) {
+		len += msgs[i]->len;
+	}
+	evbuffer_add_printf(out, "HTTP/1.1 200 OK\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Length: %zu\r\n"
+		"Cache-Control: %s\r\n"
+		"Access-Control-Allow-Origin: *\r\n\r\n", type, len, cache);
+	for (i = 0; i < n; i++) {
+		msg_add(out, msgs[i]);
+	}
+}
+
+static void
+hls_send_segment(struct conn_client *client, struct hls_segment *seg)
+{
+	struct msg *msgs[seg->nparts];
+
+	for (size_t i = 0; i < seg->nparts; i++) {
+		msgs[i] = seg->parts[i].data;
+	}
+	hls_send(client, "video/mp4", "max-age=60", msgs, seg->nparts);
+}
+
+static void
+hls_send_status(struct conn_client *client, int status)
+{
+	const char *reason;
+
+	switch (status) {
+		case 400:
+			reason = "Bad Request";
+			break;
+		case 503:
+			reason = "Service Unavailable";
+			break;
+		default:
+			status = 404;
+			reason = "Not Found";
+			break;
+	}
+	evbuffer_add_printf(bufferevent_get_output(client->bev),
+		"HTTP/1.1 %d %s\r\n"
+		"Content-Length: 0\r\n"
+		"Access-Control-Allow-Origin: *\r\n\r\n", status, reason);
+}
+
+// Whether the stream holds part (or, if part is -1, all) of segment msn or
+// anything after it
+static int
+hls_reached(struct hls_stream *hls, int64_t msn, int64_t part)
+{
+	if (msn < hls->msn) {
+		return 1;
+	}
+	return msn == hls->msn && part >= 0 &&
+		(size_t)part < hls_segment_at(hls, msn)->nparts;
+}
+
+// The status to answer req with, or 0 if it has to wait
+static int
+hls_check(struct hls_stream *hls, struct hls_request *req)
+{
+	size_t nparts;
+
+	switch (req->resource) {
+		case hls_playlist:
+			// Clients may only block on the next two segments
+			if (req->msn > hls->msn + 2) {
+				return 400;
+			}
+			if (hls->playlist == NULL) {
+				return 0;
+			}
+			return req->msn < 0 || hls_reached(hls, req->msn, req->part) ? 200 : 0;
+
+		case hls_init:
+			return hls->init ? 200 : 0;
+
+		case hls_segment:
+			if (req->msn < hls_first_msn(hls) || req->msn > hls->msn) {
+				return 404;
+			}
+			return req->msn < hls->msn ? 200 : 0;
+
+		case hls_part:
+			if (req->msn < hls_first_msn(hls)) {
+				return 404;
+			}
+			if (req->msn <= hls->msn) {
+				nparts = hls_segment_at(hls, req->msn)->nparts;
+				if ((size_t)req->part < nparts) {
+					return 200;
+				}
+				// The next part, unless the segment has ended
+				return req->msn == hls->msn && (size_t)req->part == nparts ?
+					0 : 404;
+			}
+			return req->msn == hls->msn + 1 && req->part == 0 ? 0 : 404;
+
+		default:
+			return 400;
+	}
+}
+
+// Answer req and ready its client for the next one
+static void
+hls_answer(struct hls_stream *hls, struct hls_request *req, int status)
+{
+	struct conn_client *client = req->client;
+
+	if (status != 200) {
+		hls_send_status(client, status);
+	} else {
+		switch (req->resource) {
+			case hls_playlist:
+				hls_send(client, "application/vnd.apple.mpegurl", "no-cache",
+					&hls->playlist, 1);
+				break;
+			case hls_init:
+				hls_send(client, "video/mp4", "max-age=60", &hls->init, 1);
+				break;
+			case hls_segment:
+				hls_send_segment(client, hls_segment_at(hls, req->msn));
+				break;
+			case hls_part:
+				hls_send(client, "video/mp4", "max-age=60",
+					&hls_segment_at(hls, req->msn)->parts[req->part].data, 1);
+				break;
+		}
+	}
+	conn_http_done(client);
+}
+
+// Answer whatever the stream now has for
+static void
+hls_wake(struct hls_stream *hls)
+{
+	struct hls_request *req, *next;
+	int status;
+
+	for (req = hls->waiters; req; req = next) {
+		next = req->next;
+		if ((status = hls_check(hls, req)) != 0) {
+			hls_unlink(req);
+			hls_answer(hls, req, status);
+		}
+	}
+}
+
+static void
+hls_timer_cb(evutil_socket_t fd, short events, void *arg)
+{
+	struct hls_stream *hls = arg;
+	struct hls_request *req, *next;
+	struct timeval tv = { 1, 0 };
+	uint64_t now = hls_now_ms(hls);
+
+	for (req = hls->waiters; req; req = next) {
+		next = req->next;
+		if (now - req->since > (uint64_t)hls->target * 1000 * HLS_WAIT_TARGETS) {
+			hls_unlink(req);
+			hls_answer(hls, req, 503);
+		}
+	}
+	if (hls->waiters) {
+		evtimer_add(hls->timer, &tv);
+	}
+}
+
+void
+hls_free(struct hls_stream *hls)
+{
+	struct hls_request *req;
+	int i;
+
+	// The stream is over; nothing more is coming for anyone waiting
+	while ((req = hls->waiters) != NULL) {
+		hls_unlink(req);
+		hls_answer(hls, req, 404);
+	}
+	event_free(hls->timer);
+
+	hls_track_free(&hls->video);
+	hls_track_free(&hls->audio);
+	for (i = 0; i <= HLS_WINDOW; i++) {
+		hls_segment_clear(&hls->segments[i]);
+		free(hls->segments[i].parts);
+	}
+	if (hls->init) {
+		msg_unref(hls->init);
+	}
+	if (hls->playlist) {
+		msg_unref(hls->playlist);
+	}
+	free(hls);
+}
+
+static void
+hls_write_playlist(struct hls_stream *hls)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct hls_segment *seg;
+	struct msg *msg;
+	int64_t first = hls_first_msn(hls), parts_from, msn;
+	uint64_t span = 0;
+	size_t i;
+
+	if (buf == NULL) {
+		return;
+	}
+
+	parts_from = hls->msn;
+	for (msn = hls->msn; msn >= first; msn--) {
+		if (span >= (uint64_t)hls->target * 1000 * HLS_PART_SPAN) {
+			break;
+		}
+		parts_from = msn;
+		span += hls_segment_at(hls, msn)->duration;
+	}
+
+	evbuffer_add_printf(buf, "#EXTM3U\n"
+		"#EXT-X-VERSION:6\n"
+		"#EXT-X-TARGETDURATION:%u\n"
+		"#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=%.3f\n"
+		"#EXT-X-PART-INF:PART-TARGET=%.3f\n"
+		"#EXT-X-MEDIA-SEQUENCE:%lld\n"
+		"#EXT-X-MAP:URI=\"init.mp4\"\n",
+		hls->target, HLS_PART_MS * 3 / 1000.0, HLS_PART_MS / 1000.0,
+		(long long)first);
+
+	for (msn = first; msn <= hls->msn; msn++) {
+		seg = hls_segment_at(hls, msn);
+		for (i = 0; msn >= parts_from && i < seg->nparts; i++) {
+			evbuffer_add_printf(buf,
+				"#EXT-X-PART:DURATION=%.3f,URI=\"%lld.%zu.m4s\"%s\n",
+				seg->parts[i].duration / 1000.0, (long long)msn, i,
+				seg->parts[i].independent ? ",INDEPENDENT=YES" : "");
+		}
+		if (msn < hls->msn) {
+			evbuffer_add_printf(buf, "#EXTINF:%.3f,\n%lld.m4s\n",
+				seg->duration / 1000.0, (long long)msn);
+		}
+	}
+	evbuffer_add_printf(buf, "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"%lld.%zu.m4s\"\n",
+		(long long)hls->msn, hls_segment_at(hls, hls->msn)->nparts);
+
+	if ((msg = msg_alloc(evbuffer_get_length(buf))) != NULL) {
+		evbuffer_remove(buf, msg->data, msg->len);
+		if (hls->playlist) {
+			msg_unref(hls->playlist);
+		}
+		hls->playlist = msg;
+	}
+	evbuffer_free(buf);
+}
+
+static int
+hls_add_part(struct hls_segment *seg, struct msg *data, uint32_t duration,
+	int independent)
+{
+	if (seg->nparts == seg->cap) {
+		size_t cap = seg->cap ? seg->cap * 2 : 8;
+		struct hls_part *parts = realloc(seg->parts, cap * sizeof(struct hls_part));
+		if (parts == NULL) {
+			return -1;
+		}
+		seg->parts = parts;
+		seg->cap = cap;
+	}
+	seg->parts[seg->nparts].data = data;
+	seg->parts[seg->nparts].duration = duration;
+	seg->parts[seg->nparts].independent = independent;
+	seg->nparts++;
+	seg->duration += duration;
+	return 0;
+}
+
+// End the current part at dts, and the segment with it if asked to
+static void
+hls_cut(struct hls_stream *hls, uint64_t dts, int end_segment)
+{
+	struct hls_track *tracks[2] = { &hls->video, &hls->audio };
+	struct fmp4_track info[2];
+	struct fmp4_run runs[2];
+	struct hls_segment *seg = hls_segment_at(hls, hls->msn);
+	struct msg *data;
+	uint32_t secs;
+	int i, n = 0;
+
+	for (i = 0; i < 2; i++) {
+		if (tracks[i]->info.id == 0) {
+			continue;
+		}
+		info[n] = tracks[i]->info;
+		runs[n].base_dts = tracks[i]->base_dts;
+		runs[n].samples = tracks[i]->samples;
+		runs[n].nsamples = tracks[i]->nsamples;
+		n++;
+	}
+	data = fmp4_fragment(++hls->fragments, info, runs, n);
+	hls_track_clear(&hls->video);
+	hls_track_clear(&hls->audio);
+
+	if (data == NULL || hls_add_part(seg, data,
+		dts - hls->part_start, seg->nparts == 0) != 0) {
+		log_err("Failed to add HLS part");
+		if (data) {
+			msg_unref(data);
+		}
+	}
+	hls->part_start = dts;
+
+	if (end_segment) {
+		// Rounded, as EXTINF durations are held to it
+		secs = (seg->duration + 500) / 1000;
+		if (secs > hls->target) {
+			hls->target = secs;
+		}
+		hls->msn++;
+		hls->segment_start = dts;
+		hls_segment_clear(hls_segment_at(hls, hls->msn));
+	}
+
+	hls_write_playlist(hls);
+	hls_wake(hls);
+}
+
+static int
+hls_push(struct hls_track *track)
+{
+	if (track->nsamples == track->cap) {
+		size_t cap = track->cap ? track->cap * 2 : 64;
+		struct fmp4_sample *samples = realloc(track->samples,
+			cap * sizeof(struct fmp4_sample));
+		if (samples == NULL) {
+			return -1;
+		}
+		track->samples = samples;
+		struct msg **msgs = realloc(track->msgs, cap * sizeof(struct msg *));
+		if (msgs == NULL) {
+			return -1;
+		}
+		track->msgs = msgs;
+		track->cap = cap;
+	}
+
+	if (track->nsamples == 0) {
+		track->base_dts = track->held_dts;
+	}
+	track->samples[track->nsamples] = track->held;
+	track->msgs[track->nsamples] = track->held_msg;
+	track->nsamples++;
+	track->held_msg = NULL;
+	return 0;
+}
+
+static void
+hls_add_sample(struct hls_stream *hls, struct hls_track *track,
+	struct msg *msg, size_t off, int32_t cto, int key)
+{
+	int32_t delta = msg->timestamp - (uint32_t)track->dts;
+	uint64_t dts;
+
+	if (!track->info.id) {
+		return;
+	}
+	// Timestamps only ever move forward, across the 32 bit wrap too
+	if (!track->timed) {
+		dts = msg->timestamp;
+		track->timed = 1;
+	} else {
+		dts = track->dts + (delta > 0 ? delta : 0);
+	}
+	track->dts = dts;
+
+	if (track->held_msg) {
+		track->held.duration = dts - track->held_dts;
+		track->last_duration = track->held.duration;
+		if (hls_push(track) != 0) {
+			msg_unref(track->held_msg);
+			track->held_msg = NULL;
+		}
+	}
+
+	if (track == hls->lead && track->nsamples > 0) {
+		if (key && dts - hls->segment_start >= HLS_SEGMENT_MS) {
+			hls_cut(hls, dts, 1);
+		} else if (dts + track->last_duration - hls->part_start >
+			HLS_PART_MS - HLS_PART_SLACK_MS) {
+			hls_cut(hls, dts, 0);
+		}
+	}
+
+	msg_ref(msg);
+	track->held_msg = msg;
+	track->held_dts = dts;
+	track->held.data = (const uint8_t *)msg->data + off;
+	track->held.len = msg->len - off;
+	track->held.duration = 0;
+	track->held.cto = cto;
+	track->held.key = key;
+}
+
+static void
+hls_set_config(struct hls_stream *hls, struct hls_track *track,
+	struct msg *msg, size_t off)
+{
+	// The init segment is made once; a publisher changing codec
+	// parameters midway would need a new one and a discontinuity
+	if (hls->started) {
+		return;
+	}
+	if (track->config) {
+		msg_unref(track->config);
+	}
+	msg_ref(msg);
+	track->config = msg;
+	track->info.config = (const uint8_t *)msg->data + off;
+	track->info.config_len = msg->len - off;
+}
+
+// Make the init segment from the configurations seen so far, once the
+// first sample a stream can start on comes in
+static int
+hls_start(struct hls_stream *hls, struct hls_track *track, int key,
+	uint32_t timestamp)
+{
+	struct fmp4_track info[2];
+	int n = 0;
+
+	if (hls->video.config) {
+		if (track != &hls->video || !key) {
+			return -1;
+		}
+		hls->video.info.id = ++n;
+		hls->video.info.video = 1;
+		fmp4_track_init(&hls->video.info);
+		info[n - 1] = hls->video.info;
+	} else if (track != &hls->audio || hls->audio.config == NULL) {
+		return -1;
+	}
+	if (hls->audio.config) {
+		hls->audio.info.id = ++n;
+		fmp4_track_init(&hls->audio.info);
+		info[n - 1] = hls->audio.info;
+	}
+
+	if ((hls->init = fmp4_init_segment(info, n)) == NULL) {
+		hls->video.info.id = hls->audio.info.id = 0;
+		return -1;
+	}
+	hls->lead = hls->video.info.id ? &hls->video : &hls->audio;
+	hls->part_start = hls->segment_start = timestamp;
+	hls->started = 1;
+	hls_wake(hls);
+	return 0;
+}
+
+void
+hls_msg(struct hls_stream *hls, struct msg *msg)
+{
+	const uint8_t *p = (const uint8_t *)msg->data;
+	struct hls_track *track;
+	int32_t cto = 0;
+	size_t off;
+	int key = 1;
+
+	switch (msg->type) {
+		case RTMP_TYPE_VIDEO_PACKET:
+			// Frame type and codec, AVC packet type, composition time
+			if (msg->len < 5 || (p[0] & 0x0f) != 7) {
+				return;
+			}
+			track = &hls->video;
+			if (p[1] == 0) {
+				hls_set_config(hls, track, msg, 5);
+				return;
+			}
+			if (p[1] != 1) {
+				return;
+			}
+			key = (p[0] >> 4) == 1;
+			// Signed 24 bits
+			cto = (int32_t)((uint32_t)p[2] << 24 | p[3] << 16 | p[4] << 8) >> 8;
+			off = 5;
+			break;
+
+		case RTMP_TYPE_AUDIO_PACKET:
+			// Sound format (10 for AAC) and AAC packet type
+			if (msg->len < 2 || (p[0] >> 4) != 10) {
+				return;
+			}
+			track = &hls->audio;
+			if (p[1] == 0) {
+				hls_set_config(hls, track, msg, 2);
+				return;
+			}
+			off = 2;
+			break;
+
+		default:
+			return;
+	}
+
+	if (!hls->started && hls_start(hls, track, key, msg->timestamp) != 0) {
+		return;
+	}
+	hls_add_sample(hls, track, msg, off, cto, key);
+}
+
+// Digits only, so "1.m4s" can't also be read as "+1.m4s" or "1e0.m4s"
+static int
+hls_parse_int(const char *s, size_t len, int64_t *v)
+{
+	*v = 0;
+	if (len == 0 || len > 15) {
+		return -1;
+	}
+	for (size_t i = 0; i < len; i++) {
+		if (s[i] < '0' || s[i] > '9') {
+			return -1;
+		}
+		*v = *v * 10 + s[i] - '0';
+	}
+	return 0;
+}
+
+static void
+hls_parse_query(struct hls_request *req, const char *q, size_t len)
+{
+	const char *end = q + len, *amp, *eq;
+
+	for (; q < end; q = amp + 1) {
+		if ((amp = memchr(q, '&', end - q)) == NULL) {
+			amp = end;
+		}
+		if ((eq = memchr(q, '=', amp - q)) == NULL) {
+			continue;
+		}
+		if (eq - q == 8 && memcmp(q, "_HLS_msn", 8) == 0) {
+			if (hls_parse_int(eq + 1, amp - eq - 1, &req->msn) != 0) {
+				req->resource = hls_bad;
+			}
+		} else if (eq - q == 9 && memcmp(q, "_HLS_part", 9) == 0) {
+			if (hls_parse_int(eq + 1, amp - eq - 1, &req->part) != 0) {
+				req->resource = hls_bad;
+			}
+		}
+	}
+	// A part means nothing without its segment
+	if (req->part >= 0 && req->msn < 0) {
+		req->resource = hls_bad;
+	}
+}
+
+struct hls_request *
+hls_parse(const char *path, size_t len, size_t *stream_len)
+{
+	const char *q = memchr(path, '?', len);
+	const char *name, *dot;
+	size_t end = q ? (size_t)(q - path) : len, name_len;
+	struct hls_request *req;
+	int64_t msn, part = -1;
+	int resource;
+
+	for (name = path + end; name > path && name[-1] != '/'; name--);
+	if (name - path < 2) {
+		return NULL;
+	}
+	name_len = path + end - name;
+
+	if (name_len == 10 && memcmp(name, "index.m3u8", 10) == 0) {
+		resource = hls_playlist;
+		msn = -1;
+	} else if (name_len == 8 && memcmp(name, "init.mp4", 8) == 0) {
+		resource = hls_init;
+		msn = -1;
+	} else if (name_len > 4 && memcmp(name + name_len - 4, ".m4s", 4) == 0) {
+		name_len -= 4;
+		dot = memchr(name, '.', name_len);
+		resource = dot ? hls_part : hls_segment;
+		if (hls_parse_int(name, dot ? (size_t)(dot - name) : name_len, &msn) != 0 ||
+			(dot && hls_parse_int(dot + 1, name + name_len - dot - 1, &part) != 0)) {
+			return NULL;
+		}
+	} else {
+		return NULL;
+	}
+
+	if ((req = calloc(1, sizeof(struct hls_request))) == NULL) {
+		return NULL;
+	}
+	req->resource = resource;
+	req->msn = msn;
+	req->part = part;
+	if (q && resource == hls_playlist) {
+		hls_parse_query(req, q + 1, len - end - 1);
+	}
+	*stream_len = name - 1 - path;
+	return req;
+}
+
+void
+hls_request_free(struct hls_request *req)
+{
+	if (req->stream) {
+		hls_unlink(req);
+	}
+	free(req);
+}
+
+int
+hls_serve(struct hls_stream *hls, struct conn_client *client)
+{
+	struct hls_request *req = client->proto_data;
+	struct timeval tv = { 1, 0 };
+	int status;
+
+	req->client = client;
+	if (hls == NULL) {
+		hls_send_status(client, 404);
+		conn_http_done(client);
+		return 0;
+	}
+	if ((status = hls_check(hls, req)) != 0) {
+		hls_answer(hls, req, status);
+		return 0;
+	}
+
+	req->stream = hls;
+	req->since = hls_now_ms(hls);
+	req->prev = NULL;
+	req->next = hls->waiters;
+	if (req->next) {
+		req->next->prev = req;
+	} else {
+		evtimer_add(hls->timer, &tv);
+	}
+	hls->waiters = req;
+	return 0;
+}
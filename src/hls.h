@@ -0,0 +1,46 @@
+#ifndef __TELEGENIC_HLS_H__
+#define __TELEGENIC_HLS_H__
+
+#include "conn.h"
+#include "msg.h"
+
+#include <event2/event.h>
+#include <stddef.h>
+
+// Low-latency HLS (-H). Each RTMP stream's H.264 and AAC is remuxed, once,
+// into CMAF partial segments of about half a second that are kept in
+// memory as messages, along with the last few full segments and a
+// playlist, and handed to any number of HTTP clients by reference:
+//
+//   GET /name/index.m3u8[?_HLS_msn=M[&_HLS_part=P]]
+//   GET /name/init.mp4
+//   GET /name/M.m4s       segment M
+//   GET /name/M.P.m4s     part P of segment M
+//
+// A request for the next part or segment, or a blocking playlist reload,
+// is held until the stream gets that far. Connections are kept alive
+// between requests.
+
+struct hls_stream;
+struct hls_request;
+
+struct hls_stream *hls_new(struct event_base *base);
+
+// Ends the stream for every request waiting on it
+void hls_free(struct hls_stream *hls);
+
+// Feed the stream one of its producer's messages
+void hls_msg(struct hls_stream *hls, struct msg *msg);
+
+// The request for path if it names an HLS resource, with *stream_len set
+// to the length of the stream's own path; otherwise NULL.
+struct hls_request *hls_parse(const char *path, size_t len, size_t *stream_len);
+
+void hls_request_free(struct hls_request *req);
+
+// Answer the request in client->proto_data from hls (NULL if there is no
+// such stream), now or once the stream has what it asks for. Returns -1
+// if the client should be dropped.
+int hls_serve(struct hls_stream *hls, struct conn_client *client);
+
+#endif
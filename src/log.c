@@ -0,0 +1,232 @@
+#include "log.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_RING_SIZE (256 * 1024)
+#define LOG_MAX_LINE 1024
+#define LOG_MAX_THREADS 256
+#define LOG_BATCH_SIZE (64 * 1024)
+#define LOG_BURST 20
+
+int log_level = LOG_INFO;
+const char *log_debug_path;
+
+// Each thread formats its messages into its own single-producer ring; the
+// log thread is the only consumer of all of them, so neither side ever
+// takes a lock.
+struct log_ring {
+	size_t head __attribute__((aligned(64)));
+	unsigned long dropped;
+	size_t tail __attribute__((aligned(64)));
+	char buf[LOG_RING_SIZE];
+};
+
+static struct log_ring *rings[LOG_MAX_THREADS];
+static int nrings;
+static __thread struct log_ring *ring;
+
+static pthread_t log_thread;
+static int running;
+static int stopping;
+
+static struct log_ring *
+log_ring()
+{
+	int id;
+
+	if (ring != NULL) {
+		return ring;
+	}
+
+	id = __atomic_fetch_add(&nrings, 1, __ATOMIC_ACQ_REL);
+	if (id >= LOG_MAX_THREADS || (ring = calloc(1, sizeof(struct log_ring))) == NULL) {
+		return NULL;
+	}
+	__atomic_store_n(&rings[id], ring, __ATOMIC_RELEASE);
+	return ring;
+}
+
+static void
+log_push(const char *line, size_t len)
+{
+	struct log_ring *r;
+	size_t head, tail, off, n;
+
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE) || (r = log_ring()) == NULL) {
+		fwrite(line, 1, len, stderr);
+		return;
+	}
+
+	head = r->head;
+	tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	if (LOG_RING_SIZE - (head - tail) < len) {
+		// Never block the caller on a slow stderr
+		__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	off = head & (LOG_RING_SIZE - 1);
+	n = LOG_RING_SIZE - off < len ? LOG_RING_SIZE - off : len;
+	memcpy(r->buf + off, line, n);
+	memcpy(r->buf, line + n, len - n);
+	__atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+}
+
+// Allow LOG_BURST messages per call site per second and fold the rest
+// into a count reported with the next message that gets through.
+static int
+log_ratelimit(struct log_site *site, unsigned int *suppressed)
+{
+	struct timespec ts;
+	unsigned long window;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	window = ts.tv_sec;
+
+	*suppressed = 0;
+	if (__atomic_load_n(&site->window, __ATOMIC_RELAXED) != window) {
+		__atomic_store_n(&site->window, window, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+		*suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+	}
+
+	if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) > LOG_BURST) {
+		__atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return 1;
+}
+
+void
+log_write(struct log_site *site, const char *fmt, ...)
+{
+	char line[LOG_MAX_LINE];
+	unsigned int suppressed;
+	va_list ap;
+	int len;
+
+	if (!log_ratelimit(site, &suppressed)) {
+		return;
+	}
+
+	if (suppressed) {
+		len = snprintf(line, sizeof(line),
+			"[WARN] (log) %u similar messages suppressed\n", suppressed);
+		log_push(line, len);
+	}
+
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+
+	if (len < 0) {
+		return;
+	}
+	if (len >= sizeof(line)) {
+		len = sizeof(line) - 1;
+		line[len - 1] = '\n';
+	}
+	log_push(line, len);
+}
+
+int
+log_path_enabled(const char *path)
+{
+	return log_debug_path != NULL && path != NULL &&
+		strcmp(path, log_debug_path) == 0;
+}
+
+static size_t
+log_drain(char *batch)
+{
+	size_t total = 0;
+	int n = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+
+	for (int i = 0; i < n && i < LOG_MAX_THREADS; i++) {
+		struct log_ring *r = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+		size_t head, tail, len, off, part;
+		unsigned long dropped;
+
+		if (r == NULL) {
+			continue;
+		}
+
+		if (total + LOG_MAX_LINE > LOG_BATCH_SIZE) {
+			write(STDERR_FILENO, batch, total);
+			total = 0;
+		}
+		if ((dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED))) {
+			total += snprintf(batch + total, LOG_MAX_LINE,
+				"[WARN] (log) dropped %lu messages\n", dropped);
+		}
+
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		tail = r->tail;
+		while (head != tail) {
+			if (total + LOG_MAX_LINE > LOG_BATCH_SIZE) {
+				write(STDERR_FILENO, batch, total);
+				total = 0;
+			}
+			len = head - tail;
+			if (len > LOG_BATCH_SIZE - LOG_MAX_LINE - total) {
+				len = LOG_BATCH_SIZE - LOG_MAX_LINE - total;
+			}
+			off = tail & (LOG_RING_SIZE - 1);
+			part = LOG_RING_SIZE - off < len ? LOG_RING_SIZE - off : len;
+			memcpy(batch + total, r->buf + off, part);
+			memcpy(batch + total + part, r->buf, len - part);
+			total += len;
+			tail += len;
+			__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+		}
+	}
+
+	return total;
+}
+
+static void *
+log_run(void *arg)
+{
+	char *batch = malloc(LOG_BATCH_SIZE);
+	struct timespec idle = { 0, 10 * 1000 * 1000 };
+	size_t len;
+
+	for (;;) {
+		int stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+		if ((len = log_drain(batch)) > 0) {
+			write(STDERR_FILENO, batch, len);
+		} else if (stop) {
+			break;
+		} else {
+			nanosleep(&idle, NULL);
+		}
+	}
+
+	free(batch);
+	return NULL;
+}
+
+int
+log_start()
+{
+	if (pthread_create(&log_thread, NULL, log_run, NULL) != 0) {
+		return -1;
+	}
+	__atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void
+log_stop()
+{
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(log_thread, NULL);
+}
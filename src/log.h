@@ -5,14 +5,63 @@
 #include <errno.h>
 #include <string.h>
 
-#define log_debug(M, ...) fprintf(stderr, "[DEBUG] %s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+#define LOG_ERR   0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+
+// Levels above LOG_LEVEL are compiled out entirely; build with
+// -DLOG_LEVEL=LOG_INFO to drop every debug call site from the binary.
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_DEBUG
+#endif
+
+// Call site state for rate limiting repeated messages
+struct log_site {
+	unsigned long window;
+	unsigned int count;
+	unsigned int suppressed;
+};
+
+// Runtime level, and a single stream path for which debug messages are
+// logged regardless of it
+extern int log_level;
+extern const char *log_debug_path;
+
+void log_write(struct log_site *site, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+int log_path_enabled(const char *path);
+
+// Hand log output to a background thread; until then (and after
+// log_stop) messages are written synchronously.
+int log_start();
+
+void log_stop();
+
+#define log_enabled(level) ((level) <= LOG_LEVEL && (level) <= log_level)
+
+#define log_at(enabled, M, ...) do { \
+	if (enabled) { \
+		static struct log_site log_site_; \
+		log_write(&log_site_, M, ##__VA_ARGS__); \
+	} \
+} while (0)
+
+#define log_debug(M, ...) log_at(log_enabled(LOG_DEBUG), "[DEBUG] %s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+
+// Debug message about one stream, also logged when that stream is the
+// one selected with log_debug_path
+#define log_path_debug(path, M, ...) log_at(LOG_DEBUG <= LOG_LEVEL && \
+	(LOG_DEBUG <= log_level || log_path_enabled(path)), \
+	"[DEBUG] %s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
 
 #define clean_errno() (errno == 0 ? "None" : strerror(errno))
 
-#define log_err(M, ...) fprintf(stderr, "[ERROR] (%s:%d: errno: %s) " M "\n", __FILE__, __LINE__, clean_errno(), ##__VA_ARGS__)
+#define log_err(M, ...) log_at(log_enabled(LOG_ERR), "[ERROR] (%s:%d: errno: %s) " M "\n", __FILE__, __LINE__, clean_errno(), ##__VA_ARGS__)
 
-#define log_warn(M, ...) fprintf(stderr, "[WARN] (%s:%d: errno: %s) " M "\n", __FILE__, __LINE__, clean_errno(), ##__VA_ARGS__)
+#define log_warn(M, ...) log_at(log_enabled(LOG_WARN), "[WARN] (%s:%d: errno: %s) " M "\n", __FILE__, __LINE__, clean_errno(), ##__VA_ARGS__)
 
-#define log_info(M, ...) fprintf(stderr, "[INFO] (%s:%d) " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+#define log_info(M, ...) log_at(log_enabled(LOG_INFO), "[INFO] (%s:%d) " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
 
-#endif
\ No newline at end of file
+#endif
@@ -1,10 +1,15 @@
+#include "config.h"
 #include "conn.h"
 #include "log.h"
+#include "pool.h"
+#include "reactor.h"
+#include "record.h"
+#include "stats.h"
+#include "upgrade.h"
 
 #include <arpa/inet.h>
-#include <event2/buffer.h>
-#include <event2/bufferevent.h>
-#include <event2/listener.h>
+#include <event2/thread.h>
+#include <signal.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -12,38 +17,65 @@
 int
 main(int argc, char *argv[])
 {
-	// TODO: Make port configurable
-	int port = 1234;
+	if (config_parse_args(&config, argc, argv) != 0) {
+		return 1;
+	}
 
-	struct event_base *base;
-	struct evconnlistener *listener;
-	struct sockaddr_in sin;
+	// Before libevent allocates anything
+	if (pool_init(config.pool_hugepages) != 0) {
+		return 1;
+	}
 
-	conn_init();
+	if (log_start() != 0) {
+		log_err("Failed to start log thread");
+		return 1;
+	}
 
-	if ((base = event_base_new()) == NULL) {
-		log_err("Failed to open base event");
+	// Reactors hand connections to each other across threads
+	if (evthread_use_pthreads() != 0) {
+		log_err("Failed to enable libevent threading");
 		return 1;
 	}
 
-	memset(&sin, 0, sizeof(sin));
-	sin.sin_family = AF_INET;
-	sin.sin_addr.s_addr = htonl(0);
-	sin.sin_port = htons(port);
+	// A consumer going away mid-write is an error return, not a signal
+	signal(SIGPIPE, SIG_IGN);
+
+	if (conn_init() != 0 || record_start() != 0) {
+		return 1;
+	}
 
-	listener = evconnlistener_new_bind(base, conn_accept_cb, NULL,
-		LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE, -1,
-		(struct sockaddr*)&sin, sizeof(sin));
-	if (!listener) {
-		log_err("Couldn't create listener");
+	// Whatever is taken over replaces binding the listeners. Should that
+	// fail, the log is flushed so that the reason isn't lost.
+	if (upgrade_receive() != 0) {
+		log_stop();
 		return 1;
 	}
 
-	evconnlistener_set_error_cb(listener, conn_accept_error_cb);
+	for (int i = 0; i < config.nlisteners; i++) {
+		log_info("Listening on %s for %s clients", config.listeners[i].spec,
+			config_role_name(config.listeners[i].role));
+	}
+	log_info("Running %d reactors", config.reactors);
+	if (reactor_start(config.reactors) != 0) {
+		return 1;
+	}
+
+	if (config.stats_port && stats_start(reactor_get(0), config.stats_port) != 0) {
+		return 1;
+	}
+	// Last, as it lets go of anything taken over and not picked up yet
+	if (upgrade_start(reactor_get(0)) != 0) {
+		return 1;
+	}
 
-	event_base_dispatch(base);
+	reactor_wait();
+	upgrade_stop();
+	stats_stop();
+	record_stop();
+	reactor_terminate();
 
 	conn_terminate();
+	log_stop();
 
 	return 0;
 }
@@ -0,0 +1,109 @@
+#include "msg.h"
+#include "log.h"
+#include "pool.h"
+
+struct msg *
+msg_alloc(size_t len)
+{
+	struct msg *msg = pool_alloc(sizeof(struct msg) + MSG_HEADROOM + len + MSG_TAILROOM);
+	if (msg == NULL) {
+		log_err("Failed to allocate message of %zu bytes", len);
+		return NULL;
+	}
+	msg->refcnt = 1;
+	msg->type = 0;
+	msg->flags = 0;
+	msg->timestamp = 0;
+	msg->len = len;
+	msg->data = msg->buf + MSG_HEADROOM;
+	msg->forms = NULL;
+	return msg;
+}
+
+void
+msg_ref(struct msg *msg)
+{
+	__atomic_add_fetch(&msg->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void
+msg_unref(struct msg *msg)
+{
+	struct msg_form *form, *next;
+
+	if (__atomic_sub_fetch(&msg->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+		for (form = msg->forms; form; form = next) {
+			next = form->next;
+			pool_free(form);
+		}
+		pool_free(msg);
+	}
+}
+
+struct msg_form *
+msg_get_form(struct msg *msg, uint32_t key)
+{
+	struct msg_form *form;
+
+	for (form = __atomic_load_n(&msg->forms, __ATOMIC_ACQUIRE); form;
+		form = form->next) {
+		if (form->key == key) {
+			return form;
+		}
+	}
+	return NULL;
+}
+
+struct msg_form *
+msg_alloc_form(uint32_t key, size_t len)
+{
+	struct msg_form *form = pool_alloc(sizeof(struct msg_form) + len);
+	if (form == NULL) {
+		log_err("Failed to allocate %zu byte form of message", len);
+		return NULL;
+	}
+	form->key = key;
+	form->len = len;
+	return form;
+}
+
+void
+msg_add_form(struct msg *msg, struct msg_form *form)
+{
+	form->next = __atomic_load_n(&msg->forms, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&msg->forms, &form->next, form, 1,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void
+msg_cleanup_cb(const void *data, size_t len, void *extra)
+{
+	msg_unref(extra);
+}
+
+int
+msg_add_span(struct evbuffer *out, struct msg *msg, const char *start, size_t len)
+{
+	if (len == 0) {
+		return 0;
+	}
+
+	msg_ref(msg);
+	if (evbuffer_add_reference(out, start, len, msg_cleanup_cb, msg) != 0) {
+		msg_unref(msg);
+		return -1;
+	}
+	return 0;
+}
+
+int
+msg_add_range(struct evbuffer *out, struct msg *msg, size_t off, size_t len)
+{
+	return msg_add_span(out, msg, msg->data + off, len);
+}
+
+int
+msg_add(struct evbuffer *out, struct msg *msg)
+{
+	return msg_add_range(out, msg, 0, msg->len);
+}
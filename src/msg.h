@@ -0,0 +1,76 @@
+#ifndef __TELEGENIC_MSG_H__
+#define __TELEGENIC_MSG_H__
+
+#include <event2/buffer.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A consumer may start or resume decoding at this message
+#define MSG_KEYFRAME 0x01
+// Codec configuration or stream metadata that must never be dropped
+#define MSG_CONFIG   0x02
+
+// Room left around the payload so a container can frame it in place (an
+// FLV tag header and trailer, say) and hand out header, payload and
+// trailer as one reference
+#define MSG_HEADROOM 16
+#define MSG_TAILROOM 4
+
+struct msg_form;
+
+// A msg is one unit of ingested producer data: an RTMP message (type is
+// the RTMP message type) or an opaque slice of an HTTP stream (type 0). It
+// is filled exactly once and then handed to every consumer's output buffer
+// by reference, so the per-consumer cost of fan-out is a chain append
+// rather than a memcpy. The last reference to go away (normally the last
+// consumer's evbuffer draining the bytes to its socket) frees it.
+struct msg {
+	int refcnt;
+	uint8_t type;
+	uint8_t flags;
+	uint32_t timestamp;
+	size_t len;
+	char *data;
+	struct msg_form *forms;
+	char buf[];
+};
+
+// An egress format's serialisation of a msg (its RTMP chunks at some
+// chunk size, say), built by the first consumer that needs it and shared
+// by every other. Forms live as long as their msg. A msg fanned out on
+// several reactors (see fanout.h) may have its forms built on any of them,
+// so they are published with a compare-and-swap; two reactors building the
+// same form at once both attach theirs and the newer one is used.
+struct msg_form {
+	struct msg_form *next;
+	uint32_t key;
+	size_t len;
+	char data[];
+};
+
+struct msg *msg_alloc(size_t len);
+
+void msg_ref(struct msg *msg);
+
+void msg_unref(struct msg *msg);
+
+// Append a reference to len bytes of msg starting at off to out. The msg
+// holds an extra reference until out has released the bytes.
+int msg_add_range(struct evbuffer *out, struct msg *msg, size_t off, size_t len);
+
+int msg_add(struct evbuffer *out, struct msg *msg);
+
+struct msg_form *msg_get_form(struct msg *msg, uint32_t key);
+
+// A new form of len bytes for the caller to fill in and then attach with
+// msg_add_form
+struct msg_form *msg_alloc_form(uint32_t key, size_t len);
+
+void msg_add_form(struct msg *msg, struct msg_form *form);
+
+// Append a reference to len bytes at start, which must lie within msg's
+// buffer including its head- and tailroom.
+int msg_add_span(struct evbuffer *out, struct msg *msg, const char *start,
+	size_t len);
+
+#endif
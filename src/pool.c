@@ -0,0 +1,327 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include "pool.h"
+#include "log.h"
+
+#include <event2/event.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define POOL_ARENA_SIZE (2 * 1024 * 1024)
+#define POOL_MAX_SIZE (16 * 1024 * 1024)
+// Buffers start this far into an arena, after its header
+#define POOL_ARENA_HEADER 64
+#define POOL_MAX_THREADS 256
+
+struct pool_cache;
+
+// Every buffer lives in a 2 MiB aligned arena that starts with one of
+// these, so freeing needs nothing but the pointer. An arena for a class
+// over 1 MiB holds a single buffer and is as many 2 MiB as that takes.
+struct pool_arena {
+	struct pool_cache *owner;       // NULL for a large buffer's own mapping
+	size_t len;                     // of that mapping
+};
+
+struct pool_free_buf {
+	struct pool_free_buf *next;
+};
+
+// One class on one thread
+struct pool_cache {
+	int cls;
+	size_t size;
+	struct pool_free_buf *free;
+	// Not yet carved out of the newest arena
+	char *next;
+	char *end;
+
+	// Read by pool_get_stats from any thread
+	size_t buffers;
+	size_t arenas;
+	size_t huge_arenas;
+	uint64_t allocs;
+	uint64_t remote_frees;
+
+	// Buffers freed by other threads
+	struct pool_free_buf *remote __attribute__((aligned(64)));
+};
+
+static int hugepages;
+static uint64_t large_allocs;
+static struct pool_cache *all[POOL_MAX_THREADS * POOL_CLASSES];
+static int nall;
+static __thread struct pool_cache *local[POOL_CLASSES];
+
+// Steps of 16 bytes up to 128, then eight classes to a power of two up to
+// 1 KiB and four after that. libevent's own structures (536 bytes for a
+// bufferevent, 136 for an evbuffer) are all under 1 KiB and one of each
+// per connection, so that is where the classes are finest.
+static size_t
+pool_class_size(int cls)
+{
+	if (cls < 8) {
+		return (size_t)16 * (cls + 1);
+	}
+	cls -= 8;
+	if (cls < 24) {
+		return ((size_t)128 << cls / 8) + (cls % 8 + 1) * ((size_t)16 << cls / 8);
+	}
+	cls -= 24;
+	return ((size_t)1024 << cls / 4) + (cls % 4 + 1) * ((size_t)256 << cls / 4);
+}
+
+// The smallest class size holds
+static int
+pool_class(size_t size)
+{
+	int k;
+
+	if (size <= 128) {
+		return size > 0 ? (size - 1) / 16 : 0;
+	}
+	// 2^k < size <= 2^(k+1)
+	k = 63 - __builtin_clzl(size - 1);
+	if (k < 10) {
+		k -= 7;
+		return 8 + 8 * k + (size - ((size_t)128 << k) - 1) / ((size_t)16 << k);
+	}
+	k -= 10;
+	return 32 + 4 * k + (size - ((size_t)1024 << k) - 1) / ((size_t)256 << k);
+}
+
+// len bytes aligned to an arena, in huge pages if they are on and there
+// are any to be had
+static void *
+pool_map(size_t len, int *huge)
+{
+	static int warned;
+	char *p, *aligned;
+	size_t head, tail;
+
+	*huge = 0;
+	if (hugepages) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			*huge = 1;
+			return p;
+		}
+		if (!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED)) {
+			log_info("No huge pages reserved, asking for transparent ones");
+		}
+	}
+
+	// Map an arena's worth more to find an aligned start in, and give
+	// back what is either side of it
+	p = mmap(NULL, len + POOL_ARENA_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		log_err("Failed to map %zu bytes for the buffer pool", len);
+		return NULL;
+	}
+	aligned = (char *)(((uintptr_t)p + POOL_ARENA_SIZE - 1) &
+		~(uintptr_t)(POOL_ARENA_SIZE - 1));
+	head = aligned - p;
+	tail = POOL_ARENA_SIZE - head;
+	if (head > 0) {
+		munmap(p, head);
+	}
+	if (tail > 0) {
+		munmap(aligned + len, tail);
+	}
+	if (hugepages) {
+		madvise(aligned, len, MADV_HUGEPAGE);
+	}
+	return aligned;
+}
+
+static struct pool_cache *
+pool_local(int cls)
+{
+	struct pool_cache *cache;
+	int n;
+
+	if ((cache = local[cls]) != NULL) {
+		return cache;
+	}
+	if ((cache = calloc(1, sizeof(struct pool_cache))) == NULL) {
+		return NULL;
+	}
+	cache->cls = cls;
+	cache->size = pool_class_size(cls);
+	local[cls] = cache;
+
+	n = __atomic_fetch_add(&nall, 1, __ATOMIC_ACQ_REL);
+	if (n < POOL_MAX_THREADS * POOL_CLASSES) {
+		__atomic_store_n(&all[n], cache, __ATOMIC_RELEASE);
+	}
+	return cache;
+}
+
+static int
+pool_grow(struct pool_cache *cache)
+{
+	struct pool_arena *arena;
+	size_t len = (POOL_ARENA_HEADER + cache->size + POOL_ARENA_SIZE - 1) &
+		~(size_t)(POOL_ARENA_SIZE - 1);
+	int huge;
+
+	if ((arena = pool_map(len, &huge)) == NULL) {
+		return -1;
+	}
+	arena->owner = cache;
+	arena->len = len;
+	cache->next = (char *)arena + POOL_ARENA_HEADER;
+	cache->end = (char *)arena + len;
+	__atomic_add_fetch(&cache->arenas, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&cache->huge_arenas, huge, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static void *
+pool_alloc_large(size_t size)
+{
+	struct pool_arena *arena;
+	size_t len = (POOL_ARENA_HEADER + size + POOL_ARENA_SIZE - 1) &
+		~(size_t)(POOL_ARENA_SIZE - 1);
+	int huge;
+
+	if ((arena = pool_map(len, &huge)) == NULL) {
+		return NULL;
+	}
+	arena->owner = NULL;
+	arena->len = len;
+	__atomic_add_fetch(&large_allocs, 1, __ATOMIC_RELAXED);
+	return (char *)arena + POOL_ARENA_HEADER;
+}
+
+void *
+pool_alloc(size_t size)
+{
+	struct pool_cache *cache;
+	void *buf;
+
+	if (size > POOL_MAX_SIZE) {
+		return pool_alloc_large(size);
+	}
+	if ((cache = pool_local(pool_class(size))) == NULL) {
+		return NULL;
+	}
+
+	if (cache->free == NULL) {
+		// Take back everything other threads have freed
+		cache->free = __atomic_exchange_n(&cache->remote, NULL, __ATOMIC_ACQUIRE);
+	}
+	if (cache->free != NULL) {
+		buf = cache->free;
+		cache->free = cache->free->next;
+	} else {
+		if (cache->next + cache->size > cache->end && pool_grow(cache) != 0) {
+			return NULL;
+		}
+		buf = cache->next;
+		cache->next += cache->size;
+	}
+
+	__atomic_add_fetch(&cache->buffers, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&cache->allocs, 1, __ATOMIC_RELAXED);
+	return buf;
+}
+
+static struct pool_arena *
+pool_arena_of(void *ptr)
+{
+	return (struct pool_arena *)((uintptr_t)ptr & ~(uintptr_t)(POOL_ARENA_SIZE - 1));
+}
+
+void
+pool_free(void *ptr)
+{
+	struct pool_arena *arena;
+	struct pool_cache *cache;
+	struct pool_free_buf *buf = ptr;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	arena = pool_arena_of(ptr);
+	if ((cache = arena->owner) == NULL) {
+		munmap(arena, arena->len);
+		return;
+	}
+
+	__atomic_sub_fetch(&cache->buffers, 1, __ATOMIC_RELAXED);
+	if (local[cache->cls] == cache) {
+		buf->next = cache->free;
+		cache->free = buf;
+		return;
+	}
+
+	buf->next = __atomic_load_n(&cache->remote, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&cache->remote, &buf->next, buf, 1,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	__atomic_add_fetch(&cache->remote_frees, 1, __ATOMIC_RELAXED);
+}
+
+void *
+pool_realloc(void *ptr, size_t size)
+{
+	struct pool_arena *arena;
+	size_t usable;
+	void *fresh;
+
+	if (ptr == NULL) {
+		return pool_alloc(size);
+	}
+	if (size == 0) {
+		pool_free(ptr);
+		return NULL;
+	}
+
+	arena = pool_arena_of(ptr);
+	usable = arena->owner ? arena->owner->size : arena->len - POOL_ARENA_HEADER;
+	if (size <= usable) {
+		return ptr;
+	}
+	if ((fresh = pool_alloc(size)) == NULL) {
+		return NULL;
+	}
+	memcpy(fresh, ptr, usable);
+	pool_free(ptr);
+	return fresh;
+}
+
+int
+pool_init(int huge)
+{
+	hugepages = huge;
+	event_set_mem_functions(pool_alloc, pool_realloc, pool_free);
+	return 0;
+}
+
+void
+pool_get_stats(struct pool_stats *stats)
+{
+	int n = __atomic_load_n(&nall, __ATOMIC_ACQUIRE);
+
+	memset(stats, 0, sizeof(struct pool_stats));
+	for (int i = 0; i < POOL_CLASSES; i++) {
+		stats->class_size[i] = pool_class_size(i);
+	}
+	for (int i = 0; i < n && i < POOL_MAX_THREADS * POOL_CLASSES; i++) {
+		struct pool_cache *cache = __atomic_load_n(&all[i], __ATOMIC_ACQUIRE);
+		if (cache == NULL) {
+			continue;
+		}
+		stats->buffers[cache->cls] += __atomic_load_n(&cache->buffers, __ATOMIC_RELAXED);
+		stats->arenas += __atomic_load_n(&cache->arenas, __ATOMIC_RELAXED);
+		stats->huge_arenas += __atomic_load_n(&cache->huge_arenas, __ATOMIC_RELAXED);
+		stats->allocs += __atomic_load_n(&cache->allocs, __ATOMIC_RELAXED);
+		stats->remote_frees += __atomic_load_n(&cache->remote_frees, __ATOMIC_RELAXED);
+	}
+	stats->large_allocs = __atomic_load_n(&large_allocs, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,44 @@
+#ifndef __TELEGENIC_POOL_H__
+#define __TELEGENIC_POOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Size-classed allocator for media buffers: messages, their forms and,
+// once pool_init has run, everything libevent allocates (evbuffer chains
+// above all). Classes run from 16 bytes to 16 MiB, finest below 1 KiB
+// where libevent's per-connection structures fall, and cover the largest
+// message an RTMP client may send (-M). Each thread carves the buffers of
+// a class out of its own 2 MiB arenas, which can be backed by huge pages
+// (-B), so the media path allocates without a lock, a call into malloc or
+// a mapping. A buffer may be freed on any thread: frees from a thread
+// other than the owner go onto the owner's remote list, which it takes
+// back the next time it runs dry. Anything bigger than the largest class
+// gets a mapping of its own.
+
+#define POOL_CLASSES 88
+
+// Route libevent's allocations through the pool. Must run before anything
+// else touches libevent.
+int pool_init(int hugepages);
+
+void *pool_alloc(size_t size);
+
+void *pool_realloc(void *ptr, size_t size);
+
+void pool_free(void *ptr);
+
+struct pool_stats {
+	size_t class_size[POOL_CLASSES];
+	size_t buffers[POOL_CLASSES];   // in use
+	size_t arenas;
+	size_t huge_arenas;             // of those, backed by huge pages
+	uint64_t allocs;
+	uint64_t remote_frees;
+	uint64_t large_allocs;          // too big for any class
+};
+
+// Totals across every thread
+void pool_get_stats(struct pool_stats *stats);
+
+#endif
@@ -0,0 +1,329 @@
+#include "reactor.h"
+#include "config.h"
+#include "conn.h"
+#include "epoch.h"
+#include "log.h"
+#include "upgrade.h"
+#include "uring.h"
+
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define REACTOR_TICK_MS 100
+
+struct reactor_job {
+	void (*fn)(void *);
+	void *arg;
+	struct reactor_job *next;
+};
+
+const uint64_t reactor_delay_bounds[REACTOR_DELAY_BUCKETS - 1] = {
+	100, 1000, 10000, 100000, 1000000
+};
+
+static struct reactor *reactors;
+static int nreactors;
+
+static void
+reactor_job_cb(evutil_socket_t fd, short events, void *ctx)
+{
+	struct reactor *reactor = ctx;
+	struct reactor_job *job, *next;
+
+	pthread_mutex_lock(&reactor->job_lock);
+	job = reactor->job_head;
+	reactor->job_head = reactor->job_tail = NULL;
+	pthread_mutex_unlock(&reactor->job_lock);
+
+	while (job != NULL) {
+		next = job->next;
+		job->fn(job->arg);
+		free(job);
+		job = next;
+	}
+}
+
+static uint64_t
+reactor_now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// How long past its deadline the tick ran is how long the loop was stuck
+// in other callbacks
+static void
+reactor_tick_delay(struct reactor *reactor)
+{
+	struct reactor_stats *stats = &reactor->stats;
+	uint64_t now = reactor_now_us();
+	uint64_t delay = now > reactor->tick_due ? now - reactor->tick_due : 0;
+	int i;
+
+	for (i = 0; i < REACTOR_DELAY_BUCKETS - 1; i++) {
+		if (delay <= reactor_delay_bounds[i]) {
+			break;
+		}
+	}
+	stats->delay_hist[i]++;
+	stats->delay_sum += delay;
+	if (delay > stats->delay_max) {
+		stats->delay_max = delay;
+	}
+
+	// libevent schedules a persistent timer from its previous deadline
+	// unless that has already passed
+	reactor->tick_due += REACTOR_TICK_MS * 1000;
+	if (reactor->tick_due < now) {
+		reactor->tick_due = now + REACTOR_TICK_MS * 1000;
+	}
+}
+
+static void
+reactor_tick_cb(evutil_socket_t fd, short events, void *ctx)
+{
+	reactor_tick_delay(ctx);
+	epoch_poll();
+}
+
+static void *
+reactor_run(void *arg)
+{
+	struct reactor *reactor = arg;
+	struct timeval tv = { 0, REACTOR_TICK_MS * 1000 };
+
+	if (epoch_register() != 0) {
+		return NULL;
+	}
+
+	// Reclaim retired objects even when nothing new is being retired
+	reactor->epoch_ev = event_new(reactor->base, -1, EV_PERSIST,
+		reactor_tick_cb, reactor);
+	reactor->tick_due = reactor_now_us() + REACTOR_TICK_MS * 1000;
+	event_add(reactor->epoch_ev, &tv);
+
+	// The ring belongs to the thread that submits to it
+	if (config.uring && uring_init(reactor) != 0) {
+		log_err("Reactor %d falling back to libevent I/O", reactor->id);
+	}
+
+	log_debug("Reactor %d running", reactor->id);
+	while (!event_base_got_exit(reactor->base) &&
+		!event_base_got_break(reactor->base)) {
+		// Everything the last iteration's callbacks queued goes out at once
+		if (reactor->uring) {
+			uring_flush(reactor->uring);
+		}
+		if (event_base_loop(reactor->base, EVLOOP_ONCE) != 0) {
+			break;
+		}
+		reactor->stats.loops++;
+	}
+	uring_free(reactor);
+	return NULL;
+}
+
+// Bind one of the listeners, set up with its role's socket options so
+// that every connection it accepts starts out with them
+static evutil_socket_t
+reactor_bind(const struct config_listener *conf)
+{
+	evutil_socket_t fd;
+	int on = 1;
+
+	fd = socket(conf->addr.ss_family, SOCK_STREAM, 0);
+	if (fd < 0) {
+		log_err("Couldn't create socket for %s", conf->spec);
+		return -1;
+	}
+	if (evutil_make_socket_nonblocking(fd) != 0 ||
+		evutil_make_socket_closeonexec(fd) != 0 ||
+		evutil_make_listen_socket_reuseable(fd) != 0 ||
+		evutil_make_listen_socket_reuseable_port(fd) != 0 ||
+		// An IPv6 wildcard doesn't take the IPv4 addresses too, so the
+		// two can be listened on separately
+		(conf->addr.ss_family == AF_INET6 &&
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) != 0) ||
+		sockopt_apply_listener(fd, &config.sockopts[conf->role]) != 0 ||
+		bind(fd, (struct sockaddr *)&conf->addr, conf->addr_len) != 0) {
+		log_err("Couldn't bind %s", conf->spec);
+		evutil_closesocket(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int
+reactor_listen(struct reactor *reactor, struct reactor_listener *l,
+	const struct config_listener *conf)
+{
+	evutil_socket_t fd;
+	unsigned flags = LEV_OPT_CLOSE_ON_FREE;
+
+	l->reactor = reactor;
+	l->conf = conf;
+
+	// One taken over from the server this one replaces comes with whatever
+	// that had yet to accept. It is only enabled once the connections
+	// handed over with it have been picked up.
+	if ((fd = upgrade_listener(reactor->id, l - reactor->listeners)) >= 0) {
+		flags |= LEV_OPT_DISABLED;
+	} else if ((fd = reactor_bind(conf)) < 0) {
+		return -1;
+	}
+
+	l->evl = evconnlistener_new(reactor->base, conn_accept_cb, l,
+		flags, config.backlog, fd);
+	if (l->evl == NULL) {
+		log_err("Couldn't listen on %s", conf->spec);
+		evutil_closesocket(fd);
+		return -1;
+	}
+	evconnlistener_set_error_cb(l->evl, conn_accept_error_cb);
+	return 0;
+}
+
+static int
+reactor_init(struct reactor *reactor, int id)
+{
+	reactor->id = id;
+	reactor->job_head = reactor->job_tail = NULL;
+	reactor->producers = NULL;
+	reactor->clients = NULL;
+	pthread_mutex_init(&reactor->job_lock, NULL);
+
+	if ((reactor->base = event_base_new()) == NULL) {
+		log_err("Failed to open base event");
+		return -1;
+	}
+
+	reactor->job_ev = event_new(reactor->base, -1, 0, reactor_job_cb, reactor);
+	if (reactor->job_ev == NULL) {
+		log_err("Failed to create job event");
+		return -1;
+	}
+
+	for (int i = 0; i < config.nlisteners; i++) {
+		if (reactor_listen(reactor, &reactor->listeners[i],
+			&config.listeners[i]) != 0) {
+			return -1;
+		}
+		reactor->nlisteners++;
+	}
+	return 0;
+}
+
+int
+reactor_start(int n)
+{
+	int i;
+
+	// Each reactor's counters sit on cache lines of their own
+	if (posix_memalign((void **)&reactors, 64, n * sizeof(struct reactor)) != 0) {
+		return -1;
+	}
+	memset(reactors, 0, n * sizeof(struct reactor));
+	nreactors = n;
+
+	for (i = 0; i < n; i++) {
+		if (reactor_init(&reactors[i], i) != 0) {
+			return -1;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&reactors[i].thread, NULL, reactor_run,
+			&reactors[i]) != 0) {
+			log_err("Failed to start reactor thread %d", i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void
+reactor_wait()
+{
+	for (int i = 0; i < nreactors; i++) {
+		pthread_join(reactors[i].thread, NULL);
+	}
+}
+
+void
+reactor_stop()
+{
+	for (int i = 0; i < nreactors; i++) {
+		event_base_loopexit(reactors[i].base, NULL);
+	}
+}
+
+void
+reactor_terminate()
+{
+	for (int i = 0; i < nreactors; i++) {
+		for (int j = 0; j < reactors[i].nlisteners; j++) {
+			evconnlistener_free(reactors[i].listeners[j].evl);
+		}
+		if (reactors[i].job_ev) {
+			event_free(reactors[i].job_ev);
+		}
+		if (reactors[i].epoch_ev) {
+			event_free(reactors[i].epoch_ev);
+		}
+		if (reactors[i].base) {
+			event_base_free(reactors[i].base);
+		}
+		pthread_mutex_destroy(&reactors[i].job_lock);
+	}
+	free(reactors);
+	reactors = NULL;
+	nreactors = 0;
+}
+
+int
+reactor_count()
+{
+	return nreactors;
+}
+
+struct reactor *
+reactor_get(int id)
+{
+	return &reactors[id];
+}
+
+struct reactor *
+reactor_for_hash(uint64_t hash)
+{
+	// The registry buckets on the low bits, spread reactors on the high ones
+	return &reactors[(hash >> 32) % nreactors];
+}
+
+int
+reactor_post(struct reactor *reactor, void (*fn)(void *), void *arg)
+{
+	struct reactor_job *job = malloc(sizeof(struct reactor_job));
+	if (job == NULL) {
+		return -1;
+	}
+	job->fn = fn;
+	job->arg = arg;
+	job->next = NULL;
+
+	pthread_mutex_lock(&reactor->job_lock);
+	if (reactor->job_tail) {
+		reactor->job_tail->next = job;
+	} else {
+		reactor->job_head = job;
+	}
+	reactor->job_tail = job;
+	pthread_mutex_unlock(&reactor->job_lock);
+
+	event_active(reactor->job_ev, EV_READ, 0);
+	return 0;
+}
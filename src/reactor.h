@@ -0,0 +1,101 @@
+#ifndef __TELEGENIC_REACTOR_H__
+#define __TELEGENIC_REACTOR_H__
+
+#include "config.h"
+
+#include <event2/event.h>
+#include <event2/listener.h>
+#include <pthread.h>
+#include <stdint.h>
+
+// A reactor is one event_base driven by its own thread. Every reactor
+// listens on the same addresses through SO_REUSEPORT, and each stream is
+// owned by exactly one reactor so that its producer and all of its
+// consumers are serviced by the same thread.
+struct conn_client;
+struct reactor;
+struct reactor_job;
+struct producer;
+struct uring;
+
+// Bounds of the loop delay histogram buckets in microseconds; the last
+// bucket is unbounded.
+#define REACTOR_DELAY_BUCKETS 6
+extern const uint64_t reactor_delay_bounds[REACTOR_DELAY_BUCKETS - 1];
+
+// Counters owned by a reactor's thread. Nothing else writes them and they
+// are only read by a stats job running on that same thread, so counting is
+// a plain increment on a cache line no other core touches.
+struct reactor_stats {
+	uint64_t loops;
+	// How late the reactor's tick fired: time spent in callbacks that
+	// kept the loop from getting back to its timers
+	uint64_t delay_hist[REACTOR_DELAY_BUCKETS];
+	uint64_t delay_sum;
+	uint64_t delay_max;     // since the last scrape
+
+	uint64_t accepted;
+	uint64_t clients;
+	uint64_t handshake_failures;
+	uint64_t migrations;
+	uint64_t consumers_cut;
+	uint64_t dropped_bytes;
+	uint64_t uring_submits;
+};
+
+// A reactor's socket for one of the configured listeners
+struct reactor_listener {
+	struct reactor *reactor;
+	struct evconnlistener *evl;
+	const struct config_listener *conf;
+};
+
+struct reactor {
+	int id;
+	struct event_base *base;
+	struct reactor_listener listeners[CONFIG_MAX_LISTENERS];
+	int nlisteners;
+	struct event *epoch_ev;
+	pthread_t thread;
+
+	// Work handed over from other reactors
+	struct event *job_ev;
+	pthread_mutex_t job_lock;
+	struct reactor_job *job_head;
+	struct reactor_job *job_tail;
+
+	// Streams owned by this reactor
+	struct producer *producers;
+	// Every client on this reactor, so an upgrade can find them all
+	struct conn_client *clients;
+	// Stopped reading and accepting for an upgrade, see upgrade.h
+	int frozen;
+
+	// Does socket I/O in place of the bufferevents' own, see uring.h
+	struct uring *uring;
+
+	uint64_t tick_due;
+	struct reactor_stats stats __attribute__((aligned(64)));
+};
+
+// Start n reactors, each listening on every configured listener
+int reactor_start(int n);
+
+void reactor_wait();
+
+// Make every reactor's loop exit
+void reactor_stop();
+
+void reactor_terminate();
+
+int reactor_count();
+
+struct reactor *reactor_get(int id);
+
+// The reactor owning the stream whose path hashes to hash
+struct reactor *reactor_for_hash(uint64_t hash);
+
+// Run fn(arg) on the reactor's thread at its next loop iteration.
+int reactor_post(struct reactor *reactor, void (*fn)(void *), void *arg);
+
+#endif
@@ -0,0 +1,578 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "record.h"
+#include "config.h"
+#include "flv.h"
+#include "log.h"
+#include "rtmp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+// Messages a stream may have waiting for its I/O thread
+#define RECORD_QUEUE 4096
+// Bytes a stream may have waiting before its media is dropped
+#define RECORD_MAX_LAG (32 * 1024 * 1024)
+// Size of every write but a file's last, and the alignment O_DIRECT needs
+// of buffers, lengths and offsets
+#define RECORD_BATCH (256 * 1024)
+#define RECORD_ALIGN 4096
+// Longest a partly filled batch waits to be written
+#define RECORD_FLUSH_MS 1000
+// Wait before opening a new file after one failed
+#define RECORD_RETRY_MS 1000
+#define RECORD_IDLE_MS 10
+#define RECORD_MAX_NAME 1024
+
+struct record_slot {
+	struct msg *msg;
+	uint64_t queued_ms;
+};
+
+// A recorder is written to by the reactor owning its stream and read by
+// one I/O thread. Each side keeps to its own cache line; the ring is the
+// only thing passed between them.
+struct recorder {
+	size_t head __attribute__((aligned(64)));
+	uint64_t queued_bytes;
+	uint64_t dropped_msgs;
+	uint8_t flv;
+	uint8_t saw_video;
+	uint8_t skipping;       // dropping media until the next keyframe
+	int closed;
+
+	size_t tail __attribute__((aligned(64)));
+	uint64_t written_bytes;
+	uint64_t taken_bytes;   // of the messages taken off the ring
+	// When the oldest message not yet on disk was queued, 0 if none
+	uint64_t pending_since;
+	struct recorder *next;
+	char *name;             // stream path made safe for a file name
+	int fd;
+	uint8_t direct;
+	uint8_t has_video;
+	uint64_t retry_at;
+	uint64_t file_since;
+	uint64_t file_bytes;
+	uint32_t ts_base;       // FLV timestamps start from 0 in every file
+	// Latest metadata, audio and video configuration, repeated at the
+	// start of every file so each plays on its own
+	struct msg *config[3];
+	char *buf;
+	size_t len;
+	size_t extra;           // bytes at the front of buf that are not media
+	uint64_t batch_since;
+	uint64_t batch_newest;  // when the newest message in buf was queued
+
+	struct record_slot ring[RECORD_QUEUE];
+};
+
+struct record_worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct recorder *incoming;      // opened since the thread last looked
+	struct recorder *recorders;
+};
+
+static struct record_worker *workers;
+static int nworkers;
+static int next_worker;
+static int stopping;
+
+static uint64_t
+record_now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static size_t
+record_size(struct recorder *rec, struct msg *msg)
+{
+	return rec->flv ? FLV_TAG_HEADER_SIZE + msg->len + FLV_TAG_TRAILER_SIZE
+		: msg->len;
+}
+
+static int
+record_is_keyframe(struct msg *msg)
+{
+	return msg->type == RTMP_TYPE_VIDEO_PACKET && (msg->flags & MSG_KEYFRAME);
+}
+
+static int
+record_config_slot(struct msg *msg)
+{
+	switch (msg->type) {
+		case RTMP_TYPE_AUDIO_PACKET: return 1;
+		case RTMP_TYPE_VIDEO_PACKET: return 2;
+		default: return 0;
+	}
+}
+
+// Runs on the I/O thread from here on
+
+// Let the reactor know how much of what it queued is done with: taken off
+// the ring and no longer in the batch
+static void
+record_publish(struct recorder *rec)
+{
+	__atomic_store_n(&rec->written_bytes, rec->taken_bytes - (rec->len - rec->extra),
+		__ATOMIC_RELAXED);
+	if (rec->len == rec->extra) {
+		__atomic_store_n(&rec->pending_since, 0, __ATOMIC_RELAXED);
+	} else if (rec->pending_since == 0) {
+		// Either the batch was empty or a write left some of the newest
+		// message over
+		__atomic_store_n(&rec->pending_since, rec->batch_newest, __ATOMIC_RELAXED);
+	}
+}
+
+static void
+record_fail(struct recorder *rec)
+{
+	log_err("Failed to write recording of %s", rec->name);
+	close(rec->fd);
+	rec->fd = -1;
+	rec->retry_at = record_now_ms() + RECORD_RETRY_MS;
+	// What was buffered is lost, but no longer waiting either
+	rec->len = rec->extra = 0;
+}
+
+// Write out the batch. Until a file's last write, an O_DIRECT file is
+// only given whole blocks and keeps the rest for next time.
+static void
+record_flush(struct recorder *rec, int last)
+{
+	size_t n = rec->len;
+	ssize_t ret;
+
+	if (rec->direct && !last) {
+		n &= ~(size_t)(RECORD_ALIGN - 1);
+	} else if (rec->direct && (n & (RECORD_ALIGN - 1))) {
+		fcntl(rec->fd, F_SETFL, fcntl(rec->fd, F_GETFL) & ~O_DIRECT);
+		rec->direct = 0;
+	}
+	rec->batch_since = record_now_ms();
+	if (n == 0) {
+		return;
+	}
+
+	for (size_t off = 0; off < n; off += ret) {
+		if ((ret = write(rec->fd, rec->buf + off, n - off)) < 0) {
+			if (errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			record_fail(rec);
+			return;
+		}
+	}
+
+	rec->extra -= n < rec->extra ? n : rec->extra;
+	rec->len -= n;
+	memmove(rec->buf, rec->buf + n, rec->len);
+	__atomic_store_n(&rec->pending_since, 0, __ATOMIC_RELAXED);
+}
+
+static void
+record_append(struct recorder *rec, const void *data, size_t len)
+{
+	size_t n;
+
+	if (rec->len == 0) {
+		rec->batch_since = record_now_ms();
+	}
+	rec->file_bytes += len;
+	while (len > 0 && rec->fd >= 0) {
+		n = RECORD_BATCH - rec->len < len ? RECORD_BATCH - rec->len : len;
+		memcpy(rec->buf + rec->len, data, n);
+		rec->len += n;
+		data = (const char *)data + n;
+		len -= n;
+		if (rec->len == RECORD_BATCH) {
+			record_flush(rec, 0);
+		}
+	}
+}
+
+static void
+record_append_tag(struct recorder *rec, struct msg *msg)
+{
+	uint8_t header[FLV_TAG_HEADER_SIZE];
+	int32_t delta = msg->timestamp - rec->ts_base;
+	uint32_t ts = delta > 0 && !(msg->flags & MSG_CONFIG) ? delta : 0;
+
+	// The header flv_tag_prepare framed the message with, rebased
+	memcpy(header, msg->data - FLV_TAG_HEADER_SIZE, FLV_TAG_HEADER_SIZE);
+	header[4] = ts >> 16;
+	header[5] = ts >> 8;
+	header[6] = ts;
+	header[7] = ts >> 24;
+	record_append(rec, header, sizeof(header));
+	record_append(rec, msg->data, msg->len + FLV_TAG_TRAILER_SIZE);
+}
+
+static void
+record_finish_file(struct recorder *rec)
+{
+	if (rec->fd < 0) {
+		return;
+	}
+	record_flush(rec, 1);
+	if (rec->fd >= 0) {
+		close(rec->fd);
+		rec->fd = -1;
+	}
+}
+
+static void
+record_new_file(struct recorder *rec, struct msg *first)
+{
+	char file[RECORD_MAX_NAME];
+	struct timespec ts;
+	struct tm tm;
+	int flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	gmtime_r(&ts.tv_sec, &tm);
+	snprintf(file, sizeof(file), "%s/%s-%04d%02d%02d-%02d%02d%02d.%03ld.%s",
+		config.record_dir, rec->name, tm.tm_year + 1900, tm.tm_mon + 1,
+		tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, ts.tv_nsec / 1000000,
+		rec->flv ? "flv" : "raw");
+
+	rec->direct = config.record_direct && O_DIRECT;
+	rec->fd = open(file, flags | (rec->direct ? O_DIRECT : 0), 0644);
+	if (rec->fd < 0 && rec->direct && errno == EINVAL) {
+		// Not every filesystem takes O_DIRECT (tmpfs, for one)
+		rec->direct = 0;
+		rec->fd = open(file, flags, 0644);
+	}
+	if (rec->fd < 0) {
+		log_err("Failed to open recording %s", file);
+		rec->retry_at = record_now_ms() + RECORD_RETRY_MS;
+		return;
+	}
+	log_info("Recording %s to %s", rec->name, file);
+
+	rec->file_since = record_now_ms();
+	rec->file_bytes = 0;
+	if (!rec->flv) {
+		return;
+	}
+	rec->ts_base = first->timestamp;
+	record_append(rec, flv_file_header, FLV_FILE_HEADER_SIZE);
+	for (int i = 0; i < 3; i++) {
+		if (rec->config[i] && rec->config[i] != first) {
+			record_append_tag(rec, rec->config[i]);
+		}
+	}
+	rec->extra = rec->len;
+}
+
+static int
+record_rotate_due(struct recorder *rec, uint64_t now)
+{
+	return (config.record_rotate_secs &&
+			now - rec->file_since >= (uint64_t)config.record_rotate_secs * 1000) ||
+		(config.record_rotate_bytes && rec->file_bytes >= config.record_rotate_bytes);
+}
+
+static void
+record_write_msg(struct recorder *rec, struct msg *msg, uint64_t queued_ms)
+{
+	uint64_t now = record_now_ms();
+	// A video stream's files start on a keyframe
+	int boundary = !rec->flv || record_is_keyframe(msg) ||
+		(!rec->has_video && msg->type != RTMP_TYPE_VIDEO_PACKET);
+
+	if (rec->flv && msg->type == RTMP_TYPE_VIDEO_PACKET) {
+		rec->has_video = 1;
+	}
+	if (rec->flv && (msg->flags & MSG_CONFIG)) {
+		int i = record_config_slot(msg);
+		if (rec->config[i]) {
+			msg_unref(rec->config[i]);
+		}
+		msg_ref(msg);
+		rec->config[i] = msg;
+	}
+
+	if (rec->fd >= 0 && boundary && record_rotate_due(rec, now)) {
+		record_finish_file(rec);
+	}
+	if (rec->fd < 0 && boundary && now >= rec->retry_at) {
+		record_new_file(rec, msg);
+	}
+	rec->taken_bytes += record_size(rec, msg);
+	if (rec->fd < 0) {
+		return;
+	}
+
+	rec->batch_newest = queued_ms;
+	if (rec->flv) {
+		record_append_tag(rec, msg);
+	} else {
+		record_append(rec, msg->data, msg->len);
+	}
+}
+
+// Write out whatever the reactor has queued. Returns whether there was
+// anything.
+static int
+record_drain(struct recorder *rec)
+{
+	size_t head = __atomic_load_n(&rec->head, __ATOMIC_ACQUIRE);
+	size_t tail = rec->tail;
+	struct record_slot *slot;
+	int busy = head != tail;
+
+	for (; tail != head; tail++) {
+		slot = &rec->ring[tail & (RECORD_QUEUE - 1)];
+		record_write_msg(rec, slot->msg, slot->queued_ms);
+		msg_unref(slot->msg);
+		__atomic_store_n(&rec->tail, tail + 1, __ATOMIC_RELEASE);
+		record_publish(rec);
+	}
+
+	if (rec->len > 0 && record_now_ms() - rec->batch_since >= RECORD_FLUSH_MS) {
+		record_flush(rec, 0);
+		record_publish(rec);
+	}
+	return busy;
+}
+
+static void
+record_free(struct recorder *rec)
+{
+	record_finish_file(rec);
+	for (int i = 0; i < 3; i++) {
+		if (rec->config[i]) {
+			msg_unref(rec->config[i]);
+		}
+	}
+	free(rec->buf);
+	free(rec->name);
+	free(rec);
+}
+
+static void *
+record_run(void *arg)
+{
+	struct record_worker *worker = arg;
+	struct timespec idle = { 0, RECORD_IDLE_MS * 1000 * 1000 };
+	struct recorder *rec, **prev, *last;
+	int busy, closed, stop;
+
+	for (;;) {
+		stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+
+		pthread_mutex_lock(&worker->lock);
+		if ((rec = worker->incoming)) {
+			for (last = rec; last->next; last = last->next);
+			last->next = worker->recorders;
+			worker->recorders = rec;
+			worker->incoming = NULL;
+		}
+		pthread_mutex_unlock(&worker->lock);
+
+		busy = 0;
+		for (prev = &worker->recorders; (rec = *prev); ) {
+			// Read first: everything queued before the close is drained
+			closed = __atomic_load_n(&rec->closed, __ATOMIC_ACQUIRE);
+			busy |= record_drain(rec);
+			if (closed || stop) {
+				*prev = rec->next;
+				record_free(rec);
+			} else {
+				prev = &rec->next;
+			}
+		}
+
+		if (stop) {
+			break;
+		}
+		if (!busy) {
+			nanosleep(&idle, NULL);
+		}
+	}
+	return NULL;
+}
+
+int
+record_start()
+{
+	if (config.record_dir == NULL) {
+		return 0;
+	}
+	if (access(config.record_dir, W_OK) != 0) {
+		log_err("Can't write recordings to %s", config.record_dir);
+		return -1;
+	}
+
+	if ((workers = calloc(config.record_threads, sizeof(struct record_worker))) == NULL) {
+		return -1;
+	}
+	for (int i = 0; i < config.record_threads; i++) {
+		pthread_mutex_init(&workers[i].lock, NULL);
+		if (pthread_create(&workers[i].thread, NULL, record_run, &workers[i]) != 0) {
+			log_err("Failed to start recording thread %d", i);
+			return -1;
+		}
+		nworkers++;
+	}
+	log_info("Recording to %s with %d threads", config.record_dir, nworkers);
+	return 0;
+}
+
+void
+record_stop()
+{
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	for (int i = 0; i < nworkers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		pthread_mutex_destroy(&workers[i].lock);
+	}
+	free(workers);
+	workers = NULL;
+	nworkers = 0;
+}
+
+struct recorder *
+record_open(const char *path, int flv)
+{
+	struct record_worker *worker;
+	struct recorder *rec;
+	char *p;
+
+	if (nworkers == 0) {
+		return NULL;
+	}
+	if (posix_memalign((void **)&rec, 64, sizeof(struct recorder)) != 0) {
+		return NULL;
+	}
+	memset(rec, 0, sizeof(struct recorder));
+	rec->flv = flv;
+	rec->fd = -1;
+	if (posix_memalign((void **)&rec->buf, RECORD_ALIGN, RECORD_BATCH) != 0) {
+		free(rec);
+		return NULL;
+	}
+
+	// One file name component, whatever the client asked for
+	while (*path == '/') {
+		path++;
+	}
+	if ((rec->name = strdup(*path ? path : "stream")) == NULL) {
+		free(rec->buf);
+		free(rec);
+		return NULL;
+	}
+	for (p = rec->name; *p; p++) {
+		if (!(*p >= 'a' && *p <= 'z') && !(*p >= 'A' && *p <= 'Z') &&
+			!(*p >= '0' && *p <= '9') && *p != '-' && *p != '.') {
+			*p = '_';
+		}
+	}
+
+	// Each recorder stays on one thread, so its writes stay in order
+	worker = &workers[__atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED) % nworkers];
+	pthread_mutex_lock(&worker->lock);
+	rec->next = worker->incoming;
+	worker->incoming = rec;
+	pthread_mutex_unlock(&worker->lock);
+	return rec;
+}
+
+// Whether rec, skipping since it fell behind, can take up again with msg
+static int
+record_resumes(struct recorder *rec, struct msg *msg)
+{
+	return !rec->flv || record_is_keyframe(msg) ||
+		(!rec->saw_video && msg->type != RTMP_TYPE_VIDEO_PACKET);
+}
+
+void
+record_msg(struct recorder *rec, struct msg *msg)
+{
+	size_t head = rec->head;
+	size_t tail = __atomic_load_n(&rec->tail, __ATOMIC_ACQUIRE);
+	size_t size;
+	struct record_slot *slot;
+
+	if (rec->flv && !flv_is_tag(msg)) {
+		return;
+	}
+	if (msg->type == RTMP_TYPE_VIDEO_PACKET) {
+		rec->saw_video = 1;
+	}
+	size = record_size(rec, msg);
+
+	// Configuration is small and every file needs it, so it is only
+	// dropped when the ring itself is full
+	if (head - tail == RECORD_QUEUE ||
+		(!(msg->flags & MSG_CONFIG) &&
+			((rec->skipping && !record_resumes(rec, msg)) ||
+			record_lag_bytes(rec) + size > RECORD_MAX_LAG))) {
+		if (!rec->skipping) {
+			log_info("Recording of %s fell behind, dropping media", rec->name);
+		}
+		rec->dropped_msgs++;
+		rec->skipping = 1;
+		return;
+	}
+	rec->skipping = 0;
+
+	msg_ref(msg);
+	slot = &rec->ring[head & (RECORD_QUEUE - 1)];
+	slot->msg = msg;
+	slot->queued_ms = record_now_ms();
+	rec->queued_bytes += size;
+	__atomic_store_n(&rec->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void
+record_close(struct recorder *rec)
+{
+	__atomic_store_n(&rec->closed, 1, __ATOMIC_RELEASE);
+}
+
+uint64_t
+record_lag_bytes(struct recorder *rec)
+{
+	return rec->queued_bytes - __atomic_load_n(&rec->written_bytes, __ATOMIC_RELAXED);
+}
+
+double
+record_lag_seconds(struct recorder *rec)
+{
+	uint64_t since = __atomic_load_n(&rec->pending_since, __ATOMIC_RELAXED);
+	size_t tail = __atomic_load_n(&rec->tail, __ATOMIC_ACQUIRE);
+	uint64_t now = record_now_ms();
+
+	// Only this thread writes the slots, so the oldest one is safe to read
+	// even as the I/O thread moves past it
+	if (tail != rec->head &&
+		(since == 0 || rec->ring[tail & (RECORD_QUEUE - 1)].queued_ms < since)) {
+		since = rec->ring[tail & (RECORD_QUEUE - 1)].queued_ms;
+	}
+	return since && now > since ? (now - since) / 1000.0 : 0;
+}
+
+uint64_t
+record_dropped_msgs(struct recorder *rec)
+{
+	return rec->dropped_msgs;
+}
@@ -0,0 +1,42 @@
+#ifndef __TELEGENIC_RECORD_H__
+#define __TELEGENIC_RECORD_H__
+
+#include "msg.h"
+
+#include <stdint.h>
+
+// Stream recording (-r). The reactor owning a stream hands each message
+// to the stream's recorder through a single-producer ring, taking a
+// reference and nothing else: no locks, no syscalls. A pool of I/O threads
+// polls the rings, copies the messages into large aligned buffers and
+// writes those out, so a slow disk costs the stream its recording rather
+// than its consumers their latency. RTMP streams are written as FLV files,
+// opaque ones as they came in, to a new file every -R seconds or bytes.
+
+struct recorder;
+
+int record_start();
+
+// Flush and close every recording
+void record_stop();
+
+// Start recording a stream. Returns NULL when recording is off or fails.
+struct recorder *record_open(const char *path, int flv);
+
+// Queue msg for the recording. Never blocks; if the recorder has fallen
+// too far behind, the message (and, for FLV, everything up to the next
+// keyframe) is dropped instead.
+void record_msg(struct recorder *rec, struct msg *msg);
+
+// Finish the recording once everything queued is written. rec must not be
+// used again.
+void record_close(struct recorder *rec);
+
+// How far the recording trails the stream: bytes queued and not yet
+// written, and how long the oldest of them has been waiting
+uint64_t record_lag_bytes(struct recorder *rec);
+double record_lag_seconds(struct recorder *rec);
+
+uint64_t record_dropped_msgs(struct recorder *rec);
+
+#endif
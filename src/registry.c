@@ -0,0 +1,146 @@
+#include "registry.h"
+#include "epoch.h"
+#include "log.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REGISTRY_BUCKETS 16384
+#define REGISTRY_SHARDS 64
+
+struct registry_node {
+	struct registry_node *next;
+	uint64_t hash;
+	void *value;
+	size_t len;
+	char path[];
+};
+
+// Writers lock the shard owning a bucket; buckets are striped across shards
+// so a join storm on one stream never contends with another stream's
+// publish.
+struct registry_shard {
+	pthread_mutex_t lock;
+} __attribute__((aligned(64)));
+
+static struct registry_node *buckets[REGISTRY_BUCKETS];
+static struct registry_shard shards[REGISTRY_SHARDS];
+
+void
+registry_init()
+{
+	for (int i = 0; i < REGISTRY_SHARDS; i++) {
+		pthread_mutex_init(&shards[i].lock, NULL);
+	}
+}
+
+void
+registry_terminate()
+{
+	struct registry_node *node, *next;
+
+	for (int i = 0; i < REGISTRY_BUCKETS; i++) {
+		for (node = buckets[i]; node != NULL; node = next) {
+			next = node->next;
+			free(node);
+		}
+		buckets[i] = NULL;
+	}
+	for (int i = 0; i < REGISTRY_SHARDS; i++) {
+		pthread_mutex_destroy(&shards[i].lock);
+	}
+}
+
+uint64_t
+registry_hash(const char *path, size_t len)
+{
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)path[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static inline int
+registry_match(struct registry_node *node, const char *path, size_t len,
+	uint64_t hash)
+{
+	return node->hash == hash && node->len == len &&
+		memcmp(node->path, path, len) == 0;
+}
+
+void *
+registry_get(const char *path, size_t len, uint64_t hash)
+{
+	struct registry_node *node;
+
+	node = __atomic_load_n(&buckets[hash & (REGISTRY_BUCKETS - 1)],
+		__ATOMIC_ACQUIRE);
+	while (node != NULL) {
+		if (registry_match(node, path, len, hash)) {
+			return __atomic_load_n(&node->value, __ATOMIC_ACQUIRE);
+		}
+		node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	}
+	return NULL;
+}
+
+int
+registry_add(const char *path, size_t len, uint64_t hash, void *value)
+{
+	size_t b = hash & (REGISTRY_BUCKETS - 1);
+	struct registry_shard *shard = &shards[b & (REGISTRY_SHARDS - 1)];
+	struct registry_node *node;
+
+	pthread_mutex_lock(&shard->lock);
+	for (node = buckets[b]; node != NULL; node = node->next) {
+		if (registry_match(node, path, len, hash)) {
+			pthread_mutex_unlock(&shard->lock);
+			return -1;
+		}
+	}
+
+	if ((node = malloc(sizeof(struct registry_node) + len + 1)) == NULL) {
+		pthread_mutex_unlock(&shard->lock);
+		log_err("Failed to allocate registry node");
+		return -1;
+	}
+	node->hash = hash;
+	node->value = value;
+	node->len = len;
+	memcpy(node->path, path, len);
+	node->path[len] = '\0';
+	node->next = buckets[b];
+
+	// Readers see either the old head or a fully built node
+	__atomic_store_n(&buckets[b], node, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&shard->lock);
+
+	return 0;
+}
+
+int
+registry_del(const char *path, size_t len, uint64_t hash, void *value)
+{
+	size_t b = hash & (REGISTRY_BUCKETS - 1);
+	struct registry_shard *shard = &shards[b & (REGISTRY_SHARDS - 1)];
+	struct registry_node *node, **prev;
+
+	pthread_mutex_lock(&shard->lock);
+	for (prev = &buckets[b]; (node = *prev) != NULL; prev = &node->next) {
+		if (registry_match(node, path, len, hash) && node->value == value) {
+			__atomic_store_n(prev, node->next, __ATOMIC_RELEASE);
+			pthread_mutex_unlock(&shard->lock);
+
+			// Lookups in flight may still be walking through the node
+			epoch_retire(node, free);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	return -1;
+}
@@ -0,0 +1,30 @@
+#ifndef __TELEGENIC_REGISTRY_H__
+#define __TELEGENIC_REGISTRY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The stream registry maps a path to its producer. Lookups are lock-free
+// and may run on any reactor concurrently with inserts and removals, as
+// long as they happen between epoch_enter and epoch_exit; the returned
+// value stays valid until epoch_exit. Writers serialize per shard only.
+//
+// Callers hash the path once with registry_hash and pass the hash around
+// with it, so neither placement nor lookups rehash the string.
+
+void registry_init();
+
+void registry_terminate();
+
+uint64_t registry_hash(const char *path, size_t len);
+
+void *registry_get(const char *path, size_t len, uint64_t hash);
+
+// Returns 0 if value was added, -1 if path is already registered.
+int registry_add(const char *path, size_t len, uint64_t hash, void *value);
+
+// Removes path if it still maps to value. The registry keeps its own copy
+// of the path, so the caller's string may go away as soon as this returns.
+int registry_del(const char *path, size_t len, uint64_t hash, void *value);
+
+#endif
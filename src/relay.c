@@ -0,0 +1,228 @@
+#include "relay.h"
+#include "config.h"
+#include "conn.h"
+#include "fanout.h"
+#include "flv.h"
+#include "log.h"
+#include "pool.h"
+#include "reactor.h"
+#include "rtmp.h"
+#include "upgrade.h"
+
+#include <event2/event.h>
+#include <stdlib.h>
+#include <string.h>
+
+// What the origin sends next
+enum relay_state {
+	relay_status,
+	relay_headers,
+	relay_flv_header,
+	relay_tags
+};
+
+struct relay {
+	struct conn_client *client;
+	struct event *idle_ev;
+	enum relay_state state;
+};
+
+// Read one step of the response. Returns 1 to go on, 0 to wait for more
+// and -1 if it isn't a stream.
+static int
+relay_read(struct relay *relay, struct evbuffer *in)
+{
+	struct msg *msg;
+	char *line;
+	int ret = 1;
+
+	switch (relay->state) {
+		case relay_status:
+		case relay_headers:
+			line = evbuffer_readln(in, NULL, EVBUFFER_EOL_CRLF);
+			if (line == NULL) {
+				return evbuffer_get_length(in) > CONN_MAX_HEADER_SIZE ? -1 : 0;
+			}
+			if (relay->state == relay_status) {
+				// The origin answers with 200 or not at all
+				if (strlen(line) < 12 || strncmp(line, "HTTP/1.", 7) != 0 ||
+					strncmp(line + 8, " 200", 4) != 0) {
+					log_info("Origin refused %s: %s", relay->client->path, line);
+					ret = -1;
+				}
+				relay->state = relay_headers;
+			} else if (line[0] == '\0') {
+				relay->state = relay_flv_header;
+			}
+			pool_free(line);
+			return ret;
+
+		case relay_flv_header:
+			if ((ret = flv_read_header(in)) == 1) {
+				relay->state = relay_tags;
+			}
+			return ret;
+
+		case relay_tags:
+			if ((ret = flv_read_tag(in, &msg)) == 1) {
+				rtmp_classify(msg);
+				conn_fanout(relay->client->producer, msg);
+				msg_unref(msg);
+			}
+			return ret;
+	}
+	return -1;
+}
+
+static void
+relay_read_cb(struct bufferevent *bev, void *ctx)
+{
+	struct relay *relay = ctx;
+	struct evbuffer *in = bufferevent_get_input(bev);
+	int ret;
+
+	while ((ret = relay_read(relay, in)) > 0);
+	if (ret < 0) {
+		log_info("Failed to read %s from the origin", relay->client->path);
+		conn_close_client(relay->client);
+	}
+}
+
+static void
+relay_event_cb(struct bufferevent *bev, short events, void *ctx)
+{
+	struct relay *relay = ctx;
+
+	if (events & BEV_EVENT_CONNECTED) {
+		sockopt_apply(bufferevent_getfd(bev), &config.sockopts[role_ingest]);
+		return;
+	}
+	if (events & BEV_EVENT_ERROR) {
+		log_err("Failed to pull %s from %s", relay->client->path, config.origin_spec);
+	}
+	if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+		log_path_debug(relay->client->path, "Origin closed %s", relay->client->path);
+		conn_close_client(relay->client);
+	}
+}
+
+static void
+relay_idle_cb(evutil_socket_t fd, short events, void *ctx)
+{
+	struct relay *relay = ctx;
+	struct producer *producer = relay->client->producer;
+
+	// Consumers handed to other reactors come and go without telling this
+	// one, so look again later while any are left
+	if (producer->fanout && fanout_consumers(producer->fanout) > 0) {
+		relay_consumers(relay, 0);
+		return;
+	}
+	log_path_debug(relay->client->path, "Releasing %s, no consumers for %d ms",
+		relay->client->path, config.relay_grace_ms);
+	conn_close_client(relay->client);
+}
+
+static struct relay *
+relay_alloc(struct conn_client *client)
+{
+	struct relay *relay = calloc(1, sizeof(struct relay));
+
+	if (relay == NULL) {
+		return NULL;
+	}
+	relay->client = client;
+	relay->state = relay_status;
+	relay->idle_ev = evtimer_new(client->reactor->base, relay_idle_cb, relay);
+	if (relay->idle_ev == NULL) {
+		free(relay);
+		return NULL;
+	}
+	return relay;
+}
+
+// Read the stream off the client's bufferevent, and count the grace period
+// down from now, in case the consumer that wanted the stream doesn't make it
+static void
+relay_start(struct relay *relay)
+{
+	struct bufferevent *bev = relay->client->bev;
+
+	bufferevent_setcb(bev, relay_read_cb, NULL, relay_event_cb, relay);
+	bufferevent_setwatermark(bev, EV_READ, config.sockopts[role_ingest].read_low,
+		config.sockopts[role_ingest].read_high);
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+	relay_consumers(relay, 0);
+}
+
+struct relay *
+relay_new(struct conn_client *client)
+{
+	struct relay *relay = relay_alloc(client);
+
+	if (relay == NULL) {
+		return NULL;
+	}
+
+	// The client frees the bufferevent, closing the connection
+	client->bev = bufferevent_socket_new(client->reactor->base, -1,
+		BEV_OPT_CLOSE_ON_FREE);
+	if (client->bev == NULL) {
+		relay_free(relay);
+		return NULL;
+	}
+	if (bufferevent_socket_connect(client->bev, (struct sockaddr *)&config.origin,
+		config.origin_len) != 0) {
+		log_err("Failed to connect to origin %s", config.origin_spec);
+		relay_free(relay);
+		return NULL;
+	}
+	evbuffer_add_printf(bufferevent_get_output(client->bev),
+		"GET %s.flv HTTP/1.0\r\n\r\n", client->path);
+	relay_start(relay);
+	log_path_debug(client->path, "Pulling %s from %s", client->path,
+		config.origin_spec);
+	return relay;
+}
+
+void
+relay_save(struct relay *relay, struct evbuffer *buf)
+{
+	upgrade_put_u8(buf, relay->state);
+}
+
+struct relay *
+relay_restore(struct conn_client *client, struct evbuffer *buf)
+{
+	struct relay *relay;
+	uint8_t state;
+
+	if (upgrade_get_u8(buf, &state) != 0 || state > relay_tags ||
+		(relay = relay_alloc(client)) == NULL) {
+		return NULL;
+	}
+	relay->state = state;
+	relay_start(relay);
+	return relay;
+}
+
+void
+relay_free(struct relay *relay)
+{
+	event_free(relay->idle_ev);
+	free(relay);
+}
+
+void
+relay_consumers(struct relay *relay, size_t n)
+{
+	struct timeval tv = {
+		config.relay_grace_ms / 1000, config.relay_grace_ms % 1000 * 1000
+	};
+
+	if (n > 0) {
+		evtimer_del(relay->idle_ev);
+	} else if (!evtimer_pending(relay->idle_ev, NULL)) {
+		evtimer_add(relay->idle_ev, &tv);
+	}
+}
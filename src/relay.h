@@ -0,0 +1,33 @@
+#ifndef __TELEGENIC_RELAY_H__
+#define __TELEGENIC_RELAY_H__
+
+#include <event2/buffer.h>
+#include <stddef.h>
+
+// Edge pull relay (-e). A consumer for a stream nobody publishes here has
+// the stream pulled from the origin, another telegenic, with a GET of its
+// FLV. However many consumers join, the edge keeps one connection to the
+// origin per stream. The connection is the stream's producer, so the
+// stream is fanned out, cached, recorded and segmented like one published
+// over RTMP. Once the last consumer has gone the stream is kept for the
+// grace period (-E) in case another turns up, then the connection is
+// closed and the stream ends.
+
+struct conn_client;
+struct relay;
+
+// Connect client, a producer whose stream has just been added, to the
+// origin and start pulling its stream
+struct relay *relay_new(struct conn_client *client);
+
+void relay_free(struct relay *relay);
+
+// Write what conn_save needs to carry on pulling the stream, and carry on
+// with it on client's connection, which conn_restore has set up
+void relay_save(struct relay *relay, struct evbuffer *buf);
+struct relay *relay_restore(struct conn_client *client, struct evbuffer *buf);
+
+// The stream now has n consumers
+void relay_consumers(struct relay *relay, size_t n);
+
+#endif
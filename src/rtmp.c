@@ -1,201 +1,947 @@
 #include "rtmp.h"
+#include "amf.h"
+#include "config.h"
+#include "dvr.h"
+#include "flv.h"
 #include "log.h"
+#include "slab.h"
+#include "upgrade.h"
 
+#include <arpa/inet.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define RTMP_SIG_SIZE 1536
 #define RTMP_MAX_HEADER_SIZE 18
+#define RTMP_DEFAULT_CHUNK_SIZE 128
+#define RTMP_MAX_CHUNK_STREAMS 64
+
+#define RTMP_TYPE_ABORT             0x02
+#define RTMP_TYPE_WINDOW_ACK_SIZE   0x05
+#define RTMP_TYPE_PEER_BANDWIDTH    0x06
+
+// Chunk streams and message stream the server speaks on
+#define RTMP_CSID_CONTROL 2
+#define RTMP_CSID_COMMAND 3
+#define RTMP_CSID_AUDIO   4
+#define RTMP_CSID_DATA    5
+#define RTMP_CSID_VIDEO   6
+#define RTMP_STREAM_ID 1
+
+#define RTMP_EVENT_STREAM_BEGIN 0
+
+// Messages spanning more chunks than this are chunked once into a shared
+// copy rather than queued as a slice per chunk
+#define RTMP_MAX_SLICES 8
+
+#define RTMP_WINDOW_SIZE 2500000
+#define RTMP_MAX_NAME 256
+// Room for any command the server sends, a status naming the longest path
+// included
+#define RTMP_MAX_COMMAND 1024
+
+void
+rtmp_classify(struct msg *msg)
+{
+	static const char on_metadata[] = "\x02\x00\x0aonMetaData";
+	const uint8_t *p = (const uint8_t *)msg->data;
 
-#define RTMP_TYPE_CHUNK_SIZE        0x01
-#define RTMP_TYPE_PING              0x04
-#define RTMP_TYPE_SERVER_BANDWIDTH  0x05
-#define RTMP_TYPE_CLIENT_BANDWIDTH  0x06
-#define RTMP_TYPE_AUDIO_PACKET      0x08
-#define RTMP_TYPE_VIDEO_PACKET      0x09
-#define RTMP_TYPE_AMF3_COMMAND      0x11
-#define RTMP_TYPE_INVOKE_COMMAND    0x12
-#define RTMP_TYPE_AMF0_COMMAND      0x14
+	msg->flags = 0;
+	switch (msg->type) {
+		case RTMP_TYPE_VIDEO_PACKET:
+			if (msg->len < 1) {
+				break;
+			}
+			// Frame type 1 is a keyframe; an AVC sequence header also
+			// carries frame type 1 but is configuration, not a picture
+			if ((p[0] >> 4) == 1) {
+				msg->flags |= MSG_KEYFRAME;
+			}
+			if ((p[0] & 0x0F) == 7 && msg->len > 1 && p[1] == 0) {
+				msg->flags = MSG_CONFIG;
+			}
+			break;
+
+		case RTMP_TYPE_AUDIO_PACKET:
+			// AAC sequence header
+			if (msg->len > 1 && (p[0] >> 4) == 10 && p[1] == 0) {
+				msg->flags |= MSG_CONFIG;
+			}
+			break;
+
+		case RTMP_TYPE_INVOKE_COMMAND:
+			// onMetaData describes the whole stream; onCuePoint, onTextData
+			// and the like are just part of it
+			if (msg->len > sizeof(on_metadata) - 1 &&
+				memcmp(p, on_metadata, sizeof(on_metadata) - 1) == 0) {
+				msg->flags |= MSG_CONFIG;
+			}
+			break;
+	}
+}
 
 enum rtmp_state {
 	rtmp_state_uninitialized,
-	rtmp_state_handshake_version,
 	rtmp_state_handshake_ack,
 	rtmp_state_handshake_done
 };
 
+// Header state of one chunk stream. Chunks with fmt 1-3 headers only carry
+// what changed since the previous chunk on the same chunk stream id, so the
+// rest is remembered here, along with the message being reassembled.
+struct rtmp_chunk_stream {
+	uint32_t csid;
+	uint32_t timestamp;
+	uint32_t delta;
+	uint32_t len;
+	uint32_t stream_id;
+	uint8_t type;
+	uint8_t extended;
+
+	struct msg *msg;
+	uint32_t received;
+};
+
 struct rtmp_info {
 	enum rtmp_state state;
 	int client_version;
 	uint32_t max_chunk_size;
+	uint32_t out_chunk_size;
+	char *app;
+
+	// Players get timestamps counted from the first media they are sent
+	uint32_t ts_base;
+	uint8_t ts_started;
+
+	struct rtmp_chunk_stream *streams;
+	int nstreams;
+	struct rtmp_chunk_stream *last;
+	// Bytes allocated for the messages being reassembled, at most
+	// config.rtmp_max_partial
+	size_t partial;
 };
 
-void dump(char *str, size_t len)
-{
-    char *p = str;
-    for (int n = 0; n < len; ++n)
-    {
-        printf("%2.2x ", *p);
-        ++p;
-    }
-
-    printf("\n");
-}
+static struct slab_class info_slab = SLAB_CLASS(struct rtmp_info);
 
 static struct rtmp_info *
 rtmp_alloc_info()
 {
-	struct rtmp_info *info = malloc(sizeof(struct rtmp_info));
-	info->max_chunk_size = 128;
+	struct rtmp_info *info = slab_calloc(&info_slab);
+	if (info == NULL) {
+		return NULL;
+	}
+	info->state = rtmp_state_uninitialized;
+	info->max_chunk_size = RTMP_DEFAULT_CHUNK_SIZE;
+	info->out_chunk_size = RTMP_DEFAULT_CHUNK_SIZE;
 	return info;
 }
 
-static uint8_t
-rtmp_read_uint8(char *ptr) {
-	return ptr[0];
+void
+rtmp_free_info(void *proto_data)
+{
+	struct rtmp_info *info = proto_data;
+
+	for (int i = 0; i < info->nstreams; i++) {
+		if (info->streams[i].msg) {
+			msg_unref(info->streams[i].msg);
+		}
+	}
+	free(info->streams);
+	free(info->app);
+	slab_free(info);
 }
 
 static uint32_t
-rtmp_read_uint24(char *ptr) {
-	return (ptr[0] << 16) + (ptr[1] << 8) + ptr[2];
+rtmp_read_uint24(const uint8_t *ptr) {
+	return (ptr[0] << 16) | (ptr[1] << 8) | ptr[2];
 }
 
 static uint32_t
-rtmp_read_uint32(char *ptr) {
-	uint32_t v = (ptr[0] << 16) + (ptr[1] << 8) + ptr[2];
-	return ntohl(v);
+rtmp_read_uint32(const uint8_t *ptr) {
+	return ((uint32_t)ptr[0] << 24) | (ptr[1] << 16) | (ptr[2] << 8) | ptr[3];
+}
+
+static uint32_t
+rtmp_read_uint32_le(const uint8_t *ptr) {
+	return ((uint32_t)ptr[3] << 24) | (ptr[2] << 16) | (ptr[1] << 8) | ptr[0];
+}
+
+// Clients use a handful of chunk streams, so a short array searched
+// linearly (with the last hit checked first) beats anything cleverer.
+static struct rtmp_chunk_stream *
+rtmp_chunk_stream(struct rtmp_info *info, uint32_t csid)
+{
+	struct rtmp_chunk_stream *cs;
+
+	if (info->last && info->last->csid == csid) {
+		return info->last;
+	}
+
+	for (int i = 0; i < info->nstreams; i++) {
+		if (info->streams[i].csid == csid) {
+			return info->last = &info->streams[i];
+		}
+	}
+
+	if (info->nstreams == RTMP_MAX_CHUNK_STREAMS) {
+		log_info("Too many chunk streams");
+		return NULL;
+	}
+
+	cs = realloc(info->streams,
+		(info->nstreams + 1) * sizeof(struct rtmp_chunk_stream));
+	if (cs == NULL) {
+		return NULL;
+	}
+	info->streams = cs;
+	cs = &info->streams[info->nstreams++];
+	memset(cs, 0, sizeof(struct rtmp_chunk_stream));
+	cs->csid = csid;
+	return info->last = cs;
 }
 
 static void
-rtmp_chunk(struct rtmp_info *info, void *data, size_t len)
+rtmp_write_uint24(uint8_t *ptr, uint32_t v)
 {
-	char *ptr = data;
-	uint8_t fmt, msg_type_id;
-	uint16_t csid;
-	uint32_t timestamp, msg_len, msg_stream_id;
-	char buf[info->max_chunk_size];
-	bzero(buf, info->max_chunk_size);
+	ptr[0] = v >> 16;
+	ptr[1] = v >> 8;
+	ptr[2] = v;
+}
 
-	dump(data, len);
+static void
+rtmp_write_uint32(uint8_t *ptr, uint32_t v)
+{
+	ptr[0] = v >> 24;
+	rtmp_write_uint24(ptr + 1, v);
+}
 
-	memcpy(&fmt, data, 1);
-	csid = fmt & 0x3F;
-	fmt = (fmt & 0xC0) >> 6;
-	switch (csid) {
-		case 0:
-			memcpy(&csid, &data[1], 1);
-			csid = csid + 64;
-			ptr += 2;
-			break;
+// The message stream id is the one little-endian field
+static void
+rtmp_write_uint32_le(uint8_t *ptr, uint32_t v)
+{
+	ptr[0] = v;
+	ptr[1] = v >> 8;
+	ptr[2] = v >> 16;
+	ptr[3] = v >> 24;
+}
 
+// Queue a message to the client: a type 0 chunk header, then a type 3 one
+// before every further out_chunk_size bytes of payload
+static void
+rtmp_send_at(struct conn_client *client, struct rtmp_info *info, uint8_t csid,
+	uint8_t type, uint32_t stream_id, uint32_t ts, const void *data, size_t len)
+{
+	struct evbuffer *out = bufferevent_get_output(client->bev);
+	uint8_t hdr[16], ext[5];
+	size_t hdrlen = 12, off = 0, n;
+	int extended = ts >= 0xFFFFFF;
+
+	hdr[0] = csid;
+	rtmp_write_uint24(hdr + 1, extended ? 0xFFFFFF : ts);
+	rtmp_write_uint24(hdr + 4, len);
+	hdr[7] = type;
+	rtmp_write_uint32_le(hdr + 8, stream_id);
+	if (extended) {
+		rtmp_write_uint32(hdr + 12, ts);
+		hdrlen += 4;
+	}
+	evbuffer_add(out, hdr, hdrlen);
+
+	ext[0] = 0xC0 | csid;
+	rtmp_write_uint32(ext + 1, ts);
+	do {
+		if (off > 0) {
+			evbuffer_add(out, ext, extended ? 5 : 1);
+		}
+		n = len - off < info->out_chunk_size ? len - off : info->out_chunk_size;
+		evbuffer_add(out, (const char *)data + off, n);
+		off += n;
+	} while (off < len);
+}
+
+static void
+rtmp_send(struct conn_client *client, struct rtmp_info *info, uint8_t csid,
+	uint8_t type, uint32_t stream_id, const void *data, size_t len)
+{
+	rtmp_send_at(client, info, csid, type, stream_id, 0, data, len);
+}
+
+static void
+rtmp_send_control(struct conn_client *client, struct rtmp_info *info,
+	uint8_t type, uint32_t value, int extra)
+{
+	uint8_t buf[5];
+
+	rtmp_write_uint32(buf, value);
+	buf[4] = extra;
+	rtmp_send(client, info, RTMP_CSID_CONTROL, type, 0, buf,
+		type == RTMP_TYPE_PEER_BANDWIDTH ? 5 : 4);
+}
+
+// Send an AMF0 command written by w
+static void
+rtmp_send_command(struct conn_client *client, struct rtmp_info *info,
+	uint32_t stream_id, struct amf_writer *w)
+{
+	if (w->overflow) {
+		log_err("RTMP command too big to send");
+		return;
+	}
+	rtmp_send(client, info, RTMP_CSID_COMMAND, RTMP_TYPE_AMF0_COMMAND, stream_id,
+		w->start, amf_writer_len(w));
+}
+
+static void
+rtmp_send_status(struct conn_client *client, struct rtmp_info *info,
+	const char *level, const char *code, const char *description)
+{
+	uint8_t buf[RTMP_MAX_COMMAND];
+	struct amf_writer w;
+
+	amf_writer_init(&w, buf, sizeof(buf));
+	amf_write_string(&w, "onStatus");
+	amf_write_number(&w, 0);
+	amf_write_null(&w);
+	amf_write_object_start(&w);
+	amf_write_prop_string(&w, "level", level);
+	amf_write_prop_string(&w, "code", code);
+	amf_write_prop_string(&w, "description", description);
+	amf_write_object_end(&w);
+	rtmp_send_command(client, info, RTMP_STREAM_ID, &w);
+}
+
+static int
+rtmp_connect(struct conn_client *client, struct rtmp_info *info,
+	struct amf_reader *r, double txn)
+{
+	uint8_t buf[RTMP_MAX_COMMAND];
+	struct amf_writer w;
+	const char *app;
+	size_t len;
+
+	if (amf_read_object_string(r, "app", &app, &len) != 0 || app == NULL ||
+		len == 0 || len > RTMP_MAX_NAME) {
+		log_info("RTMP connect without an app");
+		return -1;
+	}
+	free(info->app);
+	// Some encoders put a trailing slash on the app
+	while (len > 0 && app[len - 1] == '/') {
+		len--;
+	}
+	if ((info->app = strndup(app, len)) == NULL) {
+		return -1;
+	}
+	log_debug("RTMP connect to app %s", info->app);
+
+	rtmp_send_control(client, info, RTMP_TYPE_WINDOW_ACK_SIZE, RTMP_WINDOW_SIZE, 0);
+	rtmp_send_control(client, info, RTMP_TYPE_PEER_BANDWIDTH, RTMP_WINDOW_SIZE, 2);
+	rtmp_send_control(client, info, RTMP_TYPE_CHUNK_SIZE, config.rtmp_chunk_size, 0);
+	info->out_chunk_size = config.rtmp_chunk_size;
+
+	amf_writer_init(&w, buf, sizeof(buf));
+	amf_write_string(&w, "_result");
+	amf_write_number(&w, txn);
+	amf_write_object_start(&w);
+	amf_write_prop_string(&w, "fmsVer", "FMS/3,0,1,123");
+	amf_write_prop_number(&w, "capabilities", 31);
+	amf_write_object_end(&w);
+	amf_write_object_start(&w);
+	amf_write_prop_string(&w, "level", "status");
+	amf_write_prop_string(&w, "code", "NetConnection.Connect.Success");
+	amf_write_prop_string(&w, "description", "Connection succeeded.");
+	amf_write_prop_number(&w, "objectEncoding", 0);
+	amf_write_object_end(&w);
+	rtmp_send_command(client, info, 0, &w);
+	return 0;
+}
+
+static int
+rtmp_create_stream(struct conn_client *client, struct rtmp_info *info, double txn)
+{
+	uint8_t buf[64];
+	struct amf_writer w;
+
+	// One message stream per connection is all anyone uses
+	amf_writer_init(&w, buf, sizeof(buf));
+	amf_write_string(&w, "_result");
+	amf_write_number(&w, txn);
+	amf_write_null(&w);
+	amf_write_number(&w, RTMP_STREAM_ID);
+	rtmp_send_command(client, info, 0, &w);
+	return 0;
+}
+
+// Join the stream /app/name. Returns 1 if the client was handed to another
+// reactor.
+static int
+rtmp_join(struct conn_client *client, struct rtmp_info *info,
+	struct amf_reader *r, int is_producer)
+{
+	char path[2 * RTMP_MAX_NAME + 3];
+	const char *name, *query;
+	size_t len;
+	double start;
+	int n;
+
+	if (info->app == NULL || amf_skip(r) != 0 ||
+		amf_read_string(r, &name, &len) != 0 || len == 0 || len > RTMP_MAX_NAME) {
+		return -1;
+	}
+	// Stream keys and tokens ride along as a query string
+	if ((query = memchr(name, '?', len)) != NULL) {
+		if (!is_producer) {
+			client->timeshift = dvr_query_shift(query + 1, name + len - query - 1);
+		}
+		len = query - name;
+	}
+	// A play start of X seconds, rather than -2 (live or recorded) or -1
+	// (live), asks for the stream as it was X seconds ago
+	if (!is_producer && amf_read_number(r, &start) == 0 && start > 0 &&
+		start < 1000000) {
+		client->timeshift = start;
+	}
+	n = snprintf(path, sizeof(path), "/%s/%.*s", info->app, (int)len, name);
+
+	switch (conn_join(client, path, n, is_producer)) {
 		case 1:
-			memcpy(&csid, &data[1], 2);
-			csid = csid + 64;
-			ptr += 3;
-			break;
+			return 0;
+		case 0:
+			return 1;
+		default:
+			rtmp_send_status(client, info, "error",
+				is_producer ? "NetStream.Publish.BadName" : "NetStream.Play.StreamNotFound",
+				path);
+			return -1;
+	}
+}
 
+// Returns -1 to drop the client and 1 if it now belongs to another reactor
+static int
+rtmp_handle_command(struct conn_client *client, struct rtmp_info *info,
+	struct msg *msg)
+{
+	struct amf_reader r;
+	const char *name;
+	size_t len;
+	double txn;
+
+	amf_reader_init(&r, msg->data, msg->len);
+	// AMF3 commands are AMF0 behind a format byte, switching to AMF3 for
+	// any value behind the avmplus marker
+	if (msg->type == RTMP_TYPE_AMF3_COMMAND && msg->len > 0) {
+		r.p++;
+	}
+	if (amf_read_string(&r, &name, &len) != 0 || amf_read_number(&r, &txn) != 0) {
+		log_info("Malformed RTMP command");
+		return -1;
+	}
+	log_debug("RTMP command %.*s", (int)len, name);
+
+#define RTMP_IS(s) (len == sizeof(s) - 1 && memcmp(name, s, len) == 0)
+	if (RTMP_IS("connect")) {
+		return rtmp_connect(client, info, &r, txn);
+	}
+	if (RTMP_IS("createStream")) {
+		return rtmp_create_stream(client, info, txn);
+	}
+	if (RTMP_IS("publish")) {
+		return rtmp_join(client, info, &r, 1);
+	}
+	if (RTMP_IS("play")) {
+		return rtmp_join(client, info, &r, 0);
+	}
+#undef RTMP_IS
+
+	// releaseStream, FCPublish and the like need no answer
+	return 0;
+}
+
+void
+rtmp_attached(struct conn_client *client)
+{
+	struct rtmp_info *info = client->proto_data;
+
+	uint8_t begin[6] = { 0, RTMP_EVENT_STREAM_BEGIN };
+
+	if (client->is_producer) {
+		rtmp_send_status(client, info, "status", "NetStream.Publish.Start",
+			client->path);
+		return;
+	}
+
+	rtmp_write_uint32(begin + 2, RTMP_STREAM_ID);
+	rtmp_send(client, info, RTMP_CSID_CONTROL, RTMP_TYPE_PING, 0, begin, sizeof(begin));
+	rtmp_send_status(client, info, "status", "NetStream.Play.Reset", client->path);
+	rtmp_send_status(client, info, "status", "NetStream.Play.Start", client->path);
+}
+
+static uint8_t
+rtmp_msg_csid(const struct msg *msg)
+{
+	switch (msg->type) {
+		case RTMP_TYPE_AUDIO_PACKET:
+			return RTMP_CSID_AUDIO;
+		case RTMP_TYPE_VIDEO_PACKET:
+			return RTMP_CSID_VIDEO;
 		default:
-			ptr++;
-			break;
+			return RTMP_CSID_DATA;
+	}
+}
+
+// Type 3 chunk headers for the chunk streams media goes out on, for
+// queueing by reference
+static const uint8_t rtmp_fmt3[] = {
+	[RTMP_CSID_AUDIO] = 0xC0 | RTMP_CSID_AUDIO,
+	[RTMP_CSID_DATA] = 0xC0 | RTMP_CSID_DATA,
+	[RTMP_CSID_VIDEO] = 0xC0 | RTMP_CSID_VIDEO,
+};
+
+// Everything of msg's wire format after its type 0 chunk header: the
+// payload with a type 3 header between every chunk_size bytes. This is the
+// same for every player using chunk_size, so it is built once per stream
+// and shared.
+static struct msg_form *
+rtmp_msg_form(struct msg *msg, uint32_t chunk_size)
+{
+	struct msg_form *form = msg_get_form(msg, chunk_size);
+	size_t chunks, off, n;
+	uint8_t csid = rtmp_msg_csid(msg);
+	char *p;
+
+	if (form != NULL) {
+		return form;
 	}
 
-	log_debug("Chunk fmt: %d csid: %d", fmt, csid);
+	chunks = msg->len ? (msg->len + chunk_size - 1) / chunk_size : 1;
+	if ((form = msg_alloc_form(chunk_size, msg->len + chunks - 1)) == NULL) {
+		return NULL;
+	}
+	p = form->data;
+	for (off = 0; off < msg->len; off += n) {
+		if (off > 0) {
+			*p++ = 0xC0 | csid;
+		}
+		n = msg->len - off < chunk_size ? msg->len - off : chunk_size;
+		memcpy(p, msg->data + off, n);
+		p += n;
+	}
+	msg_add_form(msg, form);
+	return form;
+}
 
-	if (fmt < 3) {
-		timestamp = rtmp_read_uint24(ptr);
-		msg_len = rtmp_read_uint24(&ptr[3]);
-		msg_type_id = rtmp_read_uint8(&ptr[6]);
-		msg_stream_id = rtmp_read_uint32(&ptr[7]);
+void
+rtmp_queue_msg(struct conn_client *client, struct evbuffer *out, struct msg *msg)
+{
+	struct rtmp_info *info = client->proto_data;
+	struct msg_form *form = NULL;
+	uint8_t hdr[12], csid = rtmp_msg_csid(msg);
+	uint32_t ts = 0, chunk_size = info->out_chunk_size;
+	size_t chunks = (msg->len + chunk_size - 1) / chunk_size, off, n;
+
+	if (msg->type != RTMP_TYPE_AUDIO_PACKET && msg->type != RTMP_TYPE_VIDEO_PACKET &&
+		msg->type != RTMP_TYPE_INVOKE_COMMAND) {
+		return;
+	}
 
-		// Some weird shit about channel 03
-		if (csid == 0x03) {
-			msg_len = 256 - RTMP_MAX_HEADER_SIZE;
+	if (msg->type != RTMP_TYPE_INVOKE_COMMAND && !(msg->flags & MSG_CONFIG)) {
+		if (!info->ts_started) {
+			info->ts_base = msg->timestamp;
+			info->ts_started = 1;
+		}
+		ts = msg->timestamp - info->ts_base;
+		// Audio cached ahead of the keyframe a player starts on
+		if (ts > 0x7FFFFFFF) {
+			ts = 0;
 		}
+	}
 
-		log_debug("Chunk 0 data timestamp: %d len: %d type: %d stream: %d", timestamp, msg_len, msg_type_id, msg_stream_id);
+	// Past 0xFFFFFF ms every chunk repeats the extended timestamp, which
+	// then differs per player; that is over four hours in, so just
+	// chunk the message for this player alone
+	if (ts >= 0xFFFFFF ||
+		(chunks > RTMP_MAX_SLICES && (form = rtmp_msg_form(msg, chunk_size)) == NULL)) {
+		rtmp_send_at(client, info, csid, msg->type, RTMP_STREAM_ID,
+			ts, msg->data, msg->len);
+		return;
+	}
 
-		memcpy(buf, &ptr[11], msg_len);
-		log_debug("Message buf: ");
-		dump(buf, msg_len);
+	hdr[0] = csid;
+	rtmp_write_uint24(hdr + 1, ts);
+	rtmp_write_uint24(hdr + 4, msg->len);
+	hdr[7] = msg->type;
+	rtmp_write_uint32_le(hdr + 8, RTMP_STREAM_ID);
+	evbuffer_add(out, hdr, sizeof(hdr));
 
-		switch (msg_type_id) {
-			case RTMP_TYPE_CHUNK_SIZE:
-				memcpy(&info->max_chunk_size, buf, 4);
-				info->max_chunk_size = htonl(info->max_chunk_size);
-				log_debug("Set max chunk size: %d", info->max_chunk_size);
+	if (form != NULL) {
+		msg_add_span(out, msg, form->data, form->len);
+		return;
+	}
 
-				break;
+	// With chunks this large the payload goes out as it is: each chunk a
+	// reference into the msg, the headers between them references to
+	// constant bytes, all handed to the kernel as one iovec each
+	for (off = 0; off < msg->len; off += n) {
+		if (off > 0) {
+			evbuffer_add_reference(out, &rtmp_fmt3[csid], 1, NULL, NULL);
 		}
+		n = msg->len - off < chunk_size ? msg->len - off : chunk_size;
+		msg_add_range(out, msg, off, n);
 	}
 }
 
-int
-rtmp_read(struct conn_client *client, char *data, size_t len)
+// The "@setDataFrame" that encoders wrap metadata in is an instruction to
+// the server, not part of the stream
+static void
+rtmp_strip_set_data_frame(struct msg *msg)
 {
-	char sbuf[RTMP_SIG_SIZE + 1], *psbuf = sbuf;
-	uint32_t stime;
+	static const char prefix[] = "\x02\x00\x0d@setDataFrame";
+	size_t n = sizeof(prefix) - 1;
 
-	if (client->proto_data == NULL) {
-		client->proto_data = rtmp_alloc_info();
+	if (msg->len > n && memcmp(msg->data, prefix, n) == 0) {
+		msg->data += n;
+		msg->len -= n;
 	}
+}
 
-	struct rtmp_info *info = client->proto_data;
+static int
+rtmp_handle_msg(struct conn_client *client, struct rtmp_info *info,
+	struct msg *msg)
+{
+	const uint8_t *p = (const uint8_t *)msg->data;
+
+	switch (msg->type) {
+		case RTMP_TYPE_CHUNK_SIZE:
+			if (msg->len < 4) {
+				return -1;
+			}
+			info->max_chunk_size = rtmp_read_uint32(p) & 0x7FFFFFFF;
+			if (info->max_chunk_size == 0) {
+				return -1;
+			}
+			log_debug("Set max chunk size: %d", info->max_chunk_size);
+			break;
+
+		case RTMP_TYPE_ABORT:
+			if (msg->len >= 4) {
+				struct rtmp_chunk_stream *cs = rtmp_chunk_stream(info,
+					rtmp_read_uint32(p));
+				if (cs && cs->msg) {
+					info->partial -= cs->len;
+					msg_unref(cs->msg);
+					cs->msg = NULL;
+				}
+			}
+			break;
+
+		case RTMP_TYPE_AUDIO_PACKET:
+		case RTMP_TYPE_VIDEO_PACKET:
+		case RTMP_TYPE_INVOKE_COMMAND:
+			if (!client->is_producer || client->producer == NULL) {
+				break;
+			}
+			if (msg->type == RTMP_TYPE_INVOKE_COMMAND) {
+				rtmp_strip_set_data_frame(msg);
+			}
+			rtmp_classify(msg);
+			flv_tag_prepare(msg);
+			conn_fanout(client->producer, msg);
+			break;
+
+		case RTMP_TYPE_AMF0_COMMAND:
+		case RTMP_TYPE_AMF3_COMMAND:
+			return rtmp_handle_command(client, info, msg);
+
+		default:
+			log_debug("Ignoring message type %d", msg->type);
+			break;
+	}
+
+	return 0;
+}
+
+// Consumes one chunk from input if all of it has arrived. Returns 1 if a
+// chunk was consumed, 0 if more data is needed, 2 if the client was handed
+// to another reactor and -1 on a protocol error.
+static int
+rtmp_read_chunk(struct conn_client *client, struct rtmp_info *info,
+	struct evbuffer *input)
+{
+	uint8_t hdr[RTMP_MAX_HEADER_SIZE];
+	const uint8_t *ptr;
+	size_t avail = evbuffer_get_length(input);
+	size_t hdrlen, basic;
+	uint8_t fmt;
+	uint32_t csid, ts, payload;
+	struct rtmp_chunk_stream *cs;
+	struct msg *msg;
+	int ret;
+
+	if (avail < 1) {
+		return 0;
+	}
+	evbuffer_copyout(input, hdr, avail < sizeof(hdr) ? avail : sizeof(hdr));
+
+	fmt = hdr[0] >> 6;
+	csid = hdr[0] & 0x3F;
+	switch (csid) {
+		case 0:
+			basic = 2;
+			csid = 64 + hdr[1];
+			break;
+		case 1:
+			basic = 3;
+			csid = 64 + hdr[1] + (hdr[2] << 8);
+			break;
+		default:
+			basic = 1;
+			break;
+	}
+	if (avail < basic) {
+		return 0;
+	}
+
+	if ((cs = rtmp_chunk_stream(info, csid)) == NULL) {
+		return -1;
+	}
+
+	hdrlen = basic + (fmt == 0 ? 11 : fmt == 1 ? 7 : fmt == 2 ? 3 : 0);
+	if (avail < hdrlen) {
+		return 0;
+	}
+
+	ptr = hdr + basic;
+	ts = fmt < 3 ? rtmp_read_uint24(ptr) : 0;
+	if (fmt < 3) {
+		cs->extended = ts == 0xFFFFFF;
+	}
+	if (cs->extended) {
+		if (avail < hdrlen + 4) {
+			return 0;
+		}
+		ts = rtmp_read_uint32(hdr + hdrlen);
+		hdrlen += 4;
+	}
+
+	// A fmt 1/2 header may only start a new message, so it's safe to
+	// update the chunk stream before knowing whether the payload is here
+	if (fmt < 2) {
+		cs->len = rtmp_read_uint24(ptr + 3);
+		cs->type = ptr[6];
+	}
+	if (fmt == 0) {
+		cs->stream_id = rtmp_read_uint32_le(ptr + 7);
+	}
+
+	payload = cs->len - (cs->msg ? cs->received : 0);
+	if (payload > info->max_chunk_size) {
+		payload = info->max_chunk_size;
+	}
+	if (avail < hdrlen + payload) {
+		return 0;
+	}
+
+	if (cs->msg == NULL) {
+		if (fmt == 0) {
+			cs->timestamp = ts;
+			cs->delta = 0;
+		} else if (fmt < 3) {
+			cs->delta = ts;
+			cs->timestamp += ts;
+		} else {
+			cs->timestamp += cs->delta;
+		}
+
+		// The length is the peer's to choose, and every chunk stream may
+		// have a message under way
+		if (info->partial + cs->len > config.rtmp_max_partial) {
+			log_info("Chunk stream %d: %u byte message exceeds %zu bytes "
+				"in reassembly", csid, cs->len, config.rtmp_max_partial);
+			return -1;
+		}
+		if ((cs->msg = msg_alloc(cs->len)) == NULL) {
+			return -1;
+		}
+		cs->msg->type = cs->type;
+		cs->msg->timestamp = cs->timestamp;
+		cs->received = 0;
+		info->partial += cs->len;
+	} else if (fmt != 3) {
+		log_info("Chunk stream %d: new header mid-message", csid);
+		return -1;
+	}
+
+	evbuffer_drain(input, hdrlen);
+	evbuffer_remove(input, cs->msg->data + cs->received, payload);
+	cs->received += payload;
+
+	if (cs->received == cs->len) {
+		msg = cs->msg;
+		cs->msg = NULL;
+		info->partial -= cs->len;
+		ret = rtmp_handle_msg(client, info, msg);
+		msg_unref(msg);
+		if (ret != 0) {
+			return ret < 0 ? -1 : 2;
+		}
+	}
+
+	return 1;
+}
+
+static int
+rtmp_handshake(struct conn_client *client, struct rtmp_info *info,
+	struct evbuffer *input)
+{
+	char sbuf[1 + 2 * RTMP_SIG_SIZE];
 
 	switch (info->state)
 	{
 		case rtmp_state_uninitialized:
-			log_debug("Parsing C0");
+			// C0 and C1 always arrive together before we say anything
+			if (evbuffer_get_length(input) < 1 + RTMP_SIG_SIZE) {
+				return 0;
+			}
 
-			// Check client version
-			info->client_version = data[0];
+			evbuffer_remove(input, sbuf, 1);
+			info->client_version = sbuf[0];
 			log_debug("Client version: %d", info->client_version);
 
-			sprintf(sbuf, "%d", RTMP_VERSION);
-			conn_buffer_write(client, sbuf, 1);
+			// S0, S1 (zero time and zero random bytes) and S2 (echo of C1)
+			sbuf[0] = RTMP_VERSION;
+			memset(&sbuf[1], 0, RTMP_SIG_SIZE);
+			evbuffer_remove(input, &sbuf[1 + RTMP_SIG_SIZE], RTMP_SIG_SIZE);
+			conn_buffer_write(client, sbuf, sizeof(sbuf));
 
-			info->state = rtmp_state_handshake_version;
+			info->state = rtmp_state_handshake_ack;
+			return 1;
 
-			if (len == 1) {
-				break;
+		case rtmp_state_handshake_ack:
+			if (evbuffer_get_length(input) < RTMP_SIG_SIZE) {
+				return 0;
 			}
 
-			// The client send C1 as well
-			data = data + 1;
-			psbuf = sbuf + 1;
-
-		case rtmp_state_handshake_version:
-			log_debug("Parsing C1");
+			// Zero Fucks Given about C2
+			evbuffer_drain(input, RTMP_SIG_SIZE);
+			info->state = rtmp_state_handshake_done;
+			return 1;
 
-			// Zero Fucks Given about the client Handshake
-			stime = 0;
-			memcpy(psbuf, &stime, 4);
-			memset(&psbuf[4], 0, 4);
-			memcpy(&psbuf[8], &data[8], RTMP_SIG_SIZE - 8);
+		default:
+			return 1;
+	}
+}
 
-			conn_buffer_write(client, psbuf, RTMP_SIG_SIZE);
-			info->state = rtmp_state_handshake_ack;
+int
+rtmp_read(struct conn_client *client, struct evbuffer *input)
+{
+	int ret;
 
-			break;
+	if (client->proto_data == NULL &&
+		(client->proto_data = rtmp_alloc_info()) == NULL) {
+		return -1;
+	}
 
-		case rtmp_state_handshake_ack:
-			log_debug("Parsing C2");
+	struct rtmp_info *info = client->proto_data;
 
-			stime = 0;
-			memcpy(psbuf, &stime, 4);
-			memset(&psbuf[4], 0, 4);
-			memcpy(&psbuf[8], &data[8], RTMP_SIG_SIZE - 8);
+	while (info->state != rtmp_state_handshake_done) {
+		if ((ret = rtmp_handshake(client, info, input)) <= 0) {
+			return ret;
+		}
+	}
 
-			conn_buffer_write(client, psbuf, RTMP_SIG_SIZE);
-			info->state = rtmp_state_handshake_done;
+	// Process every complete chunk that has arrived, unless the client
+	// moves reactor on the way: the rest of its input went with it
+	while ((ret = rtmp_read_chunk(client, info, input)) == 1);
 
-			break;
+	return ret < 0 ? -1 : 0;
+}
 
-		case rtmp_state_handshake_done:
-			rtmp_chunk(info, data, len);
+void
+rtmp_save(struct conn_client *client, struct evbuffer *buf)
+{
+	struct rtmp_info *info = client->proto_data;
+	struct rtmp_chunk_stream *cs;
+
+	upgrade_put_u8(buf, info->state);
+	upgrade_put_u8(buf, info->client_version);
+	upgrade_put_u32(buf, info->max_chunk_size);
+	upgrade_put_u32(buf, info->out_chunk_size);
+	upgrade_put_str(buf, info->app, info->app ? strlen(info->app) : 0);
+	upgrade_put_u32(buf, info->ts_base);
+	upgrade_put_u8(buf, info->ts_started);
+	upgrade_put_u32(buf, info->nstreams);
+	for (int i = 0; i < info->nstreams; i++) {
+		cs = &info->streams[i];
+		upgrade_put_u32(buf, cs->csid);
+		upgrade_put_u32(buf, cs->timestamp);
+		upgrade_put_u32(buf, cs->delta);
+		upgrade_put_u32(buf, cs->len);
+		upgrade_put_u32(buf, cs->stream_id);
+		upgrade_put_u8(buf, cs->type);
+		upgrade_put_u8(buf, cs->extended);
+		// What has arrived of the message being reassembled
+		upgrade_put_str(buf, cs->msg ? cs->msg->data : NULL, cs->received);
+	}
+}
 
-			break;
+int
+rtmp_restore(struct conn_client *client, struct evbuffer *buf)
+{
+	struct rtmp_info *info = rtmp_alloc_info();
+	struct rtmp_chunk_stream *cs;
+	uint8_t state, version;
+	uint32_t nstreams;
+	char *data;
+	size_t len;
+
+	if (info == NULL) {
+		return -1;
+	}
+	client->proto_data = info;
+	if (upgrade_get_u8(buf, &state) != 0 ||
+		upgrade_get_u8(buf, &version) != 0 ||
+		upgrade_get_u32(buf, &info->max_chunk_size) != 0 ||
+		upgrade_get_u32(buf, &info->out_chunk_size) != 0 ||
+		upgrade_get_str(buf, &info->app, &len) != 0 ||
+		upgrade_get_u32(buf, &info->ts_base) != 0 ||
+		upgrade_get_u8(buf, &info->ts_started) != 0 ||
+		upgrade_get_u32(buf, &nstreams) != 0 || nstreams > RTMP_MAX_CHUNK_STREAMS) {
+		return -1;
+	}
+	info->state = state;
+	info->client_version = version;
+	if (nstreams > 0 &&
+		(info->streams = calloc(nstreams, sizeof(struct rtmp_chunk_stream))) == NULL) {
+		return -1;
 	}
 
-	return 1;
+	for (; info->nstreams < (int)nstreams; info->nstreams++) {
+		cs = &info->streams[info->nstreams];
+		if (upgrade_get_u32(buf, &cs->csid) != 0 ||
+			upgrade_get_u32(buf, &cs->timestamp) != 0 ||
+			upgrade_get_u32(buf, &cs->delta) != 0 ||
+			upgrade_get_u32(buf, &cs->len) != 0 ||
+			upgrade_get_u32(buf, &cs->stream_id) != 0 ||
+			upgrade_get_u8(buf, &cs->type) != 0 ||
+			upgrade_get_u8(buf, &cs->extended) != 0 ||
+			upgrade_get_str(buf, &data, &len) != 0) {
+			return -1;
+		}
+		if (data == NULL) {
+			continue;
+		}
+		if (len > cs->len || info->partial + cs->len > config.rtmp_max_partial ||
+			(cs->msg = msg_alloc(cs->len)) == NULL) {
+			free(data);
+			return -1;
+		}
+		info->partial += cs->len;
+		memcpy(cs->msg->data, data, len);
+		cs->msg->type = cs->type;
+		cs->msg->timestamp = cs->timestamp;
+		cs->received = len;
+		free(data);
+	}
+	return 0;
 }
@@ -5,6 +5,38 @@
 
 #define RTMP_VERSION 3
 
-int rtmp_read(struct conn_client *client, char *data, size_t len);
+#define RTMP_TYPE_CHUNK_SIZE        0x01
+#define RTMP_TYPE_PING              0x04
+#define RTMP_TYPE_SERVER_BANDWIDTH  0x05
+#define RTMP_TYPE_CLIENT_BANDWIDTH  0x06
+#define RTMP_TYPE_AUDIO_PACKET      0x08
+#define RTMP_TYPE_VIDEO_PACKET      0x09
+#define RTMP_TYPE_AMF3_COMMAND      0x11
+#define RTMP_TYPE_INVOKE_COMMAND    0x12
+#define RTMP_TYPE_AMF0_COMMAND      0x14
+
+// Set msg->flags from the message type and the FLV-style media header at
+// the start of an audio/video payload, or whether a data message is
+// onMetaData.
+void rtmp_classify(struct msg *msg);
+
+// Consume as much of input as forms complete handshake packets and chunks.
+// Returns 0 when more data is needed and -1 on a protocol error.
+int rtmp_read(struct conn_client *client, struct evbuffer *input);
+
+// Queue msg for a player in RTMP wire format.
+void rtmp_queue_msg(struct conn_client *client, struct evbuffer *out,
+	struct msg *msg);
+
+// The client has joined the stream it asked to publish or play.
+void rtmp_attached(struct conn_client *client);
+
+void rtmp_free_info(void *proto_data);
+
+// Write client's handshake and chunk stream state, message part way in
+// included, for conn_save, and read it back into a new client for
+// conn_restore. Restoring returns -1 if buf doesn't hold all of it.
+void rtmp_save(struct conn_client *client, struct evbuffer *buf);
+int rtmp_restore(struct conn_client *client, struct evbuffer *buf);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,186 @@
+#include "slab.h"
+#include "log.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLAB_PAGE_SIZE (64 * 1024)
+#define SLAB_MAX_CLASSES 16
+#define SLAB_MAX_THREADS 256
+#define SLAB_ALIGN 16
+
+struct slab;
+
+struct slab_page {
+	struct slab *owner;
+	struct slab_page *next;
+};
+
+#define SLAB_PAGE_HEADER \
+	((sizeof(struct slab_page) + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1))
+
+struct slab_free_obj {
+	struct slab_free_obj *next;
+};
+
+// One class on one thread
+struct slab {
+	struct slab_class *cls;
+	size_t size;
+	struct slab_free_obj *free;
+	struct slab_page *pages;
+
+	// Read by slab_get_stats from any thread
+	size_t objects;
+	size_t npages;
+
+	// Objects freed by other threads
+	struct slab_free_obj *remote __attribute__((aligned(64)));
+};
+
+static int nclasses;
+static struct slab *all[SLAB_MAX_THREADS * SLAB_MAX_CLASSES];
+static int nall;
+static __thread struct slab *local[SLAB_MAX_CLASSES];
+
+static struct slab *
+slab_local(struct slab_class *cls)
+{
+	int id = __atomic_load_n(&cls->id, __ATOMIC_ACQUIRE);
+	struct slab *slab;
+
+	if (id < 0) {
+		int fresh = __atomic_fetch_add(&nclasses, 1, __ATOMIC_ACQ_REL);
+		if (fresh >= SLAB_MAX_CLASSES) {
+			log_err("Too many slab classes");
+			abort();
+		}
+		// Another thread may have named the class first
+		if (!__atomic_compare_exchange_n(&cls->id, &id, fresh, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			fresh = id;
+		}
+		id = fresh;
+	}
+
+	if ((slab = local[id]) != NULL) {
+		return slab;
+	}
+
+	if ((slab = calloc(1, sizeof(struct slab))) == NULL) {
+		return NULL;
+	}
+	slab->cls = cls;
+	slab->size = (cls->size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+	local[id] = slab;
+
+	int n = __atomic_fetch_add(&nall, 1, __ATOMIC_ACQ_REL);
+	if (n < SLAB_MAX_THREADS * SLAB_MAX_CLASSES) {
+		__atomic_store_n(&all[n], slab, __ATOMIC_RELEASE);
+	}
+	return slab;
+}
+
+static int
+slab_grow(struct slab *slab)
+{
+	struct slab_page *page;
+	char *obj, *end;
+
+	if (posix_memalign((void **)&page, SLAB_PAGE_SIZE, SLAB_PAGE_SIZE) != 0) {
+		log_err("Failed to allocate %s slab page", slab->cls->name);
+		return -1;
+	}
+	page->owner = slab;
+	page->next = slab->pages;
+	slab->pages = page;
+	__atomic_add_fetch(&slab->npages, 1, __ATOMIC_RELAXED);
+
+	obj = (char *)page + SLAB_PAGE_HEADER;
+	end = (char *)page + SLAB_PAGE_SIZE;
+	for (; obj + slab->size <= end; obj += slab->size) {
+		struct slab_free_obj *f = (struct slab_free_obj *)obj;
+		f->next = slab->free;
+		slab->free = f;
+	}
+	return 0;
+}
+
+void *
+slab_alloc(struct slab_class *cls)
+{
+	struct slab *slab = slab_local(cls);
+	struct slab_free_obj *obj;
+
+	if (slab == NULL) {
+		return NULL;
+	}
+
+	if (slab->free == NULL) {
+		// Take back everything other threads have freed before growing
+		slab->free = __atomic_exchange_n(&slab->remote, NULL, __ATOMIC_ACQUIRE);
+		if (slab->free == NULL && slab_grow(slab) != 0) {
+			return NULL;
+		}
+	}
+
+	obj = slab->free;
+	slab->free = obj->next;
+	__atomic_add_fetch(&slab->objects, 1, __ATOMIC_RELAXED);
+	return obj;
+}
+
+void *
+slab_calloc(struct slab_class *cls)
+{
+	void *ptr = slab_alloc(cls);
+	if (ptr) {
+		memset(ptr, 0, cls->size);
+	}
+	return ptr;
+}
+
+void
+slab_free(void *ptr)
+{
+	struct slab_page *page;
+	struct slab *slab;
+	struct slab_free_obj *obj = ptr;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	page = (struct slab_page *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+	slab = page->owner;
+
+	if (slab->cls->id >= 0 && local[slab->cls->id] == slab) {
+		obj->next = slab->free;
+		slab->free = obj;
+		__atomic_sub_fetch(&slab->objects, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	obj->next = __atomic_load_n(&slab->remote, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&slab->remote, &obj->next, obj, 1,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	__atomic_sub_fetch(&slab->objects, 1, __ATOMIC_RELAXED);
+}
+
+void
+slab_get_stats(struct slab_class *cls, struct slab_stats *stats)
+{
+	int n = __atomic_load_n(&nall, __ATOMIC_ACQUIRE);
+
+	memset(stats, 0, sizeof(struct slab_stats));
+	for (int i = 0; i < n && i < SLAB_MAX_THREADS * SLAB_MAX_CLASSES; i++) {
+		struct slab *slab = __atomic_load_n(&all[i], __ATOMIC_ACQUIRE);
+		if (slab == NULL || slab->cls != cls) {
+			continue;
+		}
+		stats->objects += __atomic_load_n(&slab->objects, __ATOMIC_RELAXED);
+		stats->pages += __atomic_load_n(&slab->npages, __ATOMIC_RELAXED);
+	}
+	stats->bytes = stats->pages * SLAB_PAGE_SIZE;
+}
@@ -0,0 +1,36 @@
+#ifndef __TELEGENIC_SLAB_H__
+#define __TELEGENIC_SLAB_H__
+
+#include <stddef.h>
+
+// Fixed-size object allocator for per-connection state. Each thread (in
+// practice each reactor) carves objects of a class out of its own 64 KiB
+// pages, so allocating and freeing take no lock and pay no malloc header.
+// An object may be freed on any thread: frees from a thread other than the
+// owner are pushed onto the owner's remote list and picked up the next
+// time it runs dry.
+struct slab_class {
+	const char *name;
+	size_t size;
+	int id;
+};
+
+#define SLAB_CLASS(type) { #type, sizeof(type), -1 }
+
+void *slab_alloc(struct slab_class *cls);
+
+// Like slab_alloc but zeroes the object.
+void *slab_calloc(struct slab_class *cls);
+
+void slab_free(void *ptr);
+
+struct slab_stats {
+	size_t objects;
+	size_t pages;
+	size_t bytes;
+};
+
+// Totals for a class across every thread.
+void slab_get_stats(struct slab_class *cls, struct slab_stats *stats);
+
+#endif
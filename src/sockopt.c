@@ -0,0 +1,119 @@
+#include "sockopt.h"
+#include "log.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+struct sockopt_key {
+	const char *name;
+	size_t offset;
+	int is_size;
+};
+
+static const struct sockopt_key sockopt_keys[] = {
+	{ "rcvbuf", offsetof(struct sock_opts, rcvbuf), 0 },
+	{ "sndbuf", offsetof(struct sock_opts, sndbuf), 0 },
+	{ "nodelay", offsetof(struct sock_opts, nodelay), 0 },
+	{ "notsent_lowat", offsetof(struct sock_opts, notsent_lowat), 0 },
+	{ "defer_accept", offsetof(struct sock_opts, defer_accept), 0 },
+	{ "keepalive_idle", offsetof(struct sock_opts, keepalive_idle), 0 },
+	{ "keepalive_intvl", offsetof(struct sock_opts, keepalive_intvl), 0 },
+	{ "keepalive_cnt", offsetof(struct sock_opts, keepalive_cnt), 0 },
+	{ "read_low", offsetof(struct sock_opts, read_low), 1 },
+	{ "read_high", offsetof(struct sock_opts, read_high), 1 },
+	{ "write_low", offsetof(struct sock_opts, write_low), 1 },
+};
+
+int
+sockopt_set(struct sock_opts *opts, const char *key, const char *value)
+{
+	char *end;
+	long v;
+
+	v = strtol(value, &end, 10);
+	if (end == value || *end != '\0' || v < 0 || v > 0x7FFFFFFF) {
+		return -1;
+	}
+	for (size_t i = 0; i < sizeof(sockopt_keys) / sizeof(sockopt_keys[0]); i++) {
+		const struct sockopt_key *k = &sockopt_keys[i];
+		if (strcmp(key, k->name) != 0) {
+			continue;
+		}
+		if (k->is_size) {
+			*(size_t *)((char *)opts + k->offset) = v;
+		} else {
+			*(int *)((char *)opts + k->offset) = v;
+		}
+		return 0;
+	}
+	return -1;
+}
+
+static int
+sockopt_int(evutil_socket_t fd, int level, int name, int v, const char *what)
+{
+	if (setsockopt(fd, level, name, &v, sizeof(v)) != 0) {
+		log_err("Failed to set %s to %d", what, v);
+		return -1;
+	}
+	return 0;
+}
+
+int
+sockopt_apply(evutil_socket_t fd, const struct sock_opts *opts)
+{
+	int ret = 0;
+
+	if (opts->rcvbuf) {
+		ret |= sockopt_int(fd, SOL_SOCKET, SO_RCVBUF, opts->rcvbuf, "SO_RCVBUF");
+	}
+	if (opts->sndbuf) {
+		ret |= sockopt_int(fd, SOL_SOCKET, SO_SNDBUF, opts->sndbuf, "SO_SNDBUF");
+	}
+	if (opts->nodelay) {
+		ret |= sockopt_int(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+	}
+#ifdef TCP_NOTSENT_LOWAT
+	if (opts->notsent_lowat) {
+		ret |= sockopt_int(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+			opts->notsent_lowat, "TCP_NOTSENT_LOWAT");
+	}
+#endif
+	if (opts->keepalive_idle) {
+		ret |= sockopt_int(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+#ifdef TCP_KEEPIDLE
+		ret |= sockopt_int(fd, IPPROTO_TCP, TCP_KEEPIDLE,
+			opts->keepalive_idle, "TCP_KEEPIDLE");
+#endif
+#ifdef TCP_KEEPINTVL
+		if (opts->keepalive_intvl) {
+			ret |= sockopt_int(fd, IPPROTO_TCP, TCP_KEEPINTVL,
+				opts->keepalive_intvl, "TCP_KEEPINTVL");
+		}
+#endif
+#ifdef TCP_KEEPCNT
+		if (opts->keepalive_cnt) {
+			ret |= sockopt_int(fd, IPPROTO_TCP, TCP_KEEPCNT,
+				opts->keepalive_cnt, "TCP_KEEPCNT");
+		}
+#endif
+	}
+	return ret;
+}
+
+int
+sockopt_apply_listener(evutil_socket_t fd, const struct sock_opts *opts)
+{
+	int ret = sockopt_apply(fd, opts);
+
+#ifdef TCP_DEFER_ACCEPT
+	if (opts->defer_accept) {
+		ret |= sockopt_int(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+			opts->defer_accept, "TCP_DEFER_ACCEPT");
+	}
+#endif
+	return ret;
+}
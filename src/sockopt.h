@@ -0,0 +1,43 @@
+#ifndef __TELEGENIC_SOCKOPT_H__
+#define __TELEGENIC_SOCKOPT_H__
+
+#include <event2/util.h>
+#include <stddef.h>
+
+// Socket tuning for one side of the server. Zero leaves the kernel's
+// default alone, which for the buffer sizes means leaving their autotuning
+// on. Everything but the watermarks is also set on the listening sockets,
+// which is where a connection inherits it from (and the only place the
+// buffer sizes still affect the window scale it is opened with).
+struct sock_opts {
+	int rcvbuf;
+	int sndbuf;
+	int nodelay;
+	// Unsent bytes the kernel holds before saying the socket is writable,
+	// so the rest stays in user space where lag handling can drop it
+	int notsent_lowat;
+	// Seconds a connection may sit without sending before accept sees it
+	int defer_accept;
+	// Seconds idle before probing, 0 for no keepalive
+	int keepalive_idle;
+	int keepalive_intvl;
+	int keepalive_cnt;
+
+	// bufferevent watermarks. Consumers' write watermark is the lag low
+	// watermark (-w), so write_low only applies to producers.
+	size_t read_low;
+	size_t read_high;
+	size_t write_low;
+};
+
+// Set a keyword option (rcvbuf, nodelay, ...) from its text. Returns -1 if
+// there is no such option or the value doesn't parse.
+int sockopt_set(struct sock_opts *opts, const char *key, const char *value);
+
+// Apply the options to a connected socket
+int sockopt_apply(evutil_socket_t fd, const struct sock_opts *opts);
+
+// Apply the options and those only a listening socket takes
+int sockopt_apply_listener(evutil_socket_t fd, const struct sock_opts *opts);
+
+#endif
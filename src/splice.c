@@ -0,0 +1,303 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "splice.h"
+#include "config.h"
+#include "log.h"
+#include "reactor.h"
+
+#include <errno.h>
+#include <event2/event.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef __linux__
+
+// Most moved off a producer's socket per read
+#define SPLICE_READ_MAX (64 * 1024)
+// Smallest pipe a consumer is given; the kernel default
+#define SPLICE_PIPE_MIN (64 * 1024)
+
+struct splice_source {
+	struct conn_client *client;
+	struct event *ev;
+	int pipe[2];
+};
+
+struct splice_sink {
+	struct event *ev;       // write readiness while the pipe holds bytes
+	int pipe[2];
+	size_t queued;
+};
+
+// Where a read goes once every consumer has its copy
+static int splice_null = -1;
+
+int
+splice_init()
+{
+	if (!config.splice) {
+		return 0;
+	}
+	if ((splice_null = open("/dev/null", O_WRONLY | O_CLOEXEC)) < 0) {
+		log_err("Failed to open /dev/null");
+		return -1;
+	}
+	return 0;
+}
+
+void
+splice_terminate()
+{
+	if (splice_null >= 0) {
+		close(splice_null);
+		splice_null = -1;
+	}
+}
+
+static void
+splice_close_pipe(int pipe[2])
+{
+	if (pipe[0] >= 0) {
+		close(pipe[0]);
+		close(pipe[1]);
+	}
+}
+
+// Move what a consumer's pipe holds to its socket. Returns -1 if the
+// consumer has gone.
+static int
+splice_flush(struct conn_client *client)
+{
+	struct splice_sink *sink = client->proto_data;
+	int fd = bufferevent_getfd(client->bev);
+	ssize_t n;
+
+	while (sink->queued > 0) {
+		n = splice(sink->pipe[0], NULL, fd, NULL, sink->queued,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n > 0) {
+			sink->queued -= n;
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+			// Carry on once the socket has room
+			event_add(sink->ev, NULL);
+			return 0;
+		}
+		return -1;
+	}
+	return 0;
+}
+
+static void
+splice_write_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct conn_client *client = arg;
+
+	if (splice_flush(client) != 0) {
+		log_path_debug(client->path, "Consumer of %s went away", client->path);
+		conn_close_client(client);
+	}
+}
+
+// Hand a consumer its copy of the n bytes in the source pipe
+static void
+splice_send(struct conn_client *client, struct splice_source *src, size_t n)
+{
+	struct splice_sink *sink = client->proto_data;
+	ssize_t teed = tee(src->pipe[0], sink->pipe[1], n, SPLICE_F_NONBLOCK);
+
+	if (teed != (ssize_t)n) {
+		client->reactor->stats.consumers_cut++;
+		log_info("Dropping consumer of %s: %zu bytes behind",
+			client->path, sink->queued);
+		conn_close_client(client);
+		return;
+	}
+
+	sink->queued += n;
+	if (splice_flush(client) != 0) {
+		log_path_debug(client->path, "Consumer of %s went away", client->path);
+		conn_close_client(client);
+	}
+}
+
+static void
+splice_read_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct splice_source *src = arg;
+	struct conn_client *client = src->client;
+	struct producer *producer = client->producer;
+	struct conn_client *consumer;
+	ssize_t n;
+	size_t i;
+
+	n = splice(fd, NULL, src->pipe[1], NULL, SPLICE_READ_MAX,
+		SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+	if (n <= 0) {
+		if (n < 0) {
+			log_err("Failed to splice from producer of %s", client->path);
+		}
+		log_path_debug(client->path, "Client connection closed");
+		conn_close_client(client);
+		return;
+	}
+
+	producer->ingest_bytes += n;
+
+	cset_begin(&producer->consumers);
+	cset_foreach(&producer->consumers, i, consumer) {
+		splice_send(consumer, src, n);
+	}
+	cset_end(&producer->consumers);
+
+	// Every consumer has its own reference to the pages by now
+	if (splice(src->pipe[0], NULL, splice_null, NULL, n, SPLICE_F_MOVE) != n) {
+		log_err("Failed to drain pipe of %s", client->path);
+		conn_close_client(client);
+	}
+}
+
+int
+splice_start(struct conn_client *client)
+{
+	struct splice_source *src = malloc(sizeof(struct splice_source));
+
+	if (src == NULL) {
+		return -1;
+	}
+	src->client = client;
+	src->ev = NULL;
+	if (pipe2(src->pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+		log_err("Failed to create pipe for %s", client->path);
+		free(src);
+		return -1;
+	}
+	src->ev = event_new(client->reactor->base, bufferevent_getfd(client->bev),
+		EV_READ | EV_PERSIST, splice_read_cb, src);
+	if (src->ev == NULL || event_add(src->ev, NULL) != 0) {
+		splice_source_free(src);
+		return -1;
+	}
+
+	// From here on the socket is read by splice_read_cb alone
+	bufferevent_disable(client->bev, EV_READ);
+	client->producer->splice = src;
+	log_path_debug(client->path, "Splicing %s", client->path);
+	return 0;
+}
+
+void
+splice_source_free(struct splice_source *src)
+{
+	if (src->ev) {
+		event_free(src->ev);
+	}
+	splice_close_pipe(src->pipe);
+	free(src);
+}
+
+int
+splice_attach(struct conn_client *client, const char *data, size_t len)
+{
+	struct splice_sink *sink = malloc(sizeof(struct splice_sink));
+	int size;
+
+	if (sink == NULL) {
+		return -1;
+	}
+	sink->queued = 0;
+	sink->ev = NULL;
+	if (pipe2(sink->pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+		log_err("Failed to create pipe for consumer of %s", client->path);
+		free(sink);
+		return -1;
+	}
+	client->proto_data = sink;
+
+	// The pipe stands in for the output buffer, so make it as deep as the
+	// most a consumer may lag, or as near as the pipe size limit allows
+	for (size = config.lag_max; size > SPLICE_PIPE_MIN; size /= 2) {
+		if (fcntl(sink->pipe[1], F_SETPIPE_SZ, size) >= 0) {
+			break;
+		}
+	}
+
+	sink->ev = event_new(client->reactor->base, bufferevent_getfd(client->bev),
+		EV_WRITE, splice_write_cb, client);
+	if (sink->ev == NULL || write(sink->pipe[1], data, len) != (ssize_t)len) {
+		return -1;
+	}
+	sink->queued = len;
+	return splice_flush(client);
+}
+
+void
+splice_sink_free(struct splice_sink *sink)
+{
+	if (sink->ev) {
+		event_free(sink->ev);
+	}
+	splice_close_pipe(sink->pipe);
+	free(sink);
+}
+
+size_t
+splice_queued(struct conn_client *client)
+{
+	struct splice_sink *sink = client->proto_data;
+	return sink ? sink->queued : 0;
+}
+
+#else
+
+int
+splice_init()
+{
+	if (config.splice) {
+		log_err("Pass-through needs splice(2), which this platform lacks");
+		return -1;
+	}
+	return 0;
+}
+
+void
+splice_terminate()
+{
+}
+
+int
+splice_start(struct conn_client *client)
+{
+	return -1;
+}
+
+void
+splice_source_free(struct splice_source *src)
+{
+}
+
+int
+splice_attach(struct conn_client *client, const char *data, size_t len)
+{
+	return -1;
+}
+
+void
+splice_sink_free(struct splice_sink *sink)
+{
+}
+
+size_t
+splice_queued(struct conn_client *client)
+{
+	return 0;
+}
+
+#endif
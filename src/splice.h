@@ -0,0 +1,37 @@
+#ifndef __TELEGENIC_SPLICE_H__
+#define __TELEGENIC_SPLICE_H__
+
+#include "conn.h"
+
+#include <stddef.h>
+
+// Kernel pass-through for opaque HTTP streams (Linux only). A producer's
+// bytes are spliced from its socket into a pipe, teed from there into a
+// pipe per consumer and spliced on to each consumer's socket, so they never
+// enter user space. A consumer's pipe is all the output buffering it gets:
+// one that has no room for the next read is cut off, since an opaque
+// stream can't skip bytes.
+
+struct splice_source;
+struct splice_sink;
+
+int splice_init();
+
+void splice_terminate();
+
+// Take over reading a producer's socket. Whatever the producer has already
+// sent that is sitting in its input buffer must be fanned out as usual.
+int splice_start(struct conn_client *producer);
+
+void splice_source_free(struct splice_source *src);
+
+// Give a consumer its pipe, starting it off with len bytes of data (a
+// response header, say).
+int splice_attach(struct conn_client *consumer, const char *data, size_t len);
+
+void splice_sink_free(struct splice_sink *sink);
+
+// Bytes waiting in a consumer's pipe
+size_t splice_queued(struct conn_client *consumer);
+
+#endif
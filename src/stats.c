@@ -0,0 +1,545 @@
+#include "stats.h"
+#include "conn.h"
+#include "log.h"
+#include "pool.h"
+#include "upgrade.h"
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STATS_MAX_REQUEST 4096
+
+struct stats_scrape;
+
+struct stats_job {
+	struct stats_scrape *scrape;
+	int id;
+};
+
+// One connection to the metrics port and the scrape it is waiting for
+struct stats_scrape {
+	struct bufferevent *bev;
+	struct reactor *home;
+	int pending;            // reactors yet to report
+	int busy;               // between the scrape starting and the response
+	int gone;
+	int nsnaps;
+	struct stats_snapshot *snaps;
+	struct stats_job *jobs;
+};
+
+static struct evconnlistener *listener;
+
+struct stats_stream *
+stats_add_stream(struct stats_snapshot *snap)
+{
+	if (snap->nstreams == snap->streams_cap) {
+		size_t cap = snap->streams_cap ? snap->streams_cap * 2 : 16;
+		struct stats_stream *s = realloc(snap->streams, cap * sizeof(*s));
+		if (s == NULL) {
+			return NULL;
+		}
+		snap->streams = s;
+		snap->streams_cap = cap;
+	}
+	memset(&snap->streams[snap->nstreams], 0, sizeof(struct stats_stream));
+	return &snap->streams[snap->nstreams++];
+}
+
+struct stats_consumer *
+stats_add_consumer(struct stats_snapshot *snap)
+{
+	if (snap->nconsumers == snap->consumers_cap) {
+		size_t cap = snap->consumers_cap ? snap->consumers_cap * 2 : 64;
+		struct stats_consumer *c = realloc(snap->consumers, cap * sizeof(*c));
+		if (c == NULL) {
+			return NULL;
+		}
+		snap->consumers = c;
+		snap->consumers_cap = cap;
+	}
+	memset(&snap->consumers[snap->nconsumers], 0, sizeof(struct stats_consumer));
+	return &snap->consumers[snap->nconsumers++];
+}
+
+static void
+stats_free_scrape(struct stats_scrape *scrape)
+{
+	for (int i = 0; i < scrape->nsnaps; i++) {
+		struct stats_snapshot *snap = &scrape->snaps[i];
+		for (size_t j = 0; j < snap->nstreams; j++) {
+			free(snap->streams[j].path);
+		}
+		free(snap->streams);
+		free(snap->consumers);
+	}
+	free(scrape->snaps);
+	free(scrape->jobs);
+	if (scrape->bev) {
+		bufferevent_free(scrape->bev);
+	}
+	free(scrape);
+}
+
+static void
+stats_family(struct evbuffer *out, const char *name, const char *type,
+	const char *help)
+{
+	evbuffer_add_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Label values may contain anything a client put in a request path
+static void
+stats_label(struct evbuffer *out, const char *value)
+{
+	for (const char *p = value; *p; p++) {
+		switch (*p) {
+			case '\\': evbuffer_add(out, "\\\\", 2); break;
+			case '"': evbuffer_add(out, "\\\"", 2); break;
+			case '\n': evbuffer_add(out, "\\n", 2); break;
+			default: evbuffer_add(out, p, 1); break;
+		}
+	}
+}
+
+static void
+stats_reactor_metric(struct evbuffer *out, struct stats_scrape *scrape,
+	const char *name, const char *type, const char *help, size_t off)
+{
+	stats_family(out, name, type, help);
+	for (int i = 0; i < scrape->nsnaps; i++) {
+		uint64_t v = *(uint64_t *)((char *)&scrape->snaps[i].reactor + off);
+		evbuffer_add_printf(out, "%s{reactor=\"%d\"} %lu\n", name, i,
+			(unsigned long)v);
+	}
+}
+
+static void
+stats_stream_metric(struct evbuffer *out, struct stats_scrape *scrape,
+	const char *name, const char *type, const char *help, size_t off)
+{
+	stats_family(out, name, type, help);
+	for (int i = 0; i < scrape->nsnaps; i++) {
+		struct stats_snapshot *snap = &scrape->snaps[i];
+		for (size_t j = 0; j < snap->nstreams; j++) {
+			uint64_t v = *(uint64_t *)((char *)&snap->streams[j] + off);
+			evbuffer_add_printf(out, "%s{path=\"", name);
+			stats_label(out, snap->streams[j].path);
+			evbuffer_add_printf(out, "\",reactor=\"%d\"} %lu\n", i, (unsigned long)v);
+		}
+	}
+}
+
+static void
+stats_stream_gauge(struct evbuffer *out, struct stats_scrape *scrape,
+	const char *name, const char *help, size_t off)
+{
+	stats_family(out, name, "gauge", help);
+	for (int i = 0; i < scrape->nsnaps; i++) {
+		struct stats_snapshot *snap = &scrape->snaps[i];
+		for (size_t j = 0; j < snap->nstreams; j++) {
+			double v = *(double *)((char *)&snap->streams[j] + off);
+			evbuffer_add_printf(out, "%s{path=\"", name);
+			stats_label(out, snap->streams[j].path);
+			evbuffer_add_printf(out, "\",reactor=\"%d\"} %.9g\n", i, v);
+		}
+	}
+}
+
+static void
+stats_consumer_labels(struct evbuffer *out, const char *name,
+	struct stats_snapshot *snap, struct stats_consumer *c)
+{
+	evbuffer_add_printf(out, "%s{path=\"", name);
+	stats_label(out, snap->streams[c->stream].path);
+	evbuffer_add_printf(out, "\",fd=\"%d\"} ", c->fd);
+}
+
+static void
+stats_format_loop_delay(struct evbuffer *out, struct stats_scrape *scrape)
+{
+	const char *name = "telegenic_reactor_loop_delay_seconds";
+
+	stats_family(out, name, "histogram",
+		"How late the reactor's 100ms tick ran, i.e. time the loop spent busy");
+	for (int i = 0; i < scrape->nsnaps; i++) {
+		struct reactor_stats *r = &scrape->snaps[i].reactor;
+		uint64_t count = 0;
+		for (int b = 0; b < REACTOR_DELAY_BUCKETS; b++) {
+			count += r->delay_hist[b];
+			if (b < REACTOR_DELAY_BUCKETS - 1) {
+				evbuffer_add_printf(out, "%s_bucket{reactor=\"%d\",le=\"%g\"} %lu\n",
+					name, i, reactor_delay_bounds[b] / 1e6, (unsigned long)count);
+			} else {
+				evbuffer_add_printf(out, "%s_bucket{reactor=\"%d\",le=\"+Inf\"} %lu\n",
+					name, i, (unsigned long)count);
+			}
+		}
+		evbuffer_add_printf(out, "%s_sum{reactor=\"%d\"} %.6f\n", name, i,
+			r->delay_sum / 1e6);
+		evbuffer_add_printf(out, "%s_count{reactor=\"%d\"} %lu\n", name, i,
+			(unsigned long)count);
+	}
+
+	name = "telegenic_reactor_loop_delay_max_seconds";
+	stats_family(out, name, "gauge", "Longest tick delay since the previous scrape");
+	for (int i = 0; i < scrape->nsnaps; i++) {
+		evbuffer_add_printf(out, "%s{reactor=\"%d\"} %.6f\n", name, i,
+			scrape->snaps[i].reactor.delay_max / 1e6);
+	}
+}
+
+static void
+stats_format_pool(struct evbuffer *out)
+{
+	struct pool_stats pool;
+	const char *name = "telegenic_pool_buffers";
+
+	pool_get_stats(&pool);
+	stats_family(out, name, "gauge", "Media buffers in use, by size class");
+	for (int i = 0; i < POOL_CLASSES; i++) {
+		if (pool.buffers[i] > 0) {
+			evbuffer_add_printf(out, "%s{size=\"%zu\"} %zu\n", name,
+				pool.class_size[i], pool.buffers[i]);
+		}
+	}
+
+#define POOL_METRIC(name, type, help, value) \
+	stats_family(out, "telegenic_pool_" name, type, help); \
+	evbuffer_add_printf(out, "telegenic_pool_" name " %lu\n", (unsigned long)(value))
+
+	POOL_METRIC("arenas", "gauge",
+		"Arenas mapped for media buffers", pool.arenas);
+	POOL_METRIC("huge_arenas", "gauge",
+		"Arenas backed by huge pages", pool.huge_arenas);
+	POOL_METRIC("allocations_total", "counter",
+		"Media buffers handed out", pool.allocs);
+	POOL_METRIC("remote_frees_total", "counter",
+		"Media buffers freed by a thread other than their owner", pool.remote_frees);
+	POOL_METRIC("large_allocations_total", "counter",
+		"Media buffers too big for any size class", pool.large_allocs);
+
+#undef POOL_METRIC
+}
+
+static void
+stats_format(struct evbuffer *out, struct stats_scrape *scrape)
+{
+	struct stats_snapshot *snap;
+	struct stats_consumer *c;
+
+#define REACTOR_METRIC(name, type, help, field) \
+	stats_reactor_metric(out, scrape, "telegenic_" name, type, help, \
+		offsetof(struct reactor_stats, field))
+#define STREAM_METRIC(name, type, help, field) \
+	stats_stream_metric(out, scrape, "telegenic_stream_" name, type, help, \
+		offsetof(struct stats_stream, field))
+#define STREAM_GAUGE(name, help, field) \
+	stats_stream_gauge(out, scrape, "telegenic_stream_" name, help, \
+		offsetof(struct stats_stream, field))
+
+	REACTOR_METRIC("reactor_loops_total", "counter",
+		"Event loop iterations", loops);
+	stats_format_loop_delay(out, scrape);
+	REACTOR_METRIC("connections_accepted_total", "counter",
+		"Connections accepted", accepted);
+	REACTOR_METRIC("clients", "gauge",
+		"Connected clients", clients);
+	REACTOR_METRIC("handshake_failures_total", "counter",
+		"Clients dropped before attaching to a stream", handshake_failures);
+	REACTOR_METRIC("migrations_total", "counter",
+		"Clients handed to the reactor owning their stream", migrations);
+	REACTOR_METRIC("consumers_cut_total", "counter",
+		"Consumers disconnected for falling too far behind", consumers_cut);
+	REACTOR_METRIC("dropped_bytes_total", "counter",
+		"Media bytes not delivered to lagging consumers", dropped_bytes);
+	REACTOR_METRIC("uring_submits_total", "counter",
+		"io_uring_enter calls submitting socket I/O", uring_submits);
+
+	STREAM_METRIC("ingest_bytes_total", "counter",
+		"Bytes received from the producer", ingest_bytes);
+	STREAM_METRIC("consumers", "gauge",
+		"Attached consumers", consumers);
+	STREAM_METRIC("lagging_consumers", "gauge",
+		"Consumers currently skipping media", lagging);
+	STREAM_METRIC("output_bytes", "gauge",
+		"Bytes queued for all consumers", output_bytes);
+	STREAM_METRIC("output_max_bytes", "gauge",
+		"Deepest consumer output buffer", output_max);
+	STREAM_METRIC("gop_cache_bytes", "gauge",
+		"Bytes held in the GOP cache", gop_bytes);
+	STREAM_METRIC("dropped_bytes_total", "counter",
+		"Media bytes dropped for lagging consumers", dropped_bytes);
+	STREAM_METRIC("dropped_messages_total", "counter",
+		"Media messages dropped for lagging consumers", dropped_msgs);
+	STREAM_METRIC("record_lag_bytes", "gauge",
+		"Bytes queued for the recording and not yet written", record_lag_bytes);
+	STREAM_GAUGE("record_lag_seconds",
+		"How long the oldest unwritten recording bytes have waited",
+		record_lag_seconds);
+	STREAM_METRIC("record_dropped_messages_total", "counter",
+		"Messages left out of the recording because it fell behind",
+		record_dropped_msgs);
+
+#undef REACTOR_METRIC
+#undef STREAM_METRIC
+#undef STREAM_GAUGE
+
+	stats_format_pool(out);
+
+	if (!scrape->snaps[0].want_consumers) {
+		return;
+	}
+
+	stats_family(out, "telegenic_consumer_output_bytes", "gauge",
+		"Bytes queued for the consumer");
+	for (int i = 0; i < scrape->nsnaps; i++) {
+		snap = &scrape->snaps[i];
+		for (size_t j = 0; j < snap->nconsumers; j++) {
+			c = &snap->consumers[j];
+			stats_consumer_labels(out, "telegenic_consumer_output_bytes", snap, c);
+			evbuffer_add_printf(out, "%zu\n", c->output_bytes);
+		}
+	}
+	stats_family(out, "telegenic_consumer_lag_state", "gauge",
+		"0 delivering everything, 1 skipping inter frames, 2 skipping GOPs");
+	for (int i = 0; i < scrape->nsnaps; i++) {
+		snap = &scrape->snaps[i];
+		for (size_t j = 0; j < snap->nconsumers; j++) {
+			c = &snap->consumers[j];
+			stats_consumer_labels(out, "telegenic_consumer_lag_state", snap, c);
+			evbuffer_add_printf(out, "%d\n", c->lag);
+		}
+	}
+	stats_family(out, "telegenic_consumer_lag_seconds", "gauge",
+		"How long the output has stayed above the low watermark");
+	for (int i = 0; i < scrape->nsnaps; i++) {
+		snap = &scrape->snaps[i];
+		for (size_t j = 0; j < snap->nconsumers; j++) {
+			c = &snap->consumers[j];
+			stats_consumer_labels(out, "telegenic_consumer_lag_seconds", snap, c);
+			evbuffer_add_printf(out, "%.3f\n", c->lag_seconds);
+		}
+	}
+	stats_family(out, "telegenic_consumer_dropped_bytes_total", "counter",
+		"Media bytes dropped for the consumer");
+	for (int i = 0; i < scrape->nsnaps; i++) {
+		snap = &scrape->snaps[i];
+		for (size_t j = 0; j < snap->nconsumers; j++) {
+			c = &snap->consumers[j];
+			stats_consumer_labels(out, "telegenic_consumer_dropped_bytes_total", snap, c);
+			evbuffer_add_printf(out, "%lu\n", (unsigned long)c->dropped_bytes);
+		}
+	}
+}
+
+static void
+stats_written_cb(struct bufferevent *bev, void *ctx)
+{
+	stats_free_scrape(ctx);
+}
+
+static void
+stats_event_cb(struct bufferevent *bev, short events, void *ctx)
+{
+	struct stats_scrape *scrape = ctx;
+
+	if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+		// A scrape in flight frees the connection when it comes back
+		if (scrape->busy) {
+			scrape->gone = 1;
+			bufferevent_disable(bev, EV_READ|EV_WRITE);
+			return;
+		}
+		stats_free_scrape(scrape);
+	}
+}
+
+static void
+stats_respond_cb(void *arg)
+{
+	struct stats_scrape *scrape = arg;
+	struct evbuffer *body, *out;
+
+	scrape->busy = 0;
+	if (scrape->gone) {
+		stats_free_scrape(scrape);
+		return;
+	}
+
+	body = evbuffer_new();
+	stats_format(body, scrape);
+	out = bufferevent_get_output(scrape->bev);
+	evbuffer_add_printf(out, "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %zu\r\n\r\n", evbuffer_get_length(body));
+	evbuffer_add_buffer(out, body);
+	evbuffer_free(body);
+
+	// Close once the response has been written out
+	bufferevent_setwatermark(scrape->bev, EV_WRITE, 0, 0);
+	bufferevent_setcb(scrape->bev, NULL, stats_written_cb, stats_event_cb, scrape);
+	bufferevent_enable(scrape->bev, EV_WRITE);
+}
+
+// Runs on every reactor in turn; the last one to finish hands the scrape
+// back to the reactor serving the metrics port.
+static void
+stats_collect_cb(void *arg)
+{
+	struct stats_job *job = arg;
+	struct stats_scrape *scrape = job->scrape;
+	struct reactor *reactor = reactor_get(job->id);
+	struct stats_snapshot *snap = &scrape->snaps[job->id];
+
+	snap->reactor = reactor->stats;
+	reactor->stats.delay_max = 0;
+	conn_collect_stats(reactor, snap);
+
+	if (__atomic_sub_fetch(&scrape->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		reactor_post(scrape->home, stats_respond_cb, scrape);
+	}
+}
+
+static int
+stats_scrape(struct stats_scrape *scrape, int want_consumers)
+{
+	int n = reactor_count();
+
+	scrape->snaps = calloc(n, sizeof(struct stats_snapshot));
+	scrape->jobs = calloc(n, sizeof(struct stats_job));
+	if (scrape->snaps == NULL || scrape->jobs == NULL) {
+		return -1;
+	}
+	scrape->nsnaps = n;
+	scrape->pending = n;
+	scrape->busy = 1;
+
+	for (int i = 0; i < n; i++) {
+		scrape->snaps[i].want_consumers = want_consumers;
+		scrape->jobs[i].scrape = scrape;
+		scrape->jobs[i].id = i;
+	}
+	for (int i = 0; i < n; i++) {
+		if (reactor_post(reactor_get(i), stats_collect_cb, &scrape->jobs[i]) != 0) {
+			// The reactors already asked will still answer
+			log_err("Failed to post stats job to reactor %d", i);
+			if (__atomic_sub_fetch(&scrape->pending, n - i, __ATOMIC_ACQ_REL) == 0) {
+				stats_respond_cb(scrape);
+			}
+			return 0;
+		}
+	}
+	return 0;
+}
+
+static void
+stats_read_cb(struct bufferevent *bev, void *ctx)
+{
+	struct stats_scrape *scrape = ctx;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	struct evbuffer_ptr eoh;
+	char *line;
+	size_t len;
+	int want_consumers;
+
+	eoh = evbuffer_search(input, "\r\n\r\n", 4, NULL);
+	if (eoh.pos == -1) {
+		if (evbuffer_get_length(input) > STATS_MAX_REQUEST) {
+			stats_free_scrape(scrape);
+		}
+		return;
+	}
+
+	// Allocated by libevent, so by the pool
+	line = evbuffer_readln(input, &len, EVBUFFER_EOL_CRLF_STRICT);
+	bufferevent_disable(bev, EV_READ);
+	if (line == NULL || strncmp(line, "GET /", 5) != 0) {
+		pool_free(line);
+		evbuffer_add_printf(bufferevent_get_output(bev),
+			"HTTP/1.0 405 Method Not Allowed\r\n\r\n");
+		bufferevent_setcb(bev, NULL, stats_written_cb, stats_event_cb, scrape);
+		return;
+	}
+
+	// /metrics?consumers=1 adds a series per consumer
+	want_consumers = strstr(line, "consumers=1") != NULL;
+	pool_free(line);
+
+	if (stats_scrape(scrape, want_consumers) != 0) {
+		stats_free_scrape(scrape);
+	}
+}
+
+static void
+stats_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+	struct sockaddr *address, int socklen, void *ctx)
+{
+	struct reactor *reactor = ctx;
+	struct stats_scrape *scrape = calloc(1, sizeof(struct stats_scrape));
+
+	if (scrape == NULL) {
+		evutil_closesocket(fd);
+		return;
+	}
+	scrape->home = reactor;
+	scrape->bev = bufferevent_socket_new(reactor->base, fd, BEV_OPT_CLOSE_ON_FREE);
+	if (scrape->bev == NULL) {
+		log_err("Failed to set up metrics connection");
+		evutil_closesocket(fd);
+		free(scrape);
+		return;
+	}
+	bufferevent_setcb(scrape->bev, stats_read_cb, NULL, stats_event_cb, scrape);
+	bufferevent_enable(scrape->bev, EV_READ|EV_WRITE);
+}
+
+int
+stats_start(struct reactor *reactor, int port)
+{
+	struct sockaddr_in sin;
+	evutil_socket_t fd;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0);
+	sin.sin_port = htons(port);
+
+	// Taken over from the server this one replaces, which still has it
+	// bound
+	if ((fd = upgrade_stats_listener()) >= 0) {
+		listener = evconnlistener_new(reactor->base, stats_accept_cb, reactor,
+			LEV_OPT_CLOSE_ON_FREE|LEV_OPT_THREADSAFE, -1, fd);
+	} else {
+		listener = evconnlistener_new_bind(reactor->base, stats_accept_cb, reactor,
+			LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE|LEV_OPT_THREADSAFE, -1,
+			(struct sockaddr *)&sin, sizeof(sin));
+	}
+	if (listener == NULL) {
+		log_err("Couldn't create stats listener on port %d", port);
+		return -1;
+	}
+
+	log_info("Serving metrics on port %d", port);
+	return 0;
+}
+
+evutil_socket_t
+stats_listener_fd()
+{
+	return listener ? evconnlistener_get_fd(listener) : -1;
+}
+
+void
+stats_stop()
+{
+	if (listener) {
+		evconnlistener_free(listener);
+		listener = NULL;
+	}
+}
@@ -0,0 +1,65 @@
+#ifndef __TELEGENIC_STATS_H__
+#define __TELEGENIC_STATS_H__
+
+#include "reactor.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Metrics are served as Prometheus text from a listener of their own. A
+// scrape posts a job to every reactor, which copies its counters and walks
+// its own streams into a snapshot; only once every reactor has answered is
+// the response formatted. Nothing on the fan-out path is shared or atomic.
+
+// Counters are uint64_t and gauges that need a fraction double, so they
+// can be formatted by offset
+struct stats_stream {
+	char *path;
+	uint64_t ingest_bytes;
+	uint64_t consumers;
+	uint64_t lagging;
+	uint64_t output_bytes;
+	uint64_t output_max;
+	uint64_t gop_bytes;
+	uint64_t dropped_bytes;
+	uint64_t dropped_msgs;
+	uint64_t record_lag_bytes;
+	double record_lag_seconds;
+	uint64_t record_dropped_msgs;
+};
+
+struct stats_consumer {
+	size_t stream;          // index into the snapshot's streams
+	int fd;
+	size_t output_bytes;
+	int lag;
+	double lag_seconds;
+	uint64_t dropped_bytes;
+};
+
+// What one reactor reported for a scrape
+struct stats_snapshot {
+	struct reactor_stats reactor;
+	struct stats_stream *streams;
+	size_t nstreams;
+	size_t streams_cap;
+	// Only filled in when the scrape asks for per-consumer series
+	int want_consumers;
+	struct stats_consumer *consumers;
+	size_t nconsumers;
+	size_t consumers_cap;
+};
+
+struct stats_stream *stats_add_stream(struct stats_snapshot *snap);
+
+struct stats_consumer *stats_add_consumer(struct stats_snapshot *snap);
+
+// Serve metrics on port from the given reactor's event loop.
+int stats_start(struct reactor *reactor, int port);
+
+void stats_stop();
+
+// The metrics listener's socket, or -1 if there is none
+evutil_socket_t stats_listener_fd();
+
+#endif
@@ -0,0 +1,908 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include "upgrade.h"
+#include "config.h"
+#include "conn.h"
+#include "fanout.h"
+#include "log.h"
+#include "reactor.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <event2/listener.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define UPGRADE_MAGIC 0x74677570
+// Bumped whenever what either side sends changes, conn_save's records
+// included
+#define UPGRADE_VERSION 1
+// How long either side waits on the other
+#define UPGRADE_TIMEOUT_SECS 10
+// Bound on the listener specs a hello carries
+#define UPGRADE_MAX_HELLO 65536
+
+enum upgrade_type {
+	upgrade_rec_listener,   // a listening socket, its index as the payload
+	upgrade_rec_stats,      // the metrics listener
+	upgrade_rec_client,     // a client's socket and what conn_save wrote
+	upgrade_rec_end,
+	upgrade_rec_refused     // the old server won't hand over to this one
+};
+
+// What the new server says first
+struct upgrade_hello {
+	uint32_t magic;
+	uint32_t version;
+	int32_t reactors;
+	int32_t nlisteners;
+	int32_t stats_port;
+	// Of the listener specs that follow
+	uint32_t len;
+};
+
+// Ahead of every record's payload, with its socket attached
+struct upgrade_header {
+	uint32_t type;
+	int32_t reactor;
+	uint64_t len;
+};
+
+struct upgrade_record {
+	enum upgrade_type type;
+	int reactor;
+	int index;
+	evutil_socket_t fd;
+	struct evbuffer *buf;
+	struct upgrade_record *next;
+};
+
+struct upgrade_list {
+	struct upgrade_record *head;
+	struct upgrade_record **tail;
+};
+
+// Taken over by upgrade_receive, until upgrade_start picks it up
+static struct upgrade_list received = { NULL, &received.head };
+
+// Waiting for the next upgrade, on reactor 0's loop
+static struct evconnlistener *listener;
+static int upgrading;
+
+// Work done on every reactor at once, see upgrade_round
+static pthread_mutex_t round_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t round_cond = PTHREAD_COND_INITIALIZER;
+static int round_pending;
+// What the reactors saved, producers first so that their streams exist by
+// the time their consumers are restored
+static struct upgrade_list saved_producers = { NULL, &saved_producers.head };
+static struct upgrade_list saved_clients = { NULL, &saved_clients.head };
+
+void
+upgrade_put_u8(struct evbuffer *buf, uint8_t v)
+{
+	evbuffer_add(buf, &v, sizeof(v));
+}
+
+void
+upgrade_put_u32(struct evbuffer *buf, uint32_t v)
+{
+	evbuffer_add(buf, &v, sizeof(v));
+}
+
+void
+upgrade_put_u64(struct evbuffer *buf, uint64_t v)
+{
+	evbuffer_add(buf, &v, sizeof(v));
+}
+
+void
+upgrade_put_str(struct evbuffer *buf, const char *s, size_t len)
+{
+	upgrade_put_u32(buf, s ? len : UINT32_MAX);
+	if (s != NULL) {
+		evbuffer_add(buf, s, len);
+	}
+}
+
+void
+upgrade_put_buffer(struct evbuffer *buf, struct evbuffer *from)
+{
+	upgrade_put_u64(buf, evbuffer_get_length(from));
+	evbuffer_add_buffer(buf, from);
+}
+
+static int
+upgrade_get(struct evbuffer *buf, void *v, size_t len)
+{
+	if (evbuffer_get_length(buf) < len) {
+		return -1;
+	}
+	evbuffer_remove(buf, v, len);
+	return 0;
+}
+
+int
+upgrade_get_u8(struct evbuffer *buf, uint8_t *v)
+{
+	return upgrade_get(buf, v, sizeof(*v));
+}
+
+int
+upgrade_get_u32(struct evbuffer *buf, uint32_t *v)
+{
+	return upgrade_get(buf, v, sizeof(*v));
+}
+
+int
+upgrade_get_u64(struct evbuffer *buf, uint64_t *v)
+{
+	return upgrade_get(buf, v, sizeof(*v));
+}
+
+int
+upgrade_get_str(struct evbuffer *buf, char **s, size_t *len)
+{
+	uint32_t n;
+
+	*s = NULL;
+	if (upgrade_get_u32(buf, &n) != 0) {
+		return -1;
+	}
+	if (n == UINT32_MAX) {
+		return 0;
+	}
+	if (evbuffer_get_length(buf) < n || (*s = malloc(n + 1)) == NULL) {
+		return -1;
+	}
+	evbuffer_remove(buf, *s, n);
+	(*s)[n] = '\0';
+	*len = n;
+	return 0;
+}
+
+int
+upgrade_get_buffer(struct evbuffer *buf, struct evbuffer *to)
+{
+	uint64_t n;
+
+	if (upgrade_get_u64(buf, &n) != 0 || evbuffer_get_length(buf) < n) {
+		return -1;
+	}
+	evbuffer_remove_buffer(buf, to, n);
+	return 0;
+}
+
+static struct upgrade_record *
+upgrade_record_new(enum upgrade_type type)
+{
+	struct upgrade_record *rec = calloc(1, sizeof(struct upgrade_record));
+
+	if (rec == NULL) {
+		return NULL;
+	}
+	rec->type = type;
+	rec->fd = -1;
+	if ((rec->buf = evbuffer_new()) == NULL) {
+		free(rec);
+		return NULL;
+	}
+	return rec;
+}
+
+static void
+upgrade_record_free(struct upgrade_record *rec)
+{
+	if (rec->fd >= 0) {
+		evutil_closesocket(rec->fd);
+	}
+	evbuffer_free(rec->buf);
+	free(rec);
+}
+
+static void
+upgrade_list_add(struct upgrade_list *list, struct upgrade_record *rec)
+{
+	rec->next = NULL;
+	*list->tail = rec;
+	list->tail = &rec->next;
+}
+
+static void
+upgrade_list_append(struct upgrade_list *list, struct upgrade_list *from)
+{
+	if (from->head != NULL) {
+		*list->tail = from->head;
+		list->tail = from->tail;
+	}
+	from->head = NULL;
+	from->tail = &from->head;
+}
+
+static int
+upgrade_addr(struct sockaddr_un *sun)
+{
+	memset(sun, 0, sizeof(struct sockaddr_un));
+	sun->sun_family = AF_UNIX;
+	if (strlen(config.upgrade_path) >= sizeof(sun->sun_path)) {
+		log_err("Upgrade socket path too long: %s", config.upgrade_path);
+		return -1;
+	}
+	strcpy(sun->sun_path, config.upgrade_path);
+	return 0;
+}
+
+static void
+upgrade_timeout(int sock)
+{
+	struct timeval tv = { UPGRADE_TIMEOUT_SECS, 0 };
+
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Send all of buf without draining it: on the old server a client is
+// restored from its record should the new one give up
+static int
+upgrade_write(int sock, struct evbuffer *buf)
+{
+	struct evbuffer_iovec *v;
+	struct msghdr mh;
+	ssize_t sent;
+	int i = 0, n = evbuffer_peek(buf, -1, NULL, NULL, 0);
+
+	if (n == 0) {
+		return 0;
+	}
+	if ((v = malloc(n * sizeof(struct evbuffer_iovec))) == NULL) {
+		return -1;
+	}
+	evbuffer_peek(buf, -1, NULL, v, n);
+	while (i < n) {
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = (struct iovec *)&v[i];
+		mh.msg_iovlen = n - i < IOV_MAX ? n - i : IOV_MAX;
+		if ((sent = sendmsg(sock, &mh, MSG_NOSIGNAL)) <= 0) {
+			free(v);
+			return -1;
+		}
+		// What went out may end part way into a chunk
+		while (i < n && (size_t)sent >= v[i].iov_len) {
+			sent -= v[i].iov_len;
+			i++;
+		}
+		if (i < n) {
+			v[i].iov_base = (char *)v[i].iov_base + sent;
+			v[i].iov_len -= sent;
+		}
+	}
+	free(v);
+	return 0;
+}
+
+// Read exactly len bytes into buf
+static int
+upgrade_read(int sock, struct evbuffer *buf, size_t len)
+{
+	size_t want = evbuffer_get_length(buf) + len;
+	int n;
+
+	while (evbuffer_get_length(buf) < want) {
+		n = evbuffer_read(buf, sock, want - evbuffer_get_length(buf));
+		if (n <= 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+upgrade_send(int sock, enum upgrade_type type, int reactor, evutil_socket_t fd,
+	struct evbuffer *buf)
+{
+	struct upgrade_header hdr = {
+		type, reactor, buf ? evbuffer_get_length(buf) : 0
+	};
+	struct iovec iov = { &hdr, sizeof(hdr) };
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if (fd >= 0) {
+		mh.msg_control = ctl.buf;
+		mh.msg_controllen = sizeof(ctl.buf);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	if (sendmsg(sock, &mh, MSG_NOSIGNAL) != sizeof(hdr)) {
+		return -1;
+	}
+	return buf ? upgrade_write(sock, buf) : 0;
+}
+
+static struct upgrade_record *
+upgrade_recv(int sock)
+{
+	struct upgrade_header hdr;
+	struct iovec iov = { &hdr, sizeof(hdr) };
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	struct upgrade_record *rec;
+	uint32_t index;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = ctl.buf;
+	mh.msg_controllen = sizeof(ctl.buf);
+	if (recvmsg(sock, &mh, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(hdr)) {
+		log_err("Upgrade cut short: %s", strerror(errno));
+		return NULL;
+	}
+	if ((rec = upgrade_record_new(hdr.type)) == NULL) {
+		return NULL;
+	}
+	rec->reactor = hdr.reactor;
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			memcpy(&rec->fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+	if ((mh.msg_flags & MSG_CTRUNC) || upgrade_read(sock, rec->buf, hdr.len) != 0) {
+		log_err("Upgrade cut short");
+		upgrade_record_free(rec);
+		return NULL;
+	}
+
+	// Only ever sent for the same reactors and listeners this server has
+	switch (rec->type) {
+		case upgrade_rec_listener:
+			if (upgrade_get_u32(rec->buf, &index) != 0 ||
+				index >= (uint32_t)config.nlisteners) {
+				break;
+			}
+			rec->index = index;
+			// Fall through
+		case upgrade_rec_client:
+			if (rec->fd < 0 || rec->reactor < 0 || rec->reactor >= config.reactors) {
+				break;
+			}
+			return rec;
+
+		case upgrade_rec_stats:
+			if (rec->fd < 0) {
+				break;
+			}
+			return rec;
+
+		case upgrade_rec_end:
+		case upgrade_rec_refused:
+			return rec;
+	}
+	log_err("Invalid upgrade record of type %d", rec->type);
+	upgrade_record_free(rec);
+	return NULL;
+}
+
+static void
+upgrade_discard(struct upgrade_list *list)
+{
+	struct upgrade_record *rec, *next;
+
+	for (rec = list->head; rec; rec = next) {
+		next = rec->next;
+		upgrade_record_free(rec);
+	}
+	list->head = NULL;
+	list->tail = &list->head;
+}
+
+static int
+upgrade_hello(int sock)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct evbuffer *specs = evbuffer_new();
+	struct upgrade_hello hello = {
+		UPGRADE_MAGIC, UPGRADE_VERSION, config.reactors, config.nlisteners,
+		config.stats_port, 0
+	};
+	int ret = -1;
+
+	if (buf != NULL && specs != NULL) {
+		for (int i = 0; i < config.nlisteners; i++) {
+			upgrade_put_str(specs, config.listeners[i].spec,
+				strlen(config.listeners[i].spec));
+		}
+		hello.len = evbuffer_get_length(specs);
+		evbuffer_add(buf, &hello, sizeof(hello));
+		evbuffer_add_buffer(buf, specs);
+		ret = upgrade_write(sock, buf);
+	}
+	if (buf) {
+		evbuffer_free(buf);
+	}
+	if (specs) {
+		evbuffer_free(specs);
+	}
+	return ret;
+}
+
+int
+upgrade_receive()
+{
+	struct sockaddr_un sun;
+	struct upgrade_record *rec;
+	int sock, clients = 0;
+	char ack = 1;
+
+	if (config.upgrade_path == NULL) {
+		return 0;
+	}
+	if (upgrade_addr(&sun) != 0) {
+		return -1;
+	}
+	if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		log_err("Couldn't create upgrade socket: %s", strerror(errno));
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+		// Nothing running to take over from
+		if (errno == ENOENT || errno == ECONNREFUSED) {
+			close(sock);
+			return 0;
+		}
+		log_err("Couldn't connect to %s: %s", config.upgrade_path, strerror(errno));
+		close(sock);
+		return -1;
+	}
+	upgrade_timeout(sock);
+
+	log_info("Taking over from the server at %s", config.upgrade_path);
+	if (upgrade_hello(sock) != 0) {
+		log_err("Failed to send upgrade hello");
+		goto fail;
+	}
+	while ((rec = upgrade_recv(sock)) != NULL) {
+		if (rec->type == upgrade_rec_end) {
+			upgrade_record_free(rec);
+			break;
+		}
+		if (rec->type == upgrade_rec_refused) {
+			log_err("The server at %s refused to hand over, see its log",
+				config.upgrade_path);
+			upgrade_record_free(rec);
+			goto fail;
+		}
+		clients += rec->type == upgrade_rec_client;
+		upgrade_list_add(&received, rec);
+	}
+	if (rec == NULL) {
+		goto fail;
+	}
+
+	// The old server lets go of everything once it hears this
+	if (send(sock, &ack, 1, MSG_NOSIGNAL) != 1) {
+		log_err("Failed to acknowledge upgrade");
+		goto fail;
+	}
+	close(sock);
+	log_info("Took over %d clients", clients);
+	return 0;
+
+fail:
+	upgrade_discard(&received);
+	close(sock);
+	return -1;
+}
+
+evutil_socket_t
+upgrade_listener(int reactor, int index)
+{
+	struct upgrade_record *rec;
+	evutil_socket_t fd;
+
+	for (rec = received.head; rec; rec = rec->next) {
+		if (rec->type == upgrade_rec_listener && rec->reactor == reactor &&
+			rec->index == index && rec->fd >= 0) {
+			fd = rec->fd;
+			rec->fd = -1;
+			return fd;
+		}
+	}
+	return -1;
+}
+
+evutil_socket_t
+upgrade_stats_listener()
+{
+	struct upgrade_record *rec;
+	evutil_socket_t fd;
+
+	for (rec = received.head; rec; rec = rec->next) {
+		if (rec->type == upgrade_rec_stats && rec->fd >= 0) {
+			fd = rec->fd;
+			rec->fd = -1;
+			return fd;
+		}
+	}
+	return -1;
+}
+
+static void
+upgrade_done()
+{
+	pthread_mutex_lock(&round_lock);
+	if (--round_pending == 0) {
+		pthread_cond_signal(&round_cond);
+	}
+	pthread_mutex_unlock(&round_lock);
+}
+
+// Run fn on every reactor and wait for all of them to have. Jobs run in
+// the order they are posted, so whatever a reactor posted to another
+// before its round runs there first.
+static void
+upgrade_round(void (*fn)(void *))
+{
+	int n = reactor_count();
+
+	pthread_mutex_lock(&round_lock);
+	round_pending = n;
+	pthread_mutex_unlock(&round_lock);
+	for (int i = 0; i < n; i++) {
+		if (reactor_post(reactor_get(i), fn, reactor_get(i)) != 0) {
+			log_err("Failed to post upgrade work to reactor %d", i);
+			upgrade_done();
+		}
+	}
+	pthread_mutex_lock(&round_lock);
+	while (round_pending > 0) {
+		pthread_cond_wait(&round_cond, &round_lock);
+	}
+	pthread_mutex_unlock(&round_lock);
+}
+
+// Stop accepting and reading so that nothing changes until the clients
+// are saved. Output still drains.
+static void
+upgrade_freeze_cb(void *arg)
+{
+	struct reactor *reactor = arg;
+	struct conn_client *client;
+
+	reactor->frozen = 1;
+	for (int i = 0; i < reactor->nlisteners; i++) {
+		evconnlistener_disable(reactor->listeners[i].evl);
+	}
+	for (client = reactor->clients; client; client = client->next) {
+		if (client->bev) {
+			bufferevent_disable(client->bev, EV_READ);
+		}
+	}
+	upgrade_done();
+}
+
+static void
+upgrade_save_cb(void *arg)
+{
+	struct reactor *reactor = arg;
+	struct upgrade_list producers = { NULL, &producers.head };
+	struct upgrade_list clients = { NULL, &clients.head };
+	struct upgrade_record *rec;
+	struct producer *producer;
+	struct conn_client *client;
+	struct reactor *to;
+
+	// Whatever the streams' own reactors published before they froze
+	for (producer = reactor->producers; producer; producer = producer->next) {
+		if (producer->shard) {
+			fanout_flush(producer->shard);
+		}
+	}
+
+	for (client = reactor->clients; client; client = client->next) {
+		if ((rec = upgrade_record_new(upgrade_rec_client)) == NULL) {
+			continue;
+		}
+		if ((rec->fd = conn_save(client, rec->buf, &to)) < 0) {
+			upgrade_record_free(rec);
+			continue;
+		}
+		rec->reactor = to->id;
+		upgrade_list_add(client->is_producer && client->producer ?
+			&producers : &clients, rec);
+	}
+
+	pthread_mutex_lock(&round_lock);
+	upgrade_list_append(&saved_producers, &producers);
+	upgrade_list_append(&saved_clients, &clients);
+	pthread_mutex_unlock(&round_lock);
+	upgrade_done();
+}
+
+// Every client has been saved, and had its socket let go of. Consumers go
+// first, as a stream closing takes its consumers with it. Whatever is
+// restored here after a failed upgrade is taken on as usual.
+static void
+upgrade_teardown_cb(void *arg)
+{
+	struct reactor *reactor = arg;
+	struct conn_client *client, *next;
+
+	reactor->frozen = 0;
+	for (client = reactor->clients; client; client = next) {
+		next = client->next;
+		if (!client->is_producer || client->producer == NULL) {
+			conn_close_client(client);
+		}
+	}
+	while (reactor->clients) {
+		conn_close_client(reactor->clients);
+	}
+	upgrade_done();
+}
+
+static void
+upgrade_listen_cb(void *arg)
+{
+	struct reactor *reactor = arg;
+
+	for (int i = 0; i < reactor->nlisteners; i++) {
+		evconnlistener_enable(reactor->listeners[i].evl);
+	}
+	upgrade_done();
+}
+
+static void
+upgrade_restore_cb(void *arg)
+{
+	struct upgrade_record *rec = arg;
+
+	if (conn_restore(reactor_get(rec->reactor), rec->fd, rec->buf) != 0) {
+		log_info("Failed to restore a client on reactor %d", rec->reactor);
+	}
+	rec->fd = -1;
+	upgrade_record_free(rec);
+}
+
+// Restore every client in list on its reactor, in order
+static int
+upgrade_resume(struct upgrade_list *list)
+{
+	struct upgrade_record *rec, *next;
+	int n = 0;
+
+	for (rec = list->head; rec; rec = next) {
+		next = rec->next;
+		if (rec->type != upgrade_rec_client) {
+			upgrade_record_free(rec);
+		} else if (reactor_post(reactor_get(rec->reactor), upgrade_restore_cb,
+			rec) != 0) {
+			log_err("Failed to restore a client on reactor %d", rec->reactor);
+			upgrade_record_free(rec);
+		} else {
+			n++;
+		}
+	}
+	list->head = NULL;
+	list->tail = &list->head;
+	return n;
+}
+
+// Whether a new server can carry on from this one
+static int
+upgrade_check(int sock, int *stats)
+{
+	struct upgrade_hello hello;
+	struct evbuffer *specs;
+	char *spec;
+	size_t len;
+	int ret = 0;
+
+	if (recv(sock, &hello, sizeof(hello), MSG_WAITALL) != sizeof(hello)) {
+		log_err("No hello from the new server");
+		return -1;
+	}
+	if (hello.magic != UPGRADE_MAGIC || hello.version != UPGRADE_VERSION) {
+		log_err("Refusing to hand over to an incompatible server");
+		return -1;
+	}
+	if (hello.reactors != reactor_count() || hello.nlisteners != config.nlisteners) {
+		log_err("Refusing to hand over to a server with %d reactors and %d "
+			"listeners rather than %d and %d", hello.reactors, hello.nlisteners,
+			reactor_count(), config.nlisteners);
+		return -1;
+	}
+	if (hello.len > UPGRADE_MAX_HELLO || (specs = evbuffer_new()) == NULL) {
+		return -1;
+	}
+	if (upgrade_read(sock, specs, hello.len) != 0) {
+		evbuffer_free(specs);
+		return -1;
+	}
+	for (int i = 0; i < config.nlisteners && ret == 0; i++) {
+		if (upgrade_get_str(specs, &spec, &len) != 0 || spec == NULL) {
+			ret = -1;
+		} else if (strcmp(spec, config.listeners[i].spec) != 0) {
+			log_err("Refusing to hand over listener %s to a server listening "
+				"on %s", config.listeners[i].spec, spec);
+			ret = -1;
+		}
+		free(spec);
+	}
+	evbuffer_free(specs);
+	*stats = config.stats_port && hello.stats_port == config.stats_port;
+	return ret;
+}
+
+static int
+upgrade_send_all(int sock, struct upgrade_list *list, int stats)
+{
+	struct upgrade_record *rec;
+	struct reactor *reactor;
+	struct evbuffer *buf;
+	int ret = 0;
+
+	if ((buf = evbuffer_new()) == NULL) {
+		return -1;
+	}
+	for (int i = 0; i < reactor_count() && ret == 0; i++) {
+		reactor = reactor_get(i);
+		for (int j = 0; j < reactor->nlisteners && ret == 0; j++) {
+			upgrade_put_u32(buf, j);
+			ret = upgrade_send(sock, upgrade_rec_listener, i,
+				evconnlistener_get_fd(reactor->listeners[j].evl), buf);
+			evbuffer_drain(buf, evbuffer_get_length(buf));
+		}
+	}
+	evbuffer_free(buf);
+	if (ret == 0 && stats) {
+		ret = upgrade_send(sock, upgrade_rec_stats, -1, stats_listener_fd(), NULL);
+	}
+	for (rec = list->head; rec && ret == 0; rec = rec->next) {
+		ret = upgrade_send(sock, rec->type, rec->reactor, rec->fd, rec->buf);
+	}
+	if (ret == 0) {
+		ret = upgrade_send(sock, upgrade_rec_end, -1, -1, NULL);
+	}
+	return ret;
+}
+
+// Hands everything over to the new server on sock, off the reactors, which
+// it stops and starts through posted work
+static void *
+upgrade_run(void *arg)
+{
+	int sock = (intptr_t)arg, stats = 0, n = 0;
+	struct upgrade_list list = { NULL, &list.head };
+	struct upgrade_record *rec;
+	char ack;
+
+	upgrade_timeout(sock);
+	if (upgrade_check(sock, &stats) != 0) {
+		upgrade_send(sock, upgrade_rec_refused, -1, -1, NULL);
+		goto out;
+	}
+
+	log_info("Handing over to a new server");
+	upgrade_round(upgrade_freeze_cb);
+	upgrade_round(upgrade_save_cb);
+	upgrade_list_append(&list, &saved_producers);
+	upgrade_list_append(&list, &saved_clients);
+	for (rec = list.head; rec; rec = rec->next) {
+		n++;
+	}
+
+	if (upgrade_send_all(sock, &list, stats) == 0 && recv(sock, &ack, 1, 0) == 1) {
+		upgrade_round(upgrade_teardown_cb);
+		upgrade_discard(&list);
+		log_info("Handed %d clients over, exiting", n);
+		close(sock);
+		reactor_stop();
+		return NULL;
+	}
+
+	// Carry on as if nothing happened, bar the clients that couldn't be
+	// saved
+	log_err("Upgrade failed, carrying on with %d clients", n);
+	upgrade_round(upgrade_teardown_cb);
+	upgrade_resume(&list);
+	upgrade_round(upgrade_listen_cb);
+
+out:
+	close(sock);
+	__atomic_store_n(&upgrading, 0, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void
+upgrade_accept_cb(struct evconnlistener *l, evutil_socket_t fd,
+	struct sockaddr *address, int socklen, void *ctx)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	pthread_t thread;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 ||
+		cred.uid != geteuid()) {
+		log_info("Refusing upgrade from another user");
+		evutil_closesocket(fd);
+		return;
+	}
+	if (__atomic_exchange_n(&upgrading, 1, __ATOMIC_ACQ_REL)) {
+		log_info("Refusing upgrade, one is already under way");
+		evutil_closesocket(fd);
+		return;
+	}
+	if (pthread_create(&thread, NULL, upgrade_run, (void *)(intptr_t)fd) != 0) {
+		log_err("Failed to start upgrade thread");
+		evutil_closesocket(fd);
+		__atomic_store_n(&upgrading, 0, __ATOMIC_RELEASE);
+		return;
+	}
+	pthread_detach(thread);
+}
+
+int
+upgrade_start(struct reactor *reactor)
+{
+	struct sockaddr_un sun;
+	int n;
+
+	if (config.upgrade_path == NULL) {
+		return 0;
+	}
+	if (received.head != NULL) {
+		n = upgrade_resume(&received);
+		upgrade_round(upgrade_listen_cb);
+		log_info("Resumed %d clients", n);
+	}
+
+	// Whoever was waiting here before has handed over, or is gone
+	if (upgrade_addr(&sun) != 0) {
+		return -1;
+	}
+	unlink(config.upgrade_path);
+	listener = evconnlistener_new_bind(reactor->base, upgrade_accept_cb, NULL,
+		LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC |
+		LEV_OPT_LEAVE_SOCKETS_BLOCKING, 1, (struct sockaddr *)&sun, sizeof(sun));
+	if (listener == NULL) {
+		log_err("Couldn't listen for upgrades on %s", config.upgrade_path);
+		return -1;
+	}
+	if (chmod(config.upgrade_path, 0600) != 0) {
+		log_err("Couldn't restrict %s: %s", config.upgrade_path, strerror(errno));
+	}
+	log_info("Waiting for upgrades on %s", config.upgrade_path);
+	return 0;
+}
+
+void
+upgrade_stop()
+{
+	// The socket file is the next server's by now, if there is one
+	if (listener) {
+		evconnlistener_free(listener);
+		listener = NULL;
+	}
+}
@@ -0,0 +1,72 @@
+#ifndef __TELEGENIC_UPGRADE_H__
+#define __TELEGENIC_UPGRADE_H__
+
+#include <event2/buffer.h>
+#include <event2/util.h>
+#include <stdint.h>
+
+// Binary upgrades without dropping a connection (-U path). A running
+// server waits for its successor on a Unix socket at path. A new server
+// started with the same -U connects there before it binds anything, and
+// the old one:
+//
+//   - stops accepting and reading on every reactor,
+//   - saves every client: its socket, what is buffered either way, its
+//     RTMP chunk state, the stream it publishes or plays and, for a
+//     producer, the GOP a new consumer starts from,
+//   - passes the listening sockets and the clients' sockets over with
+//     SCM_RIGHTS, the saved state alongside,
+//   - and once the new server has all of it, closes its streams and exits.
+//
+// The new server picks the clients up where they were, on the reactors
+// that own their streams now, before it starts accepting on the listeners
+// it was given, so nothing connecting meanwhile is refused either: it
+// waits in the listen backlog. It then waits at path for the next upgrade.
+// If the new server gives up halfway, the old one carries on with the
+// clients itself.
+//
+// Both servers must run the same number of reactors with the same
+// listeners, or the old one refuses. HLS requests in flight are closed,
+// and recordings, HLS and time-shift windows start afresh in the new
+// server; time-shifted consumers carry on live.
+
+struct reactor;
+
+// Take over from the server waiting at the -U path, if there is one.
+// Returns 0 if there was none, or once everything has been received, and
+// -1 if there was one but taking over failed. Runs before reactor_start.
+int upgrade_receive();
+
+// The socket taken over for the listener at index on reactor, or -1 if
+// there is none and one should be bound
+evutil_socket_t upgrade_listener(int reactor, int index);
+
+// The same for the metrics listener
+evutil_socket_t upgrade_stats_listener();
+
+// Carry on with the clients upgrade_receive took over, start accepting
+// and wait at the -U path for the next upgrade on reactor's loop
+int upgrade_start(struct reactor *reactor);
+
+// Stop waiting for upgrades, before the reactors are torn down
+void upgrade_stop();
+
+// The state of a client, as written by conn_save and read back by
+// conn_restore. Reads return -1 if buf is short, which leaves the record
+// unusable.
+void upgrade_put_u8(struct evbuffer *buf, uint8_t v);
+void upgrade_put_u32(struct evbuffer *buf, uint32_t v);
+void upgrade_put_u64(struct evbuffer *buf, uint64_t v);
+// A string of len bytes, or NULL
+void upgrade_put_str(struct evbuffer *buf, const char *s, size_t len);
+// Moves everything in from to buf
+void upgrade_put_buffer(struct evbuffer *buf, struct evbuffer *from);
+
+int upgrade_get_u8(struct evbuffer *buf, uint8_t *v);
+int upgrade_get_u32(struct evbuffer *buf, uint32_t *v);
+int upgrade_get_u64(struct evbuffer *buf, uint64_t *v);
+// *s is allocated and NUL-terminated, or NULL
+int upgrade_get_str(struct evbuffer *buf, char **s, size_t *len);
+int upgrade_get_buffer(struct evbuffer *buf, struct evbuffer *to);
+
+#endif
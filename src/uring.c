@@ -0,0 +1,782 @@
+#include "uring.h"
+#include "config.h"
+#include "conn.h"
+#include "log.h"
+#include "reactor.h"
+
+#include <errno.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_URING
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define URING_ENTRIES 4096
+// Receive buffers shared by every connection on a reactor. Each is only
+// held until its bytes are copied into a connection's input.
+#define URING_BUFS 256
+#define URING_BUF_SIZE (16 * 1024)
+#define URING_BGID 0
+// Most output chains handed to one sendmsg
+#define URING_IOVECS 32
+// Rounds of submitting and reaping inline completions per flush
+#define URING_FLUSH_ROUNDS 4
+
+// What a completion is for, in the low bits of its user_data
+enum uring_op {
+	uring_op_accept,
+	uring_op_recv,
+	uring_op_send,
+	uring_op_cancel
+};
+
+#define URING_OP_MASK 3
+
+struct uring {
+	struct reactor *reactor;
+	int fd;
+	int efd;                // signalled on every completion
+	struct event *ev;
+	uint32_t accept_armed;  // by listener
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_flags;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sq_queued;     // tail of the SQEs filled in so far
+	unsigned sq_submitted;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_len;
+	void *cq_ring;
+	size_t cq_ring_len;
+	size_t sqes_len;
+
+	struct io_uring_buf_ring *br;
+	size_t br_len;
+	unsigned short br_tail;
+	char *bufs;
+
+	// Connections with I/O to start at the next flush
+	struct uring_conn *queue_head;
+	struct uring_conn *queue_tail;
+};
+
+struct uring_conn {
+	struct uring *ring;
+	struct bufferevent *bev;
+	struct evbuffer_cb_entry *output_cb;
+	// What the kernel is sending; taken from the output a chain at a time
+	// so nothing queued behind it can move the bytes
+	struct evbuffer *inflight;
+	struct uring_conn *next;
+	void (*detach_fn)(void *);
+	void *detach_arg;
+	int fd;
+	int refs;               // the owner's, the queue's and one per op in flight
+	uint8_t recving;
+	uint8_t sending;
+	uint8_t queued;
+	uint8_t closed;
+	struct msghdr msg;
+	struct iovec iov[URING_IOVECS];
+};
+
+static int
+uring_sys_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int
+uring_sys_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int
+uring_submit(struct uring *ring)
+{
+	unsigned n = ring->sq_queued - ring->sq_submitted;
+	int ret;
+
+	if (n == 0) {
+		return 0;
+	}
+	__atomic_store_n(ring->sq_tail, ring->sq_queued, __ATOMIC_RELEASE);
+	ret = uring_sys_enter(ring->fd, n, 0, 0);
+	ring->reactor->stats.uring_submits++;
+	if (ret < 0) {
+		// Out of completion queue space; reaping makes room
+		if (errno == EAGAIN || errno == EBUSY || errno == EINTR) {
+			return 0;
+		}
+		log_err("Failed to submit to io_uring");
+		return -1;
+	}
+	ring->sq_submitted += ret;
+	return ret;
+}
+
+static struct io_uring_sqe *
+uring_get_sqe(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	if (ring->sq_queued - head >= ring->sq_entries) {
+		uring_submit(ring);
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (ring->sq_queued - head >= ring->sq_entries) {
+			return NULL;
+		}
+	}
+	sqe = &ring->sqes[ring->sq_queued & ring->sq_mask];
+	ring->sq_queued++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static void
+uring_buf_recycle(struct uring *ring, unsigned short bid)
+{
+	struct io_uring_buf *buf = &ring->br->bufs[ring->br_tail & (URING_BUFS - 1)];
+
+	// Only these fields: the first entry's reserved field is the ring tail
+	buf->addr = (uintptr_t)(ring->bufs + (size_t)bid * URING_BUF_SIZE);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	ring->br_tail++;
+	__atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+static void
+uring_conn_release(struct uring_conn *uc)
+{
+	struct evbuffer *out;
+
+	if (--uc->refs > 0) {
+		return;
+	}
+
+	out = bufferevent_get_output(uc->bev);
+	evbuffer_remove_cb_entry(out, uc->output_cb);
+	if (uc->detach_fn) {
+		// Whatever was not sent goes back in front of the rest
+		if (uc->inflight) {
+			evbuffer_prepend_buffer(out, uc->inflight);
+		}
+		uc->detach_fn(uc->detach_arg);
+	} else {
+		close(uc->fd);
+	}
+	if (uc->inflight) {
+		evbuffer_free(uc->inflight);
+	}
+	bufferevent_decref(uc->bev);
+	free(uc);
+}
+
+static void
+uring_conn_queue(struct uring_conn *uc)
+{
+	struct uring *ring = uc->ring;
+
+	if (uc->queued || uc->closed) {
+		return;
+	}
+	uc->queued = 1;
+	uc->refs++;
+	uc->next = NULL;
+	if (ring->queue_tail) {
+		ring->queue_tail->next = uc;
+	} else {
+		ring->queue_head = uc;
+	}
+	ring->queue_tail = uc;
+}
+
+static void
+uring_output_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info,
+	void *arg)
+{
+	if (info->n_added > 0) {
+		uring_conn_queue(arg);
+	}
+}
+
+static void
+uring_arm_accept(struct uring *ring, int i)
+{
+	struct reactor_listener *l = &ring->reactor->listeners[i];
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+	if (sqe == NULL) {
+		return;
+	}
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = evconnlistener_get_fd(l->evl);
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = (uintptr_t)l | uring_op_accept;
+	ring->accept_armed |= 1u << i;
+}
+
+static void
+uring_arm_recv(struct uring_conn *uc)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(uc->ring);
+
+	if (sqe == NULL) {
+		uring_conn_queue(uc);
+		return;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = uc->fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->user_data = (uintptr_t)uc | uring_op_recv;
+	uc->recving = 1;
+	uc->refs++;
+}
+
+static void
+uring_send(struct uring_conn *uc)
+{
+	struct evbuffer *out = bufferevent_get_output(uc->bev);
+	struct io_uring_sqe *sqe;
+	size_t len = 0;
+	int n, i;
+
+	if (uc->inflight == NULL && (uc->inflight = evbuffer_new()) == NULL) {
+		return;
+	}
+
+	if (evbuffer_get_length(uc->inflight) == 0) {
+		n = evbuffer_peek(out, -1, NULL, uc->iov, URING_IOVECS);
+		if (n > URING_IOVECS) {
+			n = URING_IOVECS;
+		}
+		for (i = 0; i < n; i++) {
+			if (i > 0 && len + uc->iov[i].iov_len > CONN_MAX_WRITE) {
+				break;
+			}
+			len += uc->iov[i].iov_len;
+		}
+		if (len == 0) {
+			return;
+		}
+		// Whole chains, so they move rather than being copied
+		evbuffer_remove_buffer(out, uc->inflight, len);
+	}
+
+	if ((sqe = uring_get_sqe(uc->ring)) == NULL) {
+		uring_conn_queue(uc);
+		return;
+	}
+	n = evbuffer_peek(uc->inflight, -1, NULL, uc->iov, URING_IOVECS);
+	uc->msg.msg_iov = uc->iov;
+	uc->msg.msg_iovlen = n < URING_IOVECS ? n : URING_IOVECS;
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = uc->fd;
+	sqe->addr = (uintptr_t)&uc->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (uintptr_t)uc | uring_op_send;
+	uc->sending = 1;
+	uc->refs++;
+}
+
+static int
+uring_conn_pending(struct uring_conn *uc)
+{
+	return (uc->inflight && evbuffer_get_length(uc->inflight) > 0) ||
+		evbuffer_get_length(bufferevent_get_output(uc->bev)) > 0;
+}
+
+static void
+uring_recv_done(struct uring *ring, struct uring_conn *uc, int res,
+	unsigned flags)
+{
+	int more = flags & IORING_CQE_F_MORE;
+
+	if (flags & IORING_CQE_F_BUFFER) {
+		unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		// A detaching connection keeps what arrived for its next reactor
+		if (res > 0 && (!uc->closed || uc->detach_fn)) {
+			evbuffer_add(bufferevent_get_input(uc->bev),
+				ring->bufs + (size_t)bid * URING_BUF_SIZE, res);
+		}
+		uring_buf_recycle(ring, bid);
+	}
+	if (!more) {
+		uc->recving = 0;
+	}
+
+	if (!uc->closed) {
+		if (res > 0) {
+			if (bufferevent_get_enabled(uc->bev) & EV_READ) {
+				bufferevent_trigger(uc->bev, EV_READ, 0);
+			}
+		} else if (res == 0) {
+			bufferevent_trigger_event(uc->bev, BEV_EVENT_EOF | BEV_EVENT_READING, 0);
+		} else if (res != -ENOBUFS) {
+			errno = -res;
+			bufferevent_trigger_event(uc->bev, BEV_EVENT_ERROR | BEV_EVENT_READING, 0);
+		}
+	}
+
+	if (!more) {
+		// Out of buffers or the kernel ended it: receive again next flush
+		if (res != 0) {
+			uring_conn_queue(uc);
+		}
+		uring_conn_release(uc);
+	}
+}
+
+static void
+uring_send_done(struct uring_conn *uc, int res)
+{
+	uc->sending = 0;
+	if (res > 0) {
+		evbuffer_drain(uc->inflight, res);
+	}
+
+	if (!uc->closed) {
+		if (res < 0) {
+			errno = -res;
+			bufferevent_trigger_event(uc->bev, BEV_EVENT_ERROR | BEV_EVENT_WRITING, 0);
+		} else {
+			if (uring_conn_pending(uc)) {
+				uring_conn_queue(uc);
+			}
+			bufferevent_trigger(uc->bev, EV_WRITE, 0);
+		}
+	}
+	uring_conn_release(uc);
+}
+
+static void
+uring_complete(struct uring *ring, uint64_t data, int res, unsigned flags)
+{
+	void *ptr = (void *)(uintptr_t)(data & ~(uint64_t)URING_OP_MASK);
+	struct reactor_listener *l;
+
+	switch (data & URING_OP_MASK) {
+		case uring_op_accept:
+			l = ptr;
+			if (res >= 0) {
+				conn_accept(ring->reactor, res, l->conf->role);
+			} else if (res != -ECANCELED) {
+				errno = -res;
+				log_err("Accept error on %s", l->conf->spec);
+			}
+			if (!(flags & IORING_CQE_F_MORE)) {
+				ring->accept_armed &= ~(1u << (l - ring->reactor->listeners));
+			}
+			break;
+
+		case uring_op_recv:
+			uring_recv_done(ring, ptr, res, flags);
+			break;
+
+		case uring_op_send:
+			uring_send_done(ptr, res);
+			break;
+
+		case uring_op_cancel:
+			uring_conn_release(ptr);
+			break;
+	}
+}
+
+static int
+uring_reap(struct uring *ring)
+{
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	struct io_uring_cqe *cqe;
+	uint64_t data;
+	unsigned flags;
+	int res, n = 0;
+
+	// Completions that found the queue full wait in the kernel until asked for
+	if (__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+		uring_sys_enter(ring->fd, 0, 0, IORING_ENTER_GETEVENTS);
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	}
+
+	while (head != tail) {
+		cqe = &ring->cqes[head & ring->cq_mask];
+		data = cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+		__atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+
+		uring_complete(ring, data, res, flags);
+		n++;
+		if (head == tail) {
+			tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		}
+	}
+	return n;
+}
+
+static void
+uring_event_cb(evutil_socket_t fd, short events, void *ctx)
+{
+	struct uring *ring = ctx;
+	uint64_t count;
+
+	if (read(ring->efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		log_err("Failed to read io_uring eventfd");
+	}
+	uring_reap(ring);
+}
+
+void
+uring_flush(struct uring *ring)
+{
+	struct uring_conn *uc, *next;
+
+	for (int round = 0; round < URING_FLUSH_ROUNDS; round++) {
+		for (int i = 0; i < ring->reactor->nlisteners; i++) {
+			if (!(ring->accept_armed & 1u << i)) {
+				uring_arm_accept(ring, i);
+			}
+		}
+
+		uc = ring->queue_head;
+		ring->queue_head = ring->queue_tail = NULL;
+		for (; uc; uc = next) {
+			next = uc->next;
+			uc->queued = 0;
+			if (!uc->closed) {
+				if (!uc->recving) {
+					uring_arm_recv(uc);
+				}
+				if (!uc->sending && uring_conn_pending(uc)) {
+					uring_send(uc);
+				}
+			}
+			uring_conn_release(uc);
+		}
+
+		uring_submit(ring);
+		// Whatever completed on submission is handled without another wakeup
+		if (uring_reap(ring) == 0 && ring->queue_head == NULL) {
+			return;
+		}
+	}
+
+	// Still busy: come straight back rather than wait for the eventfd
+	event_active(ring->ev, EV_READ, 0);
+}
+
+static void
+uring_close_ring(struct uring *ring)
+{
+	if (ring->ev) {
+		event_free(ring->ev);
+	}
+	if (ring->efd >= 0) {
+		close(ring->efd);
+	}
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->sqes_len);
+	}
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_len);
+	}
+	if (ring->sq_ring) {
+		munmap(ring->sq_ring, ring->sq_ring_len);
+	}
+	if (ring->br) {
+		munmap(ring->br, ring->br_len);
+	}
+	if (ring->fd >= 0) {
+		close(ring->fd);
+	}
+	free(ring->bufs);
+	free(ring);
+}
+
+static int
+uring_map(struct uring *ring, struct io_uring_params *p)
+{
+	char *sq, *cq;
+
+	ring->sq_ring_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	ring->cq_ring_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_len > ring->sq_ring_len) {
+			ring->sq_ring_len = ring->cq_ring_len;
+		}
+		ring->cq_ring_len = ring->sq_ring_len;
+	}
+
+	sq = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) {
+		return -1;
+	}
+	ring->sq_ring = sq;
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		cq = sq;
+	} else {
+		cq = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED) {
+			return -1;
+		}
+	}
+	ring->cq_ring = cq;
+
+	ring->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		return -1;
+	}
+
+	ring->sq_head = (unsigned *)(sq + p->sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+	ring->sq_flags = (unsigned *)(sq + p->sq_off.flags);
+	ring->sq_mask = *(unsigned *)(sq + p->sq_off.ring_mask);
+	ring->sq_entries = p->sq_entries;
+	ring->sq_queued = ring->sq_submitted = *ring->sq_tail;
+	// SQEs are always submitted in the order they were filled in
+	for (unsigned i = 0; i < p->sq_entries; i++) {
+		((unsigned *)(sq + p->sq_off.array))[i] = i;
+	}
+
+	ring->cq_head = (unsigned *)(cq + p->cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+	ring->cq_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+	return 0;
+}
+
+static int
+uring_setup_bufs(struct uring *ring)
+{
+	struct io_uring_buf_reg reg;
+
+	ring->br_len = URING_BUFS * sizeof(struct io_uring_buf);
+	ring->br = mmap(NULL, ring->br_len, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (ring->br == MAP_FAILED) {
+		ring->br = NULL;
+		return -1;
+	}
+	if ((ring->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE)) == NULL) {
+		return -1;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)ring->br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	if (uring_sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+		return -1;
+	}
+	for (unsigned short i = 0; i < URING_BUFS; i++) {
+		uring_buf_recycle(ring, i);
+	}
+	return 0;
+}
+
+int
+uring_init(struct reactor *reactor)
+{
+	struct uring *ring = calloc(1, sizeof(struct uring));
+	struct io_uring_params p;
+
+	if (ring == NULL) {
+		return -1;
+	}
+	ring->reactor = reactor;
+	ring->fd = ring->efd = -1;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER;
+	p.cq_entries = URING_ENTRIES * 2;
+	if ((ring->fd = uring_sys_setup(URING_ENTRIES, &p)) < 0) {
+		log_err("Failed to set up io_uring");
+		goto fail;
+	}
+	if (uring_map(ring, &p) != 0) {
+		log_err("Failed to map io_uring");
+		goto fail;
+	}
+	if (uring_setup_bufs(ring) != 0) {
+		log_err("Failed to register io_uring receive buffers");
+		goto fail;
+	}
+
+	if ((ring->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+		uring_sys_register(ring->fd, IORING_REGISTER_EVENTFD, &ring->efd, 1) != 0) {
+		log_err("Failed to register io_uring eventfd");
+		goto fail;
+	}
+	ring->ev = event_new(reactor->base, ring->efd, EV_READ | EV_PERSIST,
+		uring_event_cb, ring);
+	if (ring->ev == NULL || event_add(ring->ev, NULL) != 0) {
+		goto fail;
+	}
+
+	// The listener sockets stay, but the ring accepts on them
+	for (int i = 0; i < reactor->nlisteners; i++) {
+		evconnlistener_disable(reactor->listeners[i].evl);
+	}
+
+	reactor->uring = ring;
+	log_debug("Reactor %d using io_uring", reactor->id);
+	return 0;
+
+fail:
+	uring_close_ring(ring);
+	return -1;
+}
+
+void
+uring_free(struct reactor *reactor)
+{
+	if (reactor->uring) {
+		uring_close_ring(reactor->uring);
+		reactor->uring = NULL;
+	}
+}
+
+struct uring_conn *
+uring_conn_new(struct uring *ring, evutil_socket_t fd, struct bufferevent **bevp)
+{
+	struct uring_conn *uc = calloc(1, sizeof(struct uring_conn));
+	struct bufferevent *bev;
+
+	if (uc == NULL) {
+		return NULL;
+	}
+	if ((bev = bufferevent_socket_new(ring->reactor->base, -1, 0)) == NULL) {
+		free(uc);
+		return NULL;
+	}
+	// Nothing else reads or writes these buffers' socket, so nothing needs
+	// their ends frozen
+	evbuffer_unfreeze(bufferevent_get_input(bev), 0);
+	evbuffer_unfreeze(bufferevent_get_output(bev), 1);
+	uc->output_cb = evbuffer_add_cb(bufferevent_get_output(bev),
+		uring_output_cb, uc);
+	if (uc->output_cb == NULL) {
+		bufferevent_free(bev);
+		free(uc);
+		return NULL;
+	}
+	// Held until the kernel is done with the buffers
+	bufferevent_incref(bev);
+
+	uc->ring = ring;
+	uc->bev = bev;
+	uc->fd = fd;
+	uc->refs = 1;
+	uring_conn_queue(uc);
+
+	*bevp = bev;
+	return uc;
+}
+
+evutil_socket_t
+uring_conn_fd(struct uring_conn *uc)
+{
+	return uc->fd;
+}
+
+void
+uring_conn_close(struct uring_conn *uc)
+{
+	struct io_uring_sqe *sqe;
+
+	uc->closed = 1;
+	if ((uc->recving || uc->sending) && (sqe = uring_get_sqe(uc->ring)) != NULL) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = uc->fd;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+		sqe->user_data = (uintptr_t)uc | uring_op_cancel;
+		uc->refs++;
+	}
+	uring_conn_release(uc);
+}
+
+void
+uring_conn_detach(struct uring_conn *uc, void (*fn)(void *), void *arg)
+{
+	uc->detach_fn = fn;
+	uc->detach_arg = arg;
+	uring_conn_close(uc);
+}
+
+#else
+
+int
+uring_init(struct reactor *reactor)
+{
+	log_err("Built without io_uring support");
+	return -1;
+}
+
+void
+uring_free(struct reactor *reactor)
+{
+}
+
+void
+uring_flush(struct uring *ring)
+{
+}
+
+struct uring_conn *
+uring_conn_new(struct uring *ring, evutil_socket_t fd, struct bufferevent **bev)
+{
+	return NULL;
+}
+
+evutil_socket_t
+uring_conn_fd(struct uring_conn *uc)
+{
+	return -1;
+}
+
+void
+uring_conn_close(struct uring_conn *uc)
+{
+}
+
+void
+uring_conn_detach(struct uring_conn *uc, void (*fn)(void *), void *arg)
+{
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef __TELEGENIC_URING_H__
+#define __TELEGENIC_URING_H__
+
+#include <event2/bufferevent.h>
+#include <event2/util.h>
+
+// io_uring socket I/O (built with make URING=1, enabled with -u). Each
+// reactor gets a ring that accepts its listeners' connections, receives on
+// every socket with multishot recv into a shared ring of provided buffers,
+// and sends whatever every connection queued during a loop iteration in
+// one submission. Connections still queue through a bufferevent, created
+// without a socket, so the rest of the server can't tell the difference:
+// the ring fills its input and runs its callbacks.
+
+struct reactor;
+struct uring;
+struct uring_conn;
+
+// Set up the calling reactor thread's ring and take over its listeners
+int uring_init(struct reactor *reactor);
+
+void uring_free(struct reactor *reactor);
+
+// Submit everything queued since the last flush and handle what has
+// already completed. Run by the reactor between loop iterations.
+void uring_flush(struct uring *ring);
+
+// A bufferevent whose socket I/O the ring does. Returns NULL on failure,
+// in which case fd is left open.
+struct uring_conn *uring_conn_new(struct uring *ring, evutil_socket_t fd,
+	struct bufferevent **bev);
+
+evutil_socket_t uring_conn_fd(struct uring_conn *uc);
+
+// Stop all I/O and close the socket once the kernel is done with it. The
+// bufferevent is still the caller's to free.
+void uring_conn_close(struct uring_conn *uc);
+
+// Stop all I/O and, once nothing is in flight, call fn(arg) with the
+// bufferevent's buffers holding everything received and not yet sent. The
+// socket is left open for fn to take.
+void uring_conn_detach(struct uring_conn *uc, void (*fn)(void *), void *arg);
+
+#endif